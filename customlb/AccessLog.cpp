@@ -0,0 +1,286 @@
+#include "AccessLog.h"
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+// Lines are written once this much is batched, and on every flush interval
+const size_t batchBytes = 256 * 1024;
+
+template <typename Length>
+Length copyField(char* destination, size_t capacity, string_view value) {
+    size_t length = min(value.size(), capacity);
+    memcpy(destination, value.data(), length);
+    return (Length)length;
+}
+
+uint32_t sampleDraw() {
+    thread_local uint64_t state = (uint64_t)time(nullptr) ^
+        (uint64_t)(uintptr_t)&state ^ 0x9E3779B97F4A7C15ULL;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (uint32_t)(state >> 32);
+}
+
+// Quotes and control bytes escaped for a quoted field (\xHH) or a JSON string
+void appendEscaped(string& out, string_view value, bool json) {
+    for (unsigned char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += (char)c;
+        } else if (c < 0x20 || c == 0x7f) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), json ? "\\u%04x" : "\\x%02X", c);
+            out += escaped;
+        } else {
+            out += (char)c;
+        }
+    }
+}
+
+} // namespace
+
+// ==================== AccessLog Implementation ====================
+
+AccessLog::AccessLog()
+    : fd(STDOUT_FILENO), sampleThreshold(1ULL << 32),
+      currentSecond(time(nullptr)), running(false),
+      cachedSecond(-1), reportedDrops(0) {
+}
+
+AccessLog::~AccessLog() {
+    stop();
+    if (fd != STDOUT_FILENO) {
+        close(fd);
+    }
+}
+
+bool AccessLog::configure(const AccessLogSettings& newSettings) {
+    if (!newSettings.path.empty()) {
+        int newFd = open(newSettings.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (newFd < 0) {
+            cerr << "[ACCESS LOG] Cannot open " << newSettings.path << ": " << strerror(errno) << endl;
+            return false;
+        }
+        if (fd != STDOUT_FILENO) {
+            close(fd);
+        }
+        fd = newFd;
+    }
+
+    settings = newSettings;
+    double rate = min(max(settings.sampleRate, 0.0), 1.0);
+    sampleThreshold = (uint64_t)(rate * 4294967296.0);
+
+    size_t capacity = 1;
+    while (capacity < max<size_t>(settings.bufferEntries, 2)) capacity <<= 1;
+    settings.bufferEntries = capacity;
+    return true;
+}
+
+void AccessLog::start() {
+    if (running) return;
+    running = true;
+    writerThread = thread(&AccessLog::writerLoop, this);
+}
+
+void AccessLog::stop() {
+    if (!running.exchange(false)) return;
+    wake.notify_all();
+    if (writerThread.joinable()) {
+        writerThread.join();
+    }
+}
+
+AccessLog::Ring* AccessLog::localRing() {
+    thread_local AccessLog* owner = nullptr;
+    thread_local Ring* ring = nullptr;
+    if (owner != this) {
+        auto created = make_unique<Ring>();
+        created->entries.resize(settings.bufferEntries);
+        created->mask = settings.bufferEntries - 1;
+        ring = created.get();
+        owner = this;
+        lock_guard<mutex> lock(ringsMutex);
+        rings.push_back(move(created));
+    }
+    return ring;
+}
+
+void AccessLog::record(string_view clientIP, string_view method, string_view path,
+                       string_view version, int status,
+                       string_view backend, string_view outcome,
+                       double upstreamMs, uint64_t upstreamBytes) {
+    if (status < 500 && sampleDraw() >= sampleThreshold) {
+        return;
+    }
+
+    Ring* ring = localRing();
+    size_t head = ring->head.load(memory_order_relaxed);
+    if (head - ring->tail.load(memory_order_acquire) > ring->mask) {
+        ring->dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+
+    Entry& entry = ring->entries[head & ring->mask];
+    entry.time = currentSecond.load(memory_order_relaxed);
+    entry.status = status;
+    entry.upstreamMicros = upstreamMs < 0 ? -1 : (int)min(upstreamMs * 1000, 2e9);
+    entry.upstreamBytes = upstreamBytes;
+    entry.clientIPLength = copyField<uint8_t>(entry.clientIP, sizeof(entry.clientIP), clientIP);
+    entry.methodLength = copyField<uint8_t>(entry.method, sizeof(entry.method), method);
+    entry.versionLength = copyField<uint8_t>(entry.version, sizeof(entry.version), version);
+    entry.pathLength = copyField<uint16_t>(entry.path, sizeof(entry.path), path);
+    entry.backendLength = copyField<uint8_t>(entry.backend, sizeof(entry.backend), backend);
+    entry.backendLength += copyField<uint8_t>(entry.backend + entry.backendLength,
+                                              sizeof(entry.backend) - entry.backendLength, outcome);
+
+    ring->head.store(head + 1, memory_order_release);
+}
+
+uint64_t AccessLog::droppedCount() {
+    lock_guard<mutex> lock(ringsMutex);
+    uint64_t total = 0;
+    for (const auto& ring : rings) {
+        total += ring->dropped.load(memory_order_relaxed);
+    }
+    return total;
+}
+
+void AccessLog::updateClock() {
+    currentSecond.store(time(nullptr), memory_order_relaxed);
+}
+
+void AccessLog::writerLoop() {
+    while (running) {
+        {
+            unique_lock<mutex> lock(wakeMutex);
+            wake.wait_for(lock, chrono::milliseconds(settings.flushIntervalMs),
+                          [this]() { return !running; });
+        }
+        updateClock();
+        drain();
+        flush();
+
+        uint64_t drops = droppedCount();
+        if (drops > reportedDrops) {
+            cerr << "[ACCESS LOG] " << drops - reportedDrops
+                 << " entries dropped (buffer full)" << endl;
+            reportedDrops = drops;
+        }
+    }
+
+    // Workers have stopped; write out whatever they left behind
+    drain();
+    flush();
+}
+
+void AccessLog::drain() {
+    vector<Ring*> current;
+    {
+        lock_guard<mutex> lock(ringsMutex);
+        for (const auto& ring : rings) {
+            current.push_back(ring.get());
+        }
+    }
+
+    for (Ring* ring : current) {
+        size_t tail = ring->tail.load(memory_order_relaxed);
+        size_t head = ring->head.load(memory_order_acquire);
+        for (; tail != head; tail++) {
+            format(ring->entries[tail & ring->mask]);
+            if (batch.size() >= batchBytes) {
+                flush();
+            }
+        }
+        ring->tail.store(tail, memory_order_release);
+    }
+}
+
+void AccessLog::format(const Entry& entry) {
+    if (entry.time != cachedSecond) {
+        time_t seconds = (time_t)entry.time;
+        struct tm local;
+        localtime_r(&seconds, &local);
+        char buffer[64];
+        strftime(buffer, sizeof(buffer), "%d/%b/%Y:%H:%M:%S %z", &local);
+        commonTime = buffer;
+        strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S%z", &local);
+        isoTime = buffer;
+        isoTime.insert(isoTime.size() - 2, ":"); // RFC 3339 offset
+        cachedSecond = entry.time;
+    }
+
+    string_view clientIP(entry.clientIP, entry.clientIPLength);
+    string_view method(entry.method, entry.methodLength);
+    string_view version(entry.version, entry.versionLength);
+    string_view path(entry.path, entry.pathLength);
+    string_view backend(entry.backend, entry.backendLength);
+    bool upstream = entry.upstreamMicros >= 0;
+    char upstreamTime[32];
+    snprintf(upstreamTime, sizeof(upstreamTime), "%.3f", entry.upstreamMicros / 1e6);
+
+    if (settings.format == AccessLogFormat::JSON) {
+        batch += "{\"time\":\"";
+        batch += isoTime;
+        batch += "\",\"client\":\"";
+        appendEscaped(batch, clientIP, true);
+        batch += "\",\"method\":\"";
+        appendEscaped(batch, method, true);
+        batch += "\",\"path\":\"";
+        appendEscaped(batch, path, true);
+        batch += "\",\"protocol\":\"";
+        appendEscaped(batch, version, true);
+        batch += "\",\"status\":";
+        batch += to_string(entry.status);
+        batch += ",\"backend\":\"";
+        appendEscaped(batch, backend, true);
+        batch += "\",\"upstream_time\":";
+        batch += upstream ? upstreamTime : "null";
+        batch += ",\"upstream_bytes\":";
+        batch += to_string(entry.upstreamBytes);
+        batch += "}\n";
+        return;
+    }
+
+    // host ident user [time] "request" status bytes, then our own fields
+    batch.append(clientIP);
+    batch += " - - [";
+    batch += commonTime;
+    batch += "] \"";
+    appendEscaped(batch, method, false);
+    batch += ' ';
+    appendEscaped(batch, path, false);
+    if (!version.empty()) {
+        batch += ' ';
+        appendEscaped(batch, version, false);
+    }
+    batch += "\" ";
+    batch += to_string(entry.status);
+    batch += ' ';
+    batch += upstream ? to_string(entry.upstreamBytes) : "-";
+    batch += " backend=";
+    appendEscaped(batch, backend, false);
+    batch += " upstream_time=";
+    batch += upstream ? upstreamTime : "-";
+    batch += '\n';
+}
+
+void AccessLog::flush() {
+    size_t offset = 0;
+    while (offset < batch.size()) {
+        ssize_t written = write(fd, batch.data() + offset, batch.size() - offset);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) break; // nowhere to log to; drop the batch
+        offset += written;
+    }
+    batch.clear();
+}
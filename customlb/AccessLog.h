@@ -0,0 +1,105 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+using namespace std;
+
+enum class AccessLogFormat {
+    COMMON, // Apache common log format plus backend and upstream fields
+    JSON    // one JSON object per line
+};
+
+struct AccessLogSettings {
+    AccessLogFormat format = AccessLogFormat::COMMON;
+    string path;                  // empty: stdout
+    double sampleRate = 1.0;      // fraction of 1xx-4xx requests logged; 5xx always are
+    size_t bufferEntries = 4096;  // per request thread (rounded up to a power of two)
+    int flushIntervalMs = 100;
+};
+
+// Access log that never blocks the request path. Each request thread owns a
+// single-producer ring of fixed-size records; a background writer drains
+// all rings, formats the lines and writes them out in large batches. When a
+// ring is full the record is dropped and counted rather than waited on.
+class AccessLog {
+private:
+    struct Entry {
+        int64_t time;            // unix seconds
+        int status;
+        int upstreamMicros;      // -1: no upstream response
+        uint64_t upstreamBytes;
+        uint8_t clientIPLength;
+        uint8_t methodLength;
+        uint8_t versionLength;
+        uint8_t backendLength;
+        uint16_t pathLength;
+        char clientIP[46];
+        char method[16];
+        char version[12];
+        char backend[80];
+        char path[256];          // longer targets are truncated
+    };
+
+    struct Ring {
+        vector<Entry> entries;
+        size_t mask;
+        alignas(64) atomic<size_t> head{0}; // written by the request thread
+        alignas(64) atomic<size_t> tail{0}; // written by the writer thread
+        atomic<uint64_t> dropped{0};
+    };
+
+    AccessLogSettings settings;
+    int fd;
+    uint64_t sampleThreshold; // log when a 32-bit random draw is below this
+
+    mutex ringsMutex; // registration only
+    vector<unique_ptr<Ring>> rings;
+
+    atomic<int64_t> currentSecond; // cached clock, refreshed by the writer
+    atomic<bool> running;
+    mutex wakeMutex;
+    condition_variable wake;
+    thread writerThread;
+
+    // Formatted timestamps of cachedSecond, rebuilt when the second changes
+    int64_t cachedSecond;
+    string commonTime;
+    string isoTime;
+    uint64_t reportedDrops;
+    string batch;
+
+    Ring* localRing();
+    void writerLoop();
+    void drain();
+    void format(const Entry& entry);
+    void flush();
+    void updateClock();
+
+public:
+    AccessLog();
+    ~AccessLog();
+
+    // Before start(); returns false if the log file cannot be opened
+    bool configure(const AccessLogSettings& newSettings);
+    void start();
+    void stop(); // drains whatever is still buffered
+
+    // Called on request threads: copies the fields into this thread's ring.
+    // backend and outcome are concatenated (e.g. "order-1" + "-failed").
+    void record(string_view clientIP, string_view method, string_view path,
+                string_view version, int status,
+                string_view backend, string_view outcome,
+                double upstreamMs, uint64_t upstreamBytes);
+
+    uint64_t droppedCount();
+};
+
+#endif // ACCESSLOG_H
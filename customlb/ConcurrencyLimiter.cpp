@@ -0,0 +1,179 @@
+#include "ConcurrencyLimiter.h"
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+int64_t nowTicks() {
+    return chrono::steady_clock::now().time_since_epoch().count();
+}
+
+int64_t millisToTicks(int ms) {
+    return chrono::duration_cast<chrono::steady_clock::duration>(chrono::milliseconds(ms)).count();
+}
+
+RateLimitSettings retryFloor(const RetryBudgetSettings& settings) {
+    RateLimitSettings floor;
+    floor.keySource = RateLimitKeySource::ROUTE;
+    floor.requestsPerSecond = settings.minRetriesPerSecond;
+    floor.burst = settings.minRetriesPerSecond;
+    return floor;
+}
+
+} // namespace
+
+// ==================== ConcurrencyLimiter Implementation ====================
+
+ConcurrencyLimiter::ConcurrencyLimiter(const AdaptiveConcurrencySettings& limiterSettings)
+    : config(limiterSettings) {
+    config.minLimit = max(1, config.minLimit);
+    config.maxLimit = max(config.minLimit, config.maxLimit);
+    estimate = clamp<double>(config.initialLimit, config.minLimit, config.maxLimit);
+    currentLimit = (int)estimate;
+    windowStart = nowTicks();
+}
+
+ConcurrencyLimiter::Admission ConcurrencyLimiter::acquire(const CacheWaiter& waiter) {
+    // Requests already queued go first; a newcomer only takes a free place
+    if (waiting.load() == 0 && tryAdmit()) return Admission::ADMITTED;
+
+    lock_guard<mutex> lock(queueMutex);
+    // Counted before the second try, so a release that frees a place from
+    // now on looks at the queue (and waits for this lock)
+    waiting++;
+    if (queue.empty() && tryAdmit()) {
+        waiting--;
+        return Admission::ADMITTED;
+    }
+    if (queue.size() >= (size_t)max(0, config.maxQueue) || config.maxQueueMs <= 0) {
+        waiting--;
+        shed++;
+        return Admission::REJECTED;
+    }
+    queue.push_back(waiter);
+    queuedTotal++;
+    return Admission::QUEUED;
+}
+
+bool ConcurrencyLimiter::release(CacheWaiter& next) {
+    active--;
+    if (waiting.load() == 0) return false;
+
+    lock_guard<mutex> lock(queueMutex);
+    if (queue.empty() || !tryAdmit()) return false;
+    next = queue.front();
+    queue.pop_front();
+    waiting--;
+    return true;
+}
+
+bool ConcurrencyLimiter::cancel(const CacheWaiter& waiter) {
+    lock_guard<mutex> lock(queueMutex);
+    for (auto it = queue.begin(); it != queue.end(); ++it) {
+        if (it->worker == waiter.worker && it->fd == waiter.fd && it->connectionId == waiter.connectionId) {
+            queue.erase(it);
+            waiting--;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ConcurrencyLimiter::tryAdmit() {
+    int current = active.load();
+    while (current < currentLimit.load(memory_order_relaxed)) {
+        if (active.compare_exchange_weak(current, current + 1)) {
+            int peak = peakActive.load(memory_order_relaxed);
+            while (current + 1 > peak &&
+                   !peakActive.compare_exchange_weak(peak, current + 1, memory_order_relaxed)) {
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void ConcurrencyLimiter::recordLatency(double ms) {
+    sampleSumMicros.fetch_add((uint64_t)(ms * 1000), memory_order_relaxed);
+    uint32_t count = sampleCount.fetch_add(1, memory_order_relaxed) + 1;
+
+    int64_t now = nowTicks();
+    if (count < (uint32_t)config.minWindowSamples ||
+        now - windowStart.load(memory_order_relaxed) < millisToTicks(config.windowMs)) {
+        return;
+    }
+    // Whoever closes the window updates the limit; the others carry on
+    unique_lock<mutex> lock(updateMutex, try_to_lock);
+    if (lock) updateLimit(now);
+}
+
+void ConcurrencyLimiter::updateLimit(int64_t now) {
+    if (now - windowStart.load(memory_order_relaxed) < millisToTicks(config.windowMs)) return;
+    windowStart = now;
+    uint32_t count = sampleCount.exchange(0, memory_order_relaxed);
+    uint64_t sumMicros = sampleSumMicros.exchange(0, memory_order_relaxed);
+    int peak = peakActive.exchange(active.load(memory_order_relaxed), memory_order_relaxed);
+    if (count == 0) return;
+
+    // The long-term average follows about the last 20 windows, and drifts
+    // down quickly once a spike is over so it does not excuse the next one
+    double shortLatencyMs = max(0.001, (double)sumMicros / 1000.0 / count);
+    if (longLatencyMs == 0) {
+        longLatencyMs = shortLatencyMs;
+    } else {
+        longLatencyMs += (shortLatencyMs - longLatencyMs) / 20;
+        if (longLatencyMs > shortLatencyMs * 2) longLatencyMs *= 0.95;
+    }
+
+    double gradient = clamp(config.tolerance * longLatencyMs / shortLatencyMs, 0.5, 1.0);
+    double next = estimate;
+    // Growing needs evidence: a limit that is not half used says nothing
+    if (gradient < 1.0 || peak >= estimate / 2) {
+        next = estimate * gradient + sqrt(estimate);
+    }
+    estimate = clamp(estimate * (1 - config.smoothing) + next * config.smoothing,
+                     (double)config.minLimit, (double)config.maxLimit);
+    currentLimit = (int)estimate;
+}
+
+void ConcurrencyLimiter::recordDrop() {
+    // One cut per window, however many requests failed together
+    int64_t now = nowTicks();
+    int64_t last = lastDrop.load(memory_order_relaxed);
+    if (now - last < millisToTicks(config.windowMs) ||
+        !lastDrop.compare_exchange_strong(last, now, memory_order_relaxed)) {
+        return;
+    }
+    lock_guard<mutex> lock(updateMutex);
+    estimate = max((double)config.minLimit, estimate * 0.9);
+    currentLimit = (int)estimate;
+}
+
+// ==================== RetryBudget Implementation ====================
+
+RetryBudget::RetryBudget(const RetryBudgetSettings& budgetSettings)
+    : config(budgetSettings),
+      deposit(max<int64_t>(0, (int64_t)(budgetSettings.percent * unit / 100))),
+      maxBalance(deposit * savedRequests),
+      floor(retryFloor(budgetSettings)) {
+}
+
+void RetryBudget::recordRequest() {
+    int64_t current = balance.load(memory_order_relaxed);
+    while (current < maxBalance &&
+           !balance.compare_exchange_weak(current, min(maxBalance, current + deposit), memory_order_relaxed)) {
+    }
+}
+
+bool RetryBudget::allowRetry() {
+    int64_t current = balance.load(memory_order_relaxed);
+    while (current >= unit) {
+        if (balance.compare_exchange_weak(current, current - unit, memory_order_relaxed)) return true;
+    }
+    if (config.minRetriesPerSecond > 0 && floor.takeToken("") == 0) return true;
+    exhausted++;
+    return false;
+}
@@ -0,0 +1,121 @@
+#ifndef CONCURRENCYLIMITER_H
+#define CONCURRENCYLIMITER_H
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include "Metrics.h"
+#include "ResponseCache.h"
+#include "RateLimiter.h"
+using namespace std;
+
+// Adaptive cap on a service's outstanding upstream requests
+struct AdaptiveConcurrencySettings {
+    int initialLimit = 20;
+    int minLimit = 5;
+    int maxLimit = 1000;
+    // Latency the limit tolerates, as a multiple of the long-term average,
+    // before it starts shrinking
+    double tolerance = 1.5;
+    double smoothing = 0.2;   // share of a new estimate taken per window
+    int windowMs = 250;       // the limit moves at most once per window
+    int minWindowSamples = 10;
+    // Requests over the limit wait this long for a place, then get 503
+    int maxQueue = 100;
+    int maxQueueMs = 50;
+};
+
+// Retries as a share of requests, so a struggling service does not get
+// several times its normal traffic from them
+struct RetryBudgetSettings {
+    double percent = 20;          // retries per 100 requests
+    int minRetriesPerSecond = 5;  // allowed however few requests there are
+};
+
+// Gradient concurrency limiter: each window compares the average time to
+// response head with its long-term average. While latency holds, the limit
+// grows by about its square root; as queueing inside the service shows up
+// as latency, the limit shrinks in proportion. Upstream failures cut it
+// multiplicatively (AIMD). Requests over the limit queue briefly; a freed
+// permit goes straight to the oldest waiter.
+class ConcurrencyLimiter {
+public:
+    enum class Admission {
+        ADMITTED, // the caller holds a permit and must release() it
+        QUEUED,   // parked; a permit may be handed over through release()
+        REJECTED  // over the limit with the queue full (or disabled)
+    };
+
+    ConcurrencyLimiter(const AdaptiveConcurrencySettings& limiterSettings);
+
+    const AdaptiveConcurrencySettings& settings() const { return config; }
+
+    Admission acquire(const CacheWaiter& waiter);
+    // Gives back a permit. True if it went to a queued request instead,
+    // which is then next; its owner has to be woken up.
+    bool release(CacheWaiter& next);
+    // A queued request gives up. False if it was handed a permit meanwhile,
+    // which it now holds.
+    bool cancel(const CacheWaiter& waiter);
+
+    // Outcome of a request that held a permit
+    void recordLatency(double ms);
+    void recordDrop(); // connect error, timeout or broken response
+
+    int limit() const { return currentLimit.load(memory_order_relaxed); }
+    int inFlight() const { return active.load(memory_order_relaxed); }
+    size_t queued() const { return waiting.load(memory_order_relaxed); }
+
+    // Statistics
+    ShardedCounter queuedTotal;
+    ShardedCounter shed;
+
+private:
+    AdaptiveConcurrencySettings config;
+    atomic<int> currentLimit;
+    atomic<int> active{0};
+    atomic<size_t> waiting{0};
+    atomic<int> peakActive{0}; // this window
+
+    mutex queueMutex;
+    deque<CacheWaiter> queue;
+
+    // Current window's samples; folded in by whoever closes the window
+    atomic<uint64_t> sampleSumMicros{0};
+    atomic<uint32_t> sampleCount{0};
+    atomic<int64_t> windowStart; // steady_clock ticks
+    atomic<int64_t> lastDrop{0};
+
+    mutex updateMutex;  // the fields below
+    double estimate;    // unrounded limit
+    double longLatencyMs = 0;
+
+    bool tryAdmit();
+    void updateLimit(int64_t now);
+};
+
+// Token balance fed by every request (percent / 100 each) and drawn on by
+// every retry, with a per-second floor so a quiet service can still retry
+class RetryBudget {
+public:
+    RetryBudget(const RetryBudgetSettings& budgetSettings);
+
+    void recordRequest();
+    // Takes one retry from the budget; false means do not retry
+    bool allowRetry();
+
+    ShardedCounter exhausted;
+
+private:
+    static const int64_t unit = 1000;            // balance per retry
+    static const int64_t savedRequests = 1000;   // the balance holds at most this many requests' share
+
+    RetryBudgetSettings config;
+    int64_t deposit;
+    int64_t maxBalance;
+    atomic<int64_t> balance{0};
+    RateLimiter floor;
+};
+
+#endif // CONCURRENCYLIMITER_H
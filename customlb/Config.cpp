@@ -0,0 +1,805 @@
+#include "Config.h"
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+
+using namespace std;
+
+namespace {
+
+// ==================== JSON ====================
+
+struct Json {
+    enum class Type { NUL, BOOL, NUMBER, STRING, ARRAY, OBJECT };
+
+    Type type = Type::NUL;
+    bool boolean = false;
+    double number = 0;
+    string text;
+    vector<Json> items;
+    vector<pair<string, Json>> members; // in file order
+};
+
+const char* typeName(Json::Type type) {
+    switch (type) {
+        case Json::Type::NUL: return "null";
+        case Json::Type::BOOL: return "a boolean";
+        case Json::Type::NUMBER: return "a number";
+        case Json::Type::STRING: return "a string";
+        case Json::Type::ARRAY: return "an array";
+        case Json::Type::OBJECT: return "an object";
+    }
+    return "?";
+}
+
+// Recursive-descent RFC 8259 parser
+class JsonParser {
+public:
+    JsonParser(const string& input) : text(input), pos(0) {}
+
+    bool parse(Json& value, string& error) {
+        skipSpace();
+        if (!parseValue(value, 0)) {
+            error = message;
+            return false;
+        }
+        skipSpace();
+        if (pos != text.size()) {
+            fail("unexpected data after the top-level value");
+            error = message;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static const int maxDepth = 64;
+
+    const string& text;
+    size_t pos;
+    string message;
+
+    bool fail(const string& what) {
+        if (message.empty()) {
+            int line = 1;
+            for (size_t i = 0; i < pos && i < text.size(); i++) {
+                if (text[i] == '\n') line++;
+            }
+            message = "line " + to_string(line) + ": " + what;
+        }
+        return false;
+    }
+
+    void skipSpace() {
+        while (pos < text.size() &&
+               (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r')) {
+            pos++;
+        }
+    }
+
+    bool literal(const char* word) {
+        size_t length = char_traits<char>::length(word);
+        if (text.compare(pos, length, word) != 0) return false;
+        pos += length;
+        return true;
+    }
+
+    bool parseValue(Json& value, int depth) {
+        if (depth > maxDepth) return fail("nesting too deep");
+        if (pos >= text.size()) return fail("unexpected end of input");
+
+        char c = text[pos];
+        if (c == '{') return parseObject(value, depth);
+        if (c == '[') return parseArray(value, depth);
+        if (c == '"') {
+            value.type = Json::Type::STRING;
+            return parseString(value.text);
+        }
+        if (literal("true")) {
+            value.type = Json::Type::BOOL;
+            value.boolean = true;
+            return true;
+        }
+        if (literal("false")) {
+            value.type = Json::Type::BOOL;
+            return true;
+        }
+        if (literal("null")) {
+            value.type = Json::Type::NUL;
+            return true;
+        }
+        if (c == '-' || (c >= '0' && c <= '9')) return parseNumber(value);
+        return fail(string("unexpected character '") + c + "'");
+    }
+
+    bool parseObject(Json& value, int depth) {
+        value.type = Json::Type::OBJECT;
+        pos++; // {
+        skipSpace();
+        if (pos < text.size() && text[pos] == '}') {
+            pos++;
+            return true;
+        }
+        while (true) {
+            skipSpace();
+            if (pos >= text.size() || text[pos] != '"') return fail("expected a key string");
+            string key;
+            if (!parseString(key)) return false;
+            for (const auto& member : value.members) {
+                if (member.first == key) return fail("duplicate key \"" + key + "\"");
+            }
+            skipSpace();
+            if (pos >= text.size() || text[pos] != ':') return fail("expected ':'");
+            pos++;
+            skipSpace();
+            value.members.emplace_back(key, Json());
+            if (!parseValue(value.members.back().second, depth + 1)) return false;
+            skipSpace();
+            if (pos < text.size() && text[pos] == ',') {
+                pos++;
+                continue;
+            }
+            if (pos < text.size() && text[pos] == '}') {
+                pos++;
+                return true;
+            }
+            return fail("expected ',' or '}'");
+        }
+    }
+
+    bool parseArray(Json& value, int depth) {
+        value.type = Json::Type::ARRAY;
+        pos++; // [
+        skipSpace();
+        if (pos < text.size() && text[pos] == ']') {
+            pos++;
+            return true;
+        }
+        while (true) {
+            skipSpace();
+            value.items.emplace_back();
+            if (!parseValue(value.items.back(), depth + 1)) return false;
+            skipSpace();
+            if (pos < text.size() && text[pos] == ',') {
+                pos++;
+                continue;
+            }
+            if (pos < text.size() && text[pos] == ']') {
+                pos++;
+                return true;
+            }
+            return fail("expected ',' or ']'");
+        }
+    }
+
+    bool parseHex4(uint32_t& code) {
+        if (pos + 4 > text.size()) return fail("truncated \\u escape");
+        code = 0;
+        for (int i = 0; i < 4; i++) {
+            char c = text[pos++];
+            code <<= 4;
+            if (c >= '0' && c <= '9') code |= c - '0';
+            else if (c >= 'a' && c <= 'f') code |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') code |= c - 'A' + 10;
+            else return fail("invalid \\u escape");
+        }
+        return true;
+    }
+
+    static void appendUtf8(string& out, uint32_t code) {
+        if (code < 0x80) {
+            out += (char)code;
+        } else if (code < 0x800) {
+            out += (char)(0xC0 | (code >> 6));
+            out += (char)(0x80 | (code & 0x3F));
+        } else if (code < 0x10000) {
+            out += (char)(0xE0 | (code >> 12));
+            out += (char)(0x80 | ((code >> 6) & 0x3F));
+            out += (char)(0x80 | (code & 0x3F));
+        } else {
+            out += (char)(0xF0 | (code >> 18));
+            out += (char)(0x80 | ((code >> 12) & 0x3F));
+            out += (char)(0x80 | ((code >> 6) & 0x3F));
+            out += (char)(0x80 | (code & 0x3F));
+        }
+    }
+
+    bool parseString(string& out) {
+        pos++; // opening quote
+        while (pos < text.size()) {
+            char c = text[pos++];
+            if (c == '"') return true;
+            if ((unsigned char)c < 0x20) return fail("control character in string");
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (pos >= text.size()) break;
+            char escape = text[pos++];
+            switch (escape) {
+                case '"': out += '"'; break;
+                case '\\': out += '\\'; break;
+                case '/': out += '/'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': {
+                    uint32_t code = 0;
+                    if (!parseHex4(code)) return false;
+                    if (code >= 0xD800 && code < 0xDC00) {
+                        uint32_t low = 0;
+                        if (!literal("\\u") || !parseHex4(low) || low < 0xDC00 || low >= 0xE000) {
+                            return fail("invalid surrogate pair");
+                        }
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    appendUtf8(out, code);
+                    break;
+                }
+                default:
+                    return fail(string("invalid escape '\\") + escape + "'");
+            }
+        }
+        return fail("unterminated string");
+    }
+
+    bool parseNumber(Json& value) {
+        size_t start = pos;
+        if (text[pos] == '-') pos++;
+        if (pos >= text.size() || !isdigit((unsigned char)text[pos])) return fail("invalid number");
+        if (text[pos] == '0') {
+            pos++;
+        } else {
+            while (pos < text.size() && isdigit((unsigned char)text[pos])) pos++;
+        }
+        if (pos < text.size() && text[pos] == '.') {
+            pos++;
+            if (pos >= text.size() || !isdigit((unsigned char)text[pos])) return fail("invalid number");
+            while (pos < text.size() && isdigit((unsigned char)text[pos])) pos++;
+        }
+        if (pos < text.size() && (text[pos] == 'e' || text[pos] == 'E')) {
+            pos++;
+            if (pos < text.size() && (text[pos] == '+' || text[pos] == '-')) pos++;
+            if (pos >= text.size() || !isdigit((unsigned char)text[pos])) return fail("invalid number");
+            while (pos < text.size() && isdigit((unsigned char)text[pos])) pos++;
+        }
+        value.type = Json::Type::NUMBER;
+        value.number = strtod(text.c_str() + start, nullptr);
+        return true;
+    }
+};
+
+// Compact, key-order-preserving serialization (for fingerprints)
+void dump(const Json& value, string& out) {
+    switch (value.type) {
+        case Json::Type::NUL:
+            out += "null";
+            break;
+        case Json::Type::BOOL:
+            out += value.boolean ? "true" : "false";
+            break;
+        case Json::Type::NUMBER: {
+            char buffer[32];
+            snprintf(buffer, sizeof(buffer), "%.17g", value.number);
+            out += buffer;
+            break;
+        }
+        case Json::Type::STRING:
+            out += '"';
+            for (char c : value.text) {
+                if (c == '"' || c == '\\') out += '\\';
+                out += c;
+            }
+            out += '"';
+            break;
+        case Json::Type::ARRAY:
+            out += '[';
+            for (size_t i = 0; i < value.items.size(); i++) {
+                if (i > 0) out += ',';
+                dump(value.items[i], out);
+            }
+            out += ']';
+            break;
+        case Json::Type::OBJECT:
+            out += '{';
+            for (size_t i = 0; i < value.members.size(); i++) {
+                if (i > 0) out += ',';
+                Json key;
+                key.type = Json::Type::STRING;
+                key.text = value.members[i].first;
+                dump(key, out);
+                out += ':';
+                dump(value.members[i].second, out);
+            }
+            out += '}';
+            break;
+    }
+}
+
+// ==================== Config Reader ====================
+
+// Typed access to the members of one JSON object. The first error wins and
+// makes every later call a no-op; finish() rejects keys nobody asked for.
+class ObjectReader {
+public:
+    ObjectReader(const Json& object, const string& where, string& errorOut)
+        : json(object), context(where), error(errorOut) {
+        if (error.empty() && json.type != Json::Type::OBJECT) {
+            error = context + ": expected an object";
+        }
+    }
+
+    const Json* find(const char* key, Json::Type type) {
+        if (!error.empty() || json.type != Json::Type::OBJECT) return nullptr;
+        used.insert(key);
+        for (const auto& member : json.members) {
+            if (member.first != key) continue;
+            if (member.second.type != type) {
+                error = path(key) + ": expected " + typeName(type);
+                return nullptr;
+            }
+            return &member.second;
+        }
+        return nullptr;
+    }
+
+    void integer(const char* key, int& out, int minimum = 0) {
+        const Json* value = find(key, Json::Type::NUMBER);
+        if (!value) return;
+        if (value->number != floor(value->number) || value->number < minimum || value->number > 2147483647.0) {
+            error = path(key) + ": expected an integer >= " + to_string(minimum);
+            return;
+        }
+        out = (int)value->number;
+    }
+
+    void size(const char* key, size_t& out) {
+        const Json* value = find(key, Json::Type::NUMBER);
+        if (!value) return;
+        if (value->number != floor(value->number) || value->number < 0 || value->number > 1e18) {
+            error = path(key) + ": expected a non-negative integer";
+            return;
+        }
+        out = (size_t)value->number;
+    }
+
+    void number(const char* key, double& out) {
+        const Json* value = find(key, Json::Type::NUMBER);
+        if (value) out = value->number;
+    }
+
+    void boolean(const char* key, bool& out) {
+        const Json* value = find(key, Json::Type::BOOL);
+        if (value) out = value->boolean;
+    }
+
+    void text(const char* key, string& out) {
+        const Json* value = find(key, Json::Type::STRING);
+        if (value) out = value->text;
+    }
+
+    void strings(const char* key, vector<string>& out) {
+        const Json* value = find(key, Json::Type::ARRAY);
+        if (!value) return;
+        out.clear();
+        for (const Json& item : value->items) {
+            if (item.type != Json::Type::STRING) {
+                error = path(key) + ": expected an array of strings";
+                return;
+            }
+            out.push_back(item.text);
+        }
+    }
+
+    // Maps a string value through names; error lists nothing fancy, just the key
+    template <typename Enum>
+    void choice(const char* key, Enum& out, initializer_list<pair<const char*, Enum>> names) {
+        const Json* value = find(key, Json::Type::STRING);
+        if (!value) return;
+        for (const auto& [name, option] : names) {
+            if (value->text == name) {
+                out = option;
+                return;
+            }
+        }
+        string allowed;
+        for (const auto& named : names) {
+            allowed += allowed.empty() ? "" : ", ";
+            allowed += named.first;
+        }
+        error = path(key) + ": unknown value \"" + value->text + "\" (expected one of " + allowed + ")";
+    }
+
+    bool required(const char* key) {
+        if (!error.empty()) return false;
+        for (const auto& member : json.members) {
+            if (member.first == key) return true;
+        }
+        error = path(key) + ": required";
+        return false;
+    }
+
+    string path(const string& key) const {
+        return context.empty() ? key : context + "." + key;
+    }
+
+    bool finish() {
+        if (!error.empty()) return false;
+        for (const auto& member : json.members) {
+            if (!used.count(member.first)) {
+                error = path(member.first) + ": unknown key";
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    const Json& json;
+    string context;
+    string& error;
+    set<string> used;
+};
+
+bool readBackend(const Json& json, const string& where, BackendDefinition& backend, string& error) {
+    ObjectReader reader(json, where, error);
+    reader.required("name");
+    reader.required("host");
+    reader.text("name", backend.name);
+    reader.text("host", backend.host);
+    reader.integer("port", backend.port, 1);
+    reader.integer("max_fails", backend.maxFails, 1);
+    reader.integer("fail_timeout", backend.failTimeout);
+    reader.integer("weight", backend.weight, 1);
+    return reader.finish();
+}
+
+bool readDnsBackend(const Json& json, const string& where, DnsBackendDefinition& backend, string& error) {
+    ObjectReader reader(json, where, error);
+    reader.required("host");
+    reader.text("host", backend.host);
+    reader.integer("port", backend.port, 1);
+    reader.integer("max_fails", backend.maxFails, 1);
+    reader.integer("fail_timeout", backend.failTimeout);
+    reader.integer("weight", backend.weight, 1);
+    return reader.finish();
+}
+
+bool readService(const Json& json, const string& where, ServiceDefinition& service, string& error) {
+    ObjectReader reader(json, where, error);
+    reader.required("path");
+    reader.text("path", service.path);
+    reader.choice("algorithm", service.algorithm, {
+        {"round_robin", LoadBalancingAlgorithm::ROUND_ROBIN},
+        {"least_connections", LoadBalancingAlgorithm::LEAST_CONNECTIONS},
+        {"ip_hash", LoadBalancingAlgorithm::IP_HASH},
+        {"consistent_hash", LoadBalancingAlgorithm::CONSISTENT_HASH},
+        {"power_of_two_choices", LoadBalancingAlgorithm::POWER_OF_TWO_CHOICES},
+        {"peak_ewma", LoadBalancingAlgorithm::PEAK_EWMA},
+        {"weighted_round_robin", LoadBalancingAlgorithm::WEIGHTED_ROUND_ROBIN},
+    });
+    reader.integer("slow_start_seconds", service.slowStartSeconds);
+
+    if (const Json* hashKey = reader.find("hash_key", Json::Type::OBJECT)) {
+        ObjectReader key(*hashKey, reader.path("hash_key"), error);
+        key.choice("source", service.hashKeySource, {
+            {"client_ip", HashKeySource::CLIENT_IP},
+            {"header", HashKeySource::HEADER},
+            {"cookie", HashKeySource::COOKIE},
+        });
+        key.text("name", service.hashKeyName);
+        key.finish();
+    }
+
+    if (const Json* backends = reader.find("backends", Json::Type::ARRAY)) {
+        for (size_t i = 0; i < backends->items.size() && error.empty(); i++) {
+            BackendDefinition backend;
+            if (readBackend(backends->items[i], reader.path("backends[" + to_string(i) + "]"), backend, error)) {
+                service.backends.push_back(backend);
+            }
+        }
+    }
+    if (const Json* backends = reader.find("dns_backends", Json::Type::ARRAY)) {
+        for (size_t i = 0; i < backends->items.size() && error.empty(); i++) {
+            DnsBackendDefinition backend;
+            if (readDnsBackend(backends->items[i], reader.path("dns_backends[" + to_string(i) + "]"), backend, error)) {
+                service.dnsBackends.push_back(backend);
+            }
+        }
+    }
+
+    if (const Json* settings = reader.find("health_check", Json::Type::OBJECT)) {
+        HealthCheckSettings& hc = service.healthCheck;
+        ObjectReader check(*settings, reader.path("health_check"), error);
+        check.integer("interval_seconds", hc.intervalSeconds, 1);
+        check.number("jitter", hc.jitter);
+        check.integer("timeout_ms", hc.timeoutMs, 1);
+        check.text("http_path", hc.httpPath);
+        check.integer("expected_status", hc.expectedStatus, 100);
+        check.integer("rise", hc.rise, 1);
+        check.integer("fall", hc.fall, 1);
+        check.finish();
+    }
+
+    if (const Json* settings = reader.find("outlier_detection", Json::Type::OBJECT)) {
+        OutlierDetectionSettings& od = service.outlierDetection;
+        ObjectReader outlier(*settings, reader.path("outlier_detection"), error);
+        outlier.integer("consecutive_5xx", od.consecutive5xx, 1);
+        outlier.integer("consecutive_connect_errors", od.consecutiveConnectErrors, 1);
+        outlier.integer("interval_seconds", od.intervalSeconds, 1);
+        outlier.integer("min_requests", od.minRequests);
+        outlier.number("max_5xx_rate", od.max5xxRate);
+        outlier.integer("max_p99_latency_ms", od.maxP99LatencyMs);
+        outlier.integer("base_ejection_seconds", od.baseEjectionSeconds, 1);
+        outlier.integer("max_ejection_seconds", od.maxEjectionSeconds, 1);
+        outlier.integer("max_ejection_percent", od.maxEjectionPercent);
+        outlier.finish();
+    }
+
+    if (const Json* settings = reader.find("circuit_breaker", Json::Type::OBJECT)) {
+        CircuitBreakerSettings& cb = service.circuitBreaker;
+        ObjectReader breaker(*settings, reader.path("circuit_breaker"), error);
+        breaker.integer("max_requests", cb.maxRequests, 1);
+        breaker.integer("max_pending_connects", cb.maxPendingConnects, 1);
+        breaker.finish();
+    }
+    if (const Json* settings = reader.find("timeouts", Json::Type::OBJECT)) {
+        UpstreamTimeoutSettings& timeouts = service.timeouts;
+        ObjectReader timeoutReader(*settings, reader.path("timeouts"), error);
+        timeoutReader.integer("connect_timeout_ms", timeouts.connectTimeoutMs, 1);
+        timeoutReader.integer("read_timeout_ms", timeouts.readTimeoutMs, 1);
+        timeoutReader.integer("total_timeout_ms", timeouts.totalTimeoutMs);
+        timeoutReader.finish();
+    }
+    if (const Json* settings = reader.find("retry_policy", Json::Type::OBJECT)) {
+        RetryPolicySettings& policy = service.retryPolicy;
+        ObjectReader policyReader(*settings, reader.path("retry_policy"), error);
+        policyReader.integer("backoff_base_ms", policy.backoffBaseMs);
+        policyReader.integer("backoff_max_ms", policy.backoffMaxMs);
+        policyReader.boolean("hedge", policy.hedge);
+        policyReader.number("hedge_percentile", policy.hedgePercentile);
+        policyReader.integer("hedge_min_delay_ms", policy.hedgeMinDelayMs);
+        policyReader.finish();
+    }
+
+    if (const Json* settings = reader.find("cache", Json::Type::OBJECT)) {
+        CacheSettings& cache = service.cache;
+        ObjectReader cacheReader(*settings, reader.path("cache"), error);
+        service.cacheEnabled = true;
+        cacheReader.boolean("enabled", service.cacheEnabled);
+        cacheReader.size("max_bytes", cache.maxBytes);
+        cacheReader.size("max_object_bytes", cache.maxObjectBytes);
+        cacheReader.integer("default_ttl_seconds", cache.defaultTtlSeconds);
+        cacheReader.integer("stale_while_revalidate_seconds", cache.staleWhileRevalidateSeconds);
+        cacheReader.integer("coalesce_wait_ms", cache.coalesceWaitMs);
+        cacheReader.finish();
+    }
+
+    if (const Json* settings = reader.find("single_flight", Json::Type::OBJECT)) {
+        SingleFlightSettings& flight = service.singleFlight;
+        ObjectReader flightReader(*settings, reader.path("single_flight"), error);
+        service.singleFlightEnabled = true;
+        flightReader.boolean("enabled", service.singleFlightEnabled);
+        flightReader.strings("key_headers", flight.keyHeaders);
+        flightReader.integer("max_wait_ms", flight.maxWaitMs);
+        flightReader.size("max_response_bytes", flight.maxResponseBytes);
+        flightReader.finish();
+    }
+
+    if (const Json* settings = reader.find("rate_limit", Json::Type::OBJECT)) {
+        RateLimitSettings& limit = service.rateLimit;
+        ObjectReader limitReader(*settings, reader.path("rate_limit"), error);
+        service.rateLimitEnabled = true;
+        limitReader.boolean("enabled", service.rateLimitEnabled);
+        limitReader.choice("key", limit.keySource, {
+            {"client_ip", RateLimitKeySource::CLIENT_IP},
+            {"header", RateLimitKeySource::HEADER},
+            {"route", RateLimitKeySource::ROUTE},
+        });
+        if (limit.keySource == RateLimitKeySource::HEADER) {
+            limitReader.required("header");
+        }
+        limitReader.text("header", limit.headerName);
+        limitReader.number("requests_per_second", limit.requestsPerSecond);
+        limitReader.integer("burst", limit.burst);
+        limitReader.integer("max_concurrent", limit.maxConcurrent);
+        limitReader.size("max_keys", limit.maxKeys);
+        limitReader.finish();
+    }
+    if (const Json* settings = reader.find("adaptive_concurrency", Json::Type::OBJECT)) {
+        AdaptiveConcurrencySettings& limit = service.adaptiveConcurrency;
+        ObjectReader limitReader(*settings, reader.path("adaptive_concurrency"), error);
+        service.adaptiveConcurrencyEnabled = true;
+        limitReader.boolean("enabled", service.adaptiveConcurrencyEnabled);
+        limitReader.integer("initial_limit", limit.initialLimit);
+        limitReader.integer("min_limit", limit.minLimit);
+        limitReader.integer("max_limit", limit.maxLimit);
+        limitReader.number("tolerance", limit.tolerance);
+        limitReader.number("smoothing", limit.smoothing);
+        limitReader.integer("window_ms", limit.windowMs);
+        limitReader.integer("min_window_samples", limit.minWindowSamples);
+        limitReader.integer("max_queue", limit.maxQueue);
+        limitReader.integer("max_queue_ms", limit.maxQueueMs);
+        limitReader.finish();
+    }
+    if (const Json* settings = reader.find("retry_budget", Json::Type::OBJECT)) {
+        RetryBudgetSettings& budget = service.retryBudget;
+        ObjectReader budgetReader(*settings, reader.path("retry_budget"), error);
+        service.retryBudgetEnabled = true;
+        budgetReader.boolean("enabled", service.retryBudgetEnabled);
+        budgetReader.number("percent", budget.percent);
+        budgetReader.integer("min_retries_per_second", budget.minRetriesPerSecond);
+        budgetReader.finish();
+    }
+
+    if (!reader.finish()) return false;
+    if (service.path.empty() || service.path.front() != '/') {
+        error = where + ".path: must start with '/'";
+        return false;
+    }
+    dump(json, service.fingerprint);
+    return true;
+}
+
+bool readRoute(const Json& json, const string& where, Route& route, string& error) {
+    ObjectReader reader(json, where, error);
+    reader.required("path");
+    reader.required("service");
+    reader.choice("type", route.type, {
+        {"prefix", RouteMatchType::PREFIX},
+        {"exact", RouteMatchType::EXACT},
+        {"regex", RouteMatchType::REGEX},
+    });
+    reader.text("path", route.path);
+    reader.text("host", route.host);
+    reader.strings("methods", route.methods);
+    reader.text("service", route.service);
+    reader.text("rewrite", route.rewrite);
+    // {"X-Canary": "1", "X-Debug": ""}: an empty value only requires presence
+    if (const Json* headers = reader.find("headers", Json::Type::OBJECT)) {
+        for (const auto& [name, value] : headers->members) {
+            if (value.type != Json::Type::STRING) {
+                error = reader.path("headers." + name) + ": expected a string";
+                return false;
+            }
+            route.headers.push_back({name, value.text});
+        }
+    }
+    return reader.finish();
+}
+
+} // namespace
+
+// ==================== Config Loading ====================
+
+bool parseConfig(const string& text, LoadBalancerConfig& config, string& error) {
+    Json root;
+    error.clear();
+    if (!JsonParser(text).parse(root, error)) return false;
+
+    ObjectReader reader(root, "", error);
+    reader.integer("listen_port", config.listenPort, 1);
+    reader.integer("stats_port", config.statsPort, 1);
+    reader.integer("worker_threads", config.workerThreads);
+    reader.boolean("zero_copy_relay", config.zeroCopyRelay);
+    reader.integer("drain_timeout_seconds", config.drainTimeoutSeconds);
+    reader.integer("drain_delay_seconds", config.drainDelaySeconds);
+
+    if (const Json* keepAlive = reader.find("client_keep_alive", Json::Type::OBJECT)) {
+        ObjectReader settings(*keepAlive, "client_keep_alive", error);
+        settings.integer("timeout_seconds", config.keepAliveTimeoutSeconds, 1);
+        settings.integer("max_requests", config.maxKeepAliveRequests, 1);
+        settings.finish();
+    }
+
+    if (const Json* pool = reader.find("upstream_pool", Json::Type::OBJECT)) {
+        ObjectReader settings(*pool, "upstream_pool", error);
+        settings.integer("max_idle", config.upstreamPool.maxIdle);
+        settings.integer("max_total", config.upstreamPool.maxTotal, 1);
+        settings.integer("idle_timeout_seconds", config.upstreamPool.idleTimeoutSeconds, 1);
+        settings.finish();
+    }
+
+    if (const Json* log = reader.find("access_log", Json::Type::OBJECT)) {
+        AccessLogSettings& settings = config.accessLog;
+        ObjectReader logReader(*log, "access_log", error);
+        logReader.choice("format", settings.format, {
+            {"common", AccessLogFormat::COMMON},
+            {"json", AccessLogFormat::JSON},
+        });
+        logReader.text("path", settings.path);
+        logReader.number("sample_rate", settings.sampleRate);
+        logReader.size("buffer_entries", settings.bufferEntries);
+        logReader.integer("flush_interval_ms", settings.flushIntervalMs, 1);
+        logReader.finish();
+    }
+
+    if (const Json* https = reader.find("tls", Json::Type::OBJECT)) {
+        TlsSettings& settings = config.tls;
+        ObjectReader tlsReader(*https, "tls", error);
+        config.tlsEnabled = true;
+        tlsReader.boolean("enabled", config.tlsEnabled);
+        if (config.tlsEnabled) {
+            tlsReader.required("certificate_file");
+            tlsReader.required("private_key_file");
+        }
+        tlsReader.integer("port", settings.port, 1);
+        tlsReader.text("certificate_file", settings.certificateFile);
+        tlsReader.text("private_key_file", settings.privateKeyFile);
+        tlsReader.boolean("kernel_offload", settings.kernelOffload);
+        tlsReader.boolean("session_tickets", settings.sessionTickets);
+        tlsReader.text("ticket_key_file", settings.ticketKeyFile);
+        tlsReader.integer("session_cache_size", settings.sessionCacheSize);
+        tlsReader.integer("session_timeout_seconds", settings.sessionTimeoutSeconds, 1);
+        tlsReader.finish();
+    }
+
+    if (const Json* h2 = reader.find("http2", Json::Type::OBJECT)) {
+        Http2Settings& settings = config.http2;
+        ObjectReader h2Reader(*h2, "http2", error);
+        h2Reader.boolean("enabled", settings.enabled);
+        h2Reader.integer("max_concurrent_streams", settings.maxConcurrentStreams, 1);
+        h2Reader.integer("initial_window_size", settings.initialWindowSize, 16384);
+        h2Reader.integer("connection_window_size", settings.connectionWindowSize, 65535);
+        h2Reader.size("max_buffered_body_bytes", settings.maxBufferedBodyBytes);
+        h2Reader.size("max_header_list_bytes", settings.maxHeaderListBytes);
+        h2Reader.finish();
+    }
+
+    if (const Json* limits = reader.find("client_limits", Json::Type::OBJECT)) {
+        RateLimitSettings& settings = config.clientLimits;
+        ObjectReader limitReader(*limits, "client_limits", error);
+        config.clientLimitsEnabled = true;
+        limitReader.boolean("enabled", config.clientLimitsEnabled);
+        limitReader.number("requests_per_second", settings.requestsPerSecond);
+        limitReader.integer("burst", settings.burst);
+        limitReader.integer("max_connections", settings.maxConcurrent);
+        limitReader.size("max_clients", settings.maxKeys);
+        limitReader.finish();
+    }
+
+    if (const Json* services = reader.find("services", Json::Type::ARRAY)) {
+        set<string> paths;
+        for (size_t i = 0; i < services->items.size() && error.empty(); i++) {
+            ServiceDefinition service;
+            string where = "services[" + to_string(i) + "]";
+            if (!readService(services->items[i], where, service, error)) break;
+            if (!paths.insert(service.path).second) {
+                error = where + ".path: duplicate service " + service.path;
+                break;
+            }
+            config.services.push_back(move(service));
+        }
+    }
+
+    if (const Json* routes = reader.find("routes", Json::Type::ARRAY)) {
+        for (size_t i = 0; i < routes->items.size() && error.empty(); i++) {
+            Route route;
+            if (readRoute(routes->items[i], "routes[" + to_string(i) + "]", route, error)) {
+                config.routes.push_back(route);
+            }
+        }
+    }
+
+    return reader.finish();
+}
+
+bool loadConfigFile(const string& path, LoadBalancerConfig& config, string& error) {
+    ifstream file(path);
+    if (!file) {
+        error = "cannot open " + path;
+        return false;
+    }
+    stringstream contents;
+    contents << file.rdbuf();
+    if (!parseConfig(contents.str(), config, error)) {
+        error = path + ": " + error;
+        return false;
+    }
+    return true;
+}
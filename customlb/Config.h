@@ -0,0 +1,87 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <string>
+#include <vector>
+#include "LoadBalancer.h"
+using namespace std;
+
+// Declarative configuration, as read from a JSON file. Every field has the
+// same default as the corresponding LoadBalancer setter.
+
+struct BackendDefinition {
+    string name;
+    string host;
+    int port = 8080;
+    int maxFails = 3;
+    int failTimeout = 30; // seconds
+    int weight = 1;
+};
+
+// One backend per A record of host, kept in sync as DNS changes
+struct DnsBackendDefinition {
+    string host;
+    int port = 8080;
+    int maxFails = 3;
+    int failTimeout = 30;
+    int weight = 1;
+};
+
+struct ServiceDefinition {
+    string path;
+    LoadBalancingAlgorithm algorithm = LoadBalancingAlgorithm::ROUND_ROBIN;
+    HashKeySource hashKeySource = HashKeySource::CLIENT_IP;
+    string hashKeyName;
+    vector<BackendDefinition> backends;
+    vector<DnsBackendDefinition> dnsBackends;
+    HealthCheckSettings healthCheck;
+    OutlierDetectionSettings outlierDetection;
+    CircuitBreakerSettings circuitBreaker;
+    UpstreamTimeoutSettings timeouts;
+    RetryPolicySettings retryPolicy;
+    int slowStartSeconds = 0;
+    bool cacheEnabled = false;
+    CacheSettings cache;
+    bool singleFlightEnabled = false;
+    SingleFlightSettings singleFlight;
+    bool rateLimitEnabled = false;
+    RateLimitSettings rateLimit;
+    bool adaptiveConcurrencyEnabled = false;
+    AdaptiveConcurrencySettings adaptiveConcurrency;
+    bool retryBudgetEnabled = false;
+    RetryBudgetSettings retryBudget;
+
+    // Canonical text of the definition; a reload keeps the running service
+    // (and its backends' state, cache and counters) when it is unchanged
+    string fingerprint;
+};
+
+struct LoadBalancerConfig {
+    // Listener settings only take effect at startup
+    int listenPort = 80;
+    int statsPort = 8081;
+    int workerThreads = 0;
+
+    int drainTimeoutSeconds = 30;
+    int drainDelaySeconds = 5;
+    int keepAliveTimeoutSeconds = 75;
+    int maxKeepAliveRequests = 1000;
+    bool zeroCopyRelay = true;
+    PoolSettings upstreamPool;
+    AccessLogSettings accessLog; // startup only
+    bool tlsEnabled = false;     // startup only; the certificate files are watched
+    TlsSettings tls;
+    Http2Settings http2;         // startup only
+    bool clientLimitsEnabled = false; // startup only
+    RateLimitSettings clientLimits;   // maxConcurrent counts connections
+
+    vector<ServiceDefinition> services;
+    vector<Route> routes;
+};
+
+// Reads a JSON configuration file. Unknown keys are errors, so a typo does
+// not silently fall back to a default; error names the offending key.
+bool loadConfigFile(const string& path, LoadBalancerConfig& config, string& error);
+bool parseConfig(const string& text, LoadBalancerConfig& config, string& error);
+
+#endif // CONFIG_H
@@ -0,0 +1,115 @@
+#include "ConnectionPool.h"
+#include <cerrno>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+// ==================== ConnectionPool Implementation ====================
+
+ConnectionPool::ConnectionPool()
+    : totalConnections(0), reusedConnections(0), newConnections(0), staleConnections(0) {
+}
+
+ConnectionPool::~ConnectionPool() {
+    for (auto& entry : idle) {
+        close(entry.fd);
+    }
+}
+
+void ConnectionPool::configure(const PoolSettings& poolSettings) {
+    lock_guard<mutex> lock(poolMutex);
+    settings = poolSettings;
+}
+
+bool ConnectionPool::isStale(int fd) {
+    // An idle HTTP connection must have nothing to read: EOF means the
+    // backend closed it, unexpected bytes mean it is out of sync.
+    char probe;
+    ssize_t n = recv(fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return false;
+    }
+    return true;
+}
+
+// settings are read under poolMutex: configure() runs on the reload and
+// DNS threads while workers use the pool
+int ConnectionPool::acquire() {
+    auto now = chrono::steady_clock::now();
+
+    while (true) {
+        IdleConnection entry;
+        chrono::seconds timeout;
+        {
+            lock_guard<mutex> lock(poolMutex);
+            if (idle.empty()) return -1;
+            entry = idle.back();
+            idle.pop_back();
+            timeout = chrono::seconds(settings.idleTimeoutSeconds);
+        }
+
+        if (now - entry.idleSince < timeout && !isStale(entry.fd)) {
+            reusedConnections++;
+            return entry.fd;
+        }
+
+        staleConnections++;
+        discard(entry.fd);
+    }
+}
+
+bool ConnectionPool::reserve() {
+    int limit = maxTotal();
+    int current = totalConnections.load();
+    do {
+        if (current >= limit) return false;
+    } while (!totalConnections.compare_exchange_weak(current, current + 1));
+
+    newConnections++;
+    return true;
+}
+
+void ConnectionPool::release(int fd, bool reusable) {
+    if (reusable) {
+        lock_guard<mutex> lock(poolMutex);
+        if ((int)idle.size() < settings.maxIdle) {
+            idle.push_back(IdleConnection{fd, chrono::steady_clock::now()});
+            return;
+        }
+    }
+    discard(fd);
+}
+
+void ConnectionPool::discard(int fd) {
+    if (fd >= 0) {
+        close(fd);
+    }
+    totalConnections--;
+}
+
+void ConnectionPool::evictExpired() {
+    auto now = chrono::steady_clock::now();
+    deque<IdleConnection> expired;
+    {
+        lock_guard<mutex> lock(poolMutex);
+        auto deadline = now - chrono::seconds(settings.idleTimeoutSeconds);
+        while (!idle.empty() && idle.front().idleSince <= deadline) {
+            expired.push_back(idle.front());
+            idle.pop_front();
+        }
+    }
+    for (auto& entry : expired) {
+        discard(entry.fd);
+    }
+}
+
+int ConnectionPool::maxTotal() const {
+    lock_guard<mutex> lock(poolMutex);
+    return settings.maxTotal;
+}
+
+int ConnectionPool::idleCount() const {
+    lock_guard<mutex> lock(poolMutex);
+    return idle.size();
+}
@@ -0,0 +1,62 @@
+#ifndef CONNECTIONPOOL_H
+#define CONNECTIONPOOL_H
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+using namespace std;
+
+// Upstream pool limits (shared by all backends unless overridden)
+struct PoolSettings {
+    int maxIdle = 32;            // idle keep-alive sockets kept per backend
+    int maxTotal = 512;          // open sockets (idle + in use) per backend
+    int idleTimeoutSeconds = 15; // stay below the backend's keep-alive timeout
+};
+
+// Keep-alive sockets to one backend. Idle sockets are not registered with
+// any event loop, so whichever worker acquires one adopts it.
+class ConnectionPool {
+private:
+    struct IdleConnection {
+        int fd;
+        chrono::steady_clock::time_point idleSince;
+    };
+
+    mutable mutex poolMutex;
+    deque<IdleConnection> idle; // back = most recently used
+    PoolSettings settings;
+
+    atomic<int> totalConnections;
+    atomic<uint64_t> reusedConnections;
+    atomic<uint64_t> newConnections;
+    atomic<uint64_t> staleConnections;
+
+    static bool isStale(int fd);
+
+public:
+    ConnectionPool();
+    ~ConnectionPool();
+
+    void configure(const PoolSettings& poolSettings);
+
+    // Returns a live idle socket or -1
+    int acquire();
+    // Counts a new socket against maxTotal; false when the limit is reached
+    bool reserve();
+    // Returns a socket after use; non-reusable sockets are closed
+    void release(int fd, bool reusable);
+    // Closes a reserved socket (or gives back the reservation when fd < 0)
+    void discard(int fd);
+    void evictExpired();
+
+    int idleCount() const;
+    int totalCount() const { return totalConnections.load(); }
+    int maxTotal() const;
+    uint64_t reusedCount() const { return reusedConnections.load(); }
+    uint64_t newCount() const { return newConnections.load(); }
+    uint64_t staleCount() const { return staleConnections.load(); }
+};
+
+#endif // CONNECTIONPOOL_H
@@ -0,0 +1,136 @@
+#include "DnsResolver.h"
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+using namespace std;
+
+// ==================== DnsResolver Implementation ====================
+
+DnsResolver::DnsResolver(int refreshSeconds)
+    : nextWatchId(1), running(false), refreshIntervalSeconds(refreshSeconds) {
+}
+
+DnsResolver::~DnsResolver() {
+    stop();
+}
+
+bool DnsResolver::resolve(const string& host, Addresses& addresses) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* result = nullptr;
+    if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0 || !result) {
+        return false;
+    }
+
+    addresses.clear();
+    for (struct addrinfo* ai = result; ai; ai = ai->ai_next) {
+        auto* sin = reinterpret_cast<struct sockaddr_in*>(ai->ai_addr);
+        addresses.push_back(sin->sin_addr.s_addr);
+    }
+    freeaddrinfo(result);
+
+    sort(addresses.begin(), addresses.end());
+    addresses.erase(unique(addresses.begin(), addresses.end()), addresses.end());
+    return !addresses.empty();
+}
+
+string DnsResolver::toString(uint32_t address) {
+    char buffer[INET_ADDRSTRLEN];
+    struct in_addr addr;
+    addr.s_addr = address;
+    inet_ntop(AF_INET, &addr, buffer, sizeof(buffer));
+    return buffer;
+}
+
+DnsResolver::WatchId DnsResolver::watch(const string& host, Callback callback) {
+    Watch entry{0, host, {}, callback};
+    if (resolve(host, entry.addresses)) {
+        callback(entry.addresses);
+    } else {
+        cerr << "[DNS] Failed to resolve " << host << ", will retry" << endl;
+    }
+
+    lock_guard<mutex> lock(watchMutex);
+    entry.id = nextWatchId++;
+    watches.push_back(move(entry));
+    return watches.back().id;
+}
+
+void DnsResolver::unwatch(WatchId id) {
+    lock_guard<mutex> callbackLock(callbackMutex);
+    lock_guard<mutex> lock(watchMutex);
+    watches.erase(remove_if(watches.begin(), watches.end(),
+                            [id](const Watch& entry) { return entry.id == id; }),
+                  watches.end());
+}
+
+void DnsResolver::start() {
+    running = true;
+    resolverThread = thread(&DnsResolver::resolverLoop, this);
+}
+
+void DnsResolver::stop() {
+    {
+        lock_guard<mutex> lock(wakeMutex);
+        running = false;
+    }
+    wake.notify_all();
+    if (resolverThread.joinable()) {
+        resolverThread.join();
+    }
+}
+
+void DnsResolver::refreshAll() {
+    // Watches can come and go while the lookups run
+    vector<pair<WatchId, string>> pending;
+    {
+        lock_guard<mutex> lock(watchMutex);
+        for (const Watch& entry : watches) {
+            pending.emplace_back(entry.id, entry.host);
+        }
+    }
+
+    for (const auto& [id, host] : pending) {
+        if (!running) break;
+
+        // Blocking lookup, outside the lock
+        Addresses addresses;
+        if (!resolve(host, addresses)) {
+            cerr << "[DNS] Failed to resolve " << host << ", keeping last known addresses" << endl;
+            continue;
+        }
+
+        lock_guard<mutex> callbackLock(callbackMutex);
+        Callback callback;
+        {
+            lock_guard<mutex> lock(watchMutex);
+            auto entry = find_if(watches.begin(), watches.end(),
+                                 [&](const Watch& watched) { return watched.id == id; });
+            if (entry == watches.end() || entry->addresses == addresses) continue;
+            entry->addresses = addresses;
+            callback = entry->callback;
+        }
+
+        cout << "[DNS] " << host << " now resolves to " << addresses.size() << " address(es)" << endl;
+        callback(addresses);
+    }
+}
+
+void DnsResolver::resolverLoop() {
+    while (running) {
+        {
+            unique_lock<mutex> lock(wakeMutex);
+            wake.wait_for(lock, chrono::seconds(refreshIntervalSeconds), [this]() { return !running; });
+        }
+        if (!running) break;
+
+        refreshAll();
+    }
+}
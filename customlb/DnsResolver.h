@@ -0,0 +1,63 @@
+#ifndef DNSRESOLVER_H
+#define DNSRESOLVER_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <cstdint>
+using namespace std;
+
+// Resolves backend hostnames in a background thread so DNS never runs on
+// the request path. Every watched name is re-resolved each refresh period
+// and its callback fires (on the resolver thread) when the A record set
+// changes. A failed lookup keeps the last known addresses.
+class DnsResolver {
+public:
+    // IPv4 addresses in network byte order, sorted and deduplicated
+    using Addresses = vector<uint32_t>;
+    using Callback = function<void(const Addresses& addresses)>;
+    using WatchId = uint64_t;
+
+    DnsResolver(int refreshSeconds = 5);
+    ~DnsResolver();
+
+    // Resolves host right away (callback runs on the calling thread if that
+    // succeeds), then keeps it refreshed once start() has been called
+    WatchId watch(const string& host, Callback callback);
+    // Once this returns the watch's callback is not running and never runs again
+    void unwatch(WatchId id);
+
+    void start();
+    void stop();
+
+    static bool resolve(const string& host, Addresses& addresses);
+    static string toString(uint32_t address);
+
+private:
+    struct Watch {
+        WatchId id;
+        string host;
+        Addresses addresses;
+        Callback callback;
+    };
+
+    mutex watchMutex;
+    vector<Watch> watches;
+    WatchId nextWatchId;
+    mutex callbackMutex; // held while a refresh runs a callback
+
+    atomic<bool> running;
+    thread resolverThread;
+    mutex wakeMutex;
+    condition_variable wake;
+    int refreshIntervalSeconds;
+
+    void resolverLoop();
+    void refreshAll();
+};
+
+#endif // DNSRESOLVER_H
@@ -0,0 +1,168 @@
+#include "EventLoop.h"
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using namespace std;
+
+// ==================== EventLoop Implementation ====================
+
+EventLoop::EventLoop()
+    : running(false), nextGeneration(1), nextTimerId(1) {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epollFd < 0 || wakeFd < 0) {
+        cerr << "[LOOP] Failed to create epoll/eventfd: " << strerror(errno) << endl;
+        return;
+    }
+
+    add(wakeFd, EPOLLIN, [this](uint32_t) {
+        uint64_t value;
+        while (read(wakeFd, &value, sizeof(value)) > 0) {
+        }
+    });
+}
+
+EventLoop::~EventLoop() {
+    if (wakeFd >= 0) close(wakeFd);
+    if (epollFd >= 0) close(epollFd);
+}
+
+bool EventLoop::add(int fd, uint32_t events, IoCallback callback) {
+    uint32_t generation = nextGeneration++;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = (static_cast<uint64_t>(generation) << 32) | static_cast<uint32_t>(fd);
+
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        return false;
+    }
+
+    handlers[fd] = Handler{generation, move(callback)};
+    return true;
+}
+
+bool EventLoop::modify(int fd, uint32_t events) {
+    auto it = handlers.find(fd);
+    if (it == handlers.end()) return false;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = (static_cast<uint64_t>(it->second.generation) << 32) | static_cast<uint32_t>(fd);
+
+    return epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void EventLoop::remove(int fd) {
+    auto it = handlers.find(fd);
+    if (it == handlers.end()) return;
+
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    handlers.erase(it);
+}
+
+EventLoop::TimerId EventLoop::runAfter(int64_t delayMs, Task task) {
+    TimerId id = nextTimerId++;
+    auto deadline = Clock::now() + chrono::milliseconds(delayMs);
+    timers.emplace(make_pair(deadline, id), move(task));
+    timerDeadlines[id] = deadline;
+    return id;
+}
+
+void EventLoop::cancel(TimerId id) {
+    auto it = timerDeadlines.find(id);
+    if (it == timerDeadlines.end()) return;
+
+    timers.erase(make_pair(it->second, id));
+    timerDeadlines.erase(it);
+}
+
+void EventLoop::post(Task task) {
+    {
+        lock_guard<mutex> lock(pendingMutex);
+        pendingTasks.push_back(move(task));
+    }
+
+    uint64_t one = 1;
+    ssize_t ignored = write(wakeFd, &one, sizeof(one));
+    (void)ignored;
+}
+
+int EventLoop::nextTimeoutMs() {
+    if (timers.empty()) return 1000;
+
+    auto now = Clock::now();
+    auto deadline = timers.begin()->first.first;
+    if (deadline <= now) return 0;
+
+    auto ms = chrono::duration_cast<chrono::milliseconds>(deadline - now).count() + 1;
+    return static_cast<int>(min<int64_t>(ms, 1000));
+}
+
+void EventLoop::runExpiredTimers() {
+    auto now = Clock::now();
+    while (!timers.empty() && timers.begin()->first.first <= now) {
+        auto it = timers.begin();
+        Task task = move(it->second);
+        timerDeadlines.erase(it->first.second);
+        timers.erase(it);
+        task();
+    }
+}
+
+void EventLoop::runPendingTasks() {
+    vector<Task> tasks;
+    {
+        lock_guard<mutex> lock(pendingMutex);
+        tasks.swap(pendingTasks);
+    }
+    for (auto& task : tasks) {
+        task();
+    }
+}
+
+void EventLoop::run() {
+    loopThread = this_thread::get_id();
+    running = true;
+
+    const int maxEvents = 256;
+    struct epoll_event events[maxEvents];
+
+    while (running) {
+        int n = epoll_wait(epollFd, events, maxEvents, nextTimeoutMs());
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            cerr << "[LOOP] epoll_wait failed: " << strerror(errno) << endl;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = static_cast<int>(events[i].data.u64 & 0xffffffffu);
+            uint32_t generation = static_cast<uint32_t>(events[i].data.u64 >> 32);
+
+            auto it = handlers.find(fd);
+            if (it == handlers.end() || it->second.generation != generation) {
+                continue; // fd was closed by an earlier callback in this batch
+            }
+
+            // Copy: the callback may remove (and destroy) its own handler
+            IoCallback callback = it->second.callback;
+            callback(events[i].events);
+        }
+
+        runExpiredTimers();
+        runPendingTasks();
+    }
+
+    running = false;
+}
+
+void EventLoop::stop() {
+    post([this]() { running = false; });
+}
@@ -0,0 +1,76 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+using namespace std;
+
+// Single-threaded epoll reactor. Every method except post() and stop()
+// must be called from the thread that runs the loop.
+class EventLoop {
+public:
+    using IoCallback = function<void(uint32_t events)>;
+    using Task = function<void()>;
+    using TimerId = uint64_t;
+    using Clock = chrono::steady_clock;
+
+    EventLoop();
+    ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // fd registration (events are EPOLL* flags, EPOLLET is up to the caller)
+    bool add(int fd, uint32_t events, IoCallback callback);
+    bool modify(int fd, uint32_t events);
+    void remove(int fd);
+
+    // One-shot timers
+    TimerId runAfter(int64_t delayMs, Task task);
+    void cancel(TimerId id);
+
+    // Thread-safe: queue a task to run on the loop thread
+    void post(Task task);
+
+    void run();
+    void stop();
+
+    bool isRunning() const { return running; }
+    bool isInLoopThread() const { return loopThread == this_thread::get_id(); }
+
+private:
+    struct Handler {
+        uint32_t generation;
+        IoCallback callback;
+    };
+
+    int epollFd;
+    int wakeFd;
+    atomic<bool> running;
+    thread::id loopThread;
+
+    // Generation counters guard against events for an fd number that was
+    // closed and reused within the same epoll_wait batch.
+    unordered_map<int, Handler> handlers;
+    uint32_t nextGeneration;
+
+    map<pair<Clock::time_point, TimerId>, Task> timers;
+    unordered_map<TimerId, Clock::time_point> timerDeadlines;
+    TimerId nextTimerId;
+
+    mutex pendingMutex;
+    vector<Task> pendingTasks;
+
+    int nextTimeoutMs();
+    void runExpiredTimers();
+    void runPendingTasks();
+};
+
+#endif // EVENTLOOP_H
@@ -0,0 +1,215 @@
+#include "Handoff.h"
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace std;
+
+namespace {
+
+const size_t maxHandoffFds = 256;
+
+bool makeAddress(const string& path, struct sockaddr_un& address) {
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+        cerr << "[HANDOFF] Invalid socket path: " << path << endl;
+        return false;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+} // namespace
+
+// ==================== ListenerHandoff Implementation ====================
+
+ListenerHandoff::ListenerHandoff()
+    : listenFd(-1), channel(-1) {
+}
+
+ListenerHandoff::~ListenerHandoff() {
+    if (listenFd >= 0) ::close(listenFd);
+    if (channel >= 0) ::close(channel);
+}
+
+bool ListenerHandoff::sendLine(int fd, const string& line) {
+    string data = line + "\n";
+    return send(fd, data.data(), data.size(), MSG_NOSIGNAL) == (ssize_t)data.size();
+}
+
+bool ListenerHandoff::readLine(int fd, string& line, int timeoutMs) {
+    line.clear();
+    while (line.size() < 256) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, timeoutMs);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) return false;
+
+        char c;
+        if (recv(fd, &c, 1, 0) != 1) return false;
+        if (c == '\n') return true;
+        line += c;
+    }
+    return false;
+}
+
+bool ListenerHandoff::takeOver(const string& path, Listeners& listeners) {
+    struct sockaddr_un address;
+    if (!makeAddress(path, address)) return false;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return false;
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        ::close(fd); // no running process (or a stale socket file)
+        return false;
+    }
+
+    // The descriptors arrive with the first byte of the reply
+    struct timeval timeout = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char data[128];
+    struct iovec iov = {data, sizeof(data) - 1};
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * maxHandoffFds)];
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t received = -1;
+    if (sendLine(fd, "TAKEOVER")) {
+        received = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+    }
+
+    vector<int> fds;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); received > 0 && cmsg;
+         cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const int* passed = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+        fds.insert(fds.end(), passed, passed + count);
+    }
+
+    // Releases without HTTPS send no TLS count
+    size_t workerCount = 0;
+    size_t tlsCount = 0;
+    int hasStats = 0;
+    string header;
+    if (received > 0) {
+        data[received] = '\0';
+        istringstream reply(data);
+        reply >> header >> workerCount >> hasStats >> tlsCount;
+    }
+    if (header != "LISTENERS" || (message.msg_flags & MSG_CTRUNC) ||
+        fds.size() != workerCount + tlsCount + (hasStats ? 1 : 0)) {
+        cerr << "[HANDOFF] Malformed reply from the running process at " << path << endl;
+        for (int passed : fds) ::close(passed);
+        ::close(fd);
+        return false;
+    }
+
+    listeners.workers.assign(fds.begin(), fds.begin() + workerCount);
+    listeners.tls.assign(fds.begin() + workerCount, fds.begin() + workerCount + tlsCount);
+    listeners.stats = hasStats ? fds.back() : -1;
+    channel = fd;
+    cout << "[HANDOFF] Took over " << fds.size() << " listening sockets from " << path << endl;
+    return true;
+}
+
+void ListenerHandoff::confirm() {
+    if (channel < 0) return;
+    sendLine(channel, "READY");
+    ::close(channel);
+    channel = -1;
+}
+
+bool ListenerHandoff::listen(const string& path) {
+    struct sockaddr_un address;
+    if (!makeAddress(path, address)) return false;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return false;
+
+    // Whoever listened here before has handed over (or died)
+    unlink(path.c_str());
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || ::listen(fd, 4) < 0) {
+        cerr << "[HANDOFF] Cannot listen on " << path << ": " << strerror(errno) << endl;
+        ::close(fd);
+        return false;
+    }
+
+    socketPath = path;
+    listenFd = fd;
+    return true;
+}
+
+bool ListenerHandoff::serve(const Listeners& listeners, int timeoutMs) {
+    if (listenFd < 0) return false;
+
+    struct pollfd pfd = {listenFd, POLLIN, 0};
+    if (poll(&pfd, 1, timeoutMs) <= 0) return false;
+
+    int peer = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (peer < 0) return false;
+
+    string line;
+    if (!readLine(peer, line, 5000) || line != "TAKEOVER") {
+        ::close(peer);
+        return false;
+    }
+
+    vector<int> fds = listeners.workers;
+    fds.insert(fds.end(), listeners.tls.begin(), listeners.tls.end());
+    if (listeners.stats >= 0) fds.push_back(listeners.stats);
+    string header = "LISTENERS " + to_string(listeners.workers.size()) + " " +
+                    (listeners.stats >= 0 ? "1" : "0") + " " + to_string(listeners.tls.size()) + "\n";
+
+    struct iovec iov = {const_cast<char*>(header.data()), header.size()};
+    vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+    if (sendmsg(peer, &message, MSG_NOSIGNAL) != (ssize_t)header.size()) {
+        cerr << "[HANDOFF] Failed to pass the listeners: " << strerror(errno) << endl;
+        ::close(peer);
+        return false;
+    }
+    cout << "[HANDOFF] Passed " << fds.size() << " listening sockets to a new process" << endl;
+
+    // Until READY both processes accept; if the successor dies first this
+    // one simply carries on
+    bool ready = readLine(peer, line, readyTimeoutMs) && line == "READY";
+    ::close(peer);
+    if (!ready) {
+        cerr << "[HANDOFF] The new process did not become ready; still serving" << endl;
+    }
+    return ready;
+}
+
+void ListenerHandoff::close(bool handedOver) {
+    if (listenFd >= 0) {
+        ::close(listenFd);
+        listenFd = -1;
+    }
+    if (!handedOver && !socketPath.empty()) {
+        unlink(socketPath.c_str());
+    }
+    socketPath.clear();
+}
@@ -0,0 +1,57 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <string>
+#include <vector>
+using namespace std;
+
+// Passes the listening sockets of a running load balancer to its successor
+// over a Unix domain socket (SCM_RIGHTS), so a new binary takes over the
+// ports without a window in which connections are refused or queued ones
+// are reset. Both processes accept on the shared sockets until the new one
+// reports READY; the old one then drains and exits.
+//
+//   successor                         running process
+//   connect(path), "TAKEOVER"   ->
+//                               <-    "LISTENERS <n> <stats> <tls>" + fds
+//   starts its workers, "READY" ->    drains; the successor owns path now
+class ListenerHandoff {
+public:
+    struct Listeners {
+        vector<int> workers; // one SO_REUSEPORT socket per worker
+        vector<int> tls;     // ... and per worker for HTTPS, if enabled
+        int stats = -1;
+    };
+
+    ListenerHandoff();
+    ~ListenerHandoff();
+
+    ListenerHandoff(const ListenerHandoff&) = delete;
+    ListenerHandoff& operator=(const ListenerHandoff&) = delete;
+
+    // Successor: takes over the listeners of the process serving path.
+    // False (and nothing received) when no process is listening there.
+    bool takeOver(const string& path, Listeners& listeners);
+    // Successor: tells the previous process to drain
+    void confirm();
+
+    // Running process: accepts successors at path (replacing a stale file)
+    bool listen(const string& path);
+    // Waits up to timeoutMs for a successor; true once it has the listeners
+    // and reported READY. False on timeout or if the successor went away.
+    bool serve(const Listeners& listeners, int timeoutMs);
+    // Closes the socket; removes path unless a successor has taken it over
+    void close(bool handedOver);
+
+private:
+    static const int readyTimeoutMs = 30000;
+
+    string socketPath;
+    int listenFd;
+    int channel; // successor: connection to the previous process
+
+    static bool sendLine(int fd, const string& line);
+    static bool readLine(int fd, string& line, int timeoutMs);
+};
+
+#endif // HANDOFF_H
@@ -0,0 +1,1147 @@
+#include "Http2.h"
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+// ==================== Protocol Constants ====================
+
+const char clientPreface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+const size_t clientPrefaceLength = sizeof(clientPreface) - 1;
+const size_t frameHeaderBytes = 9;
+const uint32_t localMaxFrameSize = 16384; // SETTINGS_MAX_FRAME_SIZE default, never raised
+const int64_t maxWindow = 0x7fffffff;
+
+// Per stream / per connection response bytes queued before writers wait
+const size_t maxStreamBuffered = 64 * 1024;
+const size_t maxOutputBuffered = 256 * 1024;
+// PING / SETTINGS acknowledgements queued and not yet written
+const size_t maxPendingControlReplies = 1000;
+
+enum FrameType : uint8_t {
+    FRAME_DATA = 0x0,
+    FRAME_HEADERS = 0x1,
+    FRAME_PRIORITY = 0x2,
+    FRAME_RST_STREAM = 0x3,
+    FRAME_SETTINGS = 0x4,
+    FRAME_PUSH_PROMISE = 0x5,
+    FRAME_PING = 0x6,
+    FRAME_GOAWAY = 0x7,
+    FRAME_WINDOW_UPDATE = 0x8,
+    FRAME_CONTINUATION = 0x9
+};
+
+enum FrameFlag : uint8_t {
+    FLAG_END_STREAM = 0x1,
+    FLAG_ACK = 0x1,
+    FLAG_END_HEADERS = 0x4,
+    FLAG_PADDED = 0x8,
+    FLAG_PRIORITY = 0x20
+};
+
+enum SettingId : uint16_t {
+    SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    SETTINGS_ENABLE_PUSH = 0x2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    SETTINGS_MAX_FRAME_SIZE = 0x5,
+    SETTINGS_MAX_HEADER_LIST_SIZE = 0x6
+};
+
+enum ErrorCode : uint32_t {
+    NO_ERROR = 0x0,
+    PROTOCOL_ERROR = 0x1,
+    INTERNAL_ERROR = 0x2,
+    FLOW_CONTROL_ERROR = 0x3,
+    STREAM_CLOSED = 0x5,
+    FRAME_SIZE_ERROR = 0x6,
+    REFUSED_STREAM = 0x7,
+    COMPRESSION_ERROR = 0x9,
+    ENHANCE_YOUR_CALM = 0xb
+};
+
+uint32_t read32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+void append32(string& out, uint32_t value) {
+    out.push_back((char)(value >> 24));
+    out.push_back((char)(value >> 16));
+    out.push_back((char)(value >> 8));
+    out.push_back((char)value);
+}
+
+// ==================== HPACK Tables ====================
+
+// RFC 7541 Appendix A
+const pair<const char*, const char*> staticTable[] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"}, {":status", "200"},
+    {":status", "204"}, {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""}, {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+    {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""},
+    {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""},
+    {"from", ""}, {"host", ""}, {"if-match", ""}, {"if-modified-since", ""},
+    {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+    {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+    {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+    {"www-authenticate", ""}
+};
+const size_t staticTableSize = sizeof(staticTable) / sizeof(staticTable[0]);
+
+// RFC 7541 Appendix B: code (right-aligned) and length in bits per symbol, 256 = EOS
+const pair<uint32_t, uint8_t> huffmanCodes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28},
+    {0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28},
+    {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+    {0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10},
+    {0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6},
+    {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6},
+    {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7},
+    {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7},
+    {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5},
+    {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7},
+    {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14},
+    {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23},
+    {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23},
+    {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21},
+    {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22},
+    {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22},
+    {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23},
+    {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21},
+    {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27},
+    {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22}, {0x3fffeb, 22},
+    {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27},
+    {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30},
+};
+
+// Binary tree of the codes, walked one bit at a time
+struct HuffmanTree {
+    struct Node {
+        int16_t child[2] = {-1, -1};
+        int16_t symbol = -1;
+    };
+    vector<Node> nodes;
+
+    HuffmanTree() : nodes(1) {
+        for (int symbol = 0; symbol < 257; symbol++) {
+            uint32_t code = huffmanCodes[symbol].first;
+            int bits = huffmanCodes[symbol].second;
+            int node = 0;
+            for (int bit = bits - 1; bit >= 0; bit--) {
+                int branch = (code >> bit) & 1;
+                if (nodes[node].child[branch] < 0) {
+                    nodes[node].child[branch] = (int16_t)nodes.size();
+                    nodes.emplace_back();
+                }
+                node = nodes[node].child[branch];
+            }
+            nodes[node].symbol = (int16_t)symbol;
+        }
+    }
+};
+
+bool huffmanDecode(const uint8_t* data, size_t len, string& out) {
+    static const HuffmanTree tree;
+
+    int node = 0;
+    int pendingBits = 0;   // since the last complete symbol
+    bool pendingOnes = true;
+    for (size_t i = 0; i < len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            int branch = (data[i] >> bit) & 1;
+            node = tree.nodes[node].child[branch];
+            if (node < 0) return false;
+            pendingBits++;
+            pendingOnes = pendingOnes && branch;
+            int symbol = tree.nodes[node].symbol;
+            if (symbol >= 0) {
+                if (symbol == 256) return false; // EOS inside a string
+                out.push_back((char)symbol);
+                node = 0;
+                pendingBits = 0;
+                pendingOnes = true;
+            }
+        }
+    }
+    // Padding: at most 7 bits of the EOS prefix, i.e. all ones
+    return pendingBits <= 7 && pendingOnes;
+}
+
+bool decodeInteger(const uint8_t*& p, const uint8_t* end, int prefixBits, uint64_t& value) {
+    if (p == end) return false;
+    uint64_t prefixMax = (1u << prefixBits) - 1;
+    value = *p++ & prefixMax;
+    if (value < prefixMax) return true;
+
+    for (int shift = 0; p < end && shift <= 56; shift += 7) {
+        uint8_t byte = *p++;
+        value += (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+bool decodeString(const uint8_t*& p, const uint8_t* end, string& out) {
+    if (p == end) return false;
+    bool huffman = *p & 0x80;
+    uint64_t length;
+    if (!decodeInteger(p, end, 7, length) || length > (uint64_t)(end - p)) return false;
+    if (huffman) {
+        if (!huffmanDecode(p, length, out)) return false;
+    } else {
+        out.assign((const char*)p, length);
+    }
+    p += length;
+    return true;
+}
+
+void encodeInteger(uint64_t value, int prefixBits, uint8_t firstByte, string& out) {
+    uint64_t prefixMax = (1u << prefixBits) - 1;
+    if (value < prefixMax) {
+        out.push_back((char)(firstByte | value));
+        return;
+    }
+    out.push_back((char)(firstByte | prefixMax));
+    value -= prefixMax;
+    while (value >= 0x80) {
+        out.push_back((char)(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+void encodeString(string_view value, string& out) {
+    encodeInteger(value.size(), 7, 0x00, out);
+    out.append(value.data(), value.size());
+}
+
+// HTTP/2 forbids these connection-specific fields (RFC 9113 section 8.2.2)
+bool isConnectionHeader(string_view name) {
+    return equalsIgnoreCase(name, "connection") || equalsIgnoreCase(name, "keep-alive") ||
+           equalsIgnoreCase(name, "proxy-connection") || equalsIgnoreCase(name, "transfer-encoding") ||
+           equalsIgnoreCase(name, "upgrade");
+}
+
+// RFC 9110 token; nothing in it can break an HTTP/1.1 line apart
+bool validToken(string_view text) {
+    if (text.empty()) return false;
+    for (char c : text) {
+        if (c <= ' ' || c >= 0x7f || strchr("\"(),/:;<=>?@[\\]{}", c)) return false;
+    }
+    return true;
+}
+
+bool validFieldName(string_view name) {
+    return validToken(name) && none_of(name.begin(), name.end(), [](char c) { return c >= 'A' && c <= 'Z'; });
+}
+
+bool validFieldValue(string_view value) {
+    for (char c : value) {
+        if (c == '\r' || c == '\n' || c == '\0') return false;
+    }
+    return true;
+}
+
+// base64url without padding, as in the HTTP2-Settings header
+bool base64UrlDecode(string_view text, string& out) {
+    uint32_t bits = 0;
+    int bitCount = 0;
+    for (char c : text) {
+        int value;
+        if (c >= 'A' && c <= 'Z') value = c - 'A';
+        else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') value = c - '0' + 52;
+        else if (c == '-') value = 62;
+        else if (c == '_') value = 63;
+        else if (c == '=') break;
+        else return false;
+        bits = bits << 6 | value;
+        bitCount += 6;
+        if (bitCount >= 8) {
+            bitCount -= 8;
+            out.push_back((char)(bits >> bitCount));
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+// ==================== HpackDecoder Implementation ====================
+
+HpackDecoder::HpackDecoder(size_t tableLimit)
+    : tableBytes(0), maxTableBytes(tableLimit), tableLimitBytes(tableLimit) {
+}
+
+const pair<string, string>* HpackDecoder::lookup(uint64_t index) const {
+    index -= staticTableSize + 1;
+    return index < table.size() ? &table[index] : nullptr;
+}
+
+void HpackDecoder::insert(string name, string value) {
+    size_t size = name.size() + value.size() + 32;
+    evict(size > maxTableBytes ? 0 : maxTableBytes - size);
+    if (size > maxTableBytes) return; // empties the table (RFC 7541 section 4.4)
+    tableBytes += size;
+    table.emplace_front(move(name), move(value));
+}
+
+void HpackDecoder::evict(size_t limit) {
+    while (tableBytes > limit) {
+        tableBytes -= table.back().first.size() + table.back().second.size() + 32;
+        table.pop_back();
+    }
+}
+
+bool HpackDecoder::decode(const uint8_t* data, size_t len, size_t maxListBytes,
+                          vector<pair<string, string>>& headers) {
+    const uint8_t* p = data;
+    const uint8_t* end = data + len;
+    size_t listBytes = 0;
+
+    while (p < end) {
+        uint8_t first = *p;
+        uint64_t index;
+
+        if (first & 0x20 && !(first & 0xc0)) {
+            // Dynamic table size update
+            if (!decodeInteger(p, end, 5, index) || index > tableLimitBytes) return false;
+            maxTableBytes = index;
+            evict(maxTableBytes);
+            continue;
+        }
+
+        string name;
+        string value;
+        bool indexed = first & 0x80;
+        bool incremental = !indexed && (first & 0x40);
+        if (!decodeInteger(p, end, indexed ? 7 : incremental ? 6 : 4, index)) return false;
+
+        if (indexed || index > 0) {
+            if (index == 0) return false;
+            if (index <= staticTableSize) {
+                name = staticTable[index - 1].first;
+                if (indexed) value = staticTable[index - 1].second;
+            } else {
+                const pair<string, string>* field = lookup(index);
+                if (!field) return false;
+                name = field->first;
+                if (indexed) value = field->second;
+            }
+        } else if (!decodeString(p, end, name)) {
+            return false;
+        }
+        if (!indexed && !decodeString(p, end, value)) return false;
+
+        // Indexed fields reference up to a table's worth of bytes each
+        listBytes += name.size() + value.size() + 32;
+        if (listBytes > maxListBytes) return false;
+
+        if (incremental) insert(name, value);
+        headers.emplace_back(move(name), move(value));
+    }
+    return true;
+}
+
+// ==================== HPACK Encoding ====================
+
+void hpackEncodeStatus(int statusCode, string& out) {
+    // Indexed when the static table has the whole field
+    static const int indexedStatus[] = {200, 204, 206, 304, 400, 404, 500};
+    for (int i = 0; i < 7; i++) {
+        if (indexedStatus[i] == statusCode) {
+            out.push_back((char)(0x80 | (8 + i)));
+            return;
+        }
+    }
+    encodeInteger(8, 4, 0x00, out); // literal without indexing, name ":status"
+    encodeString(to_string(statusCode), out);
+}
+
+void hpackEncodeHeader(string_view name, string_view value, string& out) {
+    size_t nameIndex = 0;
+    for (size_t i = 14; i < staticTableSize; i++) { // past the pseudo-headers
+        if (name == staticTable[i].first) {
+            nameIndex = i + 1;
+            break;
+        }
+    }
+    encodeInteger(nameIndex, 4, 0x00, out);
+    if (nameIndex == 0) {
+        encodeString(name, out);
+    }
+    encodeString(value, out);
+}
+
+// ==================== Http2Session Implementation ====================
+
+Http2Session::Http2Session(const Http2Settings& sessionSettings)
+    : settings(sessionSettings) {
+}
+
+bool Http2Session::isPreface(string_view data) {
+    size_t compared = min(data.size(), clientPrefaceLength);
+    return compared >= 4 && data.compare(0, compared, clientPreface, compared) == 0;
+}
+
+void Http2Session::start() {
+    writeSettings();
+}
+
+bool Http2Session::startUpgraded(string_view http2Settings, string request, bool headRequest) {
+    string payload;
+    if (!base64UrlDecode(http2Settings, payload) || payload.size() % 6 != 0) return false;
+
+    output.append("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+    writeSettings();
+
+    // Acknowledged by the 101 itself
+    const uint8_t* p = (const uint8_t*)payload.data();
+    for (size_t i = 0; i < payload.size(); i += 6) {
+        if (!applySetting((uint16_t)(p[i] << 8 | p[i + 1]), read32(p + i + 2))) return false;
+    }
+
+    // The upgraded request is stream 1, already half-closed by the client
+    auto stream = make_unique<Stream>();
+    stream->id = 1;
+    stream->sendWindow = peerInitialWindow;
+    stream->receiveWindow = settings.initialWindowSize;
+    stream->remoteClosed = true;
+    stream->headRequest = headRequest;
+    streams[1] = move(stream);
+    lastStreamId = 1;
+    streamsOpened++;
+    events.push_back({EventType::REQUEST, 1, move(request)});
+    return true;
+}
+
+vector<Http2Session::Event> Http2Session::takeEvents() {
+    vector<Event> taken;
+    taken.swap(events);
+    return taken;
+}
+
+bool Http2Session::receive(const char* data, size_t len) {
+    if (connectionError) return false;
+    input.append(data, len);
+
+    size_t pos = 0;
+    if (!prefaceReceived) {
+        size_t compared = min(input.size(), clientPrefaceLength);
+        if (input.compare(0, compared, clientPreface, compared) != 0) {
+            return fail(PROTOCOL_ERROR);
+        }
+        if (input.size() < clientPrefaceLength) return true;
+        prefaceReceived = true;
+        pos = clientPrefaceLength;
+    }
+
+    while (input.size() - pos >= frameHeaderBytes) {
+        const uint8_t* header = (const uint8_t*)input.data() + pos;
+        uint32_t length = (uint32_t)header[0] << 16 | (uint32_t)header[1] << 8 | header[2];
+        uint8_t type = header[3];
+        uint8_t flags = header[4];
+        uint32_t streamId = read32(header + 5) & 0x7fffffff;
+
+        if (length > localMaxFrameSize) return fail(FRAME_SIZE_ERROR);
+        if (input.size() - pos - frameHeaderBytes < length) break;
+
+        if (!handleFrame(type, flags, streamId, header + frameHeaderBytes, length)) return false;
+        pos += frameHeaderBytes + length;
+    }
+    input.erase(0, pos);
+    return true;
+}
+
+bool Http2Session::handleFrame(uint8_t type, uint8_t flags, uint32_t streamId,
+                               const uint8_t* payload, size_t length) {
+    if (!settingsReceived && type != FRAME_SETTINGS) return fail(PROTOCOL_ERROR);
+    // A header block is never interleaved with other frames
+    if (headerStreamId && (type != FRAME_CONTINUATION || streamId != headerStreamId)) {
+        return fail(PROTOCOL_ERROR);
+    }
+
+    switch (type) {
+        case FRAME_DATA:
+            return handleData(flags, streamId, payload, length);
+        case FRAME_HEADERS:
+            return handleHeaders(flags, streamId, payload, length);
+        case FRAME_PRIORITY:
+            if (streamId == 0) return fail(PROTOCOL_ERROR);
+            if (length != 5) return fail(FRAME_SIZE_ERROR);
+            return true; // responses go out in stream order regardless
+        case FRAME_RST_STREAM:
+            return handleResetStream(streamId, payload, length);
+        case FRAME_SETTINGS:
+            return handleSettings(flags, streamId, payload, length);
+        case FRAME_PUSH_PROMISE:
+            return fail(PROTOCOL_ERROR); // clients cannot push
+        case FRAME_PING:
+            if (streamId != 0) return fail(PROTOCOL_ERROR);
+            if (length != 8) return fail(FRAME_SIZE_ERROR);
+            if (!(flags & FLAG_ACK)) {
+                if (!queueControlReply()) return false;
+                writeFrame(FRAME_PING, FLAG_ACK, 0, (const char*)payload, length);
+            }
+            return true;
+        case FRAME_GOAWAY:
+            if (streamId != 0) return fail(PROTOCOL_ERROR);
+            if (length < 8) return fail(FRAME_SIZE_ERROR);
+            goAwayReceived = true;
+            return true;
+        case FRAME_WINDOW_UPDATE:
+            return handleWindowUpdate(streamId, payload, length);
+        case FRAME_CONTINUATION:
+            if (!headerStreamId) return fail(PROTOCOL_ERROR);
+            headerBlock.append((const char*)payload, length);
+            if (headerBlock.size() > settings.maxHeaderListBytes * 2) return fail(ENHANCE_YOUR_CALM);
+            return (flags & FLAG_END_HEADERS) ? finishHeaderBlock() : true;
+        default:
+            return true; // unknown frame types are ignored
+    }
+}
+
+bool Http2Session::handleData(uint8_t flags, uint32_t streamId, const uint8_t* payload, size_t length) {
+    if (streamId == 0) return fail(PROTOCOL_ERROR);
+
+    // The whole frame, padding included, counts against both windows
+    int64_t frameLength = length;
+    if (frameLength > connectionReceiveWindow) return fail(FLOW_CONTROL_ERROR);
+    connectionReceiveWindow -= frameLength;
+    grantConnectionWindow();
+
+    size_t padding = 0;
+    if (flags & FLAG_PADDED) {
+        if (length < 1 || payload[0] >= length) return fail(PROTOCOL_ERROR);
+        padding = payload[0];
+        payload++;
+        length--;
+    }
+    size_t bodyBytes = length - padding;
+
+    Stream* stream = findStream(streamId);
+    if (!stream) {
+        // Idle streams cannot carry data; closed ones may still have some in flight
+        return streamId <= lastStreamId ? true : fail(PROTOCOL_ERROR);
+    }
+    if (stream->remoteClosed) {
+        resetStream(streamId, STREAM_CLOSED);
+        return true;
+    }
+    if (frameLength > stream->receiveWindow) {
+        resetStream(streamId, FLOW_CONTROL_ERROR);
+        return true;
+    }
+    stream->receiveWindow -= frameLength;
+
+    if (stream->requestBodyLeft >= 0) {
+        if ((int64_t)bodyBytes > stream->requestBodyLeft) {
+            resetStream(streamId, PROTOCOL_ERROR); // more than its content-length
+            return true;
+        }
+        stream->requestBodyLeft -= bodyBytes;
+    }
+
+    if (bodyBytes > 0) {
+        string body;
+        if (stream->chunkedRequest) {
+            char size[24];
+            snprintf(size, sizeof(size), "%zx\r\n", bodyBytes);
+            body.append(size);
+            body.append((const char*)payload, bodyBytes);
+            body.append("\r\n");
+        } else {
+            body.assign((const char*)payload, bodyBytes);
+        }
+        bufferedBody += body.size();
+        events.push_back({EventType::REQUEST_BODY, streamId, move(body)});
+    }
+
+    if (flags & FLAG_END_STREAM) {
+        endRequest(stream);
+    } else if (stream->receiveWindow <= (int64_t)settings.initialWindowSize / 2) {
+        writeWindowUpdate(streamId, (uint32_t)(settings.initialWindowSize - stream->receiveWindow));
+        stream->receiveWindow = settings.initialWindowSize;
+    }
+    return true;
+}
+
+// END_STREAM from the client: the body is complete
+void Http2Session::endRequest(Stream* stream) {
+    stream->remoteClosed = true;
+    if (stream->requestBodyLeft > 0) {
+        resetStream(stream->id, PROTOCOL_ERROR); // less than its content-length
+        return;
+    }
+    if (stream->chunkedRequest) {
+        bufferedBody += 5;
+        events.push_back({EventType::REQUEST_BODY, stream->id, "0\r\n\r\n"});
+    }
+}
+
+bool Http2Session::handleHeaders(uint8_t flags, uint32_t streamId, const uint8_t* payload, size_t length) {
+    if (streamId == 0 || streamId % 2 == 0) return fail(PROTOCOL_ERROR);
+
+    size_t padding = 0;
+    if (flags & FLAG_PADDED) {
+        if (length < 1) return fail(PROTOCOL_ERROR);
+        padding = payload[0];
+        payload++;
+        length--;
+    }
+    if (flags & FLAG_PRIORITY) {
+        if (length < 5) return fail(PROTOCOL_ERROR);
+        payload += 5;
+        length -= 5;
+    }
+    if (padding > length) return fail(PROTOCOL_ERROR);
+
+    headerStreamId = streamId;
+    headerEndStream = flags & FLAG_END_STREAM;
+    headerBlock.assign((const char*)payload, length - padding);
+    if (headerBlock.size() > settings.maxHeaderListBytes * 2) return fail(ENHANCE_YOUR_CALM);
+    return (flags & FLAG_END_HEADERS) ? finishHeaderBlock() : true;
+}
+
+bool Http2Session::finishHeaderBlock() {
+    uint32_t streamId = headerStreamId;
+    headerStreamId = 0;
+
+    // Decoded even for streams that are refused: the table must stay in sync
+    vector<pair<string, string>> fields;
+    if (!decoder.decode((const uint8_t*)headerBlock.data(), headerBlock.size(),
+                        settings.maxHeaderListBytes * 2, fields)) {
+        return fail(COMPRESSION_ERROR);
+    }
+    headerBlock.clear();
+
+    Stream* existing = findStream(streamId);
+    if (existing) {
+        // Trailers: they end the request, and are not forwarded
+        if (existing->remoteClosed) {
+            resetStream(streamId, STREAM_CLOSED);
+        } else if (!headerEndStream) {
+            resetStream(streamId, PROTOCOL_ERROR);
+        } else {
+            endRequest(existing);
+        }
+        return true;
+    }
+    if (streamId <= lastStreamId) {
+        return true; // trailers racing our reset of the stream
+    }
+    lastStreamId = streamId;
+
+    if (goAwaySent || streams.size() >= (size_t)settings.maxConcurrentStreams) {
+        writeReset(streamId, REFUSED_STREAM);
+        return true;
+    }
+
+    auto stream = make_unique<Stream>();
+    stream->id = streamId;
+    stream->sendWindow = peerInitialWindow;
+    stream->receiveWindow = settings.initialWindowSize;
+    string request;
+    if (!translateRequest(fields, headerEndStream, *stream, request)) {
+        writeReset(streamId, PROTOCOL_ERROR);
+        return true;
+    }
+    stream->remoteClosed = headerEndStream;
+    streams[streamId] = move(stream);
+    streamsOpened++;
+    events.push_back({EventType::REQUEST, streamId, move(request)});
+    return true;
+}
+
+// Pseudo-headers and fields -> an HTTP/1.1 request head. The exchange
+// closes after one response; a body without a content-length is chunked.
+bool Http2Session::translateRequest(const vector<pair<string, string>>& fields, bool endStream,
+                                    Stream& stream, string& request) {
+    string_view method;
+    string_view path;
+    string_view scheme;
+    string_view authority;
+    string cookies;
+    string headers;
+    int64_t contentLength = -1;
+    bool regularSeen = false;
+
+    for (const auto& [name, value] : fields) {
+        if (!validFieldValue(value)) return false;
+
+        if (!name.empty() && name[0] == ':') {
+            if (regularSeen) return false; // pseudo-headers come first
+            string_view* target = name == ":method" ? &method : name == ":path" ? &path :
+                                  name == ":scheme" ? &scheme : name == ":authority" ? &authority : nullptr;
+            if (!target || !target->empty()) return false;
+            *target = value;
+            continue;
+        }
+        regularSeen = true;
+
+        if (!validFieldName(name) || isConnectionHeader(name)) return false;
+        if (name == "te") {
+            if (value != "trailers") return false;
+            continue; // hop-by-hop; trailers are not forwarded anyway
+        }
+        if (name == "cookie") {
+            // Split into one field per cookie for compression; HTTP/1.1 wants one line
+            if (!cookies.empty()) cookies.append("; ");
+            cookies.append(value);
+            continue;
+        }
+        if (name == "host" && !authority.empty()) continue;
+        if (name == "content-length") {
+            if (value.empty() || value.size() > 18 ||
+                value.find_first_not_of("0123456789") != string::npos) {
+                return false;
+            }
+            int64_t length = stoll(value);
+            if (contentLength >= 0 && contentLength != length) return false;
+            contentLength = length;
+        }
+        headers.append(name).append(": ").append(value).append("\r\n");
+    }
+
+    if (method.empty() || method == "CONNECT" || scheme.empty() || path.empty()) return false;
+    if (!validToken(method) || (path[0] != '/' && path != "*") ||
+        any_of(path.begin(), path.end(), [](char c) { return c <= ' ' || c == 0x7f; })) {
+        return false;
+    }
+    if (endStream && contentLength > 0) return false;
+
+    request.append(method).append(" ").append(path).append(" HTTP/1.1\r\n");
+    if (!authority.empty()) {
+        request.append("Host: ").append(authority).append("\r\n");
+    }
+    request.append(headers);
+    if (!cookies.empty()) {
+        request.append("Cookie: ").append(cookies).append("\r\n");
+    }
+    if (contentLength >= 0) {
+        stream.requestBodyLeft = contentLength;
+    } else if (!endStream) {
+        stream.chunkedRequest = true;
+        request.append("Transfer-Encoding: chunked\r\n");
+    }
+    request.append("Connection: close\r\n\r\n");
+    stream.headRequest = method == "HEAD";
+    return true;
+}
+
+bool Http2Session::handleSettings(uint8_t flags, uint32_t streamId, const uint8_t* payload, size_t length) {
+    if (streamId != 0) return fail(PROTOCOL_ERROR);
+    if (flags & FLAG_ACK) {
+        return length == 0 ? true : fail(FRAME_SIZE_ERROR);
+    }
+    if (length % 6 != 0) return fail(FRAME_SIZE_ERROR);
+
+    for (size_t i = 0; i < length; i += 6) {
+        if (!applySetting((uint16_t)(payload[i] << 8 | payload[i + 1]), read32(payload + i + 2))) {
+            return false;
+        }
+    }
+    settingsReceived = true;
+    if (!queueControlReply()) return false;
+    writeFrame(FRAME_SETTINGS, FLAG_ACK, 0, nullptr, 0);
+    flushAll(); // a larger initial window unblocks streams
+    return true;
+}
+
+bool Http2Session::applySetting(uint16_t id, uint32_t value) {
+    switch (id) {
+        case SETTINGS_ENABLE_PUSH:
+            return value <= 1 ? true : fail(PROTOCOL_ERROR);
+        case SETTINGS_INITIAL_WINDOW_SIZE: {
+            if (value > maxWindow) return fail(FLOW_CONTROL_ERROR);
+            int64_t delta = (int64_t)value - peerInitialWindow;
+            for (auto& [id, stream] : streams) {
+                stream->sendWindow += delta;
+                if (stream->sendWindow > maxWindow) return fail(FLOW_CONTROL_ERROR);
+            }
+            peerInitialWindow = value;
+            return true;
+        }
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < 16384 || value > 16777215) return fail(PROTOCOL_ERROR);
+            peerMaxFrameSize = value;
+            return true;
+        default:
+            // Header table size: the encoder never indexes. Concurrency:
+            // the server opens no streams. Unknown ids are ignored.
+            return true;
+    }
+}
+
+bool Http2Session::handleWindowUpdate(uint32_t streamId, const uint8_t* payload, size_t length) {
+    if (length != 4) return fail(FRAME_SIZE_ERROR);
+    uint32_t increment = read32(payload) & 0x7fffffff;
+
+    if (streamId == 0) {
+        if (increment == 0) return fail(PROTOCOL_ERROR);
+        connectionSendWindow += increment;
+        if (connectionSendWindow > maxWindow) return fail(FLOW_CONTROL_ERROR);
+        flushAll();
+        return true;
+    }
+
+    Stream* stream = findStream(streamId);
+    if (!stream) {
+        return streamId <= lastStreamId ? true : fail(PROTOCOL_ERROR);
+    }
+    if (increment == 0) {
+        resetStream(streamId, PROTOCOL_ERROR);
+        return true;
+    }
+    stream->sendWindow += increment;
+    if (stream->sendWindow > maxWindow) {
+        resetStream(streamId, FLOW_CONTROL_ERROR);
+        return true;
+    }
+    flushStream(stream);
+    return true;
+}
+
+bool Http2Session::handleResetStream(uint32_t streamId, const uint8_t* payload, size_t length) {
+    if (streamId == 0) return fail(PROTOCOL_ERROR);
+    if (length != 4) return fail(FRAME_SIZE_ERROR);
+    (void)payload;
+
+    auto it = streams.find(streamId);
+    if (it == streams.end()) {
+        return streamId <= lastStreamId ? true : fail(PROTOCOL_ERROR);
+    }
+    bool detached = it->second->detached;
+    bool answered = it->second->localClosed;
+    streams.erase(it);
+    if (!detached) {
+        events.push_back({EventType::RESET, streamId, ""});
+    }
+
+    // Opening streams only to cancel them costs the client nothing and
+    // the backends a request each (the "rapid reset" attack)
+    if (!answered && ++streamsResetByClient > 100 && streamsResetByClient * 2 > streamsOpened) {
+        return fail(ENHANCE_YOUR_CALM);
+    }
+    return true;
+}
+
+Http2Session::Stream* Http2Session::findStream(uint32_t streamId) {
+    auto it = streams.find(streamId);
+    return it == streams.end() ? nullptr : it->second.get();
+}
+
+// Window freed by DATA goes back to the client only while the bodies it
+// let in stay under maxBufferedBodyBytes; otherwise once enough is released
+void Http2Session::grantConnectionWindow() {
+    if (connectionReceiveWindow > (int64_t)settings.connectionWindowSize / 2 ||
+        bufferedBody >= settings.maxBufferedBodyBytes) {
+        return;
+    }
+    writeWindowUpdate(0, (uint32_t)(settings.connectionWindowSize - connectionReceiveWindow));
+    connectionReceiveWindow = settings.connectionWindowSize;
+}
+
+void Http2Session::releaseRequestBody(size_t bytes) {
+    bufferedBody -= min(bytes, bufferedBody);
+    if (!connectionError) {
+        grantConnectionWindow();
+    }
+}
+
+// Stream error: RST_STREAM, and the owner drops the exchange
+void Http2Session::resetStream(uint32_t streamId, uint32_t errorCode) {
+    writeReset(streamId, errorCode);
+    auto it = streams.find(streamId);
+    if (it == streams.end()) return;
+    if (!it->second->detached) {
+        events.push_back({EventType::RESET, streamId, ""});
+    }
+    streams.erase(it);
+}
+
+// Connection error: GOAWAY, then the connection closes
+bool Http2Session::fail(uint32_t errorCode) {
+    if (!connectionError) {
+        writeGoAway(errorCode);
+        connectionError = true;
+        goAwaySent = true;
+    }
+    return false;
+}
+
+// ==================== Responses ====================
+
+size_t Http2Session::writeResponse(uint32_t streamId, const char* data, size_t len) {
+    Stream* stream = findStream(streamId);
+    if (!stream || stream->responseEnded) {
+        return len; // reset, or bytes past the end of the response
+    }
+    if (stream->data.size() - stream->dataOffset >= maxStreamBuffered || outputFull()) {
+        stream->blocked = true;
+        return 0;
+    }
+
+    size_t pos = 0;
+    while (pos < len && !stream->responseEnded) {
+        if (!stream->headSent) {
+            size_t before = stream->responseHead.size();
+            stream->responseHead.append(data + pos, len - pos);
+            HttpHead head;
+            HttpParser::Result result = stream->responseParser.parse(
+                stream->responseHead.data(), stream->responseHead.size(), head);
+            if (result == HttpParser::Result::INCOMPLETE) {
+                return len;
+            }
+            if (result != HttpParser::Result::COMPLETE || head.statusCode == 101 ||
+                !sendHead(stream, head)) {
+                resetStream(streamId, INTERNAL_ERROR);
+                return len;
+            }
+            pos += head.length - before;
+            stream->responseHead.clear();
+            stream->responseParser.reset();
+            continue;
+        }
+
+        pos += stream->framer.consume(data + pos, len - pos, &stream->data);
+        if (stream->framer.error) {
+            resetStream(streamId, INTERNAL_ERROR);
+            return len;
+        }
+        stream->responseEnded = stream->framer.complete;
+    }
+
+    flushStream(stream);
+    return len;
+}
+
+// One HEADERS block for the final head; interim (1xx) heads are dropped
+bool Http2Session::sendHead(Stream* stream, const HttpHead& head) {
+    if (head.statusCode < 200) return true;
+    if (!responseFraming(head, stream->headRequest, stream->framer)) return false;
+
+    string block;
+    hpackEncodeStatus(head.statusCode, block);
+    string name;
+    for (size_t i = 0; i < head.headerCount; i++) {
+        const HttpHeader& header = head.headers[i];
+        if (isConnectionHeader(header.name) || equalsIgnoreCase(header.name, "te")) continue;
+        name.assign(header.name);
+        transform(name.begin(), name.end(), name.begin(), ::tolower);
+        hpackEncodeHeader(name, header.value, block);
+    }
+
+    stream->headSent = true;
+    stream->responseEnded = stream->framer.complete;
+    writeHeaderBlock(stream->id, block, stream->responseEnded);
+    if (stream->responseEnded) {
+        stream->localClosed = true;
+    }
+    return true;
+}
+
+void Http2Session::endResponse(uint32_t streamId) {
+    Stream* stream = findStream(streamId);
+    if (!stream || stream->responseEnded || !stream->headSent) return;
+    if (stream->framer.mode == BodyFramer::Mode::UNTIL_CLOSE) {
+        stream->responseEnded = true;
+        flushStream(stream);
+    }
+}
+
+void Http2Session::closeStream(uint32_t streamId) {
+    Stream* stream = findStream(streamId);
+    if (!stream) return;
+    stream->detached = true;
+    if (!stream->responseEnded) {
+        resetStream(streamId, INTERNAL_ERROR); // cut short: the client must not take it as complete
+        return;
+    }
+    flushStream(stream);
+}
+
+// Sends as much of the stream's body as the windows allow; ends the stream
+// once all of it is out
+void Http2Session::flushStream(Stream* stream) {
+    while (stream->dataOffset < stream->data.size() && stream->sendWindow > 0 &&
+           connectionSendWindow > 0 && !outputFull()) {
+        size_t length = min<int64_t>({(int64_t)(stream->data.size() - stream->dataOffset), stream->sendWindow,
+                                      connectionSendWindow, (int64_t)peerMaxFrameSize});
+        bool last = stream->responseEnded && stream->dataOffset + length == stream->data.size();
+        writeFrame(FRAME_DATA, last ? FLAG_END_STREAM : 0, stream->id,
+                   stream->data.data() + stream->dataOffset, length);
+        stream->dataOffset += length;
+        stream->sendWindow -= length;
+        connectionSendWindow -= length;
+        if (last) {
+            stream->localClosed = true;
+        }
+    }
+    if (stream->dataOffset == stream->data.size()) {
+        stream->data.clear();
+        stream->dataOffset = 0;
+        if (stream->responseEnded && !stream->localClosed) {
+            writeFrame(FRAME_DATA, FLAG_END_STREAM, stream->id, nullptr, 0);
+            stream->localClosed = true;
+        }
+    }
+
+    if (stream->localClosed) {
+        if (!stream->detached) return; // the owner still has to close it
+        // An early response: the client can stop sending the rest of the body
+        if (!stream->remoteClosed) {
+            writeReset(stream->id, NO_ERROR);
+        }
+        streams.erase(stream->id);
+        return;
+    }
+    if (stream->blocked && stream->data.size() - stream->dataOffset < maxStreamBuffered && !outputFull()) {
+        stream->blocked = false;
+        events.push_back({EventType::WRITABLE, stream->id, ""});
+    }
+}
+
+void Http2Session::flushAll() {
+    // flushStream() may erase the stream it is given, and only that one
+    for (auto it = streams.begin(); it != streams.end();) {
+        Stream* stream = (it++)->second.get();
+        flushStream(stream);
+    }
+}
+
+bool Http2Session::outputFull() const {
+    return output.size() - outputOffset >= maxOutputBuffered;
+}
+
+// Acknowledgements cost the client 9 bytes each to ask for and queue here
+// until it reads them; one that asks without reading is cut off (the
+// "ping flood" / "settings flood" attacks)
+bool Http2Session::queueControlReply() {
+    if (++pendingControlReplies > maxPendingControlReplies) {
+        return fail(ENHANCE_YOUR_CALM);
+    }
+    return true;
+}
+
+void Http2Session::consumed(size_t bytes) {
+    outputOffset += bytes;
+    if (outputOffset == output.size()) {
+        output.clear();
+        outputOffset = 0;
+        pendingControlReplies = 0;
+    } else if (outputOffset > maxOutputBuffered) {
+        output.erase(0, outputOffset);
+        outputOffset = 0;
+    }
+    flushAll();
+}
+
+void Http2Session::goAway() {
+    if (goAwaySent) return;
+    writeGoAway(NO_ERROR);
+    goAwaySent = true;
+}
+
+bool Http2Session::finished() const {
+    return (goAwaySent || goAwayReceived) && streams.empty();
+}
+
+// ==================== Frame Output ====================
+
+void Http2Session::writeFrame(uint8_t type, uint8_t flags, uint32_t streamId,
+                              const char* payload, size_t length) {
+    output.push_back((char)(length >> 16));
+    output.push_back((char)(length >> 8));
+    output.push_back((char)length);
+    output.push_back((char)type);
+    output.push_back((char)flags);
+    append32(output, streamId);
+    if (length > 0) {
+        output.append(payload, length);
+    }
+}
+
+void Http2Session::writeHeaderBlock(uint32_t streamId, const string& block, bool endStream) {
+    size_t offset = 0;
+    uint8_t type = FRAME_HEADERS;
+    do {
+        size_t length = min<size_t>(block.size() - offset, peerMaxFrameSize);
+        bool last = offset + length == block.size();
+        uint8_t flags = (last ? FLAG_END_HEADERS : 0) |
+                        (type == FRAME_HEADERS && endStream ? FLAG_END_STREAM : 0);
+        writeFrame(type, flags, streamId, block.data() + offset, length);
+        offset += length;
+        type = FRAME_CONTINUATION;
+    } while (offset < block.size());
+}
+
+void Http2Session::writeWindowUpdate(uint32_t streamId, uint32_t increment) {
+    string payload;
+    append32(payload, increment);
+    writeFrame(FRAME_WINDOW_UPDATE, 0, streamId, payload.data(), payload.size());
+}
+
+void Http2Session::writeReset(uint32_t streamId, uint32_t errorCode) {
+    string payload;
+    append32(payload, errorCode);
+    writeFrame(FRAME_RST_STREAM, 0, streamId, payload.data(), payload.size());
+}
+
+void Http2Session::writeGoAway(uint32_t errorCode) {
+    string payload;
+    append32(payload, lastStreamId);
+    append32(payload, errorCode);
+    writeFrame(FRAME_GOAWAY, 0, 0, payload.data(), payload.size());
+}
+
+void Http2Session::writeSettings() {
+    string payload;
+    auto setting = [&payload](uint16_t id, uint32_t value) {
+        payload.push_back((char)(id >> 8));
+        payload.push_back((char)id);
+        append32(payload, value);
+    };
+    setting(SETTINGS_ENABLE_PUSH, 0);
+    setting(SETTINGS_MAX_CONCURRENT_STREAMS, settings.maxConcurrentStreams);
+    setting(SETTINGS_INITIAL_WINDOW_SIZE, settings.initialWindowSize);
+    setting(SETTINGS_MAX_HEADER_LIST_SIZE, (uint32_t)settings.maxHeaderListBytes);
+    writeFrame(FRAME_SETTINGS, 0, 0, payload.data(), payload.size());
+
+    // The connection window starts at 64 KiB whatever the settings say
+    if (settings.connectionWindowSize > 65535) {
+        writeWindowUpdate(0, settings.connectionWindowSize - 65535);
+        connectionReceiveWindow = settings.connectionWindowSize;
+    }
+}
@@ -0,0 +1,206 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <cstdint>
+#include "HttpParser.h"
+using namespace std;
+
+// HTTP/2 front end: h2 negotiated through ALPN on the HTTPS listener, and
+// h2c (prior knowledge or an HTTP/1.1 Upgrade) on the plain one
+struct Http2Settings {
+    bool enabled = true;
+    int maxConcurrentStreams = 128;
+    // Request body bytes a client may send ahead, per stream and per connection
+    int initialWindowSize = 1024 * 1024;
+    int connectionWindowSize = 16 * 1024 * 1024;
+    // Request bodies are sent upstream whole; past this many bytes held for
+    // a connection's streams, its window opens only as they finish
+    size_t maxBufferedBodyBytes = 32 * 1024 * 1024;
+    // Advertised limit; decoding stops (connection error) at twice this
+    size_t maxHeaderListBytes = 64 * 1024;
+};
+
+// HPACK (RFC 7541) header block decoder. One per connection: the dynamic
+// table carries over from block to block.
+class HpackDecoder {
+public:
+    HpackDecoder(size_t tableLimit = 4096);
+
+    // Appends the block's fields to headers; false on a malformed block or
+    // one that decodes to more than maxListBytes
+    bool decode(const uint8_t* data, size_t len, size_t maxListBytes,
+                vector<pair<string, string>>& headers);
+
+private:
+    deque<pair<string, string>> table; // newest first
+    size_t tableBytes;
+    size_t maxTableBytes;   // current, set by the encoder
+    size_t tableLimitBytes; // ours, from SETTINGS_HEADER_TABLE_SIZE
+
+    const pair<string, string>* lookup(uint64_t index) const;
+    void insert(string name, string value);
+    void evict(size_t limit);
+};
+
+// HPACK encoding without the dynamic table or Huffman coding: responses
+// reference static table names and are otherwise sent as literals
+void hpackEncodeStatus(int statusCode, string& out);
+void hpackEncodeHeader(string_view name, string_view value, string& out); // name in lower case
+
+// Server side of one HTTP/2 connection: frames, HPACK, flow control and
+// stream states, without any I/O. The owner feeds it what the client sent
+// and writes out what it queues. Each stream is an HTTP/1.1 exchange: its
+// request comes out as HTTP/1.1 text (body chunked unless the client gave
+// a content-length) and its response goes back in as HTTP/1.1 bytes.
+class Http2Session {
+public:
+    enum class EventType {
+        REQUEST,      // a new stream; data is its request so far
+        REQUEST_BODY, // data continues the stream's request
+        RESET,        // the stream is gone; drop its exchange
+        WRITABLE      // the stream takes response bytes again
+    };
+
+    struct Event {
+        EventType type;
+        uint32_t streamId;
+        string data;
+    };
+
+    Http2Session(const Http2Settings& sessionSettings);
+
+    // True if data (at least 4 bytes) starts like the client connection preface
+    static bool isPreface(string_view data);
+
+    // Queues the server preface; the client's comes first in receive()
+    void start();
+    // h2c Upgrade: queues the 101 response and the server preface, applies
+    // the HTTP2-Settings header and turns the upgraded request (HTTP/1.1
+    // text, without its upgrade headers) into stream 1. False if the
+    // header does not decode.
+    bool startUpgraded(string_view http2Settings, string request, bool headRequest);
+
+    // Processes what the client sent; false on a connection error, after
+    // which the queued GOAWAY is the last thing to send
+    bool receive(const char* data, size_t len);
+    // Events since the last call, oldest first
+    vector<Event> takeEvents();
+
+    // HTTP/1.1 response bytes of a stream. Returns how many were taken: 0
+    // once the stream has buffered enough, until a WRITABLE event.
+    size_t writeResponse(uint32_t streamId, const char* data, size_t len);
+    // The stream's response is complete (ends a close-delimited body)
+    void endResponse(uint32_t streamId);
+    // The stream's exchange is gone; resets it unless its response was complete
+    void closeStream(uint32_t streamId);
+
+    // The owner let go of request body bytes it was given as REQUEST_BODY
+    void releaseRequestBody(size_t bytes);
+
+    // Bytes to send to the client; consumed() drops what was written
+    string_view pendingOutput() const { return string_view(output).substr(outputOffset); }
+    void consumed(size_t bytes);
+    // The client is behind on reading; it is not read from until it catches up
+    bool outputFull() const;
+
+    // Graceful shutdown: no new streams, the open ones finish
+    void goAway();
+    bool goingAway() const { return goAwaySent || goAwayReceived; }
+    // Shutting down (either side) and every stream is done
+    bool finished() const;
+    bool failed() const { return connectionError; }
+    size_t streamCount() const { return streams.size(); }
+
+private:
+    struct Stream {
+        uint32_t id;
+        int64_t sendWindow;
+        int64_t receiveWindow;
+        bool remoteClosed = false;       // END_STREAM received
+        bool chunkedRequest = false;
+        int64_t requestBodyLeft = -1;    // of the client's content-length, -1 if none
+        bool headRequest = false;
+
+        // Response translation: HTTP/1.1 head -> HEADERS, body -> DATA
+        string responseHead;
+        HttpParser responseParser{false};
+        bool headSent = false;
+        BodyFramer framer;
+        string data;                     // DATA payload waiting for window
+        size_t dataOffset = 0;
+        bool responseEnded = false;      // all of it is in data
+        bool localClosed = false;        // END_STREAM sent
+        bool blocked = false;            // writeResponse() refused bytes
+        bool detached = false;           // closeStream() was called
+    };
+
+    Http2Settings settings;
+    HpackDecoder decoder;
+
+    string input;           // a partial frame
+    string output;
+    size_t outputOffset = 0;
+    size_t pendingControlReplies = 0; // since output last drained
+    vector<Event> events;
+
+    bool prefaceReceived = false;
+    bool settingsReceived = false;
+    bool goAwaySent = false;
+    bool goAwayReceived = false;
+    bool connectionError = false;
+
+    // Peer settings
+    uint32_t peerMaxFrameSize = 16384;
+    int64_t peerInitialWindow = 65535;
+
+    int64_t connectionSendWindow = 65535;
+    int64_t connectionReceiveWindow = 65535;
+    size_t bufferedBody = 0; // REQUEST_BODY bytes the owner still holds
+
+    map<uint32_t, unique_ptr<Stream>> streams;
+    uint32_t lastStreamId = 0;
+    uint64_t streamsOpened = 0;
+    uint64_t streamsResetByClient = 0;
+
+    // Header block being assembled from HEADERS + CONTINUATION
+    uint32_t headerStreamId = 0;
+    bool headerEndStream = false;
+    string headerBlock;
+
+    bool handleFrame(uint8_t type, uint8_t flags, uint32_t streamId, const uint8_t* payload, size_t length);
+    bool handleData(uint8_t flags, uint32_t streamId, const uint8_t* payload, size_t length);
+    bool handleHeaders(uint8_t flags, uint32_t streamId, const uint8_t* payload, size_t length);
+    bool handleSettings(uint8_t flags, uint32_t streamId, const uint8_t* payload, size_t length);
+    bool handleWindowUpdate(uint32_t streamId, const uint8_t* payload, size_t length);
+    bool handleResetStream(uint32_t streamId, const uint8_t* payload, size_t length);
+    bool applySetting(uint16_t id, uint32_t value);
+    bool finishHeaderBlock();
+    bool translateRequest(const vector<pair<string, string>>& fields, bool endStream,
+                          Stream& stream, string& request);
+    void endRequest(Stream* stream);
+
+    Stream* findStream(uint32_t streamId);
+    void resetStream(uint32_t streamId, uint32_t errorCode);
+    bool fail(uint32_t errorCode);
+
+    bool sendHead(Stream* stream, const HttpHead& head);
+    void flushStream(Stream* stream);
+    void flushAll();
+    bool queueControlReply();
+    void grantConnectionWindow();
+
+    void writeFrame(uint8_t type, uint8_t flags, uint32_t streamId, const char* payload, size_t length);
+    void writeHeaderBlock(uint32_t streamId, const string& block, bool endStream);
+    void writeWindowUpdate(uint32_t streamId, uint32_t increment);
+    void writeReset(uint32_t streamId, uint32_t errorCode);
+    void writeGoAway(uint32_t errorCode);
+    void writeSettings();
+};
+
+#endif // HTTP2_H
@@ -0,0 +1,509 @@
+#include "HttpParser.h"
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+
+using namespace std;
+
+// ==================== Helpers ====================
+
+bool equalsIgnoreCase(string_view a, string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return false;
+    }
+    return true;
+}
+
+static string_view trim(string_view value) {
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+        value.remove_prefix(1);
+    }
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+        value.remove_suffix(1);
+    }
+    return value;
+}
+
+bool hasToken(string_view list, string_view token) {
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        string_view item = trim(list.substr(0, comma));
+        if (equalsIgnoreCase(item, token)) return true;
+        if (comma == string_view::npos) break;
+        list.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+string_view cookieValue(string_view cookieHeader, string_view name) {
+    while (!cookieHeader.empty()) {
+        size_t semicolon = cookieHeader.find(';');
+        string_view pair = trim(cookieHeader.substr(0, semicolon));
+        if (pair.size() > name.size() && pair[name.size()] == '=' &&
+            pair.compare(0, name.size(), name) == 0) {
+            return pair.substr(name.size() + 1);
+        }
+        if (semicolon == string_view::npos) break;
+        cookieHeader.remove_prefix(semicolon + 1);
+    }
+    return string_view();
+}
+
+// RFC 7230 tchar
+static bool isTokenChar(char c) {
+    return isalnum((unsigned char)c) || strchr("!#$%&'*+-.^_`|~", c) != nullptr;
+}
+
+static bool isToken(string_view value) {
+    if (value.empty()) return false;
+    for (char c : value) {
+        if (!isTokenChar(c)) return false;
+    }
+    return true;
+}
+
+// field-vchar / obs-text, SP and HTAB: no CR, LF, NUL or other CTL that a
+// server downstream might take as a line end (RFC 9110 5.5)
+static bool isFieldValue(string_view value) {
+    for (char c : value) {
+        unsigned char byte = (unsigned char)c;
+        if ((byte < 0x20 && byte != '\t') || byte == 0x7f) return false;
+    }
+    return true;
+}
+
+// ==================== HttpHead Implementation ====================
+
+HttpHead::HttpHead() {
+    clear();
+}
+
+void HttpHead::clear() {
+    startLine = method = target = version = reason = string_view();
+    statusCode = 0;
+    headerCount = 0;
+    length = 0;
+}
+
+string_view HttpHead::header(string_view name) const {
+    for (size_t i = 0; i < headerCount; i++) {
+        if (equalsIgnoreCase(headers[i].name, name)) {
+            return headers[i].value;
+        }
+    }
+    return string_view();
+}
+
+bool HttpHead::headerHasToken(string_view name, string_view token) const {
+    // The same header may be split over several lines
+    for (size_t i = 0; i < headerCount; i++) {
+        if (equalsIgnoreCase(headers[i].name, name) && hasToken(headers[i].value, token)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+string_view HttpHead::cookie(string_view name) const {
+    for (size_t i = 0; i < headerCount; i++) {
+        if (equalsIgnoreCase(headers[i].name, "Cookie")) {
+            string_view value = cookieValue(headers[i].value, name);
+            if (!value.empty()) return value;
+        }
+    }
+    return string_view();
+}
+
+bool HttpHead::keepAlive() const {
+    if (isHttp11()) {
+        return !headerHasToken("Connection", "close");
+    }
+    return headerHasToken("Connection", "keep-alive");
+}
+
+void HttpHead::rebase(const char* oldBase, const char* newBase) {
+    if (oldBase == newBase) return;
+
+    auto move = [oldBase, newBase](string_view& view) {
+        if (view.data()) {
+            view = string_view(newBase + (view.data() - oldBase), view.size());
+        }
+    };
+    move(startLine);
+    move(method);
+    move(target);
+    move(version);
+    move(reason);
+    for (size_t i = 0; i < headerCount; i++) {
+        move(headers[i].name);
+        move(headers[i].value);
+    }
+}
+
+// ==================== HttpParser Implementation ====================
+
+HttpParser::HttpParser(bool requestParser, size_t maxHead)
+    : isRequest(requestParser), maxHeadBytes(maxHead), scanned(0) {
+}
+
+void HttpParser::reset() {
+    scanned = 0;
+}
+
+bool HttpParser::parseStartLine(string_view line, HttpHead& head) const {
+    if (!isFieldValue(line)) return false;
+    size_t firstSpace = line.find(' ');
+    if (firstSpace == string_view::npos) return false;
+
+    if (isRequest) {
+        // method SP request-target SP HTTP-version
+        size_t secondSpace = line.find(' ', firstSpace + 1);
+        if (secondSpace == string_view::npos) return false;
+
+        head.method = line.substr(0, firstSpace);
+        head.target = line.substr(firstSpace + 1, secondSpace - firstSpace - 1);
+        head.version = line.substr(secondSpace + 1);
+
+        return isToken(head.method) && !head.target.empty() &&
+               head.target.find_first_of(" \t") == string_view::npos &&
+               (head.version == "HTTP/1.1" || head.version == "HTTP/1.0");
+    }
+
+    // HTTP-version SP status-code SP reason-phrase
+    head.version = line.substr(0, firstSpace);
+    string_view status = line.substr(firstSpace + 1, 3);
+    if (head.version.substr(0, 7) != "HTTP/1." || status.size() != 3) return false;
+
+    int code = 0;
+    for (char c : status) {
+        if (!isdigit((unsigned char)c)) return false;
+        code = code * 10 + (c - '0');
+    }
+    head.statusCode = code;
+    head.reason = line.size() > firstSpace + 4 ? line.substr(firstSpace + 5) : string_view();
+    return true;
+}
+
+HttpParser::Result HttpParser::parse(const char* data, size_t len, HttpHead& head) {
+    // Only scan bytes that arrived since the last call (minus a possibly
+    // split terminator)
+    size_t from = scanned >= 3 ? scanned - 3 : 0;
+    const char* found = nullptr;
+    if (len > from) {
+        found = static_cast<const char*>(memmem(data + from, len - from, "\r\n\r\n", 4));
+    }
+    if (!found) {
+        scanned = len;
+        return len > maxHeadBytes ? Result::TOO_LARGE : Result::INCOMPLETE;
+    }
+
+    size_t headLength = (found - data) + 4;
+    if (headLength > maxHeadBytes) {
+        return Result::TOO_LARGE;
+    }
+    scanned = headLength;
+
+    head.clear();
+    string_view remainingHead(data, headLength - 2); // every line ends in CRLF
+
+    size_t lineEnd = remainingHead.find("\r\n");
+    head.startLine = remainingHead.substr(0, lineEnd);
+    if (!parseStartLine(head.startLine, head)) {
+        return Result::INVALID;
+    }
+    remainingHead.remove_prefix(lineEnd + 2);
+
+    while (!remainingHead.empty()) {
+        lineEnd = remainingHead.find("\r\n");
+        string_view line = remainingHead.substr(0, lineEnd);
+        remainingHead.remove_prefix(lineEnd + 2);
+
+        // Obsolete line folding and "Name : value" are smuggling vectors
+        size_t colon = line.find(':');
+        if (colon == string_view::npos || !isToken(line.substr(0, colon))) {
+            return Result::INVALID;
+        }
+        if (head.headerCount == HttpHead::maxHeaders) {
+            return Result::TOO_LARGE;
+        }
+
+        // A bare LF is a line end to some servers: "X: y\nTransfer-Encoding: chunked"
+        // would be two headers there and one here
+        string_view value = line.substr(colon + 1);
+        if (!isFieldValue(value)) {
+            return Result::INVALID;
+        }
+
+        HttpHeader& header = head.headers[head.headerCount++];
+        header.name = line.substr(0, colon);
+        header.value = trim(value);
+    }
+
+    head.length = headLength;
+    return Result::COMPLETE;
+}
+
+// ==================== Framing ====================
+
+// All Content-Length headers must agree and be plain digits
+static bool contentLength(const HttpHead& head, bool& present, uint64_t& length) {
+    present = false;
+    length = 0;
+    for (size_t i = 0; i < head.headerCount; i++) {
+        if (!equalsIgnoreCase(head.headers[i].name, "Content-Length")) continue;
+
+        string_view value = head.headers[i].value;
+        if (value.empty() || value.size() > 18) return false;
+        uint64_t parsed = 0;
+        for (char c : value) {
+            if (!isdigit((unsigned char)c)) return false;
+            parsed = parsed * 10 + (c - '0');
+        }
+        if (present && parsed != length) return false;
+        present = true;
+        length = parsed;
+    }
+    return true;
+}
+
+// Transfer codings across every Transfer-Encoding line, which together form
+// one list (RFC 9112 6.1). chunkedLast: the final coding is chunked, and
+// chunked appears nowhere else.
+static bool transferEncoding(const HttpHead& head, bool& chunkedLast) {
+    bool present = false;
+    int chunkedCount = 0;
+    chunkedLast = false;
+    for (size_t i = 0; i < head.headerCount; i++) {
+        if (!equalsIgnoreCase(head.headers[i].name, "Transfer-Encoding")) continue;
+
+        string_view list = head.headers[i].value;
+        while (true) {
+            size_t comma = list.find(',');
+            string_view coding = trim(list.substr(0, comma));
+            if (!coding.empty()) {
+                present = true;
+                chunkedLast = equalsIgnoreCase(coding, "chunked");
+                if (chunkedLast) chunkedCount++;
+            }
+            if (comma == string_view::npos) break;
+            list.remove_prefix(comma + 1);
+        }
+    }
+    chunkedLast = chunkedLast && chunkedCount == 1;
+    return present;
+}
+
+bool requestFraming(const HttpHead& head, BodyFramer& framer) {
+    bool hasLength;
+    uint64_t length;
+    if (!contentLength(head, hasLength, length)) return false;
+
+    bool chunked;
+    if (transferEncoding(head, chunked)) {
+        // Only a final "chunked" coding can be framed, and never together
+        // with Content-Length; anything else the backend might read differently
+        if (hasLength || !chunked) return false;
+        framer.reset(BodyFramer::Mode::CHUNKED);
+    } else if (hasLength) {
+        framer.reset(BodyFramer::Mode::CONTENT_LENGTH, length);
+    } else {
+        framer.reset(BodyFramer::Mode::NONE);
+    }
+    return true;
+}
+
+bool responseFraming(const HttpHead& head, bool headRequest, BodyFramer& framer) {
+    int status = head.statusCode;
+    if (status == 101) {
+        framer.reset(BodyFramer::Mode::UNTIL_CLOSE);
+        return true;
+    }
+    if (headRequest || status < 200 || status == 204 || status == 304) {
+        framer.reset(BodyFramer::Mode::NONE);
+        return true;
+    }
+
+    bool hasLength;
+    uint64_t length;
+    if (!contentLength(head, hasLength, length)) return false;
+
+    // Transfer-Encoding overrides Content-Length; without a final chunked
+    // coding the body runs until the backend closes (RFC 9112 6.3)
+    bool chunked;
+    if (transferEncoding(head, chunked)) {
+        framer.reset(chunked ? BodyFramer::Mode::CHUNKED : BodyFramer::Mode::UNTIL_CLOSE);
+    } else if (hasLength) {
+        framer.reset(BodyFramer::Mode::CONTENT_LENGTH, length);
+    } else {
+        framer.reset(BodyFramer::Mode::UNTIL_CLOSE);
+    }
+    return true;
+}
+
+// ==================== Serialization ====================
+
+void appendHeaders(const HttpHead& head, initializer_list<string_view> dropHeaders,
+                   string& out) {
+    for (size_t i = 0; i < head.headerCount; i++) {
+        const HttpHeader& header = head.headers[i];
+
+        bool drop = false;
+        for (string_view name : dropHeaders) {
+            if (equalsIgnoreCase(header.name, name)) {
+                drop = true;
+                break;
+            }
+        }
+        if (drop) continue;
+
+        out.append(header.name.data(), header.name.size());
+        out.append(": ", 2);
+        out.append(header.value.data(), header.value.size());
+        out.append("\r\n", 2);
+    }
+}
+
+// ==================== BodyFramer Implementation ====================
+
+BodyFramer::BodyFramer() {
+    reset(Mode::NONE);
+}
+
+void BodyFramer::reset(Mode newMode, uint64_t contentLength) {
+    mode = newMode;
+    chunkState = ChunkState::SIZE_START;
+    remaining = newMode == Mode::CONTENT_LENGTH ? contentLength : 0;
+    error = false;
+    complete = newMode == Mode::NONE ||
+               (newMode == Mode::CONTENT_LENGTH && contentLength == 0);
+}
+
+size_t BodyFramer::consume(const char* data, size_t len, string* payload) {
+    if (complete || error) return 0;
+    
+    switch (mode) {
+        case Mode::NONE:
+            return 0;
+        case Mode::UNTIL_CLOSE:
+            if (payload) payload->append(data, len);
+            return len;
+        case Mode::CONTENT_LENGTH: {
+            size_t take = min<uint64_t>(remaining, len);
+            if (payload) payload->append(data, take);
+            remaining -= take;
+            complete = remaining == 0;
+            return take;
+        }
+        case Mode::CHUNKED:
+            break;
+    }
+    
+    // The body is forwarded as is, so anything another parser could frame
+    // differently (a bare LF, a size with no digits) is an error
+    size_t pos = 0;
+    while (pos < len && !complete && !error) {
+        char c = data[pos];
+        switch (chunkState) {
+            case ChunkState::SIZE_START:
+                if (!isxdigit((unsigned char)c)) {
+                    error = true;
+                    break;
+                }
+                chunkState = ChunkState::SIZE;
+                [[fallthrough]];
+            case ChunkState::SIZE:
+                if (isxdigit((unsigned char)c)) {
+                    if (remaining > (UINT64_MAX >> 4)) {
+                        error = true;
+                        break;
+                    }
+                    int digit = isdigit((unsigned char)c) ? c - '0' : (tolower(c) - 'a' + 10);
+                    remaining = remaining * 16 + digit;
+                } else if (c == ';' || c == ' ' || c == '\t') {
+                    chunkState = ChunkState::EXTENSION;
+                } else if (c == '\r') {
+                    chunkState = ChunkState::SIZE_LF;
+                } else {
+                    error = true;
+                }
+                pos++;
+                break;
+            case ChunkState::EXTENSION:
+                if (c == '\r') {
+                    chunkState = ChunkState::SIZE_LF;
+                } else if (!isFieldValue(string_view(&c, 1))) {
+                    error = true;
+                    break;
+                }
+                pos++;
+                break;
+            case ChunkState::SIZE_LF:
+                if (c != '\n') {
+                    error = true;
+                    break;
+                }
+                chunkState = remaining == 0 ? ChunkState::TRAILER_START : ChunkState::DATA;
+                pos++;
+                break;
+            case ChunkState::DATA: {
+                size_t take = min<uint64_t>(remaining, len - pos);
+                if (payload) payload->append(data + pos, take);
+                remaining -= take;
+                pos += take;
+                if (remaining == 0) chunkState = ChunkState::DATA_CR;
+                break;
+            }
+            case ChunkState::DATA_CR:
+                if (c != '\r') {
+                    error = true;
+                    break;
+                }
+                chunkState = ChunkState::DATA_LF;
+                pos++;
+                break;
+            case ChunkState::DATA_LF:
+                if (c != '\n') {
+                    error = true;
+                    break;
+                }
+                chunkState = ChunkState::SIZE_START;
+                pos++;
+                break;
+            case ChunkState::TRAILER_START:
+                if (c == '\r') {
+                    chunkState = ChunkState::FINAL_LF;
+                    pos++;
+                    break;
+                }
+                chunkState = ChunkState::TRAILER_LINE;
+                [[fallthrough]];
+            case ChunkState::TRAILER_LINE:
+                if (c == '\r') {
+                    chunkState = ChunkState::TRAILER_LF;
+                } else if (!isFieldValue(string_view(&c, 1))) {
+                    error = true;
+                    break;
+                }
+                pos++;
+                break;
+            case ChunkState::TRAILER_LF:
+                if (c != '\n') {
+                    error = true;
+                    break;
+                }
+                chunkState = ChunkState::TRAILER_START;
+                pos++;
+                break;
+            case ChunkState::FINAL_LF:
+                if (c != '\n') {
+                    error = true;
+                    break;
+                }
+                complete = true;
+                pos++;
+                break;
+        }
+    }
+    return pos;
+}
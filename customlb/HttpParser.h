@@ -0,0 +1,130 @@
+#ifndef HTTPPARSER_H
+#define HTTPPARSER_H
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <initializer_list>
+using namespace std;
+
+// One header line; both views point into the receive buffer
+struct HttpHeader {
+    string_view name;
+    string_view value;
+};
+
+// Parsed HTTP/1.x message head. Nothing is copied: every view points into
+// the buffer that was parsed and is only valid while that buffer is
+// unchanged (see rebase() for buffers that reallocate).
+struct HttpHead {
+    static const size_t maxHeaders = 64;
+
+    string_view startLine;
+
+    // Request line
+    string_view method;
+    string_view target;
+    string_view version;
+
+    // Status line
+    int statusCode;
+    string_view reason;
+
+    HttpHeader headers[maxHeaders];
+    size_t headerCount;
+    size_t length; // head bytes including the terminating blank line
+
+    HttpHead();
+
+    void clear();
+    // Case-insensitive lookup of the first header with this name
+    string_view header(string_view name) const;
+    bool headerHasToken(string_view name, string_view token) const;
+    // Value of a cookie sent in any Cookie header, or empty
+    string_view cookie(string_view name) const;
+    bool isHttp11() const { return version == "HTTP/1.1"; }
+    // Persistent connection semantics of this message's version/Connection
+    bool keepAlive() const;
+    // Re-points every view after the underlying buffer moved
+    void rebase(const char* oldBase, const char* newBase);
+};
+
+// Finds where an HTTP/1.1 message body ends as bytes arrive
+struct BodyFramer {
+    enum class Mode {
+        NONE,
+        CONTENT_LENGTH,
+        CHUNKED,
+        UNTIL_CLOSE
+    };
+
+    enum class ChunkState {
+        SIZE_START,  // at least one hex digit
+        SIZE,
+        EXTENSION,
+        SIZE_LF,
+        DATA,
+        DATA_CR,
+        DATA_LF,
+        TRAILER_START,
+        TRAILER_LINE,
+        TRAILER_LF,
+        FINAL_LF
+    };
+
+    Mode mode;
+    ChunkState chunkState;
+    uint64_t remaining; // body bytes, or bytes left in the current chunk
+    bool complete;
+    bool error;
+
+    BodyFramer();
+
+    void reset(Mode newMode, uint64_t contentLength = 0);
+    // Returns how many of the given bytes belong to this message body.
+    // Length-only modes never read data, so it may be null for them.
+    // The body's content (chunk framing removed) is appended to payload.
+    size_t consume(const char* data, size_t len, string* payload = nullptr);
+};
+
+// Resumable head parser. Feed it the whole buffer from the start of the
+// message each time more bytes arrive; it only scans the new bytes for
+// the end of the head and parses the head once, in a single pass.
+class HttpParser {
+public:
+    enum class Result {
+        INCOMPLETE,
+        COMPLETE,
+        INVALID,
+        TOO_LARGE
+    };
+
+    HttpParser(bool requestParser, size_t maxHead = 64 * 1024);
+
+    void reset();
+    Result parse(const char* data, size_t len, HttpHead& head);
+
+private:
+    bool isRequest;
+    size_t maxHeadBytes;
+    size_t scanned;
+
+    bool parseStartLine(string_view line, HttpHead& head) const;
+};
+
+bool equalsIgnoreCase(string_view a, string_view b);
+// True if a comma-separated header value contains token (case-insensitive)
+bool hasToken(string_view list, string_view token);
+// Value of the named cookie in a Cookie header ("a=1; b=2"), or empty
+string_view cookieValue(string_view cookieHeader, string_view name);
+
+// Message framing per RFC 9112 section 6.3. requestFraming returns false
+// for bodies that cannot be framed safely (request smuggling vectors).
+bool requestFraming(const HttpHead& head, BodyFramer& framer);
+bool responseFraming(const HttpHead& head, bool headRequest, BodyFramer& framer);
+
+// Appends head's header lines to out, skipping any named in dropHeaders
+void appendHeaders(const HttpHead& head, initializer_list<string_view> dropHeaders,
+                   string& out);
+
+#endif // HTTPPARSER_H
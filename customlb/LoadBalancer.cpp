@@ -1,543 +1,3858 @@
 #include "LoadBalancer.h"
+#include "Config.h"
 #include <iostream>
 #include <sstream>
 #include <cstring>
 #include <climits>
+#include <cmath>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <strings.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <csignal>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
 #include <algorithm>
+#include <numeric>
 #include <iomanip>
+#include <set>
 
 using namespace std;
 
-// ==================== Backend Implementation ====================
+// ==================== OutlierStats Implementation ====================
+
+const int OutlierStats::latencyBucketMs[OutlierStats::latencyBucketCount] = {
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, INT_MAX
+};
 
-Backend::Backend(const string& n, const string& h, int p, int maxF, int timeout)
-    : name(n), host(h), port(p), activeConnections(0), isHealthy(true),
-      consecutiveFailures(0), maxFails(maxF), failTimeout(timeout) {
+void OutlierStats::recordLatency(double ms) {
+    int bucket = 0;
+    while (bucket < latencyBucketCount - 1 && ms > latencyBucketMs[bucket]) {
+        bucket++;
+    }
+    latency[bucket].fetch_add(1, memory_order_relaxed);
 }
 
-bool Backend::checkHealth() {
-    // Simple TCP health check
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) return false;
-    
-    // Set timeout
-    struct timeval tv;
-    tv.tv_sec = 2;
-    tv.tv_usec = 0;
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-    
-    struct hostent* server = gethostbyname(host.c_str());
-    if (!server) {
-        close(sock);
-        return false;
+int OutlierStats::latencyPercentileMs(double percentile) const {
+    uint64_t total = 0;
+    for (int i = 0; i < latencyBucketCount; i++) {
+        total += latency[i].load(memory_order_relaxed);
     }
+    if (total == 0) return 0;
     
-    struct sockaddr_in serverAddr;
-    memset(&serverAddr, 0, sizeof(serverAddr));
-    serverAddr.sin_family = AF_INET;
-    memcpy(&serverAddr.sin_addr.s_addr, server->h_addr, server->h_length);
-    serverAddr.sin_port = htons(port);
-    
-    int result = connect(sock, (struct sockaddr*)&serverAddr, sizeof(serverAddr));
-    close(sock);
+    uint64_t rank = (uint64_t)ceil(total * percentile);
+    uint64_t seen = 0;
+    for (int i = 0; i < latencyBucketCount; i++) {
+        seen += latency[i].load(memory_order_relaxed);
+        if (seen >= rank) return latencyBucketMs[i];
+    }
+    return latencyBucketMs[latencyBucketCount - 1];
+}
+
+void OutlierStats::resetWindow() {
+    requests = 0;
+    errors = 0;
+    for (auto& bucket : latency) {
+        bucket = 0;
+    }
+}
+
+// ==================== Backend Implementation ====================
+
+Backend::Backend(const string& n, const string& h, int p, int maxF, int timeout, int w)
+    : name(n), host(h), port(p), address(0), removed(false), removedAt(0), probeFailed(false),
+      activeConnections(0), isHealthy(true),
+      consecutiveFailures(0), lastFailTime(0), latencyEwmaMs(0), latencyUpdatedAt(0),
+      maxFails(maxF), failTimeout(timeout), weight(max(w, 1)), upSince(0),
+      pendingConnects(0), circuitOverflows(0) {
+    // IP literals need no resolver
+    struct in_addr literal;
+    if (inet_pton(AF_INET, host.c_str(), &literal) == 1) {
+        address = literal.s_addr;
+    }
+}
+
+bool Backend::resolveAddress(struct sockaddr_in& addr) const {
+    uint32_t ip = address.load(memory_order_relaxed);
+    if (ip == 0) return false;
     
-    return result == 0;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = ip;
+    addr.sin_port = htons(port);
+    return true;
 }
 
-void Backend::recordFailure() {
+bool Backend::recordFailure() {
     consecutiveFailures++;
-    lastFailTime = chrono::steady_clock::now();
+    lastFailTime = chrono::steady_clock::now().time_since_epoch().count();
     
     if (consecutiveFailures >= maxFails) {
-        isHealthy = false;
-        cout << "[HEALTH] Backend " << name << " marked as DOWN ("
-             << consecutiveFailures << " failures)" << endl;
+        if (isHealthy.exchange(false)) {
+            cout << "[HEALTH] Backend " << name << " marked as DOWN ("
+                 << consecutiveFailures << " failures)" << endl;
+        }
+        return true;
     }
+    return false;
 }
 
-void Backend::recordSuccess() {
+bool Backend::recordSuccess() {
     if (consecutiveFailures > 0) {
         consecutiveFailures = 0;
-        if (!isHealthy) {
-            isHealthy = true;
+        if (!isHealthy.exchange(true)) {
+            upSince = chrono::steady_clock::now().time_since_epoch().count();
             cout << "[HEALTH] Backend " << name << " marked as UP" << endl;
+            return true;
         }
     }
+    return false;
 }
 
-bool Backend::shouldRetry() {
+bool Backend::markProbeDown() {
+    lastFailTime = chrono::steady_clock::now().time_since_epoch().count();
+    if (probeFailed.exchange(true)) return false;
+    
+    isHealthy = false;
+    cout << "[HEALTH] Backend " << name << " marked as DOWN (health check failed)" << endl;
+    return true;
+}
+
+bool Backend::markProbeUp() {
+    bool wasDown = probeFailed.exchange(false) || !isHealthy;
+    if (!wasDown) return false;
+    
+    consecutiveFailures = 0;
+    isHealthy = true;
+    upSince = chrono::steady_clock::now().time_since_epoch().count();
+    cout << "[HEALTH] Backend " << name << " marked as UP (health check passed)" << endl;
+    return true;
+}
+
+bool Backend::isSelectable(chrono::steady_clock::time_point now) const {
+    if (removed || probeFailed) return false;
+    if (now.time_since_epoch().count() < outlier.ejectedUntil.load(memory_order_relaxed)) return false;
     if (isHealthy) return true;
     
-    auto now = chrono::steady_clock::now();
-    auto elapsed = chrono::duration_cast<chrono::seconds>(now - lastFailTime).count();
+    auto lastFail = chrono::steady_clock::time_point(chrono::steady_clock::duration(lastFailTime.load()));
+    return now - lastFail >= chrono::seconds(failTimeout);
+}
+
+void Backend::recordLatency(double ms) {
+    int64_t now = chrono::steady_clock::now().time_since_epoch().count();
+    int64_t last = latencyUpdatedAt.exchange(now);
+    double elapsed = chrono::duration<double>(chrono::steady_clock::duration(now - last)).count();
+    double weight = exp(-elapsed / latencyDecaySeconds);
     
-    if (elapsed >= failTimeout) {
-        cout << "[HEALTH] Retry timeout expired for " << name << ", attempting recovery" << endl;
-        consecutiveFailures = 0; // Reset for retry
-        return true;
-    }
+    // Peak-sensitive: a slower sample takes effect at once, faster ones
+    // pull the average down gradually
+    double current = latencyEwmaMs.load();
+    double next;
+    do {
+        next = ms > current ? ms : current * weight + ms * (1.0 - weight);
+    } while (!latencyEwmaMs.compare_exchange_weak(current, next));
+}
+
+double Backend::latencyEstimateMs(int64_t nowTicks) const {
+    int64_t last = latencyUpdatedAt.load(memory_order_relaxed);
+    double elapsed = chrono::duration<double>(chrono::steady_clock::duration(nowTicks - last)).count();
+    return latencyEwmaMs.load(memory_order_relaxed) * exp(-elapsed / latencyDecaySeconds);
+}
+
+int Backend::scaledWeight(int64_t nowTicks, int slowStartSeconds) const {
+    int full = weight * 100;
+    int64_t since = upSince.load(memory_order_relaxed);
+    if (slowStartSeconds <= 0 || since == 0) return full;
     
-    return false;
+    double elapsed = chrono::duration<double>(chrono::steady_clock::duration(nowTicks - since)).count();
+    if (elapsed >= slowStartSeconds) return full;
+    return max(1, (int)(full * elapsed / slowStartSeconds));
 }
 
 // ==================== ServiceConfig Implementation ====================
 
 ServiceConfig::ServiceConfig(const string& p, LoadBalancingAlgorithm algo)
-    : path(p), algorithm(algo), roundRobinIndex(0) {
+    : path(p), algorithm(algo), roundRobinIndex(0),
+      hashKeySource(HashKeySource::CLIENT_IP), lastOutlierSweep(0), slowStartSeconds(0),
+      currentSnapshot(new BackendSnapshot()) {
+    snapshot = currentSnapshot.get();
 }
 
-shared_ptr<Backend> ServiceConfig::selectBackend(const string& clientIP) {
-    switch (algorithm) {
-        case LoadBalancingAlgorithm::ROUND_ROBIN:
-            return selectRoundRobin();
-        case LoadBalancingAlgorithm::LEAST_CONNECTIONS:
-            return selectLeastConnections();
-        case LoadBalancingAlgorithm::IP_HASH:
-            return selectIPHash(clientIP);
+void ServiceConfig::addBackend(shared_ptr<Backend> backend) {
+    {
+        lock_guard<mutex> lock(snapshotMutex);
+        backends.push_back(backend);
     }
-    return nullptr;
+    refreshSnapshot();
 }
 
-shared_ptr<Backend> ServiceConfig::selectRoundRobin() {
-    vector<shared_ptr<Backend>> healthy;
-    for (auto& backend : backends) {
-        if (backend->isHealthy || backend->shouldRetry()) {
-            healthy.push_back(backend);
-        }
+vector<shared_ptr<Backend>> ServiceConfig::members() {
+    lock_guard<mutex> lock(snapshotMutex);
+    return backends;
+}
+
+// Both under snapshotMutex, so a backend coming back is never dropped
+bool ServiceConfig::restoreBackend(Backend* backend) {
+    lock_guard<mutex> lock(snapshotMutex);
+    auto member = find_if(backends.begin(), backends.end(),
+                          [&](const shared_ptr<Backend>& candidate) { return candidate.get() == backend; });
+    if (member == backends.end()) return false;
+    if (backend->removed.exchange(false)) {
+        backend->upSince = chrono::steady_clock::now().time_since_epoch().count();
+        cout << "[DNS] Backend " << backend->name << " is back" << endl;
     }
+    return true;
+}
+
+vector<shared_ptr<Backend>> ServiceConfig::dropRemovedBackends() {
+    int64_t cutoff = (chrono::steady_clock::now() - chrono::seconds(removedBackendGraceSeconds))
+                         .time_since_epoch().count();
+    vector<shared_ptr<Backend>> dropped;
+    lock_guard<mutex> lock(snapshotMutex);
     
-    if (healthy.empty()) return nullptr;
+    // Removed ones left the snapshot long ago; requests still using
+    // one hold it through its counters
+    droppedBackends.erase(
+        remove_if(droppedBackends.begin(), droppedBackends.end(),
+                  [](const shared_ptr<Backend>& backend) {
+                      return backend->activeConnections.load() == 0 && backend->pendingConnects.load() == 0;
+                  }),
+        droppedBackends.end());
     
-    size_t index = roundRobinIndex.fetch_add(1) % healthy.size();
-    return healthy[index];
+    for (auto it = backends.begin(); it != backends.end();) {
+        Backend* backend = it->get();
+        if (!backend->removed || backend->removedAt.load() > cutoff) {
+            ++it;
+            continue;
+        }
+        cout << "[DNS] Backend " << backend->name << " dropped" << endl;
+        dropped.push_back(*it);
+        droppedBackends.push_back(*it);
+        it = backends.erase(it);
+    }
+    return dropped;
 }
 
-shared_ptr<Backend> ServiceConfig::selectLeastConnections() {
-    shared_ptr<Backend> selected = nullptr;
-    int minConnections = INT_MAX;
-    
-    for (auto& backend : backends) {
-        if (backend->isHealthy || backend->shouldRetry()) {
-            int conns = backend->activeConnections.load();
-            if (conns < minConnections) {
-                minConnections = conns;
-                selected = backend;
-            }
+bool ServiceConfig::snapshotIsCurrent(chrono::steady_clock::time_point now) const {
+    const vector<Backend*>& current = currentSnapshot->backends;
+    bool weighted = algorithm == LoadBalancingAlgorithm::WEIGHTED_ROUND_ROBIN;
+    int64_t nowTicks = now.time_since_epoch().count();
+    size_t i = 0;
+    for (const auto& backend : backends) {
+        if (!backend->isSelectable(now)) continue;
+        if (i >= current.size() || current[i] != backend.get()) return false;
+        // Slow start changes weights without changing membership
+        if (weighted && currentSnapshot->weights[i] != backend->scaledWeight(nowTicks, slowStartSeconds)) {
+            return false;
         }
+        i++;
     }
-    
-    return selected;
+    return i == current.size();
 }
 
-shared_ptr<Backend> ServiceConfig::selectIPHash(const string& clientIP) {
-    vector<shared_ptr<Backend>> healthy;
-    for (auto& backend : backends) {
-        if (backend->isHealthy || backend->shouldRetry()) {
-            healthy.push_back(backend);
+void ServiceConfig::refreshSnapshot() {
+    lock_guard<mutex> lock(snapshotMutex);
+    auto now = chrono::steady_clock::now();
+    if (snapshotIsCurrent(now)) return;
+    
+    unique_ptr<BackendSnapshot> next(new BackendSnapshot());
+    for (const auto& backend : backends) {
+        if (!backend->isSelectable(now)) continue;
+        
+        const vector<Backend*>& current = currentSnapshot->backends;
+        if (!backend->isHealthy && find(current.begin(), current.end(), backend.get()) == current.end()) {
+            cout << "[HEALTH] Retry timeout expired for " << backend->name << ", attempting recovery" << endl;
         }
+        next->backends.push_back(backend.get());
+    }
+    if (algorithm == LoadBalancingAlgorithm::CONSISTENT_HASH) {
+        next->maglevTable = buildMaglevTable(next->backends);
+    }
+    if (algorithm == LoadBalancingAlgorithm::WEIGHTED_ROUND_ROBIN) {
+        for (Backend* backend : next->backends) {
+            next->weights.push_back(backend->scaledWeight(now.time_since_epoch().count(), slowStartSeconds));
+        }
+        next->schedule = buildSmoothSchedule(next->weights);
     }
     
-    if (healthy.empty()) return nullptr;
+    snapshot.store(next.get(), memory_order_release);
     
-    hash<string> hasher;
-    size_t hashValue = hasher(clientIP);
-    size_t index = hashValue % healthy.size();
+    // Readers hold a snapshot only for one selection call, so anything
+    // retired well before now can no longer be in use
+    currentSnapshot->retiredAt = now;
+    retiredSnapshots.push_back(move(currentSnapshot));
+    currentSnapshot = move(next);
     
-    return healthy[index];
+    auto grace = chrono::seconds(snapshotGracePeriodSeconds);
+    retiredSnapshots.erase(
+        remove_if(retiredSnapshots.begin(), retiredSnapshots.end(),
+                  [&](const unique_ptr<BackendSnapshot>& old) { return now - old->retiredAt >= grace; }),
+        retiredSnapshots.end());
 }
 
-// ==================== HttpRequest Implementation ====================
-
-HttpRequest HttpRequest::parse(const string& rawRequest) {
-    HttpRequest req;
-    istringstream stream(rawRequest);
-    string line;
-    
-    // Parse request line
-    if (getline(stream, line)) {
-        istringstream requestLine(line);
-        requestLine >> req.method >> req.path >> req.version;
+bool ServiceConfig::eject(Backend* backend, const string& reason) {
+    auto now = chrono::steady_clock::now();
+    int64_t nowTicks = now.time_since_epoch().count();
+    const OutlierDetectionSettings& settings = outlierDetection;
+    {
+        lock_guard<mutex> lock(snapshotMutex);
+        OutlierStats& stats = backend->outlier;
+        if (stats.ejectedUntil > nowTicks) return false;
+        
+        size_t ejected = 0;
+        for (const auto& member : backends) {
+            if (member->outlier.ejectedUntil > nowTicks) ejected++;
+        }
+        if ((ejected + 1) * 100 > backends.size() * settings.maxEjectionPercent) {
+            return false;
+        }
+        
+        int ejections = ++stats.ejections;
+        int64_t seconds = settings.baseEjectionSeconds;
+        for (int i = 1; i < ejections && seconds < settings.maxEjectionSeconds; i++) {
+            seconds *= 2;
+        }
+        seconds = min<int64_t>(seconds, settings.maxEjectionSeconds);
+        stats.ejectedUntil = (now + chrono::seconds(seconds)).time_since_epoch().count();
+        stats.consecutive5xx = 0;
+        stats.consecutiveConnectErrors = 0;
+        
+        cout << "[OUTLIER] Ejected " << backend->name << " for " << seconds
+             << "s (" << reason << ")" << endl;
     }
+    refreshSnapshot();
+    return true;
+}
+
+void ServiceConfig::recordResponse(Backend* backend, int status, double latencyMs) {
+    OutlierStats& stats = backend->outlier;
+    stats.requests.fetch_add(1, memory_order_relaxed);
+    stats.recordLatency(latencyMs);
+    stats.consecutiveConnectErrors.store(0, memory_order_relaxed);
     
-    // Parse headers
-    while (getline(stream, line) && line != "\r" && !line.empty()) {
-        size_t colonPos = line.find(':');
-        if (colonPos != string::npos) {
-            string key = line.substr(0, colonPos);
-            string value = line.substr(colonPos + 1);
-            // Trim whitespace
-            value.erase(0, value.find_first_not_of(" \t\r\n"));
-            value.erase(value.find_last_not_of(" \t\r\n") + 1);
-            req.headers[key] = value;
+    if (status < 500) {
+        if (stats.consecutive5xx.load(memory_order_relaxed) != 0) {
+            stats.consecutive5xx.store(0, memory_order_relaxed);
         }
+        return;
     }
     
-    // Parse body (if any)
-    string bodyPart;
-    while (getline(stream, line)) {
-        bodyPart += line + "\n";
+    stats.errors++;
+    if (++stats.consecutive5xx >= outlierDetection.consecutive5xx) {
+        eject(backend, to_string(outlierDetection.consecutive5xx) + " consecutive 5xx");
+    }
+}
+
+void ServiceConfig::recordConnectError(Backend* backend) {
+    OutlierStats& stats = backend->outlier;
+    stats.requests++;
+    stats.errors++;
+    if (++stats.consecutiveConnectErrors >= outlierDetection.consecutiveConnectErrors) {
+        eject(backend, to_string(outlierDetection.consecutiveConnectErrors) + " consecutive connect errors");
     }
-    req.body = bodyPart;
-    
-    return req;
 }
 
-string HttpRequest::toString() const {
-    ostringstream oss;
-    oss << method << " " << path << " " << version << "\r\n";
-    for (const auto& header : headers) {
-        oss << header.first << ": " << header.second << "\r\n";
+void ServiceConfig::evaluateOutliers() {
+    const OutlierDetectionSettings& settings = outlierDetection;
+    int64_t now = chrono::steady_clock::now().time_since_epoch().count();
+    int64_t interval = chrono::duration_cast<chrono::steady_clock::duration>(
+        chrono::seconds(settings.intervalSeconds)).count();
+    
+    // Called each maintenance tick, which only worker 0 runs
+    if (now - lastOutlierSweep.load() < interval) return;
+    lastOutlierSweep = now;
+    
+    for (const auto& backend : members()) {
+        OutlierStats& stats = backend->outlier;
+        uint32_t requests = stats.requests;
+        bool ejected = stats.ejectedUntil > now;
+        
+        if (!ejected && requests >= (uint32_t)settings.minRequests) {
+            double errorRate = (double)stats.errors / requests;
+            int p99 = stats.latencyPercentileMs(0.99);
+            if (errorRate > settings.max5xxRate) {
+                ejected = eject(backend.get(), to_string((int)(errorRate * 100)) + "% errors");
+            } else if (settings.maxP99LatencyMs > 0 && p99 > settings.maxP99LatencyMs) {
+                ejected = eject(backend.get(), "p99 latency " + to_string(p99) + "ms");
+            }
+        }
+        
+        // A clean interval forgives one earlier ejection
+        if (!ejected && stats.ejections > 0) {
+            stats.ejections--;
+        }
+        stats.resetWindow();
     }
-    oss << "\r\n";
-    if (!body.empty()) {
-        oss << body;
+}
+
+// Stable across processes and builds (unlike std::hash), so every load
+// balancer replica maps a key to the same backend
+static uint64_t hashKey(string_view data, uint64_t seed) {
+    uint64_t h = 14695981039346656037ULL ^ seed;
+    for (unsigned char c : data) {
+        h = (h ^ c) * 1099511628211ULL;
     }
-    return oss.str();
+    // splitmix64 finalizer: FNV alone leaves the low bits poorly mixed
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
 }
 
-// ==================== HttpResponse Implementation ====================
+// Maglev lookup table (Eisenbud et al., NSDI 2016): backends take turns
+// claiming their next preferred slot, so each ends up with an equal share
+// and removing one only reassigns the slots it owned (plus a few others).
+vector<uint32_t> ServiceConfig::buildMaglevTable(const vector<Backend*>& members) {
+    const size_t size = maglevTableSize;
+    const uint32_t empty = UINT32_MAX;
+    vector<uint32_t> table(size, empty);
+    if (members.empty()) return table;
+    
+    size_t n = members.size();
+    vector<uint64_t> offset(n), skip(n), next(n, 0);
+    for (size_t i = 0; i < n; i++) {
+        // Permutations depend on the name only, not on position in the set
+        offset[i] = hashKey(members[i]->name, 0xa5a5) % size;
+        skip[i] = hashKey(members[i]->name, 0x5a5a) % (size - 1) + 1;
+    }
+    
+    size_t filled = 0;
+    while (true) {
+        for (size_t i = 0; i < n; i++) {
+            size_t slot = (offset[i] + next[i] * skip[i]) % size;
+            while (table[slot] != empty) {
+                next[i]++;
+                slot = (offset[i] + next[i] * skip[i]) % size;
+            }
+            table[slot] = i;
+            next[i]++;
+            if (++filled == size) return table;
+        }
+    }
+}
 
-HttpResponse HttpResponse::parse(const string& rawResponse) {
-    HttpResponse resp;
-    istringstream stream(rawResponse);
-    string line;
+// nginx's smooth weighted round robin, run once per snapshot for a full
+// cycle: every pick adds each weight to its backend's counter, takes the
+// largest counter and subtracts the total from it. Heavy backends come up
+// interleaved with light ones instead of in bursts.
+vector<uint32_t> ServiceConfig::buildSmoothSchedule(vector<int> weights) {
+    if (weights.empty()) return {};
     
-    // Parse status line
-    if (getline(stream, line)) {
-        istringstream statusLine(line);
-        statusLine >> resp.version >> resp.statusCode;
-        getline(statusLine, resp.statusMessage);
-        // Trim whitespace
-        resp.statusMessage.erase(0, resp.statusMessage.find_first_not_of(" \t\r\n"));
+    int divisor = 0;
+    for (int w : weights) divisor = gcd(divisor, w);
+    long total = 0;
+    for (int& w : weights) {
+        w /= divisor;
+        total += w;
     }
     
-    // Parse headers
-    while (getline(stream, line) && line != "\r" && !line.empty()) {
-        size_t colonPos = line.find(':');
-        if (colonPos != string::npos) {
-            string key = line.substr(0, colonPos);
-            string value = line.substr(colonPos + 1);
-            value.erase(0, value.find_first_not_of(" \t\r\n"));
-            value.erase(value.find_last_not_of(" \t\r\n") + 1);
-            resp.headers[key] = value;
+    // Long cycles (mid-ramp weights) are scaled down to bound the table
+    if (total > (long)maxScheduleLength) {
+        long scaled = 0;
+        for (int& w : weights) {
+            w = max(1, (int)(w * (long)maxScheduleLength / total));
+            scaled += w;
         }
+        total = scaled;
     }
     
-    // Parse body
-    string bodyPart;
-    while (getline(stream, line)) {
-        bodyPart += line + "\n";
+    vector<uint32_t> schedule;
+    schedule.reserve(total);
+    vector<long> current(weights.size(), 0);
+    for (long step = 0; step < total; step++) {
+        size_t best = 0;
+        for (size_t i = 0; i < weights.size(); i++) {
+            current[i] += weights[i];
+            if (current[i] > current[best]) best = i;
+        }
+        current[best] -= total;
+        schedule.push_back(best);
     }
-    resp.body = bodyPart;
+    return schedule;
+}
+
+Backend* ServiceConfig::selectBackend(const string& clientIP, const HttpHead& request) {
+    const BackendSnapshot& set = *snapshot.load(memory_order_acquire);
+    if (set.backends.empty()) return nullptr;
     
-    return resp;
+    switch (algorithm) {
+        case LoadBalancingAlgorithm::ROUND_ROBIN:
+            return selectRoundRobin(set);
+        case LoadBalancingAlgorithm::LEAST_CONNECTIONS:
+            return selectLeastConnections(set);
+        case LoadBalancingAlgorithm::IP_HASH:
+            return selectIPHash(set, clientIP);
+        case LoadBalancingAlgorithm::CONSISTENT_HASH: {
+            string_view key;
+            if (hashKeySource == HashKeySource::HEADER) {
+                key = request.header(hashKeyName);
+            } else if (hashKeySource == HashKeySource::COOKIE) {
+                key = request.cookie(hashKeyName);
+            }
+            return selectConsistentHash(set, key.empty() ? string_view(clientIP) : key);
+        }
+        case LoadBalancingAlgorithm::POWER_OF_TWO_CHOICES:
+            return selectPowerOfTwo(set);
+        case LoadBalancingAlgorithm::PEAK_EWMA:
+            return selectPeakEwma(set);
+        case LoadBalancingAlgorithm::WEIGHTED_ROUND_ROBIN:
+            return selectWeightedRoundRobin(set);
+    }
+    return nullptr;
 }
 
-string HttpResponse::toString() const {
-    ostringstream oss;
-    oss << version << " " << statusCode << " " << statusMessage << "\r\n";
-    for (const auto& header : headers) {
-        oss << header.first << ": " << header.second << "\r\n";
+Backend* ServiceConfig::selectUntried(const string& clientIP, const HttpHead& request,
+                                      const vector<Backend*>& tried) {
+    Backend* selected = selectBackend(clientIP, request);
+    if (!selected || find(tried.begin(), tried.end(), selected) == tried.end()) {
+        return selected;
     }
-    oss << "\r\n";
-    if (!body.empty()) {
-        oss << body;
+    
+    // Walking on from the usual choice keeps hash-based services'
+    // retries of a key on the same fallback backend
+    const BackendSnapshot& set = *snapshot.load(memory_order_acquire);
+    size_t n = set.backends.size();
+    size_t start = find(set.backends.begin(), set.backends.end(), selected) - set.backends.begin();
+    for (size_t i = 1; i <= n; i++) {
+        Backend* candidate = set.backends[(start + i) % n];
+        if (find(tried.begin(), tried.end(), candidate) == tried.end()) {
+            return candidate;
+        }
     }
-    return oss.str();
+    return nullptr;
 }
 
-// ==================== HealthChecker Implementation ====================
+Backend* ServiceConfig::selectRoundRobin(const BackendSnapshot& set) {
+    size_t index = roundRobinIndex.fetch_add(1, memory_order_relaxed) % set.backends.size();
+    return set.backends[index];
+}
 
-HealthChecker::HealthChecker(int intervalSeconds)
-    : running(false), checkIntervalSeconds(intervalSeconds) {
+Backend* ServiceConfig::selectLeastConnections(const BackendSnapshot& set) {
+    Backend* selected = nullptr;
+    int minConnections = INT_MAX;
+    
+    for (Backend* backend : set.backends) {
+        int conns = backend->activeConnections.load(memory_order_relaxed);
+        if (conns < minConnections) {
+            minConnections = conns;
+            selected = backend;
+        }
+    }
+    
+    return selected;
 }
 
-HealthChecker::~HealthChecker() {
-    stop();
+Backend* ServiceConfig::selectIPHash(const BackendSnapshot& set, const string& clientIP) {
+    hash<string> hasher;
+    size_t hashValue = hasher(clientIP);
+    size_t index = hashValue % set.backends.size();
+    
+    return set.backends[index];
 }
 
-void HealthChecker::addBackend(shared_ptr<Backend> backend) {
-    allBackends.push_back(backend);
+Backend* ServiceConfig::selectConsistentHash(const BackendSnapshot& set, string_view key) {
+    size_t slot = hashKey(key, 0) % set.maglevTable.size();
+    return set.backends[set.maglevTable[slot]];
 }
 
-void HealthChecker::start() {
-    running = true;
-    healthCheckThread = thread(&HealthChecker::healthCheckLoop, this);
+// Two distinct random members (the same one twice for a single backend)
+static pair<Backend*, Backend*> pickTwo(const BackendSnapshot& set) {
+    // xorshift64*, one state per thread: no shared cache line to fight over
+    thread_local uint64_t state = (hash<thread::id>()(this_thread::get_id()) ^
+                                   chrono::steady_clock::now().time_since_epoch().count()) | 1;
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    uint64_t random = state * 2685821657736338717ULL;
+    
+    size_t n = set.backends.size();
+    if (n == 1) return {set.backends[0], set.backends[0]};
+    size_t first = (random >> 32) % n;
+    size_t second = (first + 1 + (random & 0xffffffffu) % (n - 1)) % n;
+    return {set.backends[first], set.backends[second]};
 }
 
-void HealthChecker::stop() {
-    running = false;
-    if (healthCheckThread.joinable()) {
-        healthCheckThread.join();
-    }
+Backend* ServiceConfig::selectPowerOfTwo(const BackendSnapshot& set) {
+    auto [a, b] = pickTwo(set);
+    return b->activeConnections.load(memory_order_relaxed) <
+           a->activeConnections.load(memory_order_relaxed) ? b : a;
 }
 
-void HealthChecker::healthCheckLoop() {
-    while (running) {
-        for (auto& backend : allBackends) {
-            bool healthy = backend->checkHealth();
-            if (healthy) {
-                backend->recordSuccess();
-            } else {
-                backend->recordFailure();
-            }
-        }
-        
-        this_thread::sleep_for(chrono::seconds(checkIntervalSeconds));
+Backend* ServiceConfig::selectPeakEwma(const BackendSnapshot& set) {
+    auto [a, b] = pickTwo(set);
+    int64_t now = chrono::steady_clock::now().time_since_epoch().count();
+    
+    // Expected wait: latency times the requests queued ahead of this one.
+    // The floor keeps unmeasured backends comparable by load alone.
+    auto cost = [now](Backend* backend) {
+        double latency = max(backend->latencyEstimateMs(now), 0.1);
+        return latency * (backend->activeConnections.load(memory_order_relaxed) + 1);
+    };
+    return cost(b) < cost(a) ? b : a;
+}
+
+Backend* ServiceConfig::selectWeightedRoundRobin(const BackendSnapshot& set) {
+    size_t index = roundRobinIndex.fetch_add(1, memory_order_relaxed) % set.schedule.size();
+    return set.backends[set.schedule[index]];
+}
+
+// ==================== ClientConnection Implementation ====================
+
+ClientConnection::ClientConnection(int sock, const string& ip, Worker* w)
+    : clientSocket(sock), id(0), clientIP(ip), worker(w), tls(nullptr), overConnectionLimit(false),
+      http2FlushPosted(false), http2ReadPaused(false), parent(nullptr), streamId(0), http2BodyHeld(0), requestsServed(0), requestParser(true), requestBase(nullptr),
+      requestLength(0), holdsPermit(false),
+      backend(nullptr), backendSocket(-1), backendReused(false), connectPending(false),
+      hedgeTimer(0), responseParser(false),
+      pipeRead(-1), pipeWrite(-1), pipeBytes(0), useSplice(false), timer(0) {
+    resetRequest();
+}
+
+void ClientConnection::resetRequest() {
+    state = ConnectionState::READING_REQUEST;
+    outBuffer.clear();
+    outOffset = 0;
+    closeAfterWrite = true;
+    
+    // The finished request's bytes were kept in place for its views
+    if (requestLength > 0) {
+        inBuffer.erase(0, requestLength);
+        requestLength = 0;
     }
+    requestParser.reset();
+    request.clear();
+    requestBody = string_view();
+    requestHeadParsed = false;
+    requestComplete = false;
+    requestBodyStart = 0;
+    requestScanned = 0;
+    clientKeepAlive = false;
+    service.reset();
+    attempt = 0;
+    triedBackends.clear();
+    deadline = chrono::steady_clock::time_point::max();
+    requestSlot.reset();
+    cacheKey.clear();
+    cacheLeader = false;
+    cacheFill.reset();
+    flightKey.clear();
+    flightLeader = false;
+    flightFill.reset();
+    
+    upstreamRequest.clear();
+    upstreamOffset = 0;
+    upstreamResponse.clear();
+    responseParser.reset();
+    responseHead.clear();
+    responseHeadParsed = false;
+    responseScanned = 0;
+    responseHeadStart = 0;
+    upstreamKeepAlive = false;
+    upstreamLatencyMs = -1;
+    upstreamBytes = 0;
 }
 
-// ==================== LoadBalancer Implementation ====================
+void ClientConnection::beginAttempt(chrono::steady_clock::time_point started) {
+    forwardStart = started;
+    upstreamResponse.clear();
+    upstreamLatencyMs = -1;
+    upstreamBytes = 0;
+    responseParser.reset();
+    responseHeadParsed = false;
+    responseScanned = 0;
+    upstreamKeepAlive = false;
+}
 
-LoadBalancer::LoadBalancer(int port, int stats)
-    : listenPort(port), statsPort(stats), running(false),
-      totalRequests(0), failedRequests(0),
-      totalBytesReceived(0), totalBytesSent(0) {
-    healthChecker = make_unique<HealthChecker>(30); // Check every 30 seconds
+// ==================== HealthChecker Implementation ====================
+
+HealthChecker::HealthChecker()
+    : random(random_device()()) {
 }
 
-LoadBalancer::~LoadBalancer() {
+HealthChecker::~HealthChecker() {
     stop();
 }
 
-void LoadBalancer::addService(const string& path, LoadBalancingAlgorithm algo) {
-    services[path] = make_shared<ServiceConfig>(path, algo);
+void HealthChecker::addBackend(shared_ptr<Backend> backend, shared_ptr<ServiceConfig> service) {
+    loop.post([this, backend, service]() {
+        auto target = make_unique<Target>();
+        target->backend = backend;
+        target->service = service;
+        schedule(target.get(), true);
+        targets.push_back(move(target));
+    });
 }
 
-void LoadBalancer::addBackendToService(const string& path, const string& name,
-                                      const string& host, int port,
-                                      int maxFails, int failTimeout) {
-    auto it = services.find(path);
-    if (it != services.end()) {
-        auto backend = make_shared<Backend>(name, host, port, maxFails, failTimeout);
-        it->second->backends.push_back(backend);
-        healthChecker->addBackend(backend);
-    }
+void HealthChecker::removeBackend(shared_ptr<Backend> backend) {
+    loop.post([this, backend]() {
+        for (auto& target : targets) {
+            if (target->backend != backend) continue;
+            loop.cancel(target->timer);
+            if (target->fd >= 0) {
+                loop.remove(target->fd);
+                close(target->fd);
+            }
+        }
+        targets.erase(remove_if(targets.begin(), targets.end(),
+                                [&](const unique_ptr<Target>& target) { return target->backend == backend; }),
+                      targets.end());
+    });
 }
 
-shared_ptr<ServiceConfig> LoadBalancer::matchService(const string& path) {
-    // Find longest matching prefix
-    shared_ptr<ServiceConfig> matched = nullptr;
-    size_t maxLen = 0;
-    
-    for (auto& [servicePath, config] : services) {
-        if (path.find(servicePath) == 0 && servicePath.length() > maxLen) {
-            matched = config;
-            maxLen = servicePath.length();
+void HealthChecker::removeService(shared_ptr<ServiceConfig> service) {
+    loop.post([this, service]() {
+        for (auto& target : targets) {
+            if (target->service != service) continue;
+            loop.cancel(target->timer);
+            if (target->fd >= 0) {
+                loop.remove(target->fd);
+                close(target->fd);
+            }
         }
+        targets.erase(remove_if(targets.begin(), targets.end(),
+                                [&](const unique_ptr<Target>& target) { return target->service == service; }),
+                      targets.end());
+    });
+}
+
+void HealthChecker::start() {
+    healthCheckThread = thread([this]() { loop.run(); });
+}
+
+void HealthChecker::stop() {
+    if (healthCheckThread.joinable()) {
+        loop.stop();
+        healthCheckThread.join();
     }
-    
-    return matched;
+    for (auto& target : targets) {
+        if (target->fd >= 0) close(target->fd);
+    }
+    targets.clear();
 }
 
-bool LoadBalancer::forwardRequest(int clientSocket, HttpRequest& request,
-                                  shared_ptr<Backend> backend,
-                                  const string& clientIP) {
-    // Connect to backend
-    int backendSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (backendSocket < 0) {
-        return false;
+void HealthChecker::schedule(Target* target, bool first) {
+    const HealthCheckSettings& settings = target->service->healthCheck;
+    double intervalMs = settings.intervalSeconds * 1000.0;
+    
+    // The first probe lands anywhere in the interval to spread the load
+    // over the sweep; later ones keep the interval +/- jitter
+    double delayMs;
+    if (first) {
+        delayMs = uniform_real_distribution<double>(0, intervalMs)(random);
+    } else {
+        double spread = intervalMs * settings.jitter;
+        delayMs = intervalMs + uniform_real_distribution<double>(-spread, spread)(random);
     }
     
-    // Set timeouts
-    struct timeval tv;
-    tv.tv_sec = 60;
-    tv.tv_usec = 0;
-    setsockopt(backendSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    setsockopt(backendSocket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    target->timer = loop.runAfter((int64_t)delayMs, [this, target]() { startProbe(target); });
+}
+
+void HealthChecker::startProbe(Target* target) {
+    Backend& backend = *target->backend;
+    const HealthCheckSettings& settings = target->service->healthCheck;
     
-    struct hostent* server = gethostbyname(backend->host.c_str());
-    if (!server) {
-        close(backendSocket);
-        return false;
+    if (backend.removed) {
+        schedule(target, false);
+        return;
     }
     
     struct sockaddr_in serverAddr;
-    memset(&serverAddr, 0, sizeof(serverAddr));
-    serverAddr.sin_family = AF_INET;
-    memcpy(&serverAddr.sin_addr.s_addr, server->h_addr, server->h_length);
-    serverAddr.sin_port = htons(backend->port);
-    
-    if (connect(backendSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
-        close(backendSocket);
-        return false;
+    if (!backend.resolveAddress(serverAddr)) {
+        finishProbe(target, false);
+        return;
     }
     
-    // Add/modify headers for proxying
-    request.headers["X-Real-IP"] = clientIP;
-    request.headers["X-Forwarded-For"] = clientIP;
-    request.headers["X-Forwarded-Proto"] = "http";
-    request.headers["Connection"] = "close";
-    
-    // Send request to backend
-    string requestStr = request.toString();
-    ssize_t sent = send(backendSocket, requestStr.c_str(), requestStr.length(), 0);
-    if (sent < 0) {
-        close(backendSocket);
-        return false;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        schedule(target, false); // Our problem, not a verdict on the backend
+        return;
     }
     
-    totalBytesSent += sent;
-    
-    // Receive response from backend
-    char buffer[8192];
-    string response;
-    ssize_t bytesRead;
-    
-    while ((bytesRead = recv(backendSocket, buffer, sizeof(buffer), 0)) > 0) {
-        response.append(buffer, bytesRead);
-        totalBytesReceived += bytesRead;
+    target->fd = fd;
+    target->connected = false;
+    target->sent = 0;
+    target->response.clear();
+    if (!settings.httpPath.empty()) {
+        target->request = "GET " + settings.httpPath + " HTTP/1.1\r\nHost: " + backend.host +
+                          "\r\nUser-Agent: customlb-health\r\nConnection: close\r\n\r\n";
     }
     
-    close(backendSocket);
-    
-    // Forward response to client
-    if (!response.empty()) {
-        send(clientSocket, response.c_str(), response.length(), 0);
-        return true;
+    int result = connect(fd, (struct sockaddr*)&serverAddr, sizeof(serverAddr));
+    if (result < 0 && errno != EINPROGRESS) {
+        finishProbe(target, false);
+        return;
     }
     
-    return false;
+    loop.add(fd, EPOLLOUT, [this, target](uint32_t events) { onProbeEvent(target, events); });
+    target->timer = loop.runAfter(settings.timeoutMs, [this, target]() {
+        target->timer = 0;
+        finishProbe(target, false);
+    });
 }
 
-void LoadBalancer::handleClient(int clientSocket, const string& clientIP) {
-    totalRequests++;
-    
-    char buffer[8192] = {0};
-    ssize_t bytesRead = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
-    
-    if (bytesRead <= 0) {
-        close(clientSocket);
-        return;
+void HealthChecker::onProbeEvent(Target* target, uint32_t events) {
+    if (!target->connected) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(target->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+            finishProbe(target, false);
+            return;
+        }
+        
+        target->connected = true;
+        if (target->request.empty()) {
+            finishProbe(target, true); // TCP check: connecting is enough
+            return;
+        }
     }
     
-    string rawRequest(buffer, bytesRead);
-    HttpRequest request = HttpRequest::parse(rawRequest);
-    
-    // Check for health endpoint
-    if (request.path == "/health") {
-        string response = generateHealthCheckResponse();
-        send(clientSocket, response.c_str(), response.length(), 0);
-        close(clientSocket);
-        logRequest(clientIP, request.method, request.path, 200, "health-check");
+    if (target->sent < target->request.size()) {
+        ssize_t n = send(target->fd, target->request.data() + target->sent,
+                         target->request.size() - target->sent, MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            finishProbe(target, false);
+            return;
+        }
+        if (n > 0) target->sent += n;
+        if (target->sent == target->request.size()) {
+            loop.modify(target->fd, EPOLLIN);
+        }
         return;
     }
     
-    // Serve index.html for root path
-    if (request.path == "/" || request.path == "/index.html") {
-        string indexHTML = R"(<!DOCTYPE html>
-<html>
-<head>
-<title>Order Processing</title>
-<link rel="stylesheet" href="https://maxcdn.bootstrapcdn.com/bootstrap/3.2.0/css/bootstrap.min.css" />
-<link rel="stylesheet" href="https://maxcdn.bootstrapcdn.com/bootstrap/3.2.0/css/bootstrap-theme.min.css" />
-<script src="https://maxcdn.bootstrapcdn.com/bootstrap/3.2.0/js/bootstrap.min.js"></script>
-</head>
-<body>
-<h1>Order Processing</h1>
-<div class="container">
-<div class="row">
-<div class="col-md-4"><a href="/customer/list.html">Customer</a></div>
-<div class="col-md-4">List / add / remove customers</div>
-</div>
-<div class="row">
-<div class="col-md-4"><a href="/catalog/list.html">Catalog</a></div>
-<div class="col-md-4">List / add / remove items</div>
-</div>
-<div class="row">
-<div class="col-md-4"><a href="/catalog/searchForm.html">Catalog</a></div>
-<div class="col-md-4">Search Items</div>
-</div>
-<div class="row">
-<div class="col-md-4"><a href="/order/">Order</a></div>
-<div class="col-md-4">Create an order</div>
-</div>
-</div>
-</body>
-</html>)";
-        
-        ostringstream response;
-        response << "HTTP/1.1 200 OK\r\n";
-        response << "Content-Type: text/html\r\n";
-        response << "Content-Length: " << indexHTML.length() << "\r\n";
-        response << "Connection: close\r\n";
-        response << "\r\n";
-        response << indexHTML;
-        
-        string responseStr = response.str();
-        send(clientSocket, responseStr.c_str(), responseStr.length(), 0);
-        close(clientSocket);
-        logRequest(clientIP, request.method, request.path, 200, "static-index");
+    char buffer[512];
+    ssize_t n = recv(target->fd, buffer, sizeof(buffer), 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (n <= 0) {
+        finishProbe(target, false);
         return;
     }
+    target->response.append(buffer, n);
     
-    // Match service by path
-    auto service = matchService(request.path);
-    if (!service) {
-        string response = "HTTP/1.1 404 Not Found\r\n\r\nService not found";
-        send(clientSocket, response.c_str(), response.length(), 0);
-        close(clientSocket);
-        failedRequests++;
-        logRequest(clientIP, request.method, request.path, 404, "no-service");
+    // Only the status line matters
+    size_t lineEnd = target->response.find("\r\n");
+    if (lineEnd == string::npos) {
+        if (target->response.size() > 1024) finishProbe(target, false);
         return;
     }
     
-    // Strip the service prefix from the path (like Nginx proxy_pass with trailing /)
-    // E.g., /catalog/list.html -> /list.html
-    string originalPath = request.path;
-    if (request.path.find(service->path) == 0) {
-        request.path = "/" + request.path.substr(service->path.length());
+    int status = 0;
+    string_view line(target->response.data(), lineEnd);
+    if (line.size() >= 12 && line.substr(0, 5) == "HTTP/") {
+        status = atoi(string(line.substr(9, 3)).c_str());
+    }
+    finishProbe(target, status == target->service->healthCheck.expectedStatus);
+}
+
+void HealthChecker::finishProbe(Target* target, bool passed) {
+    if (target->timer != 0) {
+        loop.cancel(target->timer);
+        target->timer = 0;
+    }
+    if (target->fd >= 0) {
+        loop.remove(target->fd);
+        close(target->fd);
+        target->fd = -1;
     }
     
-    // Select backend with retry logic
-    const int maxRetries = 3;
-    bool success = false;
+    const HealthCheckSettings& settings = target->service->healthCheck;
+    Backend& backend = *target->backend;
+    bool changed = false;
     
-    for (int attempt = 0; attempt < maxRetries && !success; attempt++) {
-        auto backend = service->selectBackend(clientIP);
-        
-        if (!backend) {
-            string response = "HTTP/1.1 503 Service Unavailable\r\n\r\nNo healthy backends";
-            send(clientSocket, response.c_str(), response.length(), 0);
-            failedRequests++;
-            logRequest(clientIP, request.method, originalPath, 503, "no-backend");
-            break;
+    if (passed) {
+        target->failures = 0;
+        if (++target->passes >= settings.rise) {
+            changed = backend.markProbeUp();
         }
-        
-        backend->activeConnections++;
-        
-        success = forwardRequest(clientSocket, request, backend, clientIP);
-        
-        if (success) {
-            backend->recordSuccess();
-            logRequest(clientIP, request.method, originalPath, 200, backend->name);
+    } else {
+        target->passes = 0;
+        if (++target->failures >= settings.fall) {
+            changed = backend.markProbeDown();
+        }
+    }
+    
+    if (changed) {
+        target->service->refreshSnapshot();
+    }
+    schedule(target, false);
+}
+
+// ==================== LoadBalancer Implementation ====================
+
+LoadBalancer::LoadBalancer(int port, int stats)
+    : listenPort(port), statsPort(stats), workerThreads(0),
+      keepAliveTimeoutMs(75000), maxKeepAliveRequests(1000), zeroCopyRelay(true),
+      running(false) {
+    healthChecker = make_unique<HealthChecker>(); // Intervals are per service
+    resolver = make_unique<DnsResolver>(5);         // Re-resolve every 5 seconds
+    accessLog = make_unique<AccessLog>();
+}
+
+LoadBalancer::~LoadBalancer() {
+    stop();
+}
+
+shared_ptr<ServiceConfig> LoadBalancer::findService(const string& path) {
+    lock_guard<mutex> lock(servicesMutex);
+    auto it = services.find(path);
+    return it != services.end() ? it->second : nullptr;
+}
+
+map<string, shared_ptr<ServiceConfig>> LoadBalancer::currentServices() {
+    lock_guard<mutex> lock(servicesMutex);
+    return services;
+}
+
+void LoadBalancer::setWorkerThreads(int count) {
+    workerThreads = count;
+}
+
+void LoadBalancer::setUpstreamPoolSettings(const PoolSettings& settings) {
+    poolSettings = settings;
+}
+
+void LoadBalancer::setZeroCopyRelay(bool enabled) {
+    zeroCopyRelay = enabled;
+}
+
+void LoadBalancer::setDrainTimeout(int seconds) {
+    drainTimeoutSeconds = seconds;
+}
+
+void LoadBalancer::setDrainDelay(int seconds) {
+    drainDelaySeconds = seconds;
+}
+
+void LoadBalancer::setHandoffSocket(const string& path) {
+    handoffPath = path;
+}
+
+void LoadBalancer::setClientKeepAlive(int timeoutSeconds, int maxRequests) {
+    keepAliveTimeoutMs = timeoutSeconds * 1000;
+    maxKeepAliveRequests = maxRequests;
+}
+
+void LoadBalancer::addService(const string& path, LoadBalancingAlgorithm algo) {
+    {
+        lock_guard<mutex> lock(servicesMutex);
+        services[path] = make_shared<ServiceConfig>(path, algo);
+    }
+    
+    lock_guard<mutex> lock(routesMutex);
+    publishRoutes(routes);
+}
+
+bool LoadBalancer::addRoute(const Route& route) {
+    lock_guard<mutex> lock(routesMutex);
+    vector<Route> next = routes;
+    next.push_back(route);
+    if (!publishRoutes(next)) return false;
+    routes = move(next);
+    return true;
+}
+
+bool LoadBalancer::setRoutes(const vector<Route>& newRoutes) {
+    lock_guard<mutex> lock(routesMutex);
+    if (!publishRoutes(newRoutes)) return false;
+    routes = newRoutes;
+    return true;
+}
+
+void LoadBalancer::setHealthCheck(const string& path, const HealthCheckSettings& settings) {
+    if (auto service = findService(path)) {
+        service->healthCheck = settings;
+    }
+}
+
+void LoadBalancer::setOutlierDetection(const string& path, const OutlierDetectionSettings& settings) {
+    if (auto service = findService(path)) {
+        service->outlierDetection = settings;
+    }
+}
+
+void LoadBalancer::setCircuitBreaker(const string& path, const CircuitBreakerSettings& settings) {
+    if (auto service = findService(path)) {
+        service->circuitBreaker = settings;
+    }
+}
+
+void LoadBalancer::setUpstreamTimeouts(const string& path, const UpstreamTimeoutSettings& settings) {
+    if (auto service = findService(path)) {
+        service->timeouts = settings;
+    }
+}
+
+void LoadBalancer::setRetryPolicy(const string& path, const RetryPolicySettings& settings) {
+    if (auto service = findService(path)) {
+        service->retryPolicy = settings;
+    }
+}
+
+void LoadBalancer::setSlowStart(const string& path, int seconds) {
+    if (auto service = findService(path)) {
+        service->slowStartSeconds = seconds;
+    }
+}
+
+bool LoadBalancer::setTls(const TlsSettings& settings) {
+    auto context = make_unique<TlsContext>(settings);
+    string error;
+    if (!context->load(error)) {
+        cerr << "[TLS] " << error << endl;
+        return false;
+    }
+    tls = move(context);
+    return true;
+}
+
+void LoadBalancer::setHttp2(const Http2Settings& settings) {
+    http2Settings = settings;
+}
+
+void LoadBalancer::setClientLimits(const RateLimitSettings& settings) {
+    clientLimits = make_unique<RateLimiter>(settings);
+}
+
+bool LoadBalancer::setAccessLog(const AccessLogSettings& settings) {
+    return accessLog->configure(settings);
+}
+
+void LoadBalancer::setCache(const string& path, const CacheSettings& settings) {
+    if (auto service = findService(path)) {
+        service->cache = make_unique<ResponseCache>(settings);
+    }
+}
+
+void LoadBalancer::setSingleFlight(const string& path, const SingleFlightSettings& settings) {
+    if (auto service = findService(path)) {
+        service->singleFlight = make_unique<SingleFlight>(settings);
+    }
+}
+
+void LoadBalancer::setRateLimit(const string& path, const RateLimitSettings& settings) {
+    if (auto service = findService(path)) {
+        service->rateLimit = make_unique<RateLimiter>(settings);
+    }
+}
+
+void LoadBalancer::setAdaptiveConcurrency(const string& path, const AdaptiveConcurrencySettings& settings) {
+    if (auto service = findService(path)) {
+        service->concurrencyLimit = make_unique<ConcurrencyLimiter>(settings);
+    }
+}
+
+void LoadBalancer::setRetryBudget(const string& path, const RetryBudgetSettings& settings) {
+    if (auto service = findService(path)) {
+        service->retryBudget = make_unique<RetryBudget>(settings);
+    }
+}
+
+void LoadBalancer::setHashKey(const string& path, HashKeySource source, const string& name) {
+    if (auto service = findService(path)) {
+        service->hashKeySource = source;
+        service->hashKeyName = name;
+    }
+}
+
+void LoadBalancer::addBackendToService(const string& path, const string& name,
+                                      const string& host, int port,
+                                      int maxFails, int failTimeout, int weight) {
+    if (auto service = findService(path)) {
+        addBackend(service, name, host, port, maxFails, failTimeout, weight);
+    }
+}
+
+void LoadBalancer::addBackendsFromDns(const string& path, const string& host, int port,
+                                     int maxFails, int failTimeout, int weight) {
+    if (auto service = findService(path)) {
+        watchDnsBackends(service, host, port, maxFails, failTimeout, weight);
+    }
+}
+
+void LoadBalancer::addBackend(const shared_ptr<ServiceConfig>& service, const string& name,
+                              const string& host, int port, int maxFails, int failTimeout, int weight) {
+    auto backend = make_shared<Backend>(name, host, port, maxFails, failTimeout, weight);
+    backend->pool.configure(poolSettings);
+    if (backend->address == 0) {
+        // A Service name: connect to its (first) current address
+        service->dnsWatches.push_back(resolver->watch(host, [backend](const DnsResolver::Addresses& addresses) {
+            backend->address = addresses.front();
+        }));
+    }
+    service->addBackend(backend);
+    healthChecker->addBackend(backend, service);
+}
+
+void LoadBalancer::watchDnsBackends(const shared_ptr<ServiceConfig>& service, const string& host, int port,
+                                    int maxFails, int failTimeout, int weight) {
+    PoolSettings pool = poolSettings;
+    HealthChecker* checker = healthChecker.get();
+    // The service's members from this watch, by address. Removed ones stay
+    // until dropped, so an address that comes back in time reuses its backend.
+    auto known = make_shared<map<uint32_t, weak_ptr<Backend>>>();
+    auto initial = make_shared<bool>(true);
+    
+    // The watch holds the service; retireService() drops it
+    service->dnsWatches.push_back(resolver->watch(host, [=](const DnsResolver::Addresses& addresses) {
+        int64_t now = chrono::steady_clock::now().time_since_epoch().count();
+        
+        for (uint32_t address : addresses) {
+            auto found = known->find(address);
+            if (found != known->end()) {
+                // A dropped one comes back as a new backend
+                auto backend = found->second.lock();
+                if (backend && service->restoreBackend(backend.get())) continue;
+            }
+            
+            string ip = DnsResolver::toString(address);
+            auto backend = make_shared<Backend>(host + "-" + ip, ip, port, maxFails, failTimeout, weight);
+            backend->pool.configure(pool);
+            if (!*initial) {
+                backend->upSince = now; // Slow start for pods that just appeared
+                cout << "[DNS] Discovered backend " << backend->name << endl;
+            }
+            (*known)[address] = backend;
+            service->addBackend(backend);
+            checker->addBackend(backend, service);
+        }
+        
+        for (auto it = known->begin(); it != known->end();) {
+            auto backend = it->second.lock();
+            if (!backend) {
+                it = known->erase(it); // dropped, and no request holds it
+                continue;
+            }
+            if (!binary_search(addresses.begin(), addresses.end(), it->first) && !backend->removed) {
+                backend->removedAt = now;
+                backend->removed = true;
+                cout << "[DNS] Backend " << backend->name << " removed" << endl;
+            }
+            ++it;
+        }
+        
+        *initial = false;
+        service->refreshSnapshot();
+    }));
+}
+
+// Called with routesMutex held. Leaves the current table in place if any
+// route does not compile.
+bool LoadBalancer::publishRoutes(const vector<Route>& explicitRoutes) {
+    auto activeServices = currentServices();
+    unique_ptr<RouteTable> next(new RouteTable());
+    string error;
+    for (const Route& route : explicitRoutes) {
+        auto service = activeServices.find(route.service);
+        if (service == activeServices.end()) {
+            cerr << "[ROUTER] Route " << route.path << " names unknown service " << route.service << endl;
+            return false;
+        }
+        if (!next->add(route, service->second, error)) {
+            cerr << "[ROUTER] " << error << endl;
+            return false;
+        }
+    }
+    // Like Nginx proxy_pass with a trailing /: /catalog/list.html -> /list.html
+    for (const auto& [path, service] : activeServices) {
+        Route route;
+        route.path = path;
+        route.service = path;
+        route.rewrite = "/";
+        next->add(route, service, error);
+    }
+    
+    routeTable.store(next.get(), memory_order_release);
+    
+    // A request holds the table only while it is matched
+    auto now = chrono::steady_clock::now();
+    if (currentRoutes) {
+        currentRoutes->retiredAt = now;
+        retiredRoutes.push_back(move(currentRoutes));
+    }
+    currentRoutes = move(next);
+    
+    auto grace = chrono::seconds(routeGracePeriodSeconds);
+    retiredRoutes.erase(
+        remove_if(retiredRoutes.begin(), retiredRoutes.end(),
+                  [&](const unique_ptr<RouteTable>& old) { return now - old->retiredAt >= grace; }),
+        retiredRoutes.end());
+    return true;
+}
+
+const CompiledRoute* LoadBalancer::matchRoute(const HttpHead& request, string_view path) {
+    const RouteTable* table = routeTable.load(memory_order_acquire);
+    return table ? table->match(request, path) : nullptr;
+}
+
+// ==================== Config File ====================
+
+bool LoadBalancer::loadConfigFile(const string& path) {
+    auto config = make_unique<LoadBalancerConfig>();
+    string error;
+    if (!::loadConfigFile(path, *config, error)) {
+        cerr << "[CONFIG] " << error << endl;
+        return false;
+    }
+    
+    listenPort = config->listenPort;
+    statsPort = config->statsPort;
+    workerThreads = config->workerThreads;
+    if (!setAccessLog(config->accessLog) || (config->tlsEnabled && !setTls(config->tls)) ||
+        !applyConfig(*config)) {
+        return false;
+    }
+    setHttp2(config->http2);
+    if (config->clientLimitsEnabled) {
+        setClientLimits(config->clientLimits);
+    }
+    
+    configPath = path;
+    startupConfig = move(config);
+    cout << "[CONFIG] Loaded " << path << endl;
+    return true;
+}
+
+bool LoadBalancer::reloadConfig() {
+    if (configPath.empty()) {
+        cerr << "[CONFIG] Not started from a config file; nothing to reload" << endl;
+        return false;
+    }
+    
+    LoadBalancerConfig config;
+    string error;
+    if (!::loadConfigFile(configPath, config, error)) {
+        cerr << "[CONFIG] Reload failed, keeping the running configuration: " << error << endl;
+        return false;
+    }
+    
+    const LoadBalancerConfig& startup = *startupConfig;
+    const AccessLogSettings& log = config.accessLog;
+    const TlsSettings& https = config.tls;
+    const RateLimitSettings& limits = config.clientLimits;
+    if (config.listenPort != startup.listenPort || config.statsPort != startup.statsPort ||
+        config.workerThreads != startup.workerThreads ||
+        log.format != startup.accessLog.format || log.path != startup.accessLog.path ||
+        log.sampleRate != startup.accessLog.sampleRate ||
+        log.bufferEntries != startup.accessLog.bufferEntries ||
+        log.flushIntervalMs != startup.accessLog.flushIntervalMs ||
+        config.tlsEnabled != startup.tlsEnabled || https.port != startup.tls.port ||
+        https.certificateFile != startup.tls.certificateFile ||
+        https.privateKeyFile != startup.tls.privateKeyFile ||
+        https.kernelOffload != startup.tls.kernelOffload ||
+        https.sessionTickets != startup.tls.sessionTickets ||
+        https.ticketKeyFile != startup.tls.ticketKeyFile ||
+        https.sessionCacheSize != startup.tls.sessionCacheSize ||
+        https.sessionTimeoutSeconds != startup.tls.sessionTimeoutSeconds ||
+        config.http2.enabled != startup.http2.enabled ||
+        config.http2.maxConcurrentStreams != startup.http2.maxConcurrentStreams ||
+        config.http2.initialWindowSize != startup.http2.initialWindowSize ||
+        config.http2.connectionWindowSize != startup.http2.connectionWindowSize ||
+        config.http2.maxBufferedBodyBytes != startup.http2.maxBufferedBodyBytes ||
+        config.http2.maxHeaderListBytes != startup.http2.maxHeaderListBytes ||
+        config.clientLimitsEnabled != startup.clientLimitsEnabled ||
+        limits.requestsPerSecond != startup.clientLimits.requestsPerSecond ||
+        limits.burst != startup.clientLimits.burst ||
+        limits.maxConcurrent != startup.clientLimits.maxConcurrent ||
+        limits.maxKeys != startup.clientLimits.maxKeys) {
+        cerr << "[CONFIG] listen_port, stats_port, worker_threads, access_log, tls, http2 and client_limits changes "
+             << "take effect on restart (certificate files are reloaded as they change)" << endl;
+    }
+    
+    if (!applyConfig(config)) {
+        cerr << "[CONFIG] Reload failed, keeping the running configuration" << endl;
+        return false;
+    }
+    return true;
+}
+
+bool LoadBalancer::applyConfig(const LoadBalancerConfig& config) {
+    // Validate the routes before anything is built, so a bad file changes nothing
+    set<string> paths;
+    for (const ServiceDefinition& definition : config.services) {
+        paths.insert(definition.path);
+    }
+    for (const Route& route : config.routes) {
+        string error;
+        if (!paths.count(route.service)) {
+            cerr << "[CONFIG] Route " << route.path << " names unknown service " << route.service << endl;
+            return false;
+        }
+        if (!RouteTable().add(route, nullptr, error)) {
+            cerr << "[CONFIG] " << error << endl;
+            return false;
+        }
+    }
+    
+    lock_guard<mutex> lock(configMutex);
+    keepAliveTimeoutMs = config.keepAliveTimeoutSeconds * 1000;
+    maxKeepAliveRequests = config.maxKeepAliveRequests;
+    zeroCopyRelay = config.zeroCopyRelay;
+    drainTimeoutSeconds = config.drainTimeoutSeconds;
+    drainDelaySeconds = config.drainDelaySeconds;
+    poolSettings = config.upstreamPool; // for the backends built below
+    
+    // New and changed services are built in full before any request sees them
+    map<string, shared_ptr<ServiceConfig>> previous = currentServices();
+    map<string, shared_ptr<ServiceConfig>> next;
+    int added = 0, changed = 0, unchanged = 0;
+    for (const ServiceDefinition& definition : config.services) {
+        auto current = previous.find(definition.path);
+        if (current != previous.end() && current->second->fingerprint == definition.fingerprint) {
+            next[definition.path] = current->second;
+            unchanged++;
+            continue;
+        }
+        (current == previous.end() ? added : changed)++;
+        next[definition.path] = buildService(definition);
+    }
+    
+    // One route table swap moves all new requests over at once
+    {
+        lock_guard<mutex> routesLock(routesMutex);
+        {
+            lock_guard<mutex> servicesLock(servicesMutex);
+            services = next;
+        }
+        publishRoutes(config.routes);
+        routes = config.routes;
+    }
+    
+    // Requests in flight hold their service, so a replaced one lives on
+    // until they finish; only its probes and DNS watches stop now
+    int removed = 0;
+    for (const auto& [path, service] : previous) {
+        auto kept = next.find(path);
+        if (kept != next.end() && kept->second == service) continue;
+        if (kept == next.end()) removed++;
+        retireService(service);
+    }
+    
+    cout << "[CONFIG] " << next.size() << " services (" << added << " added, " << changed
+         << " changed, " << removed << " removed, " << unchanged << " unchanged), "
+         << config.routes.size() << " routes" << endl;
+    return true;
+}
+
+shared_ptr<ServiceConfig> LoadBalancer::buildService(const ServiceDefinition& definition) {
+    auto service = make_shared<ServiceConfig>(definition.path, definition.algorithm);
+    service->fingerprint = definition.fingerprint;
+    service->hashKeySource = definition.hashKeySource;
+    service->hashKeyName = definition.hashKeyName;
+    service->healthCheck = definition.healthCheck;
+    service->outlierDetection = definition.outlierDetection;
+    service->circuitBreaker = definition.circuitBreaker;
+    service->timeouts = definition.timeouts;
+    service->retryPolicy = definition.retryPolicy;
+    service->slowStartSeconds = definition.slowStartSeconds;
+    if (definition.cacheEnabled) {
+        service->cache = make_unique<ResponseCache>(definition.cache);
+    }
+    if (definition.singleFlightEnabled) {
+        service->singleFlight = make_unique<SingleFlight>(definition.singleFlight);
+    }
+    if (definition.rateLimitEnabled) {
+        service->rateLimit = make_unique<RateLimiter>(definition.rateLimit);
+    }
+    if (definition.adaptiveConcurrencyEnabled) {
+        service->concurrencyLimit = make_unique<ConcurrencyLimiter>(definition.adaptiveConcurrency);
+    }
+    if (definition.retryBudgetEnabled) {
+        service->retryBudget = make_unique<RetryBudget>(definition.retryBudget);
+    }
+    
+    for (const BackendDefinition& backend : definition.backends) {
+        addBackend(service, backend.name, backend.host, backend.port,
+                   backend.maxFails, backend.failTimeout, backend.weight);
+    }
+    for (const DnsBackendDefinition& backend : definition.dnsBackends) {
+        watchDnsBackends(service, backend.host, backend.port,
+                         backend.maxFails, backend.failTimeout, backend.weight);
+    }
+    return service;
+}
+
+void LoadBalancer::retireService(const shared_ptr<ServiceConfig>& service) {
+    for (DnsResolver::WatchId id : service->dnsWatches) {
+        resolver->unwatch(id);
+    }
+    service->dnsWatches.clear();
+    healthChecker->removeService(service);
+}
+
+// Polls instead of using inotify, so editors that replace a file and
+// Kubernetes ConfigMap and Secret updates (a symlink swap) are all noticed
+void LoadBalancer::watchFiles() {
+    struct stat last;
+    bool known = !configPath.empty() && stat(configPath.c_str(), &last) == 0;
+    
+    unique_lock<mutex> lock(watcherMutex);
+    while (running) {
+        watcherWake.wait_for(lock, chrono::milliseconds(configPollIntervalMs), [this]() { return !running; });
+        if (!running) break;
+        lock.unlock();
+        
+        if (tls) {
+            tls->reloadIfChanged();
+        }
+        
+        struct stat current;
+        if (!configPath.empty() && stat(configPath.c_str(), &current) == 0 &&
+            !(known && current.st_dev == last.st_dev && current.st_ino == last.st_ino &&
+              current.st_size == last.st_size && current.st_mtim.tv_sec == last.st_mtim.tv_sec &&
+              current.st_mtim.tv_nsec == last.st_mtim.tv_nsec)) {
+            last = current;
+            known = true;
+            cout << "[CONFIG] " << configPath << " changed, reloading" << endl;
+            reloadConfig();
+        }
+        lock.lock();
+    }
+}
+
+// ==================== Worker Event Loop ====================
+
+int LoadBalancer::openListenSocket(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+    
+    // Every worker binds its own socket; the kernel spreads new connections
+    int opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+    
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    
+    if (bind(sock, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        cerr << "Bind failed on port " << port << endl;
+        close(sock);
+        return -1;
+    }
+    
+    if (listen(sock, SOMAXCONN) < 0) {
+        cerr << "Listen failed" << endl;
+        close(sock);
+        return -1;
+    }
+    
+    return sock;
+}
+
+void LoadBalancer::runWorker(Worker* worker) {
+    // Level-triggered so a full accept queue is drained over several passes
+    worker->loop.add(worker->listenSocket, EPOLLIN, [this, worker](uint32_t) {
+        acceptConnections(worker, false);
+    });
+    if (worker->tlsListenSocket >= 0) {
+        worker->loop.add(worker->tlsListenSocket, EPOLLIN, [this, worker](uint32_t) {
+            acceptConnections(worker, true);
+        });
+    }
+    
+    if (worker->id == 0) {
+        scheduleMaintenance(worker);
+    }
+    
+    worker->loop.run();
+    
+    // HTTP/2 streams are closed by their connection
+    vector<ClientConnection*> remaining;
+    for (auto& entry : worker->connections) {
+        if (!entry.second->parent) {
+            remaining.push_back(entry.second.get());
+        }
+    }
+    for (auto* conn : remaining) {
+        closeConnection(conn);
+    }
+    
+    if (worker->listenSocket >= 0) {
+        worker->loop.remove(worker->listenSocket);
+        close(worker->listenSocket);
+        worker->listenSocket = -1;
+    }
+    if (worker->tlsListenSocket >= 0) {
+        worker->loop.remove(worker->tlsListenSocket);
+        close(worker->tlsListenSocket);
+        worker->tlsListenSocket = -1;
+    }
+    
+    for (auto& idlePipe : worker->idlePipes) {
+        close(idlePipe.first);
+        close(idlePipe.second);
+    }
+    worker->idlePipes.clear();
+}
+
+void LoadBalancer::scheduleMaintenance(Worker* worker) {
+    worker->loop.runAfter(maintenanceIntervalMs, [this, worker]() {
+        runMaintenance();
+        scheduleMaintenance(worker);
+    });
+}
+
+void LoadBalancer::acceptConnections(Worker* worker, bool secure) {
+    const int maxAcceptsPerEvent = 64;
+    int listenSocket = secure ? worker->tlsListenSocket : worker->listenSocket;
+    
+    for (int i = 0; i < maxAcceptsPerEvent; i++) {
+        struct sockaddr_in clientAddr;
+        socklen_t clientLen = sizeof(clientAddr);
+        int clientSocket = accept4(listenSocket, (struct sockaddr*)&clientAddr,
+                                   &clientLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientSocket < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                cerr << "[ACCEPT] accept failed: " << strerror(errno) << endl;
+            }
+            return;
+        }
+        
+        int one = 1;
+        setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        
+        SSL* ssl = nullptr;
+        if (secure && !(ssl = tls->newConnection(clientSocket))) {
+            tls->failedHandshakes++;
+            close(clientSocket);
+            continue;
+        }
+        
+        char ipBuffer[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &clientAddr.sin_addr, ipBuffer, sizeof(ipBuffer));
+        
+        auto conn = make_unique<ClientConnection>(clientSocket, ipBuffer, worker);
+        conn->id = worker->nextConnectionId++;
+        if (ssl) {
+            conn->tls = ssl;
+            conn->state = ConnectionState::TLS_HANDSHAKE;
+        }
+        // Over the client's connection limit: kept just long enough to
+        // answer its first request with 429
+        if (clientLimits && !clientLimits->enter(conn->clientIP, conn->connectionSlot)) {
+            conn->overConnectionLimit = true;
+        }
+        ClientConnection* raw = conn.get();
+        worker->connections[clientSocket] = move(conn);
+        
+        // Registering an already-readable fd reports it immediately
+        worker->loop.add(clientSocket, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                         [this, raw](uint32_t events) { onClientEvent(raw, events); });
+        resetTimer(raw, ssl ? tlsHandshakeTimeoutMs : clientTimeoutMs);
+    }
+}
+
+// ==================== Drain and Handoff ====================
+
+void LoadBalancer::drain() {
+    // Listeners being passed to a successor must not be closed under it
+    lock_guard<mutex> lock(drainMutex);
+    if (draining.exchange(true)) return;
+    
+    // Health checkers (and load balancers in front) first see /health fail
+    // on new connections, rather than refused ones. A successor that took
+    // the listeners over is accepting already.
+    int delayMs = handedOver ? 0 : drainDelaySeconds * 1000;
+    int timeoutMs = drainTimeoutSeconds * 1000;
+    if (delayMs > 0) {
+        cout << "[DRAIN] Failing /health; closing the listeners in " << drainDelaySeconds << "s" << endl;
+    }
+    for (auto& worker : workers) {
+        Worker* w = worker.get();
+        w->loop.post([this, w, delayMs, timeoutMs]() {
+            w->loop.runAfter(delayMs, [this, w, timeoutMs]() {
+                if (w->id == 0) {
+                    cout << "[DRAIN] No longer accepting connections; waiting up to "
+                         << timeoutMs / 1000 << "s for requests in flight" << endl;
+                }
+                stopAccepting(w);
+                w->loop.runAfter(timeoutMs, [w]() {
+                    cout << "[DRAIN] Worker " << w->id << ": closing " << w->connections.size()
+                         << " connections at the deadline" << endl;
+                    w->loop.stop();
+                });
+                checkDrained(w);
+            });
+        });
+    }
+}
+
+void LoadBalancer::stopAccepting(Worker* worker) {
+    // A successor may still hold the sockets
+    for (int* listenSocket : {&worker->listenSocket, &worker->tlsListenSocket}) {
+        if (*listenSocket >= 0) {
+            worker->loop.remove(*listenSocket);
+            close(*listenSocket);
+            *listenSocket = -1;
+        }
+    }
+    
+    // Idle keep-alive connections would otherwise wait out their timeout
+    vector<ClientConnection*> idle;
+    for (auto& [fd, conn] : worker->connections) {
+        if (conn->state == ConnectionState::READING_REQUEST && conn->inBuffer.empty() && !conn->parent) {
+            idle.push_back(conn.get());
+        } else if (conn->http2) {
+            // GOAWAY: the streams already open finish, then it closes
+            conn->http2->goAway();
+            scheduleHttp2Flush(conn.get());
+        }
+    }
+    for (auto* conn : idle) {
+        closeConnection(conn);
+    }
+}
+
+void LoadBalancer::checkDrained(Worker* worker) {
+    if (draining && worker->listenSocket < 0 && worker->tlsListenSocket < 0 && worker->connections.empty() &&
+        worker->cacheRefreshes.empty()) {
+        worker->loop.stop();
+    }
+}
+
+// Hands the listeners to each new process that asks, until one takes over
+void LoadBalancer::serveHandoff() {
+    while (running && !draining) {
+        bool tookOver;
+        {
+            lock_guard<mutex> lock(drainMutex);
+            if (draining) break;
+            tookOver = handoff.serve(listeners, handoffPollIntervalMs);
+        }
+        if (tookOver) {
+            handedOver = true;
+            drain();
+        }
+    }
+    handoff.close(handedOver);
+}
+
+int LoadBalancer::openStatsSocket() {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+    
+    int opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    
+    struct sockaddr_in statsAddr;
+    memset(&statsAddr, 0, sizeof(statsAddr));
+    statsAddr.sin_family = AF_INET;
+    statsAddr.sin_addr.s_addr = INADDR_ANY;
+    statsAddr.sin_port = htons(statsPort);
+    
+    if (bind(sock, (struct sockaddr*)&statsAddr, sizeof(statsAddr)) < 0 || listen(sock, 10) < 0) {
+        cerr << "Stats server failed to listen on port " << statsPort << endl;
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Polls so a stop or handoff is noticed without a connection arriving.
+// /metrics stays up while draining; a successor serves it after a handoff.
+void LoadBalancer::serveStats(int statsSocket) {
+    fcntl(statsSocket, F_SETFL, fcntl(statsSocket, F_GETFL) | O_NONBLOCK);
+    while (running && !handedOver) {
+        struct pollfd pfd = {statsSocket, POLLIN, 0};
+        if (poll(&pfd, 1, handoffPollIntervalMs) <= 0) continue;
+        
+        // Accepted sockets are blocking again
+        int clientSocket = accept4(statsSocket, nullptr, nullptr, SOCK_CLOEXEC);
+        if (clientSocket >= 0) {
+            thread([this, clientSocket]() {
+                handleStatsRequest(clientSocket);
+            }).detach();
+        }
+    }
+    close(statsSocket);
+}
+
+// ==================== Client Connection State Machine ====================
+
+// Maps an SSL_read()/SSL_write() result onto the recv()/send() conventions
+static ssize_t tlsResult(SSL* ssl, int result) {
+    if (result > 0) return result;
+    
+    int error = SSL_get_error(ssl, result);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (error == SSL_ERROR_ZERO_RETURN) {
+        return 0; // close_notify
+    }
+    
+    // Fatal: the connection must not send close_notify on its way out
+    if (error != SSL_ERROR_SYSCALL || errno == 0 || errno == EAGAIN) {
+        errno = EPROTO;
+    }
+    ERR_clear_error();
+    SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    return -1;
+}
+
+ssize_t LoadBalancer::clientRecv(ClientConnection* conn, char* buffer, size_t length) {
+    if (conn->parent) {
+        // A stream's request is handed to it by its connection
+        errno = EAGAIN;
+        return -1;
+    }
+    if (!conn->tls) {
+        return recv(conn->clientSocket, buffer, length, 0);
+    }
+    return tlsResult(conn->tls, SSL_read(conn->tls, buffer, (int)min<size_t>(length, INT_MAX)));
+}
+
+ssize_t LoadBalancer::clientSend(ClientConnection* conn, const char* data, size_t length) {
+    if (conn->parent) {
+        // Into the session as DATA frames; its connection writes them out
+        size_t taken = conn->parent->http2->writeResponse(conn->streamId, data, length);
+        scheduleHttp2Flush(conn->parent);
+        if (taken == 0) {
+            errno = EAGAIN; // a WRITABLE event resumes it
+            return -1;
+        }
+        return taken;
+    }
+    if (!conn->tls) {
+        return send(conn->clientSocket, data, length, MSG_NOSIGNAL);
+    }
+    return tlsResult(conn->tls, SSL_write(conn->tls, data, (int)min<size_t>(length, INT_MAX)));
+}
+
+void LoadBalancer::continueHandshake(ClientConnection* conn) {
+    int result = SSL_do_handshake(conn->tls);
+    if (result != 1) {
+        if (tlsResult(conn->tls, result) < 0 && errno == EAGAIN) return;
+        tls->failedHandshakes++;
+        closeConnection(conn);
+        return;
+    }
+    
+    tls->recordHandshake(conn->tls);
+    if (TlsContext::selectedProtocol(conn->tls) == "h2") {
+        conn->http2 = make_unique<Http2Session>(http2Settings);
+        conn->http2->start();
+        startHttp2(conn);
+        return;
+    }
+    conn->state = ConnectionState::READING_REQUEST;
+    resetTimer(conn, clientTimeoutMs);
+    readRequest(conn);
+}
+
+void LoadBalancer::onClientEvent(ClientConnection* conn, uint32_t events) {
+    if (events & EPOLLERR) {
+        closeConnection(conn);
+        return;
+    }
+    
+    // A TLS write can be waiting for a record from the client
+    uint32_t writable = EPOLLOUT | EPOLLHUP;
+    if (conn->tls) {
+        writable |= EPOLLIN;
+    }
+    switch (conn->state) {
+        case ConnectionState::TLS_HANDSHAKE:
+            continueHandshake(conn);
+            break;
+        case ConnectionState::READING_REQUEST:
+            readRequest(conn);
+            break;
+        case ConnectionState::HTTP2:
+            readHttp2(conn);
+            break;
+        case ConnectionState::WRITING_RESPONSE:
+            if (events & writable) {
+                writeToClient(conn);
+            }
+            break;
+        case ConnectionState::RELAYING_RESPONSE:
+            if (events & writable) {
+                pumpRelay(conn);
+            }
+            break;
+        default:
+            // Backend exchange in progress; a fully closed client aborts it
+            if (events & EPOLLHUP) {
+                closeConnection(conn);
+            }
+            break;
+    }
+}
+
+void LoadBalancer::readRequest(ClientConnection* conn) {
+    char buffer[8192];
+    bool peerClosed = false;
+    bool progress = false;
+    
+    while (true) {
+        ssize_t bytesRead = clientRecv(conn, buffer, sizeof(buffer));
+        if (bytesRead > 0) {
+            conn->inBuffer.append(buffer, bytesRead);
+            progress = true;
+            continue;
+        }
+        if (bytesRead == 0) {
+            peerClosed = true;
+            break;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        
+        closeConnection(conn);
+        return;
+    }
+    
+    if (progress) {
+        resetTimer(conn, clientTimeoutMs);
+    }
+    
+    // h2c with prior knowledge: the client opens with the HTTP/2 preface
+    if (http2Settings.enabled && conn->requestsServed == 0 && !conn->requestHeadParsed && !conn->parent &&
+        Http2Session::isPreface(conn->inBuffer)) {
+        conn->http2 = make_unique<Http2Session>(http2Settings);
+        conn->http2->start();
+        startHttp2(conn);
+        return;
+    }
+    
+    int error = parseRequest(conn);
+    if (error == 431) {
+        conn->closeAfterWrite = true;
+        sendSimpleResponse(conn, 431, "Request Header Fields Too Large", "");
+        return;
+    }
+    if (error == 413) {
+        conn->closeAfterWrite = true;
+        sendSimpleResponse(conn, 413, "Payload Too Large", "");
+        return;
+    }
+    if (error != 0) {
+        conn->closeAfterWrite = true;
+        sendSimpleResponse(conn, 400, "Bad Request", "");
+        return;
+    }
+    
+    if (!conn->requestComplete) {
+        if (peerClosed) {
+            closeConnection(conn);
+        }
+        return;
+    }
+    
+    // A half-closed client still gets its (last) response
+    if (peerClosed) {
+        conn->clientKeepAlive = false;
+    } else if (http2Settings.enabled && conn->requestsServed == 0 && !conn->tls && !conn->parent &&
+               upgradeToHttp2(conn)) {
+        return;
+    }
+    handleClient(conn);
+}
+
+// Frames the next request in inBuffer. Returns 0, or an HTTP error status.
+int LoadBalancer::parseRequest(ClientConnection* conn) {
+    string& data = conn->inBuffer;
+    
+    if (!conn->requestHeadParsed) {
+        // Tolerate stray CRLFs between pipelined requests
+        size_t start = data.find_first_not_of("\r\n");
+        if (start == string::npos) {
+            data.clear();
+            conn->requestParser.reset();
+            return 0;
+        }
+        if (start > 0) {
+            data.erase(0, start);
+            conn->requestParser.reset();
+        }
+        
+        switch (conn->requestParser.parse(data.data(), data.size(), conn->request)) {
+            case HttpParser::Result::INCOMPLETE:
+                return 0;
+            case HttpParser::Result::TOO_LARGE:
+                conn->request.clear();
+                return 431;
+            case HttpParser::Result::INVALID:
+                conn->request.clear();
+                return 400;
+            case HttpParser::Result::COMPLETE:
+                break;
+        }
+        
+        if (!requestFraming(conn->request, conn->requestFramer)) {
+            return 400;
+        }
+        if (conn->requestFramer.mode == BodyFramer::Mode::CONTENT_LENGTH &&
+            conn->requestFramer.remaining > maxRequestBodyBytes) {
+            return 413;
+        }
+        
+        conn->clientKeepAlive = conn->request.keepAlive();
+        conn->requestHeadParsed = true;
+        conn->requestBase = data.data();
+        conn->requestBodyStart = conn->request.length;
+        conn->requestScanned = conn->request.length;
+    }
+    
+    if (!conn->requestFramer.complete) {
+        conn->requestScanned += conn->requestFramer.consume(
+            data.data() + conn->requestScanned, data.size() - conn->requestScanned);
+        if (conn->requestFramer.error) {
+            return 400;
+        }
+        if (conn->requestScanned - conn->requestBodyStart > maxRequestBodyBytes) {
+            return 413;
+        }
+        if (!conn->requestFramer.complete) {
+            return 0;
+        }
+    }
+    
+    // The request stays at the front of inBuffer (pipelined ones follow it)
+    // until it is answered; re-point the head if the body grew the buffer.
+    conn->request.rebase(conn->requestBase, data.data());
+    conn->requestBody = string_view(data.data() + conn->requestBodyStart,
+                                    conn->requestScanned - conn->requestBodyStart);
+    conn->requestLength = conn->requestScanned;
+    conn->requestComplete = true;
+    return 0;
+}
+
+void LoadBalancer::handleClient(ClientConnection* conn) {
+    totalRequests++;
+    conn->requestsServed++;
+    
+    const HttpHead& request = conn->request;
+    const string& clientIP = conn->clientIP;
+    string_view target = request.target;
+    string_view path = target.substr(0, target.find('?'));
+    string_view query = target.substr(path.size());
+    
+    if (conn->requestsServed >= maxKeepAliveRequests || !running || draining) {
+        conn->clientKeepAlive = false;
+    }
+    conn->closeAfterWrite = !conn->clientKeepAlive;
+    
+    // Check for health endpoint; failing it while draining takes this
+    // instance out of rotation
+    if (path == "/health") {
+        if (draining) {
+            logRequest(conn, 503, "health-check");
+            sendSimpleResponse(conn, 503, "Service Unavailable", "draining\n");
+            return;
+        }
+        logRequest(conn, 200, "health-check");
+        sendSimpleResponse(conn, 200, "OK", "healthy\n");
+        return;
+    }
+    
+    // Serve index.html for root path
+    if (path == "/" || path == "/index.html") {
+        string indexHTML = R"(<!DOCTYPE html>
+<html>
+<head>
+<title>Order Processing</title>
+<link rel="stylesheet" href="https://maxcdn.bootstrapcdn.com/bootstrap/3.2.0/css/bootstrap.min.css" />
+<link rel="stylesheet" href="https://maxcdn.bootstrapcdn.com/bootstrap/3.2.0/css/bootstrap-theme.min.css" />
+<script src="https://maxcdn.bootstrapcdn.com/bootstrap/3.2.0/js/bootstrap.min.js"></script>
+</head>
+<body>
+<h1>Order Processing</h1>
+<div class="container">
+<div class="row">
+<div class="col-md-4"><a href="/customer/list.html">Customer</a></div>
+<div class="col-md-4">List / add / remove customers</div>
+</div>
+<div class="row">
+<div class="col-md-4"><a href="/catalog/list.html">Catalog</a></div>
+<div class="col-md-4">List / add / remove items</div>
+</div>
+<div class="row">
+<div class="col-md-4"><a href="/catalog/searchForm.html">Catalog</a></div>
+<div class="col-md-4">Search Items</div>
+</div>
+<div class="row">
+<div class="col-md-4"><a href="/order/">Order</a></div>
+<div class="col-md-4">Create an order</div>
+</div>
+</div>
+</body>
+</html>)";
+        
+        logRequest(conn, 200, "static-index");
+        sendSimpleResponse(conn, 200, "OK", indexHTML, "text/html");
+        return;
+    }
+    
+    if (clientLimits && rejectOverLimit(conn, nullptr)) {
+        return;
+    }
+    
+    const CompiledRoute* route = matchRoute(request, path);
+    if (!route) {
+        failedRequests++;
+        logRequest(conn, 404, "no-service");
+        sendSimpleResponse(conn, 404, "Not Found", "Service not found");
+        return;
+    }
+    shared_ptr<ServiceConfig> service = route->service;
+    if (service->rateLimit && rejectOverLimit(conn, service)) {
+        return;
+    }
+    string upstreamTarget = route->upstreamTarget(path, query);
+    
+    // Rewrite only what changes: the request target, the hop-by-hop headers
+    // (ours to set; keep the upstream socket warm) and the proxy headers
+    string& out = conn->upstreamRequest;
+    out.clear();
+    out.append(request.method).append(" ").append(upstreamTarget);
+    out.append(" ").append(request.version).append("\r\n");
+    appendHeaders(request, {"Connection", "Keep-Alive", "Proxy-Connection",
+                            "X-Real-IP", "X-Forwarded-For", "X-Forwarded-Proto"}, out);
+    out.append("X-Real-IP: ").append(clientIP).append("\r\n");
+    out.append("X-Forwarded-For: ").append(clientIP).append("\r\n");
+    bool secure = conn->tls || (conn->parent && conn->parent->tls);
+    out.append(secure ? "X-Forwarded-Proto: https\r\n" : "X-Forwarded-Proto: http\r\n");
+    out.append("Connection: keep-alive\r\n\r\n");
+    out.append(conn->requestBody);
+    
+    conn->service = service;
+    conn->attempt = 0;
+    
+    if (service->cache && serveFromCache(conn, true)) {
+        return;
+    }
+    if (service->singleFlight && joinFlight(conn)) {
+        return;
+    }
+    
+    tryNextBackend(conn);
+}
+
+// Admission control, before any backend work: the client limits when
+// service is null, otherwise the service's rate limit
+bool LoadBalancer::rejectOverLimit(ClientConnection* conn, const shared_ptr<ServiceConfig>& service) {
+    int retryAfter;
+    if (service) {
+        RateLimiter& limiter = *service->rateLimit;
+        retryAfter = limiter.admit(limiter.keyFor(conn->request, conn->clientIP), conn->requestSlot);
+    } else if ((conn->parent ? conn->parent : conn)->overConnectionLimit) {
+        conn->clientKeepAlive = false;
+        conn->closeAfterWrite = true;
+        retryAfter = 1;
+    } else {
+        retryAfter = clientLimits->takeToken(conn->clientIP);
+    }
+    if (retryAfter == 0) return false;
+    
+    failedRequests++;
+    logRequest(conn, 429, "rate-limited");
+    if (service) {
+        service->traffic.recordStatus(429);
+    }
+    sendSimpleResponse(conn, 429, "Too Many Requests", "Too many requests\n", "text/plain",
+                       "Retry-After: " + to_string(retryAfter) + "\r\n");
+    return true;
+}
+
+// Locally generated response, framed so the connection can stay open
+void LoadBalancer::sendSimpleResponse(ClientConnection* conn, int statusCode,
+                                      const string& reason, const string& body,
+                                      const string& contentType, const string& extraHeaders) {
+    string response;
+    response.reserve(128 + extraHeaders.size() + body.size());
+    response.append("HTTP/1.1 ").append(to_string(statusCode)).append(" ").append(reason);
+    response.append("\r\nContent-Type: ").append(contentType);
+    response.append("\r\nContent-Length: ").append(to_string(body.size())).append("\r\n");
+    response.append(extraHeaders);
+    if (conn->closeAfterWrite) {
+        response.append("Connection: close\r\n");
+    } else if (conn->request.version == "HTTP/1.0") {
+        response.append("Connection: keep-alive\r\n");
+    }
+    response.append("\r\n");
+    if (conn->request.method != "HEAD") {
+        response.append(body);
+    }
+    sendResponse(conn, response);
+}
+
+// May close (and free) conn, so callers must not touch it afterwards
+void LoadBalancer::sendResponse(ClientConnection* conn, const string& response) {
+    conn->outBuffer = response;
+    conn->outOffset = 0;
+    conn->state = ConnectionState::WRITING_RESPONSE;
+    resetTimer(conn, clientTimeoutMs);
+    writeToClient(conn);
+}
+
+// Returns 1 once outBuffer is fully sent, 0 if the client would block,
+// -1 on a socket error
+int LoadBalancer::flushClientBuffer(ClientConnection* conn) {
+    while (conn->outOffset < conn->outBuffer.size()) {
+        ssize_t sent = clientSend(conn, conn->outBuffer.data() + conn->outOffset,
+                                  conn->outBuffer.size() - conn->outOffset);
+        if (sent > 0) {
+            conn->outOffset += sent;
+            continue;
+        }
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0; // wait for EPOLLOUT
+        }
+        return -1;
+    }
+    
+    conn->outBuffer.clear();
+    conn->outOffset = 0;
+    return 1;
+}
+
+void LoadBalancer::writeToClient(ClientConnection* conn) {
+    int flushed = flushClientBuffer(conn);
+    if (flushed < 0) {
+        closeConnection(conn);
+        return;
+    }
+    if (flushed > 0) {
+        finishResponse(conn);
+    }
+}
+
+// The response is fully sent: close, or go back for the next request
+void LoadBalancer::finishResponse(ClientConnection* conn) {
+    releaseCacheFill(conn);
+    releaseFlight(conn, false);
+    releasePermit(conn);
+    
+    // One request per stream
+    if (conn->parent) {
+        conn->parent->http2->endResponse(conn->streamId);
+        closeConnection(conn);
+        return;
+    }
+    
+    if (conn->closeAfterWrite || draining) {
+        closeConnection(conn);
+        return;
+    }
+    
+    // Keep-alive: wait for the next request on this connection
+    conn->resetRequest();
+    if (conn->inBuffer.empty()) {
+        resetTimer(conn, keepAliveTimeoutMs);
+        readRequest(conn);
+        return;
+    }
+    
+    // A pipelined request is already buffered; pick it up on the next loop
+    // pass instead of recursing through the state machine once per request
+    EventLoop& loop = conn->worker->loop;
+    if (conn->timer) {
+        loop.cancel(conn->timer);
+    }
+    conn->timer = loop.runAfter(0, [this, conn]() {
+        conn->timer = 0;
+        resetTimer(conn, clientTimeoutMs);
+        readRequest(conn);
+    });
+}
+
+void LoadBalancer::closeConnection(ClientConnection* conn) {
+    Worker* worker = conn->worker;
+    
+    releaseCacheFill(conn);
+    releaseFlight(conn, false);
+    releasePermit(conn);
+    
+    if (conn->timer) {
+        worker->loop.cancel(conn->timer);
+        conn->timer = 0;
+    }
+    releaseBackend(conn);
+    
+    int clientSocket = conn->clientSocket;
+    if (conn->parent) {
+        // A stream has no socket: the session ends it, or resets it if its
+        // response was cut short
+        ClientConnection* parent = conn->parent;
+        parent->http2->releaseRequestBody(conn->http2BodyHeld);
+        parent->http2->closeStream(conn->streamId);
+        parent->streams.erase(conn->streamId);
+        scheduleHttp2Flush(parent);
+    } else {
+        // Streams go with their connection (which needs no flush any more)
+        conn->http2FlushPosted = true;
+        vector<ClientConnection*> streams;
+        for (auto& entry : conn->streams) {
+            streams.push_back(entry.second);
+        }
+        for (auto* stream : streams) {
+            closeConnection(stream);
+        }
+        
+        // Best effort close_notify; the socket is closed either way
+        if (conn->tls) {
+            if (SSL_is_init_finished(conn->tls) && SSL_shutdown(conn->tls) < 0) {
+                ERR_clear_error();
+            }
+            SSL_free(conn->tls);
+            conn->tls = nullptr;
+        }
+        
+        worker->loop.remove(clientSocket);
+        close(clientSocket);
+    }
+    
+    // Destroys conn
+    worker->connections.erase(clientSocket);
+    checkDrained(worker);
+}
+
+void LoadBalancer::resetTimer(ClientConnection* conn, int timeoutMs) {
+    EventLoop& loop = conn->worker->loop;
+    if (conn->timer) {
+        loop.cancel(conn->timer);
+    }
+    conn->timer = loop.runAfter(timeoutMs, [this, conn]() {
+        conn->timer = 0;
+        onTimeout(conn);
+    });
+}
+
+void LoadBalancer::onTimeout(ClientConnection* conn) {
+    switch (conn->state) {
+        case ConnectionState::CONNECTING_BACKEND:
+        case ConnectionState::SENDING_REQUEST:
+        case ConnectionState::READING_RESPONSE:
+            if (chrono::steady_clock::now() >= conn->deadline) {
+                sendGatewayTimeout(conn);
+                break;
+            }
+            if (conn->state == ConnectionState::CONNECTING_BACKEND) {
+                conn->service->recordConnectError(conn->backend);
+            }
+            failForward(conn, true);
+            break;
+        case ConnectionState::RETRY_BACKOFF:
+            tryNextBackend(conn);
+            break;
+        case ConnectionState::WAITING_FOR_CACHE:
+            // The fetch we waited for is taking too long; make our own
+            tryNextBackend(conn);
+            break;
+        case ConnectionState::WAITING_FOR_FLIGHT:
+            conn->service->singleFlight->fallbacks++;
+            tryNextBackend(conn);
+            break;
+        case ConnectionState::WAITING_FOR_PERMIT:
+            // Queued as long as allowed, unless a permit was handed over
+            // just now (its wake-up then finds the request moved on)
+            if (conn->service->concurrencyLimit->cancel({conn->worker, conn->clientSocket, conn->id})) {
+                conn->service->concurrencyLimit->shed++;
+                shedRequest(conn);
+            } else {
+                conn->holdsPermit = true;
+                tryNextBackend(conn);
+            }
+            break;
+        case ConnectionState::RELAYING_RESPONSE:
+            // Stalled on a slow client, or on a backend that stopped mid-body
+            if (conn->outOffset < conn->outBuffer.size() || conn->pipeBytes > 0) {
+                closeConnection(conn);
+            } else {
+                abortRelay(conn);
+            }
+            break;
+        case ConnectionState::HTTP2:
+            // Idle with no streams: GOAWAY, and close if the client has not
+            // gone by the next timeout
+            if (!conn->streams.empty()) {
+                resetTimer(conn, keepAliveTimeoutMs);
+            } else if (conn->http2->goingAway()) {
+                closeConnection(conn);
+            } else {
+                conn->http2->goAway();
+                resetTimer(conn, clientTimeoutMs);
+                flushHttp2(conn);
+            }
+            break;
+        default:
+            closeConnection(conn);
+            break;
+    }
+}
+
+// ==================== HTTP/2 Front End ====================
+
+// The connection now speaks HTTP/2 through conn->http2
+void LoadBalancer::startHttp2(ClientConnection* conn) {
+    conn->state = ConnectionState::HTTP2;
+    http2Connections++;
+    resetTimer(conn, keepAliveTimeoutMs);
+    readHttp2(conn);
+}
+
+// "Upgrade: h2c" on the first request of a plain connection (RFC 7540
+// section 3.2); the request is answered as stream 1. One with a body stays
+// on HTTP/1.1, which the RFC allows and which spares re-framing the body.
+bool LoadBalancer::upgradeToHttp2(ClientConnection* conn) {
+    const HttpHead& request = conn->request;
+    string_view settings = request.header("HTTP2-Settings");
+    if (!request.headerHasToken("Upgrade", "h2c") || !request.headerHasToken("Connection", "HTTP2-Settings") ||
+        settings.empty() || !conn->requestBody.empty()) {
+        return false;
+    }
+    
+    string upgraded;
+    upgraded.append(request.method).append(" ").append(request.target).append(" HTTP/1.1\r\n");
+    appendHeaders(request, {"Connection", "Upgrade", "HTTP2-Settings", "Keep-Alive", "Proxy-Connection",
+                            "Transfer-Encoding", "Content-Length"}, upgraded);
+    upgraded.append("Connection: close\r\n\r\n");
+    
+    auto session = make_unique<Http2Session>(http2Settings);
+    if (!session->startUpgraded(settings, move(upgraded), request.method == "HEAD")) {
+        return false; // a malformed HTTP2-Settings header means no upgrade
+    }
+    
+    // Whatever follows the request (the client preface) is HTTP/2 already
+    conn->resetRequest();
+    conn->http2 = move(session);
+    startHttp2(conn);
+    return true;
+}
+
+// Feeds what the client sent to the session and acts on the result
+void LoadBalancer::readHttp2(ClientConnection* conn) {
+    Http2Session& session = *conn->http2;
+    bool progress = false;
+    bool valid = true;
+    
+    // Bytes that came in before the switch
+    if (!conn->inBuffer.empty()) {
+        valid = session.receive(conn->inBuffer.data(), conn->inBuffer.size());
+        conn->inBuffer.clear();
+        progress = true;
+    }
+    
+    char buffer[16384];
+    while (valid) {
+        // What the client sends may need answering; while it does not
+        // read the answers, the rest waits in the socket
+        if (session.outputFull()) {
+            conn->http2ReadPaused = true;
+            break;
+        }
+        ssize_t bytesRead = clientRecv(conn, buffer, sizeof(buffer));
+        if (bytesRead > 0) {
+            valid = session.receive(buffer, bytesRead);
+            progress = true;
+            continue;
+        }
+        if (bytesRead == 0) {
+            closeConnection(conn);
+            return;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        
+        closeConnection(conn);
+        return;
+    }
+    
+    if (progress && conn->streams.empty()) {
+        resetTimer(conn, keepAliveTimeoutMs);
+    }
+    runHttp2Events(conn);
+    flushHttp2(conn);
+}
+
+// Hands requests, request bodies, resets and window openings to the
+// streams. Never closes conn itself.
+void LoadBalancer::runHttp2Events(ClientConnection* conn) {
+    // A stream finishing can free room for others, queuing more events
+    while (true) {
+        vector<Http2Session::Event> events = conn->http2->takeEvents();
+        if (events.empty()) return;
+        
+        for (auto& event : events) {
+            if (event.type == Http2Session::EventType::REQUEST) {
+                openStream(conn, event.streamId, event.data);
+                continue;
+            }
+            auto it = conn->streams.find(event.streamId);
+            if (it == conn->streams.end()) {
+                if (event.type == Http2Session::EventType::REQUEST_BODY) {
+                    conn->http2->releaseRequestBody(event.data.size());
+                }
+                continue;
+            }
+            ClientConnection* stream = it->second;
+            
+            switch (event.type) {
+                case Http2Session::EventType::REQUEST_BODY:
+                    // Past the end of the request only if it was rejected early
+                    if (stream->state == ConnectionState::READING_REQUEST) {
+                        stream->http2BodyHeld += event.data.size();
+                        stream->inBuffer.append(event.data);
+                        readRequest(stream);
+                    } else {
+                        conn->http2->releaseRequestBody(event.data.size());
+                    }
+                    break;
+                case Http2Session::EventType::RESET:
+                    http2StreamResets++;
+                    closeConnection(stream);
+                    break;
+                case Http2Session::EventType::WRITABLE:
+                    onClientEvent(stream, EPOLLOUT);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+}
+
+void LoadBalancer::openStream(ClientConnection* conn, uint32_t streamId, string& request) {
+    Worker* worker = conn->worker;
+    
+    // Keys below zero can never collide with a socket
+    int key = worker->nextStreamKey;
+    while (worker->connections.count(key)) {
+        key = key == INT_MIN ? -1 : key - 1;
+    }
+    worker->nextStreamKey = key == INT_MIN ? -1 : key - 1;
+    
+    auto stream = make_unique<ClientConnection>(key, conn->clientIP, worker);
+    stream->id = worker->nextConnectionId++;
+    stream->parent = conn;
+    stream->streamId = streamId;
+    stream->inBuffer = move(request);
+    ClientConnection* raw = stream.get();
+    worker->connections[key] = move(stream);
+    conn->streams[streamId] = raw;
+    http2Streams++;
+    
+    resetTimer(raw, clientTimeoutMs);
+    readRequest(raw);
+}
+
+// Writes out the frames the session queued; closes the connection once
+// the session is done, or broken and its GOAWAY sent
+void LoadBalancer::flushHttp2(ClientConnection* conn) {
+    Http2Session& session = *conn->http2;
+    
+    while (true) {
+        string_view pending = session.pendingOutput();
+        if (pending.empty()) break;
+        ssize_t sent = clientSend(conn, pending.data(), pending.size());
+        if (sent > 0) {
+            session.consumed(sent);
+            continue;
+        }
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break; // EPOLLOUT resumes it
+        
+        closeConnection(conn);
+        return;
+    }
+    
+    // Output drained: streams held back by it write again
+    runHttp2Events(conn);
+    
+    if (session.pendingOutput().empty() && (session.failed() || session.finished())) {
+        closeConnection(conn);
+        return;
+    }
+    
+    // Edge-triggered: what was left in the socket brings no new event
+    if (conn->http2ReadPaused && !session.outputFull()) {
+        conn->http2ReadPaused = false;
+        Worker* worker = conn->worker;
+        int fd = conn->clientSocket;
+        uint64_t id = conn->id;
+        worker->loop.runAfter(0, [this, worker, fd, id]() {
+            auto it = worker->connections.find(fd);
+            if (it == worker->connections.end() || it->second->id != id) return;
+            readHttp2(it->second.get());
+        });
+    }
+}
+
+// Streams write into the session from deep inside their own state
+// machines; the frames go out on the next loop pass, together
+void LoadBalancer::scheduleHttp2Flush(ClientConnection* conn) {
+    if (conn->http2FlushPosted) return;
+    conn->http2FlushPosted = true;
+    
+    Worker* worker = conn->worker;
+    int fd = conn->clientSocket;
+    uint64_t id = conn->id;
+    worker->loop.runAfter(0, [this, worker, fd, id]() {
+        auto it = worker->connections.find(fd);
+        if (it == worker->connections.end() || it->second->id != id) return;
+        it->second->http2FlushPosted = false;
+        flushHttp2(it->second.get());
+    });
+}
+
+// ==================== Backend Side ====================
+
+// Safe to send again after a backend may have acted on it: the idempotent
+// methods (RFC 9110, 9.2.2), or a request the client vouches for with an
+// Idempotency-Key
+static bool isReplayable(const HttpHead& request) {
+    static const string_view methods[] = {"GET", "HEAD", "OPTIONS", "TRACE", "PUT", "DELETE"};
+    for (string_view method : methods) {
+        if (request.method == method) return true;
+    }
+    return !request.header("Idempotency-Key").empty();
+}
+
+void LoadBalancer::tryNextBackend(ClientConnection* conn) {
+    // Retries reuse the permit of the first attempt
+    if (conn->attempt == 0 && conn->service->concurrencyLimit && !acquirePermit(conn)) {
+        return;
+    }
+    
+    // Whether a retry may happen at all was settled by retryRequest()
+    if (conn->attempt > 0) {
+        conn->service->traffic.addRetry();
+    } else {
+        int totalTimeoutMs = conn->service->timeouts.totalTimeoutMs;
+        conn->deadline = totalTimeoutMs > 0
+            ? chrono::steady_clock::now() + chrono::milliseconds(totalTimeoutMs)
+            : chrono::steady_clock::time_point::max();
+        if (conn->service->retryBudget) {
+            conn->service->retryBudget->recordRequest();
+        }
+    }
+    conn->attempt++;
+    
+    // Another backend than the ones that failed, unless none is left
+    Backend* backend = conn->service->selectUntried(conn->clientIP, conn->request, conn->triedBackends);
+    if (!backend && !conn->triedBackends.empty()) {
+        backend = conn->service->selectBackend(conn->clientIP, conn->request);
+    }
+    if (!backend) {
+        failedRequests++;
+        logRequest(conn, 503, "no-backend");
+        conn->service->traffic.recordStatus(503);
+        sendSimpleResponse(conn, 503, "Service Unavailable", "No healthy backends");
+        return;
+    }
+    
+    // Circuit breaker: shed at once rather than pile onto a saturated backend
+    const CircuitBreakerSettings& limits = conn->service->circuitBreaker;
+    if (backend->activeConnections.load(memory_order_relaxed) >= limits.maxRequests ||
+        backend->pendingConnects.load(memory_order_relaxed) >= limits.maxPendingConnects) {
+        backend->circuitOverflows++;
+        failedRequests++;
+        logRequest(conn, 503, backend->name, "-circuit-open");
+        conn->service->traffic.recordStatus(503);
+        sendSimpleResponse(conn, 503, "Service Unavailable", "Backend overloaded");
+        return;
+    }
+    
+    conn->backend = backend;
+    conn->triedBackends.push_back(backend);
+    backend->activeConnections++;
+    
+    scheduleHedge(conn);
+    forwardRequest(conn, true);
+}
+
+// Starts a non-blocking connect on a reserved pool slot. Returns the
+// socket, or -1 with the slot given back.
+int LoadBalancer::connectBackend(Backend* backend) {
+    ConnectionPool& pool = backend->pool;
+    
+    struct sockaddr_in serverAddr;
+    if (!backend->resolveAddress(serverAddr)) {
+        pool.discard(-1);
+        return -1;
+    }
+    
+    int backendSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (backendSocket < 0) {
+        pool.discard(-1);
+        return -1;
+    }
+    
+    int one = 1;
+    setsockopt(backendSocket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    
+    if (connect(backendSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0 &&
+        errno != EINPROGRESS) {
+        pool.discard(backendSocket);
+        return -1;
+    }
+    
+    return backendSocket;
+}
+
+void LoadBalancer::forwardRequest(ClientConnection* conn, bool reuseIdle) {
+    Backend& backend = *conn->backend;
+    
+    conn->upstreamOffset = 0;
+    conn->beginAttempt(chrono::steady_clock::now());
+    
+    int idleSocket = reuseIdle ? backend.pool.acquire() : -1;
+    conn->backendReused = idleSocket >= 0;
+    
+    if (conn->backendReused) {
+        conn->backendSocket = idleSocket;
+        conn->state = ConnectionState::SENDING_REQUEST;
+    } else {
+        if (!backend.pool.reserve()) {
+            // Our own connection cap, not a backend fault: shed the request
+            failedRequests++;
+            logRequest(conn, 503, backend.name, "-pool-full");
+            conn->service->traffic.recordStatus(503);
+            releaseBackend(conn);
+            sendSimpleResponse(conn, 503, "Service Unavailable", "Backend connection limit reached");
+            return;
+        }
+        conn->backendSocket = connectBackend(conn->backend);
+        if (conn->backendSocket < 0) {
+            conn->service->recordConnectError(conn->backend);
+            failForward(conn);
+            return;
+        }
+        conn->state = ConnectionState::CONNECTING_BACKEND;
+        conn->connectPending = true;
+        backend.pendingConnects++;
+    }
+    
+    conn->worker->loop.add(conn->backendSocket, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                           [this, conn](uint32_t events) { onBackendEvent(conn, events); });
+    const UpstreamTimeoutSettings& timeouts = conn->service->timeouts;
+    resetTimer(conn, attemptTimeoutMs(conn, conn->backendReused ? timeouts.readTimeoutMs
+                                                                : timeouts.connectTimeoutMs));
+    
+    if (conn->backendReused) {
+        sendToBackend(conn);
+    }
+}
+
+void LoadBalancer::onBackendEvent(ClientConnection* conn, uint32_t events) {
+    switch (conn->state) {
+        case ConnectionState::CONNECTING_BACKEND: {
+            if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) break;
+            
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(conn->backendSocket, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (error != 0) {
+                conn->service->recordConnectError(conn->backend);
+                failForward(conn);
+                return;
+            }
+            
+            conn->connectPending = false;
+            conn->backend->pendingConnects--;
+            conn->backend->traffic.recordConnect(chrono::duration<double, milli>(
+                chrono::steady_clock::now() - conn->forwardStart).count());
+            conn->state = ConnectionState::SENDING_REQUEST;
+            resetTimer(conn, attemptTimeoutMs(conn, conn->service->timeouts.readTimeoutMs));
+            sendToBackend(conn);
+            break;
+        }
+        case ConnectionState::SENDING_REQUEST:
+            if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+                sendToBackend(conn);
+            }
+            break;
+        case ConnectionState::READING_RESPONSE:
+            readFromBackend(conn);
+            break;
+        case ConnectionState::RELAYING_RESPONSE:
+            pumpRelay(conn);
+            break;
+        default:
+            break;
+    }
+}
+
+void LoadBalancer::sendToBackend(ClientConnection* conn) {
+    const string& data = conn->upstreamRequest;
+    
+    while (conn->upstreamOffset < data.size()) {
+        ssize_t sent = send(conn->backendSocket, data.data() + conn->upstreamOffset,
+                            data.size() - conn->upstreamOffset, MSG_NOSIGNAL);
+        if (sent > 0) {
+            conn->upstreamOffset += sent;
+            totalBytesSent += sent;
+            conn->backend->traffic.addBytesOut(sent);
+            continue;
+        }
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return; // wait for EPOLLOUT
+        }
+        
+        onBackendClosed(conn);
+        return;
+    }
+    
+    conn->state = ConnectionState::READING_RESPONSE;
+    resetTimer(conn, attemptTimeoutMs(conn, conn->service->timeouts.readTimeoutMs));
+    readFromBackend(conn);
+}
+
+void LoadBalancer::readFromBackend(ClientConnection* conn) {
+    char buffer[8192];
+    bool progress = false;
+    
+    while (true) {
+        ssize_t bytesRead = recv(conn->backendSocket, buffer, sizeof(buffer), 0);
+        if (bytesRead > 0) {
+            conn->upstreamResponse.append(buffer, bytesRead);
+            totalBytesReceived += bytesRead;
+            conn->backend->traffic.addBytesIn(bytesRead);
+            conn->upstreamBytes += bytesRead;
+            progress = true;
+            dropHedge(conn, false); // this backend answered first
+            
+            if (!frameResponse(conn)) {
+                failForward(conn);
+                return;
+            }
+            if (conn->responseHeadParsed) {
+                startRelay(conn);
+                return;
+            }
+            continue;
+        }
+        if (bytesRead == 0) {
+            onBackendClosed(conn);
+            return;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        
+        onBackendClosed(conn);
+        return;
+    }
+    
+    if (progress) {
+        resetTimer(conn, attemptTimeoutMs(conn, conn->service->timeouts.readTimeoutMs));
+    }
+}
+
+bool LoadBalancer::frameResponse(ClientConnection* conn) {
+    string& data = conn->upstreamResponse;
+    
+    while (!conn->responseHeadParsed) {
+        size_t headStart = conn->responseScanned;
+        HttpHead& head = conn->responseHead;
+        
+        auto result = conn->responseParser.parse(data.data() + headStart,
+                                                 data.size() - headStart, head);
+        if (result == HttpParser::Result::INCOMPLETE) {
+            return true;
+        }
+        if (result != HttpParser::Result::COMPLETE) {
+            return false;
+        }
+        conn->responseScanned = headStart + head.length;
+        conn->responseParser.reset();
+        
+        // Interim 1xx responses are relayed as-is; the final head follows
+        if (head.statusCode < 200 && head.statusCode != 101) {
+            continue;
+        }
+        
+        if (!responseFraming(head, conn->request.method == "HEAD", conn->responseFramer)) {
+            return false;
+        }
+        conn->responseHeadStart = headStart;
+        conn->responseHeadParsed = true;
+        double latencyMs = chrono::duration<double, milli>(
+            chrono::steady_clock::now() - conn->forwardStart).count();
+        conn->upstreamLatencyMs = latencyMs;
+        conn->backend->recordLatency(latencyMs);
+        conn->service->recordResponse(conn->backend, head.statusCode, latencyMs);
+        conn->backend->traffic.recordStatus(head.statusCode);
+        conn->backend->traffic.recordResponse(latencyMs);
+        if (conn->holdsPermit) {
+            conn->service->concurrencyLimit->recordLatency(latencyMs);
+        }
+        conn->upstreamKeepAlive = head.keepAlive();
+    }
+    
+    if (!conn->responseFramer.complete) {
+        conn->responseScanned += conn->responseFramer.consume(
+            data.data() + conn->responseScanned, data.size() - conn->responseScanned);
+        if (conn->responseFramer.error) {
+            return false;
+        }
+    }
+    
+    // Bytes past the end of the response mean the socket is out of sync
+    if (conn->responseFramer.complete && conn->responseScanned < data.size()) {
+        conn->upstreamKeepAlive = false;
+        data.resize(conn->responseScanned);
+    }
+    return true;
+}
+
+void LoadBalancer::onBackendClosed(ClientConnection* conn) {
+    if (conn->upstreamResponse.empty() && conn->backendReused && isReplayable(conn->request)) {
+        // The backend timed out the idle socket just as we reused it;
+        // not a backend failure, so retry once on a fresh connection.
+        closeBackendSocket(conn, false);
+        forwardRequest(conn, false);
+        return;
+    }
+    
+    // Nothing has reached the client yet, so this attempt can be retried
+    failForward(conn);
+}
+
+void LoadBalancer::failForward(ClientConnection* conn, bool timedOut) {
+    if (conn->backend->recordFailure()) {
+        conn->service->refreshSnapshot();
+    }
+    conn->backend->traffic.addFailure();
+    if (conn->holdsPermit) {
+        conn->service->concurrencyLimit->recordDrop();
+    }
+    failedRequests++;
+    if (timedOut) {
+        logRequest(conn, 504, conn->backend->name, "-timeout");
+    } else {
+        logRequest(conn, 502, conn->backend->name, "-failed");
+    }
+    
+    // A connect failure (or a send that got nothing through) left the
+    // backend unaware of the request
+    bool requestSent = conn->upstreamOffset > 0;
+    unique_ptr<HedgedAttempt> hedge = move(conn->hedge);
+    releaseBackend(conn);
+    if (hedge) {
+        // Already on its way elsewhere: it takes over as the attempt
+        adoptHedge(conn, move(hedge));
+        return;
+    }
+    retryRequest(conn, requestSent, timedOut);
+}
+
+void LoadBalancer::closeBackendSocket(ClientConnection* conn, bool reusable) {
+    if (conn->backendSocket < 0) return;
+    
+    if (conn->connectPending) {
+        conn->connectPending = false;
+        conn->backend->pendingConnects--;
+    }
+    
+    conn->worker->loop.remove(conn->backendSocket);
+    conn->backend->pool.release(conn->backendSocket, reusable);
+    conn->backendSocket = -1;
+}
+
+void LoadBalancer::releaseBackend(ClientConnection* conn) {
+    dropHedge(conn, false);
+    closeBackendSocket(conn, false);
+    releasePipe(conn);
+    if (conn->backend) {
+        conn->backend->activeConnections--;
+        conn->backend = nullptr;
+    }
+    conn->upstreamResponse.clear();
+}
+
+void LoadBalancer::runMaintenance() {
+    for (const auto& [path, service] : currentServices()) {
+        for (const auto& backend : service->dropRemovedBackends()) {
+            healthChecker->removeBackend(backend);
+        }
+        for (const auto& backend : service->members()) {
+            backend->pool.evictExpired();
+        }
+        // Picks up health checker verdicts and expired fail timeouts/ejections
+        service->evaluateOutliers();
+        service->refreshSnapshot();
+    }
+}
+
+// ==================== Retries and Hedging ====================
+
+// After a failed attempt: another one after a jittered pause, if the
+// request may be repeated and maxRetries, the retry budget and the
+// request's deadline leave room for it. Otherwise the last attempt's
+// failure is the answer: 504 if it timed out, 502 if it failed.
+void LoadBalancer::retryRequest(ClientConnection* conn, bool requestSent, bool timedOut) {
+    RetryBudget* budget = conn->service->retryBudget.get();
+    if (conn->attempt >= maxRetries || (requestSent && !isReplayable(conn->request)) ||
+        (budget && !budget->allowRetry())) {
+        if (timedOut) {
+            conn->service->traffic.recordStatus(504);
+            sendSimpleResponse(conn, 504, "Gateway Timeout", "Backend timeout");
+        } else {
+            conn->service->traffic.recordStatus(502);
+            sendSimpleResponse(conn, 502, "Bad Gateway", "Backend error");
+        }
+        return;
+    }
+    
+    // Full jitter, so requests that failed together do not retry together
+    const RetryPolicySettings& policy = conn->service->retryPolicy;
+    int delayMs = 0;
+    if (policy.backoffBaseMs > 0) {
+        int64_t ceiling = min<int64_t>(policy.backoffMaxMs,
+                                       (int64_t)policy.backoffBaseMs << min(conn->attempt - 1, 20));
+        delayMs = uniform_int_distribution<int>(0, (int)max<int64_t>(0, ceiling))(conn->worker->random);
+    }
+    if (chrono::steady_clock::now() + chrono::milliseconds(delayMs) >= conn->deadline) {
+        sendGatewayTimeout(conn);
+        return;
+    }
+    if (delayMs == 0) {
+        tryNextBackend(conn);
+        return;
+    }
+    conn->state = ConnectionState::RETRY_BACKOFF;
+    resetTimer(conn, delayMs);
+}
+
+int LoadBalancer::attemptTimeoutMs(const ClientConnection* conn, int timeoutMs) const {
+    if (conn->deadline == chrono::steady_clock::time_point::max()) return timeoutMs;
+    int64_t remainingMs = chrono::ceil<chrono::milliseconds>(
+        conn->deadline - chrono::steady_clock::now()).count();
+    return (int)clamp<int64_t>(remainingMs, 0, timeoutMs);
+}
+
+// The request's deadline passed before any backend answered
+void LoadBalancer::sendGatewayTimeout(ClientConnection* conn) {
+    conn->service->deadlineExceeded++;
+    if (conn->holdsPermit) {
+        conn->service->concurrencyLimit->recordDrop();
+    }
+    failedRequests++;
+    if (conn->backend) {
+        logRequest(conn, 504, conn->backend->name, "-timeout");
+    } else {
+        logRequest(conn, 504, "timeout");
+    }
+    conn->service->traffic.recordStatus(504);
+    releaseBackend(conn);
+    sendSimpleResponse(conn, 504, "Gateway Timeout", "Backend timeout");
+}
+
+// Arms the hedge of a GET/HEAD whose attempt just started: once it has
+// gone unanswered for the backend's usual (percentile) latency
+void LoadBalancer::scheduleHedge(ClientConnection* conn) {
+    const RetryPolicySettings& policy = conn->service->retryPolicy;
+    if (!policy.hedge || conn->hedge || conn->attempt >= maxRetries ||
+        (conn->request.method != "GET" && conn->request.method != "HEAD")) {
+        return;
+    }
+    // Without recent latencies (or beyond the last bucket) there is no
+    // telling what slow is
+    int delayMs = conn->backend->outlier.latencyPercentileMs(policy.hedgePercentile);
+    if (delayMs == 0 || delayMs == INT_MAX) return;
+    delayMs = max(delayMs, policy.hedgeMinDelayMs);
+    if (chrono::steady_clock::now() + chrono::milliseconds(delayMs) >= conn->deadline) return;
+    
+    EventLoop& loop = conn->worker->loop;
+    if (conn->hedgeTimer) {
+        loop.cancel(conn->hedgeTimer);
+    }
+    conn->hedgeTimer = loop.runAfter(delayMs, [this, conn]() {
+        conn->hedgeTimer = 0;
+        startHedge(conn);
+    });
+}
+
+void LoadBalancer::startHedge(ClientConnection* conn) {
+    // Only while the attempt still waits for its first byte
+    bool unanswered = conn->state == ConnectionState::CONNECTING_BACKEND ||
+                      conn->state == ConnectionState::SENDING_REQUEST ||
+                      (conn->state == ConnectionState::READING_RESPONSE && conn->upstreamBytes == 0);
+    if (!unanswered || conn->hedge || conn->attempt >= maxRetries) return;
+    
+    ServiceConfig& service = *conn->service;
+    Backend* backend = service.selectUntried(conn->clientIP, conn->request, conn->triedBackends);
+    if (!backend ||
+        backend->activeConnections.load(memory_order_relaxed) >= service.circuitBreaker.maxRequests ||
+        backend->pendingConnects.load(memory_order_relaxed) >= service.circuitBreaker.maxPendingConnects ||
+        (service.retryBudget && !service.retryBudget->allowRetry())) {
+        return;
+    }
+    
+    auto hedge = make_unique<HedgedAttempt>();
+    hedge->backend = backend;
+    hedge->started = chrono::steady_clock::now();
+    hedge->fd = backend->pool.acquire();
+    hedge->reused = hedge->fd >= 0;
+    if (hedge->reused) {
+        hedge->state = ConnectionState::SENDING_REQUEST;
+    } else {
+        if (!backend->pool.reserve()) return;
+        hedge->fd = connectBackend(backend);
+        if (hedge->fd < 0) {
+            service.recordConnectError(backend);
+            return;
+        }
+        hedge->connectPending = true;
+        backend->pendingConnects++;
+    }
+    backend->activeConnections++;
+    conn->triedBackends.push_back(backend);
+    conn->attempt++;
+    service.hedges++;
+    
+    // Writable (or connected) at once, which starts the send
+    int fd = hedge->fd;
+    conn->hedge = move(hedge);
+    conn->worker->loop.add(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                           [this, conn](uint32_t events) { onHedgeEvent(conn, events); });
+}
+
+void LoadBalancer::onHedgeEvent(ClientConnection* conn, uint32_t events) {
+    if (!conn->hedge) return;
+    HedgedAttempt& hedge = *conn->hedge;
+    
+    if (hedge.state == ConnectionState::CONNECTING_BACKEND) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+        
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(hedge.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0) {
+            conn->service->recordConnectError(hedge.backend);
+            dropHedge(conn, true);
+            return;
+        }
+        hedge.connectPending = false;
+        hedge.backend->pendingConnects--;
+        hedge.backend->traffic.recordConnect(chrono::duration<double, milli>(
+            chrono::steady_clock::now() - hedge.started).count());
+        hedge.state = ConnectionState::SENDING_REQUEST;
+    }
+    
+    if (hedge.state == ConnectionState::SENDING_REQUEST) {
+        const string& data = conn->upstreamRequest;
+        while (hedge.sent < data.size()) {
+            ssize_t sent = send(hedge.fd, data.data() + hedge.sent, data.size() - hedge.sent, MSG_NOSIGNAL);
+            if (sent > 0) {
+                hedge.sent += sent;
+                totalBytesSent += sent;
+                hedge.backend->traffic.addBytesOut(sent);
+                continue;
+            }
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            
+            dropHedge(conn, !hedge.reused); // a reused socket may just have gone stale
+            return;
+        }
+        hedge.state = ConnectionState::READING_RESPONSE;
+    }
+    
+    // The first response byte wins the race; a close or reset loses it
+    char byte;
+    ssize_t peeked = recv(hedge.fd, &byte, 1, MSG_PEEK);
+    if (peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (peeked <= 0) {
+        dropHedge(conn, !hedge.reused);
+        return;
+    }
+    
+    conn->service->hedgesWon++;
+    unique_ptr<HedgedAttempt> winner = move(conn->hedge);
+    releaseBackend(conn); // the slower attempt, through no fault of its backend
+    adoptHedge(conn, move(winner));
+}
+
+// The hedge becomes the connection's attempt, where it stands
+void LoadBalancer::adoptHedge(ClientConnection* conn, unique_ptr<HedgedAttempt> hedge) {
+    EventLoop& loop = conn->worker->loop;
+    loop.remove(hedge->fd);
+    
+    conn->backend = hedge->backend;
+    conn->backendSocket = hedge->fd;
+    conn->backendReused = hedge->reused;
+    conn->connectPending = hedge->connectPending;
+    conn->upstreamOffset = hedge->sent;
+    conn->beginAttempt(hedge->started);
+    conn->state = hedge->state;
+    
+    // Registering again reports what is pending (a response byte) at once
+    loop.add(conn->backendSocket, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+             [this, conn](uint32_t events) { onBackendEvent(conn, events); });
+    const UpstreamTimeoutSettings& timeouts = conn->service->timeouts;
+    resetTimer(conn, attemptTimeoutMs(conn, conn->state == ConnectionState::CONNECTING_BACKEND
+                                                ? timeouts.connectTimeoutMs
+                                                : timeouts.readTimeoutMs));
+}
+
+// Cancels a pending hedge and closes one in flight. failed: its backend
+// let it down, rather than it losing the race.
+void LoadBalancer::dropHedge(ClientConnection* conn, bool failed) {
+    if (conn->hedgeTimer) {
+        conn->worker->loop.cancel(conn->hedgeTimer);
+        conn->hedgeTimer = 0;
+    }
+    if (!conn->hedge) return;
+    
+    HedgedAttempt& hedge = *conn->hedge;
+    Backend* backend = hedge.backend;
+    if (failed) {
+        if (backend->recordFailure()) {
+            conn->service->refreshSnapshot();
+        }
+        backend->traffic.addFailure();
+    }
+    if (hedge.connectPending) {
+        backend->pendingConnects--;
+    }
+    conn->worker->loop.remove(hedge.fd);
+    backend->pool.release(hedge.fd, false);
+    backend->activeConnections--;
+    conn->hedge.reset();
+}
+
+// ==================== Streaming Response Relay ====================
+
+void LoadBalancer::startRelay(ClientConnection* conn) {
+    BodyFramer& framer = conn->responseFramer;
+    
+    // The client only learns where a close-delimited body ends from the close
+    if (framer.mode == BodyFramer::Mode::UNTIL_CLOSE) {
+        conn->closeAfterWrite = true;
+    }
+    
+    const char* connection = nullptr;
+    if (conn->closeAfterWrite) {
+        connection = "close";
+    } else if (conn->request.version == "HTTP/1.0") {
+        connection = "keep-alive";
+    }
+    
+    // Forward the head with only the hop-by-hop headers replaced; body
+    // bytes that arrived together with it go out in the same write
+    const HttpHead& head = conn->responseHead;
+    const string& data = conn->upstreamResponse;
+    size_t bodyStart = conn->responseHeadStart + head.length;
+    
+    string& out = conn->outBuffer;
+    out.clear();
+    out.append(data, 0, conn->responseHeadStart);
+    out.append(head.startLine).append("\r\n");
+    appendHeaders(head, {"Connection", "Keep-Alive", "Proxy-Connection"}, out);
+    if (connection) {
+        out.append("Connection: ").append(connection).append("\r\n");
+    }
+    out.append("\r\n");
+    out.append(data, bodyStart, string::npos);
+    conn->outOffset = 0;
+    
+    // A cacheable response, or one identical requests wait for, is copied
+    // aside as it streams past
+    if (!conn->cacheKey.empty()) {
+        conn->cacheFill = conn->service->cache->prepare(
+            head, framer.mode != BodyFramer::Mode::UNTIL_CLOSE, time(nullptr));
+        if (conn->cacheFill) {
+            conn->cacheFill->varyValues = ResponseCache::varyValuesOf(conn->request, conn->cacheFill->varyNames);
+        }
+    }
+    if (conn->flightLeader) {
+        conn->flightFill = SingleFlight::capture(head, framer.mode != BodyFramer::Mode::UNTIL_CLOSE);
+    }
+    captureResponse(conn, data.data() + bodyStart, data.size() - bodyStart);
+    conn->upstreamResponse.clear();
+    
+    // The body needs no inspection unless it is chunked, so let the kernel
+    // move it socket -> pipe -> socket without copying through user space.
+    // A TLS client qualifies only if the kernel encrypts for it (kTLS).
+    bool lengthOnly = framer.mode == BodyFramer::Mode::CONTENT_LENGTH ||
+                      framer.mode == BodyFramer::Mode::UNTIL_CLOSE;
+    bool plainSocket = !conn->parent && (!conn->tls || TlsContext::kernelSend(conn->tls));
+    conn->useSplice = zeroCopyRelay && lengthOnly && plainSocket && !framer.complete &&
+                      !conn->cacheFill && !conn->flightFill && acquirePipe(conn);
+    
+    // The request's deadline is met; from here only stalls end it
+    conn->state = ConnectionState::RELAYING_RESPONSE;
+    resetTimer(conn, conn->service->timeouts.readTimeoutMs);
+    pumpRelay(conn);
+}
+
+// Moves body bytes backend -> client until one side would block. Only
+// reads from the backend once the client has taken everything queued,
+// so each connection buffers at most relayChunkBytes.
+void LoadBalancer::pumpRelay(ClientConnection* conn) {
+    BodyFramer& framer = conn->responseFramer;
+    bool progress = false;
+    
+    while (true) {
+        int flushed = flushClientBuffer(conn);
+        if (flushed < 0) {
+            closeConnection(conn);
+            return;
+        }
+        if (flushed == 0) break;
+        
+        if (conn->pipeBytes > 0) {
+            ssize_t moved = splice(conn->pipeRead, nullptr, conn->clientSocket, nullptr,
+                                   conn->pipeBytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved > 0) {
+                conn->pipeBytes -= moved;
+                progress = true;
+                continue;
+            }
+            if (moved < 0 && errno == EINTR) continue;
+            if (moved < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            
+            closeConnection(conn);
+            return;
+        }
+        
+        if (framer.complete) {
+            finishRelay(conn);
+            return;
+        }
+        
+        ssize_t bytesRead;
+        if (conn->useSplice) {
+            size_t want = relayChunkBytes;
+            if (framer.mode == BodyFramer::Mode::CONTENT_LENGTH) {
+                want = min<uint64_t>(want, framer.remaining);
+            }
+            bytesRead = splice(conn->backendSocket, nullptr, conn->pipeWrite, nullptr,
+                               want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (bytesRead > 0) {
+                conn->pipeBytes += bytesRead;
+                // Length-only framing never looks at the bytes themselves
+                framer.consume(nullptr, bytesRead);
+            }
+        } else {
+            conn->outBuffer.resize(relayChunkBytes);
+            bytesRead = recv(conn->backendSocket, &conn->outBuffer[0], relayChunkBytes, 0);
+            if (bytesRead > 0) {
+                size_t used = framer.consume(conn->outBuffer.data(), bytesRead);
+                if (framer.error) {
+                    abortRelay(conn);
+                    return;
+                }
+                if (used < (size_t)bytesRead) {
+                    conn->upstreamKeepAlive = false; // trailing bytes after the body
+                }
+                conn->outBuffer.resize(used);
+                captureResponse(conn, conn->outBuffer.data(), used);
+            } else {
+                conn->outBuffer.clear();
+            }
+        }
+        
+        if (bytesRead > 0) {
+            totalBytesReceived += bytesRead;
+            conn->backend->traffic.addBytesIn(bytesRead);
+            conn->upstreamBytes += bytesRead;
+            progress = true;
+            continue;
+        }
+        if (bytesRead == 0) {
+            // EOF ends a close-delimited body; anything else was truncated
+            if (framer.mode == BodyFramer::Mode::UNTIL_CLOSE) {
+                framer.complete = true;
+                conn->upstreamKeepAlive = false;
+                continue;
+            }
+            abortRelay(conn);
+            return;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        
+        abortRelay(conn);
+        return;
+    }
+    
+    if (progress) {
+        resetTimer(conn, conn->service->timeouts.readTimeoutMs);
+    }
+}
+
+void LoadBalancer::finishRelay(ClientConnection* conn) {
+    conn->backend->recordSuccess();
+    logRequest(conn, conn->responseHead.statusCode, conn->backend->name);
+    conn->service->traffic.recordStatus(conn->responseHead.statusCode);
+    fillCache(conn);
+    releaseCacheFill(conn);
+    releaseFlight(conn, true);
+    
+    bool reusable = conn->upstreamKeepAlive &&
+                    conn->responseFramer.mode != BodyFramer::Mode::UNTIL_CLOSE;
+    closeBackendSocket(conn, reusable);
+    releaseBackend(conn);
+    
+    finishResponse(conn);
+}
+
+// Part of the response is already with the client, so there is nothing
+// left to retry: drop the connection so the client sees the truncation.
+void LoadBalancer::abortRelay(ClientConnection* conn) {
+    if (conn->backend->recordFailure()) {
+        conn->service->refreshSnapshot();
+    }
+    conn->backend->traffic.addFailure();
+    failedRequests++;
+    logRequest(conn, conn->responseHead.statusCode, conn->backend->name, "-aborted");
+    conn->service->traffic.recordStatus(conn->responseHead.statusCode);
+    closeConnection(conn);
+}
+
+bool LoadBalancer::acquirePipe(ClientConnection* conn) {
+    Worker* worker = conn->worker;
+    
+    if (!worker->idlePipes.empty()) {
+        conn->pipeRead = worker->idlePipes.back().first;
+        conn->pipeWrite = worker->idlePipes.back().second;
+        worker->idlePipes.pop_back();
+        return true;
+    }
+    
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return false;
+    }
+    conn->pipeRead = fds[0];
+    conn->pipeWrite = fds[1];
+    return true;
+}
+
+void LoadBalancer::releasePipe(ClientConnection* conn) {
+    if (conn->pipeRead < 0) return;
+    
+    // A pipe still holding bytes from an aborted relay cannot be reused
+    Worker* worker = conn->worker;
+    if (conn->pipeBytes == 0 && worker->idlePipes.size() < maxIdlePipes) {
+        worker->idlePipes.emplace_back(conn->pipeRead, conn->pipeWrite);
+    } else {
+        close(conn->pipeRead);
+        close(conn->pipeWrite);
+    }
+    conn->pipeRead = -1;
+    conn->pipeWrite = -1;
+    conn->pipeBytes = 0;
+    conn->useSplice = false;
+}
+
+// ==================== Response Cache ====================
+
+// Answers the request from the service cache, or parks it behind an
+// in-flight fetch of the same key. False means forward it; the response
+// is then captured if the request may fill the cache.
+bool LoadBalancer::serveFromCache(ClientConnection* conn, bool coalesce) {
+    ResponseCache& cache = *conn->service->cache;
+    const HttpHead& request = conn->request;
+    
+    bool mayServe = false;
+    bool mayStore = false;
+    if (!ResponseCache::cacheableRequest(request, mayServe, mayStore)) {
+        return false;
+    }
+    string key = ResponseCache::keyFor(conn->service->path, request);
+    if (mayStore) {
+        conn->cacheKey = key;
+    }
+    if (!mayServe) {
+        return false;
+    }
+    
+    int64_t now = time(nullptr);
+    CacheWaiter waiter{conn->worker, conn->clientSocket, conn->id};
+    auto found = cache.lookup(key, request, now, coalesce && mayStore, waiter);
+    
+    switch (found.result) {
+        case ResponseCache::Result::HIT:
+        case ResponseCache::Result::STALE: {
+            bool stale = found.result == ResponseCache::Result::STALE;
+            // One background refresh per stale entry, however many clients hit it
+            if (stale && mayStore && !found.entry->revalidating.exchange(true)) {
+                startCacheRefresh(conn, found.entry);
+            }
+            
+            const char* connection = nullptr;
+            if (conn->closeAfterWrite) {
+                connection = "close";
+            } else if (request.version == "HTTP/1.0") {
+                connection = "keep-alive";
+            }
+            int status = found.entry->statusCode;
+            logRequest(conn, status, stale ? "cache-stale" : "cache-hit");
+            conn->service->traffic.recordStatus(status);
+            sendResponse(conn, ResponseCache::render(*found.entry, now, stale ? "STALE" : "HIT",
+                                                     connection, request.method == "HEAD"));
+            return true;
+        }
+        case ResponseCache::Result::WAIT:
+            conn->state = ConnectionState::WAITING_FOR_CACHE;
+            resetTimer(conn, cache.settings().coalesceWaitMs);
+            return true;
+        default:
+            conn->cacheLeader = found.leader;
+            return false;
+    }
+}
+
+// The fetch this client waited for has ended, stored or not
+void LoadBalancer::resumeCacheWaiter(ClientConnection* conn) {
+    if (!serveFromCache(conn, false)) {
+        tryNextBackend(conn);
+    }
+}
+
+// Copies relayed body bytes into the cache and single-flight captures,
+// dropping a capture once the response outgrows its limit
+void LoadBalancer::captureResponse(ClientConnection* conn, const char* data, size_t len) {
+    if (conn->cacheFill) {
+        CachedResponse& fill = *conn->cacheFill;
+        if (fill.head.size() + fill.body.size() + len > conn->service->cache->settings().maxObjectBytes) {
+            conn->cacheFill.reset(); // too large to store; keep relaying it
         } else {
-            backend->recordFailure();
-            failedRequests++;
-            logRequest(clientIP, request.method, originalPath, 502, backend->name + "-failed");
+            fill.body.append(data, len);
+        }
+    }
+    if (conn->flightFill) {
+        CachedResponse& fill = *conn->flightFill;
+        if (fill.head.size() + fill.body.size() + len > conn->service->singleFlight->settings().maxResponseBytes) {
+            conn->flightFill.reset(); // the followers fetch it themselves
+        } else {
+            fill.body.append(data, len);
+        }
+    }
+}
+
+// The relayed response is complete: store what was captured
+void LoadBalancer::fillCache(ClientConnection* conn) {
+    if (!conn->cacheFill) return;
+    conn->service->cache->store(conn->cacheKey, move(conn->cacheFill));
+    conn->cacheFill.reset();
+}
+
+// Drops any partial capture and, if this request was the key's fetcher,
+// wakes the clients parked behind it on their own workers
+void LoadBalancer::releaseCacheFill(ClientConnection* conn) {
+    conn->cacheFill.reset();
+    if (!conn->cacheLeader) return;
+    conn->cacheLeader = false;
+    
+    for (const CacheWaiter& waiter : conn->service->cache->finishFill(conn->cacheKey)) {
+        Worker* worker = waiter.worker;
+        worker->loop.post([this, worker, waiter]() {
+            // The waiter may have timed out, or its fd been reused since
+            auto it = worker->connections.find(waiter.fd);
+            if (it == worker->connections.end()) return;
+            ClientConnection* parked = it->second.get();
+            if (parked->id != waiter.connectionId ||
+                parked->state != ConnectionState::WAITING_FOR_CACHE) {
+                return;
+            }
+            resumeCacheWaiter(parked);
+        });
+    }
+}
+
+// Re-fetches a stale entry on its own backend connection while the stale
+// copy keeps being served; the client's request is not involved further
+void LoadBalancer::startCacheRefresh(ClientConnection* conn, shared_ptr<const CachedResponse> stale) {
+    const shared_ptr<ServiceConfig>& service = conn->service;
+    Backend* backend = service->selectBackend(conn->clientIP, conn->request);
+    if (!backend ||
+        backend->activeConnections.load(memory_order_relaxed) >= service->circuitBreaker.maxRequests) {
+        stale->revalidating = false;
+        return;
+    }
+    
+    auto refresh = make_unique<CacheRefresh>();
+    refresh->fd = backend->pool.acquire();
+    if (refresh->fd < 0) {
+        if (!backend->pool.reserve()) {
+            stale->revalidating = false;
+            return;
+        }
+        refresh->fd = connectBackend(backend);
+        if (refresh->fd < 0) {
+            service->recordConnectError(backend);
+            stale->revalidating = false;
+            return;
+        }
+        refresh->connectPending = true;
+        backend->pendingConnects++;
+    }
+    
+    refresh->service = service;
+    refresh->backend = backend;
+    refresh->key = conn->cacheKey;
+    refresh->stale = move(stale);
+    refresh->request = conn->upstreamRequest;
+    refresh->started = chrono::steady_clock::now();
+    backend->activeConnections++;
+    
+    Worker* worker = conn->worker;
+    CacheRefresh* raw = refresh.get();
+    worker->loop.add(raw->fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                     [this, worker, raw](uint32_t events) { onCacheRefreshEvent(worker, raw, events); });
+    armCacheRefreshTimer(worker, raw);
+    worker->cacheRefreshes[raw->fd] = move(refresh);
+}
+
+// The service's connect or read timeout, as for a client's request, and
+// its total timeout until the response head
+void LoadBalancer::armCacheRefreshTimer(Worker* worker, CacheRefresh* refresh) {
+    const UpstreamTimeoutSettings& timeouts = refresh->service->timeouts;
+    int64_t timeoutMs = refresh->connectPending ? timeouts.connectTimeoutMs : timeouts.readTimeoutMs;
+    if (timeouts.totalTimeoutMs > 0 && !refresh->headParsed) {
+        int64_t elapsedMs = chrono::duration_cast<chrono::milliseconds>(
+            chrono::steady_clock::now() - refresh->started).count();
+        timeoutMs = clamp<int64_t>(timeouts.totalTimeoutMs - elapsedMs, 0, timeoutMs);
+    }
+    
+    if (refresh->timer) {
+        worker->loop.cancel(refresh->timer);
+    }
+    refresh->timer = worker->loop.runAfter(timeoutMs, [this, worker, refresh]() {
+        refresh->timer = 0;
+        finishCacheRefresh(worker, refresh, false);
+    });
+}
+
+void LoadBalancer::onCacheRefreshEvent(Worker* worker, CacheRefresh* refresh, uint32_t events) {
+    if (refresh->connectPending) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+        
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(refresh->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0) {
+            refresh->service->recordConnectError(refresh->backend);
+            finishCacheRefresh(worker, refresh, false);
+            return;
+        }
+        refresh->connectPending = false;
+        refresh->backend->pendingConnects--;
+        armCacheRefreshTimer(worker, refresh);
+    }
+    
+    while (refresh->sent < refresh->request.size()) {
+        ssize_t sent = send(refresh->fd, refresh->request.data() + refresh->sent,
+                            refresh->request.size() - refresh->sent, MSG_NOSIGNAL);
+        if (sent > 0) {
+            refresh->sent += sent;
+            refresh->backend->traffic.addBytesOut(sent);
+            continue;
+        }
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        finishCacheRefresh(worker, refresh, false);
+        return;
+    }
+    
+    size_t limit = maxResponseHeaderBytes + refresh->service->cache->settings().maxObjectBytes;
+    string& data = refresh->response;
+    char buffer[8192];
+    bool progress = false;
+    while (true) {
+        ssize_t bytesRead = recv(refresh->fd, buffer, sizeof(buffer), 0);
+        if (bytesRead == 0) {
+            finishCacheRefresh(worker, refresh, false); // cut short
+            return;
+        }
+        if (bytesRead < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (progress) {
+                    armCacheRefreshTimer(worker, refresh); // read timeout is per silence
+                }
+                return;
+            }
+            finishCacheRefresh(worker, refresh, false);
+            return;
+        }
+        progress = true;
+        data.append(buffer, bytesRead);
+        refresh->backend->traffic.addBytesIn(bytesRead);
+        if (data.size() > limit) {
+            finishCacheRefresh(worker, refresh, false); // would not be stored anyway
+            return;
+        }
+        
+        while (!refresh->headParsed) {
+            HttpHead head;
+            auto result = refresh->parser.parse(data.data() + refresh->scanned,
+                                                data.size() - refresh->scanned, head);
+            if (result == HttpParser::Result::INCOMPLETE) break;
+            if (result != HttpParser::Result::COMPLETE) {
+                finishCacheRefresh(worker, refresh, false);
+                return;
+            }
+            refresh->parser.reset();
+            refresh->headStart = refresh->scanned;
+            refresh->scanned += head.length;
+            if (head.statusCode < 200) continue;
+            
+            if (!responseFraming(head, false, refresh->framer)) {
+                finishCacheRefresh(worker, refresh, false);
+                return;
+            }
+            refresh->headParsed = true;
+        }
+        if (!refresh->headParsed) continue;
+        
+        refresh->scanned += refresh->framer.consume(data.data() + refresh->scanned,
+                                                    data.size() - refresh->scanned);
+        if (refresh->framer.error) {
+            finishCacheRefresh(worker, refresh, false);
+            return;
+        }
+        if (refresh->framer.complete) {
+            finishCacheRefresh(worker, refresh, true);
+            return;
         }
+    }
+}
+
+// Stores the refreshed response (if it may be) and frees the refresh
+void LoadBalancer::finishCacheRefresh(Worker* worker, CacheRefresh* refresh, bool succeeded) {
+    Backend* backend = refresh->backend;
+    ServiceConfig& service = *refresh->service;
+    bool stored = false;
+    bool reusable = false;
+    
+    if (succeeded) {
+        HttpParser parser(false);
+        HttpHead head;
+        const string& data = refresh->response;
+        parser.parse(data.data() + refresh->headStart, data.size() - refresh->headStart, head);
         
-        backend->activeConnections--;
+        double latencyMs = chrono::duration<double, milli>(
+            chrono::steady_clock::now() - refresh->started).count();
+        backend->recordLatency(latencyMs);
+        service.recordResponse(backend, head.statusCode, latencyMs);
+        backend->traffic.recordStatus(head.statusCode);
+        backend->traffic.recordResponse(latencyMs);
+        backend->recordSuccess();
+        
+        // A response that varies differently is a different set of entries;
+        // leave it to the next miss
+        auto entry = service.cache->prepare(head, refresh->framer.mode != BodyFramer::Mode::UNTIL_CLOSE,
+                                            time(nullptr));
+        if (entry && entry->varyNames == refresh->stale->varyNames) {
+            size_t bodyStart = refresh->headStart + head.length;
+            entry->varyValues = refresh->stale->varyValues;
+            entry->body.assign(data, bodyStart, refresh->scanned - bodyStart);
+            service.cache->store(refresh->key, move(entry));
+            stored = true;
+        }
+        reusable = head.keepAlive() && refresh->framer.mode != BodyFramer::Mode::UNTIL_CLOSE &&
+                   refresh->scanned == data.size();
+    } else {
+        if (backend->recordFailure()) {
+            service.refreshSnapshot();
+        }
+        backend->traffic.addFailure();
     }
     
-    if (!success) {
-        string response = "HTTP/1.1 502 Bad Gateway\r\n\r\nBackend error";
-        send(clientSocket, response.c_str(), response.length(), 0);
+    // Not refreshed: the next stale hit tries again
+    if (!stored) {
+        refresh->stale->revalidating = false;
     }
     
-    close(clientSocket);
+    if (refresh->timer) {
+        worker->loop.cancel(refresh->timer);
+    }
+    if (refresh->connectPending) {
+        backend->pendingConnects--;
+    }
+    int fd = refresh->fd;
+    worker->loop.remove(fd);
+    backend->pool.release(fd, reusable);
+    backend->activeConnections--;
+    
+    // Destroys refresh
+    worker->cacheRefreshes.erase(fd);
+    checkDrained(worker);
+}
+
+// ==================== Adaptive Concurrency ====================
+
+// False if the request was queued or shed rather than admitted
+bool LoadBalancer::acquirePermit(ClientConnection* conn) {
+    if (conn->holdsPermit) return true;
+    ConcurrencyLimiter& limiter = *conn->service->concurrencyLimit;
+    switch (limiter.acquire({conn->worker, conn->clientSocket, conn->id})) {
+        case ConcurrencyLimiter::Admission::ADMITTED:
+            conn->holdsPermit = true;
+            return true;
+        case ConcurrencyLimiter::Admission::QUEUED:
+            conn->state = ConnectionState::WAITING_FOR_PERMIT;
+            resetTimer(conn, limiter.settings().maxQueueMs);
+            return false;
+        default:
+            shedRequest(conn);
+            return false;
+    }
+}
+
+// Gives the request's place back, or takes it out of the queue. A freed
+// place goes to the longest-waiting request, woken up on its own worker.
+void LoadBalancer::releasePermit(ClientConnection* conn) {
+    if (!conn->service || !conn->service->concurrencyLimit) return;
+    ConcurrencyLimiter& limiter = *conn->service->concurrencyLimit;
+    if (conn->state == ConnectionState::WAITING_FOR_PERMIT && !conn->holdsPermit) {
+        if (limiter.cancel({conn->worker, conn->clientSocket, conn->id})) return;
+        conn->holdsPermit = true; // handed over after all
+    }
+    if (!conn->holdsPermit) return;
+    conn->holdsPermit = false;
+    
+    CacheWaiter next;
+    if (!limiter.release(next)) return;
+    Worker* worker = next.worker;
+    worker->loop.post([this, worker, next]() {
+        // A request that timed out or closed meanwhile has dealt with the permit
+        auto it = worker->connections.find(next.fd);
+        if (it == worker->connections.end()) return;
+        ClientConnection* parked = it->second.get();
+        if (parked->id != next.connectionId || parked->state != ConnectionState::WAITING_FOR_PERMIT) {
+            return;
+        }
+        parked->holdsPermit = true;
+        tryNextBackend(parked);
+    });
+}
+
+// Over the limit with no room (or no time left) in the queue
+void LoadBalancer::shedRequest(ClientConnection* conn) {
+    failedRequests++;
+    logRequest(conn, 503, "overloaded");
+    conn->service->traffic.recordStatus(503);
+    sendSimpleResponse(conn, 503, "Service Unavailable", "Service overloaded", "text/plain",
+                       "Retry-After: 1\r\n");
+}
+
+// ==================== Single-Flight Coalescing ====================
+
+// Parks the request behind an identical one already being forwarded.
+// False means forward it, as the key's leader if it has a key.
+bool LoadBalancer::joinFlight(ClientConnection* conn) {
+    // The cache already makes identical misses wait for its fetcher
+    if (conn->cacheLeader) return false;
+    
+    SingleFlight& flight = *conn->service->singleFlight;
+    string key = flight.keyFor(conn->service->path, conn->request, conn->requestBody);
+    if (key.empty()) return false;
+    
+    if (flight.join(key, {conn->worker, conn->clientSocket, conn->id})) {
+        conn->flightKey = move(key);
+        conn->flightLeader = true;
+        return false;
+    }
+    conn->state = ConnectionState::WAITING_FOR_FLIGHT;
+    resetTimer(conn, flight.settings().maxWaitMs);
+    return true;
+}
+
+// Hands the leader's response (null if it could not be captured) to its
+// followers on their own workers; the others forward their requests
+void LoadBalancer::releaseFlight(ClientConnection* conn, bool completed) {
+    shared_ptr<const CachedResponse> response;
+    if (completed) {
+        response = move(conn->flightFill);
+    }
+    conn->flightFill.reset();
+    if (!conn->flightLeader) return;
+    conn->flightLeader = false;
+    
+    SingleFlight* flight = conn->service->singleFlight.get();
+    for (const CacheWaiter& waiter : flight->finish(conn->flightKey)) {
+        Worker* worker = waiter.worker;
+        worker->loop.post([this, worker, waiter, response, flight]() {
+            auto it = worker->connections.find(waiter.fd);
+            if (it == worker->connections.end()) return;
+            ClientConnection* parked = it->second.get();
+            if (parked->id != waiter.connectionId ||
+                parked->state != ConnectionState::WAITING_FOR_FLIGHT) {
+                return;
+            }
+            if (response) {
+                serveFlightResponse(parked, response);
+            } else {
+                flight->fallbacks++;
+                tryNextBackend(parked);
+            }
+        });
+    }
+}
+
+void LoadBalancer::serveFlightResponse(ClientConnection* conn, shared_ptr<const CachedResponse> response) {
+    const char* connection = nullptr;
+    if (conn->closeAfterWrite) {
+        connection = "close";
+    } else if (conn->request.version == "HTTP/1.0") {
+        connection = "keep-alive";
+    }
+    logRequest(conn, response->statusCode, "single-flight");
+    conn->service->traffic.recordStatus(response->statusCode);
+    sendResponse(conn, ResponseCache::render(*response, 0, nullptr, connection, false));
 }
 
 void LoadBalancer::handleStatsRequest(int clientSocket) {
-    string response = generateStatsHTML();
-    send(clientSocket, response.c_str(), response.length(), 0);
+    // Read the request head so /metrics can be told apart from the HTML page
+    struct timeval timeout = {2, 0};
+    setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    
+    HttpParser parser(true, 8192);
+    HttpHead request;
+    string received;
+    auto result = HttpParser::Result::INCOMPLETE;
+    char buffer[2048];
+    while (result == HttpParser::Result::INCOMPLETE) {
+        ssize_t bytesRead = recv(clientSocket, buffer, sizeof(buffer), 0);
+        if (bytesRead <= 0) break;
+        received.append(buffer, bytesRead);
+        parser.reset();
+        result = parser.parse(received.data(), received.size(), request);
+    }
+    
+    string response;
+    string_view path = request.target.substr(0, request.target.find('?'));
+    if (result == HttpParser::Result::COMPLETE && path == "/metrics") {
+        string body = generateMetrics();
+        response = "HTTP/1.1 200 OK\r\n"
+                   "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                   "Content-Length: " + to_string(body.size()) + "\r\n"
+                   "Connection: close\r\n\r\n" + body;
+    } else {
+        response = generateStatsHTML();
+    }
+    
+    size_t offset = 0;
+    while (offset < response.size()) {
+        ssize_t sent = send(clientSocket, response.data() + offset, response.size() - offset, MSG_NOSIGNAL);
+        if (sent <= 0) break;
+        offset += sent;
+    }
     close(clientSocket);
 }
 
@@ -564,8 +3879,10 @@ string LoadBalancer::generateStatsHTML() {
     html << "<tr><td>Total Requests</td><td>" << totalRequests.load() << "</td></tr>";
     html << "<tr><td>Failed Requests</td><td>" << failedRequests.load() << "</td></tr>";
     html << "<tr><td>Success Rate</td><td>";
-    if (totalRequests > 0) {
-        double successRate = (double)(totalRequests - failedRequests) / totalRequests * 100;
+    uint64_t requests = totalRequests.load();
+    if (requests > 0) {
+        uint64_t failed = min(failedRequests.load(), requests); // counts failed attempts too
+        double successRate = (double)(requests - failed) / requests * 100;
         html << fixed << setprecision(2) << successRate << "%";
     } else {
         html << "N/A";
@@ -573,31 +3890,104 @@ string LoadBalancer::generateStatsHTML() {
     html << "</td></tr>";
     html << "<tr><td>Bytes Received</td><td>" << totalBytesReceived.load() << "</td></tr>";
     html << "<tr><td>Bytes Sent</td><td>" << totalBytesSent.load() << "</td></tr>";
+    if (clientLimits) {
+        html << "<tr><td>Client Limits (rate / connections)</td><td>" << clientLimits->rateLimited.load()
+             << " / " << clientLimits->concurrencyLimited.load() << " refused, "
+             << clientLimits->keyCount() << " clients tracked</td></tr>";
+    }
     html << "</table>";
     
     html << "<h2>Services and Backends</h2>";
-    for (const auto& [path, service] : services) {
+    for (const auto& [path, service] : currentServices()) {
         string algoName;
         switch (service->algorithm) {
             case LoadBalancingAlgorithm::ROUND_ROBIN: algoName = "Round Robin"; break;
             case LoadBalancingAlgorithm::LEAST_CONNECTIONS: algoName = "Least Connections"; break;
             case LoadBalancingAlgorithm::IP_HASH: algoName = "IP Hash"; break;
+            case LoadBalancingAlgorithm::CONSISTENT_HASH: algoName = "Consistent Hash"; break;
+            case LoadBalancingAlgorithm::POWER_OF_TWO_CHOICES: algoName = "Power of Two Choices"; break;
+            case LoadBalancingAlgorithm::PEAK_EWMA: algoName = "Peak EWMA"; break;
+            case LoadBalancingAlgorithm::WEIGHTED_ROUND_ROBIN: algoName = "Weighted Round Robin"; break;
         }
         
         html << "<h3>Service: " << path << " (Algorithm: " << algoName << ")</h3>";
-        html << "<table><tr><th>Name</th><th>Host:Port</th><th>Status</th><th>Active Connections</th><th>Failures</th></tr>";
+        html << "<table><tr><th>Name</th><th>Host:Port</th><th>Status</th><th>Active Connections</th><th>Failures</th>";
+        html << "<th>Latency EWMA</th><th>Pool (idle/open/max)</th><th>Upstream Reuse</th></tr>";
         
-        for (const auto& backend : service->backends) {
+        for (const auto& backend : service->members()) {
             html << "<tr>";
             html << "<td>" << backend->name << "</td>";
             html << "<td>" << backend->host << ":" << backend->port << "</td>";
             html << "<td class='" << (backend->isHealthy ? "healthy" : "unhealthy") << "'>";
-            html << (backend->isHealthy ? "UP" : "DOWN") << "</td>";
+            bool ejected = backend->outlier.ejectedUntil > chrono::steady_clock::now().time_since_epoch().count();
+            html << (backend->removed ? "REMOVED" : ejected ? "EJECTED" : backend->isHealthy ? "UP" : "DOWN") << "</td>";
             html << "<td>" << backend->activeConnections.load() << "</td>";
             html << "<td>" << backend->consecutiveFailures.load() << "</td>";
+            html << "<td>" << fixed << setprecision(1)
+                 << backend->latencyEstimateMs(chrono::steady_clock::now().time_since_epoch().count())
+                 << " ms</td>";
+            
+            const ConnectionPool& pool = backend->pool;
+            uint64_t reused = pool.reusedCount();
+            uint64_t opened = pool.newCount();
+            html << "<td>" << pool.idleCount() << " / " << pool.totalCount()
+                 << " / " << pool.maxTotal() << "</td>";
+            html << "<td>";
+            if (reused + opened > 0) {
+                html << fixed << setprecision(1) << (double)reused / (reused + opened) * 100 << "%";
+            } else {
+                html << "N/A";
+            }
+            html << " (" << pool.staleCount() << " stale)</td>";
             html << "</tr>";
         }
         html << "</table>";
+        
+        if (service->cache) {
+            ResponseCache& cache = *service->cache;
+            uint64_t hits = cache.hits.load();
+            uint64_t staleHits = cache.staleHits.load();
+            uint64_t misses = cache.misses.load();
+            html << "<p><strong>Cache:</strong> " << hits << " hits, " << staleHits << " stale, "
+                 << misses << " misses, " << cache.coalesced.load() << " coalesced (hit ratio ";
+            if (hits + staleHits + misses > 0) {
+                html << fixed << setprecision(1)
+                     << (double)(hits + staleHits) / (hits + staleHits + misses) * 100 << "%";
+            } else {
+                html << "N/A";
+            }
+            html << "); " << cache.entryCount() << " entries, " << cache.byteCount() << " bytes</p>";
+        }
+        if (service->singleFlight) {
+            SingleFlight& flight = *service->singleFlight;
+            html << "<p><strong>Single-flight:</strong> " << flight.leaders.load() << " fetched, "
+                 << flight.followers.load() << " coalesced, " << flight.fallbacks.load()
+                 << " fell back</p>";
+        }
+        if (service->rateLimit) {
+            RateLimiter& limit = *service->rateLimit;
+            html << "<p><strong>Rate limit:</strong> " << limit.rateLimited.load() << " over the rate, "
+                 << limit.concurrencyLimited.load() << " over the concurrency limit; "
+                 << limit.keyCount() << " keys tracked</p>";
+        }
+        if (service->concurrencyLimit) {
+            ConcurrencyLimiter& limiter = *service->concurrencyLimit;
+            html << "<p><strong>Adaptive concurrency:</strong> limit " << limiter.limit() << ", "
+                 << limiter.inFlight() << " in flight, " << limiter.queued() << " queued; "
+                 << limiter.queuedTotal.load() << " waited, " << limiter.shed.load() << " shed</p>";
+        }
+        if (service->retryBudget) {
+            html << "<p><strong>Retry budget:</strong> " << service->retryBudget->exhausted.load()
+                 << " retries refused</p>";
+        }
+        if (service->retryPolicy.hedge) {
+            html << "<p><strong>Hedging:</strong> " << service->hedges.load() << " hedges sent, "
+                 << service->hedgesWon.load() << " answered first</p>";
+        }
+        if (service->timeouts.totalTimeoutMs > 0) {
+            html << "<p><strong>Deadline:</strong> " << service->timeouts.totalTimeoutMs << "ms, "
+                 << service->deadlineExceeded.load() << " requests timed out</p>";
+        }
     }
     
     html << "<br><p><a href='/nginx_status'>Refresh</a></p>";
@@ -606,116 +3996,372 @@ string LoadBalancer::generateStatsHTML() {
     return html.str();
 }
 
-string LoadBalancer::generateHealthCheckResponse() {
-    ostringstream response;
-    response << "HTTP/1.1 200 OK\r\n";
-    response << "Content-Type: text/plain\r\n";
-    response << "Connection: close\r\n\r\n";
-    response << "healthy\n";
-    return response.str();
-}
-
-void LoadBalancer::logRequest(const string& clientIP, const string& method,
-                              const string& path, int statusCode,
-                              const string& backendName) {
-    lock_guard<mutex> lock(logMutex);
-    auto now = chrono::system_clock::now();
-    auto timeT = chrono::system_clock::to_time_t(now);
+// Prometheus text exposition of the proxy, service and backend counters
+string LoadBalancer::generateMetrics() {
+    PrometheusWriter out;
+    static const char* statusClasses[5] = {"1xx", "2xx", "3xx", "4xx", "5xx"};
+    
+    out.family("customlb_requests_total", "counter", "Requests received from clients.");
+    out.sample("customlb_requests_total", "", totalRequests.load());
+    out.family("customlb_failed_requests_total", "counter", "Requests answered with a local error or failed upstream attempts.");
+    out.sample("customlb_failed_requests_total", "", failedRequests.load());
+    
+    // Summed once per scrape; the samples below are grouped by family
+    struct ServiceTotals {
+        string labels;
+        TrafficTotals traffic;
+    };
+    struct BackendTotals {
+        string labels;
+        shared_ptr<Backend> backend;
+        TrafficTotals traffic;
+    };
+    vector<ServiceTotals> serviceTotals;
+    vector<BackendTotals> backendTotals;
+    auto activeServices = currentServices();
+    for (const auto& [path, service] : activeServices) {
+        string serviceLabel = PrometheusWriter::label("service", path);
+        serviceTotals.push_back({serviceLabel, service->traffic.totals()});
+        for (const auto& backend : service->members()) {
+            backendTotals.push_back({serviceLabel + "," + PrometheusWriter::label("backend", backend->name),
+                                     backend, backend->traffic.totals()});
+        }
+    }
+    
+    out.family("customlb_access_log_dropped_total", "counter", "Access log lines dropped because a buffer was full.");
+    out.sample("customlb_access_log_dropped_total", "", accessLog->droppedCount());
+    
+    if (tls) {
+        out.family("customlb_tls_handshakes_total", "counter", "TLS handshakes, by result.");
+        out.sample("customlb_tls_handshakes_total", PrometheusWriter::label("result", "full"), tls->fullHandshakes.load());
+        out.sample("customlb_tls_handshakes_total", PrometheusWriter::label("result", "resumed"), tls->resumedHandshakes.load());
+        out.sample("customlb_tls_handshakes_total", PrometheusWriter::label("result", "failed"), tls->failedHandshakes.load());
+        out.family("customlb_tls_kernel_offload_total", "counter", "TLS connections whose records the kernel encrypts or decrypts (kTLS).");
+        out.sample("customlb_tls_kernel_offload_total", PrometheusWriter::label("direction", "send"), tls->kernelSendConnections.load());
+        out.sample("customlb_tls_kernel_offload_total", PrometheusWriter::label("direction", "receive"), tls->kernelReceiveConnections.load());
+        out.family("customlb_tls_certificate_reloads_total", "counter", "Certificate and key reloads after the files changed.");
+        out.sample("customlb_tls_certificate_reloads_total", "", tls->reloads.load());
+    }
+    if (http2Settings.enabled) {
+        out.family("customlb_http2_connections_total", "counter", "Client connections that switched to HTTP/2 (ALPN h2 or h2c).");
+        out.sample("customlb_http2_connections_total", "", http2Connections.load());
+        out.family("customlb_http2_streams_total", "counter", "HTTP/2 streams taken on as requests.");
+        out.sample("customlb_http2_streams_total", "", http2Streams.load());
+        out.family("customlb_http2_stream_resets_total", "counter", "HTTP/2 streams reset by the client or for a protocol error before their response ended.");
+        out.sample("customlb_http2_stream_resets_total", "", http2StreamResets.load());
+    }
+    
+    out.family("customlb_service_responses_total", "counter", "Final responses sent to clients, by status class.");
+    for (const auto& s : serviceTotals) {
+        for (int i = 0; i < 5; i++) {
+            out.sample("customlb_service_responses_total",
+                       s.labels + "," + PrometheusWriter::label("code", statusClasses[i]),
+                       s.traffic.responses[i]);
+        }
+    }
+    out.family("customlb_service_retries_total", "counter", "Requests retried on another backend attempt.");
+    for (const auto& s : serviceTotals) {
+        out.sample("customlb_service_retries_total", s.labels, s.traffic.retries);
+    }
+    
+    if (clientLimits) {
+        out.family("customlb_client_limited_total", "counter", "Requests refused with 429 by the per-client limits, by limit.");
+        out.sample("customlb_client_limited_total", PrometheusWriter::label("limit", "rate"), clientLimits->rateLimited.load());
+        out.sample("customlb_client_limited_total", PrometheusWriter::label("limit", "connections"), clientLimits->concurrencyLimited.load());
+        out.family("customlb_client_limit_keys", "gauge", "Client IPs whose limits are being tracked.");
+        out.sample("customlb_client_limit_keys", "", (double)clientLimits->keyCount());
+    }
+    out.family("customlb_rate_limited_total", "counter", "Requests refused with 429 by a service's rate limit, by limit.");
+    for (const auto& [path, service] : activeServices) {
+        if (!service->rateLimit) continue;
+        RateLimiter& limit = *service->rateLimit;
+        string labels = PrometheusWriter::label("service", path) + ",";
+        out.sample("customlb_rate_limited_total", labels + PrometheusWriter::label("limit", "rate"), limit.rateLimited.load());
+        out.sample("customlb_rate_limited_total", labels + PrometheusWriter::label("limit", "concurrency"), limit.concurrencyLimited.load());
+    }
+    out.family("customlb_rate_limit_keys", "gauge", "Keys whose rate limit state is being tracked.");
+    for (const auto& [path, service] : activeServices) {
+        if (!service->rateLimit) continue;
+        out.sample("customlb_rate_limit_keys", PrometheusWriter::label("service", path), (double)service->rateLimit->keyCount());
+    }
+    
+    out.family("customlb_concurrency_limit", "gauge", "Current adaptive concurrency limit.");
+    for (const auto& [path, service] : activeServices) {
+        if (!service->concurrencyLimit) continue;
+        out.sample("customlb_concurrency_limit", PrometheusWriter::label("service", path), (double)service->concurrencyLimit->limit());
+    }
+    out.family("customlb_concurrency_in_flight", "gauge", "Requests holding an adaptive concurrency permit.");
+    for (const auto& [path, service] : activeServices) {
+        if (!service->concurrencyLimit) continue;
+        out.sample("customlb_concurrency_in_flight", PrometheusWriter::label("service", path), (double)service->concurrencyLimit->inFlight());
+    }
+    out.family("customlb_concurrency_queued", "gauge", "Requests waiting for an adaptive concurrency permit.");
+    for (const auto& [path, service] : activeServices) {
+        if (!service->concurrencyLimit) continue;
+        out.sample("customlb_concurrency_queued", PrometheusWriter::label("service", path), (double)service->concurrencyLimit->queued());
+    }
+    out.family("customlb_concurrency_queued_total", "counter", "Requests that waited for an adaptive concurrency permit.");
+    for (const auto& [path, service] : activeServices) {
+        if (!service->concurrencyLimit) continue;
+        out.sample("customlb_concurrency_queued_total", PrometheusWriter::label("service", path), service->concurrencyLimit->queuedTotal.load());
+    }
+    out.family("customlb_concurrency_shed_total", "counter", "Requests refused with 503 by the adaptive concurrency limit.");
+    for (const auto& [path, service] : activeServices) {
+        if (!service->concurrencyLimit) continue;
+        out.sample("customlb_concurrency_shed_total", PrometheusWriter::label("service", path), service->concurrencyLimit->shed.load());
+    }
+    out.family("customlb_retry_budget_exhausted_total", "counter", "Retries not attempted because the retry budget was spent.");
+    for (const auto& [path, service] : activeServices) {
+        if (!service->retryBudget) continue;
+        out.sample("customlb_retry_budget_exhausted_total", PrometheusWriter::label("service", path), service->retryBudget->exhausted.load());
+    }
+    out.family("customlb_hedged_requests_total", "counter", "Hedged second attempts, by whether they answered first.");
+    for (const auto& [path, service] : activeServices) {
+        if (!service->retryPolicy.hedge) continue;
+        string labels = PrometheusWriter::label("service", path) + ",";
+        out.sample("customlb_hedged_requests_total", labels + PrometheusWriter::label("result", "sent"), service->hedges.load());
+        out.sample("customlb_hedged_requests_total", labels + PrometheusWriter::label("result", "won"), service->hedgesWon.load());
+    }
+    out.family("customlb_deadline_exceeded_total", "counter", "Requests answered with 504 because their total timeout passed.");
+    for (const auto& [path, service] : activeServices) {
+        out.sample("customlb_deadline_exceeded_total", PrometheusWriter::label("service", path), service->deadlineExceeded.load());
+    }
+    
+    out.family("customlb_cache_requests_total", "counter", "Cache lookups, by result.");
+    for (const auto& [path, service] : activeServices) {
+        if (!service->cache) continue;
+        ResponseCache& cache = *service->cache;
+        string labels = PrometheusWriter::label("service", path) + ",";
+        out.sample("customlb_cache_requests_total", labels + PrometheusWriter::label("result", "hit"), cache.hits.load());
+        out.sample("customlb_cache_requests_total", labels + PrometheusWriter::label("result", "stale"), cache.staleHits.load());
+        out.sample("customlb_cache_requests_total", labels + PrometheusWriter::label("result", "miss"), cache.misses.load());
+        out.sample("customlb_cache_requests_total", labels + PrometheusWriter::label("result", "coalesced"), cache.coalesced.load());
+    }
+    out.family("customlb_singleflight_requests_total", "counter", "Coalescable requests, by role in their flight.");
+    for (const auto& [path, service] : activeServices) {
+        if (!service->singleFlight) continue;
+        SingleFlight& flight = *service->singleFlight;
+        string labels = PrometheusWriter::label("service", path) + ",";
+        out.sample("customlb_singleflight_requests_total", labels + PrometheusWriter::label("role", "leader"), flight.leaders.load());
+        out.sample("customlb_singleflight_requests_total", labels + PrometheusWriter::label("role", "follower"), flight.followers.load());
+        out.sample("customlb_singleflight_requests_total", labels + PrometheusWriter::label("role", "fallback"), flight.fallbacks.load());
+    }
+    out.family("customlb_cache_stores_total", "counter", "Responses stored in the cache.");
+    for (const auto& [path, service] : activeServices) {
+        if (!service->cache) continue;
+        out.sample("customlb_cache_stores_total", PrometheusWriter::label("service", path), service->cache->stores.load());
+    }
+    out.family("customlb_cache_evictions_total", "counter", "Cache keys evicted to stay within the memory limit.");
+    for (const auto& [path, service] : activeServices) {
+        if (!service->cache) continue;
+        out.sample("customlb_cache_evictions_total", PrometheusWriter::label("service", path), service->cache->evictions.load());
+    }
+    out.family("customlb_cache_entries", "gauge", "Keys currently cached.");
+    for (const auto& [path, service] : activeServices) {
+        if (!service->cache) continue;
+        out.sample("customlb_cache_entries", PrometheusWriter::label("service", path), (double)service->cache->entryCount());
+    }
+    out.family("customlb_cache_bytes", "gauge", "Memory held by cached responses.");
+    for (const auto& [path, service] : activeServices) {
+        if (!service->cache) continue;
+        out.sample("customlb_cache_bytes", PrometheusWriter::label("service", path), (double)service->cache->byteCount());
+    }
+    
+    out.family("customlb_backend_responses_total", "counter", "Upstream response heads, by status class.");
+    for (const auto& b : backendTotals) {
+        for (int i = 0; i < 5; i++) {
+            out.sample("customlb_backend_responses_total",
+                       b.labels + "," + PrometheusWriter::label("code", statusClasses[i]),
+                       b.traffic.responses[i]);
+        }
+    }
+    out.family("customlb_backend_failures_total", "counter", "Upstream attempts that failed or were cut off mid-response.");
+    for (const auto& b : backendTotals) {
+        out.sample("customlb_backend_failures_total", b.labels, b.traffic.failures);
+    }
+    out.family("customlb_backend_received_bytes_total", "counter", "Bytes read from the backend.");
+    for (const auto& b : backendTotals) {
+        out.sample("customlb_backend_received_bytes_total", b.labels, b.traffic.bytesIn);
+    }
+    out.family("customlb_backend_sent_bytes_total", "counter", "Bytes written to the backend.");
+    for (const auto& b : backendTotals) {
+        out.sample("customlb_backend_sent_bytes_total", b.labels, b.traffic.bytesOut);
+    }
+    out.family("customlb_backend_connect_seconds", "histogram", "Time to establish new upstream connections.");
+    for (const auto& b : backendTotals) {
+        out.histogram("customlb_backend_connect_seconds", b.labels,
+                      b.traffic.connectBuckets, b.traffic.connectSumMicros);
+    }
+    out.family("customlb_backend_response_seconds", "histogram", "Time from forwarding a request to its response head.");
+    for (const auto& b : backendTotals) {
+        out.histogram("customlb_backend_response_seconds", b.labels,
+                      b.traffic.responseBuckets, b.traffic.responseSumMicros);
+    }
     
-    char timeBuffer[100];
-    strftime(timeBuffer, sizeof(timeBuffer), "%Y-%m-%d %H:%M:%S", localtime(&timeT));
+    auto now = chrono::steady_clock::now();
+    out.family("customlb_backend_up", "gauge", "Whether the backend is currently selectable.");
+    for (const auto& b : backendTotals) {
+        out.sample("customlb_backend_up", b.labels, (uint64_t)(b.backend->isSelectable(now) ? 1 : 0));
+    }
+    out.family("customlb_backend_active_requests", "gauge", "Requests currently assigned to the backend.");
+    for (const auto& b : backendTotals) {
+        out.sample("customlb_backend_active_requests", b.labels,
+                   (double)b.backend->activeConnections.load(memory_order_relaxed));
+    }
+    out.family("customlb_backend_pool_connections", "gauge", "Open upstream connections, idle and in use.");
+    for (const auto& b : backendTotals) {
+        out.sample("customlb_backend_pool_connections", b.labels, (double)b.backend->pool.totalCount());
+    }
     
-    cout << "[" << timeBuffer << "] "
-         << clientIP << " \"" << method << " " << path << "\" "
-         << statusCode << " backend=" << backendName << endl;
+    return out.text();
+}
+
+void LoadBalancer::logRequest(const ClientConnection* conn, int statusCode,
+                              string_view backendName, string_view outcome) {
+    const HttpHead& request = conn->request;
+    string_view version = conn->parent ? "HTTP/2.0" : request.version;
+    accessLog->record(conn->clientIP, request.method, request.target, version,
+                      statusCode, backendName, outcome,
+                      conn->upstreamLatencyMs, conn->upstreamBytes);
 }
 
 void LoadBalancer::start() {
     cout << "\n=== Custom C++ Load Balancer ===" << endl;
     cout << "Starting health checker..." << endl;
     healthChecker->start();
+    resolver->start();
+    accessLog->start();
     
     cout << "Configured services:" << endl;
-    for (const auto& [path, service] : services) {
-        cout << "  " << path << " -> " << service->backends.size() << " backends" << endl;
+    for (const auto& [path, service] : currentServices()) {
+        cout << "  " << path << " -> " << service->members().size() << " backends" << endl;
     }
     
     running = true;
     
-    // Start stats server in separate thread
-    thread statsThread([this]() {
-        int statsSocket = socket(AF_INET, SOCK_STREAM, 0);
-        int opt = 1;
-        setsockopt(statsSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-        
-        struct sockaddr_in statsAddr;
-        memset(&statsAddr, 0, sizeof(statsAddr));
-        statsAddr.sin_family = AF_INET;
-        statsAddr.sin_addr.s_addr = INADDR_ANY;
-        statsAddr.sin_port = htons(statsPort);
-        
-        bind(statsSocket, (struct sockaddr*)&statsAddr, sizeof(statsAddr));
-        listen(statsSocket, 10);
-        
-        cout << "Stats server listening on port " << statsPort << endl;
-        
-        while (running) {
-            int clientSocket = accept(statsSocket, nullptr, nullptr);
-            if (clientSocket >= 0) {
-                thread([this, clientSocket]() {
-                    handleStatsRequest(clientSocket);
-                }).detach();
-            }
-        }
-        
-        close(statsSocket);
-    });
-    statsThread.detach();
+    // SSL_write() and splice() into a client socket cannot pass MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
     
-    // Start main load balancer server
-    int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-    int opt = 1;
-    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (tls) {
+        tls->setApplicationProtocols(http2Settings.enabled ? vector<string>{"h2", "http/1.1"}
+                                                           : vector<string>{"http/1.1"});
+    }
     
-    struct sockaddr_in address;
-    memset(&address, 0, sizeof(address));
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(listenPort);
+    if (!configPath.empty() || tls) {
+        fileWatcher = thread(&LoadBalancer::watchFiles, this);
+    }
     
-    if (bind(serverSocket, (struct sockaddr*)&address, sizeof(address)) < 0) {
-        cerr << "Bind failed on port " << listenPort << endl;
-        return;
+    // A process already serving the handoff socket passes its listeners on
+    ListenerHandoff::Listeners inherited;
+    bool takingOver = !handoffPath.empty() && handoff.takeOver(handoffPath, inherited);
+    
+    // Start stats server in separate thread
+    int statsSocket = inherited.stats >= 0 ? inherited.stats : openStatsSocket();
+    if (statsSocket >= 0) {
+        cout << "Stats server listening on port " << statsPort << endl;
+        statsThread = thread(&LoadBalancer::serveStats, this, statsSocket);
     }
     
-    if (listen(serverSocket, 100) < 0) {
-        cerr << "Listen failed" << endl;
-        return;
+    // One event loop per core, each with its own SO_REUSEPORT listener
+    int workerCount = workerThreads;
+    if (workerCount <= 0) {
+        workerCount = max(1u, thread::hardware_concurrency());
+    }
+    // Connections queued on an inherited socket nobody accepts from would be lost
+    workerCount = max(workerCount, (int)inherited.workers.size());
+    if (!tls && !inherited.tls.empty()) {
+        cerr << "[TLS] Not configured; closing the " << inherited.tls.size()
+             << " HTTPS sockets taken over" << endl;
+        for (int fd : inherited.tls) {
+            close(fd);
+        }
+        inherited.tls.clear();
+    }
+    
+    {
+        lock_guard<mutex> lock(drainMutex);
+        for (int i = 0; i < workerCount; i++) {
+            auto worker = make_unique<Worker>(i);
+            worker->listenSocket = i < (int)inherited.workers.size() ? inherited.workers[i] : openListenSocket(listenPort);
+            if (tls) {
+                worker->tlsListenSocket = i < (int)inherited.tls.size() ? inherited.tls[i]
+                                                                        : openListenSocket(tls->settings().port);
+            }
+            bool opened = worker->listenSocket >= 0 && (!tls || worker->tlsListenSocket >= 0);
+            workers.push_back(move(worker));
+            if (!opened) {
+                for (auto& failed : workers) {
+                    if (failed->listenSocket >= 0) close(failed->listenSocket);
+                    if (failed->tlsListenSocket >= 0) close(failed->tlsListenSocket);
+                }
+                workers.clear();
+                return;
+            }
+            listeners.workers.push_back(workers.back()->listenSocket);
+            if (tls) {
+                listeners.tls.push_back(workers.back()->tlsListenSocket);
+            }
+        }
+        listeners.stats = statsSocket;
     }
     
-    cout << "Load balancer listening on port " << listenPort << endl;
+    cout << "Load balancer listening on port " << listenPort;
+    if (tls) {
+        cout << " and " << tls->settings().port << " (HTTPS)";
+    }
+    cout << " (" << workerCount << " worker threads";
+    if (takingOver) {
+        cout << ", " << inherited.workers.size() + inherited.tls.size() << " sockets taken over";
+    }
+    cout << ")" << endl;
     cout << "Stats available at http://localhost:" << statsPort << "/nginx_status" << endl;
     cout << "Health check at http://localhost:" << listenPort << "/health" << endl;
     cout << "Press Ctrl+C to stop\n" << endl;
     
-    while (running) {
-        struct sockaddr_in clientAddr;
-        socklen_t clientLen = sizeof(clientAddr);
-        int clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddr, &clientLen);
-        
-        if (clientSocket >= 0) {
-            string clientIP = inet_ntoa(clientAddr.sin_addr);
-            
-            thread([this, clientSocket, clientIP]() {
-                handleClient(clientSocket, clientIP);
-            }).detach();
-        }
+    for (auto& worker : workers) {
+        worker->loopThread = thread(&LoadBalancer::runWorker, this, worker.get());
+    }
+    
+    // Accepting now: the previous process can drain, and the next one
+    // takes over from this one
+    if (takingOver) {
+        handoff.confirm();
+    }
+    if (!handoffPath.empty() && handoff.listen(handoffPath)) {
+        handoffThread = thread(&LoadBalancer::serveHandoff, this);
     }
     
-    close(serverSocket);
+    for (auto& worker : workers) {
+        worker->loopThread.join();
+    }
+    
+    if (draining) {
+        cout << "[DRAIN] Finished" << (handedOver ? " after handing over the listeners" : "") << endl;
+        stop();
+    }
 }
 
 void LoadBalancer::stop() {
-    running = false;
+    // Signal handling, a finished drain and the destructor may all get here
+    lock_guard<mutex> stopLock(stopMutex);
+    {
+        lock_guard<mutex> lock(watcherMutex);
+        running = false;
+    }
+    watcherWake.notify_all();
+    if (fileWatcher.joinable()) {
+        fileWatcher.join();
+    }
+    for (auto& worker : workers) {
+        worker->loop.stop();
+    }
+    if (statsThread.joinable()) {
+        statsThread.join();
+    }
+    if (handoffThread.joinable()) {
+        handoffThread.join();
+    }
     healthChecker->stop();
+    resolver->stop();
+    accessLog->stop();
 }
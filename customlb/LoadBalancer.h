@@ -9,13 +9,63 @@
 #include <chrono>
 #include <memory>
 #include <thread>
+#include <condition_variable>
+#include <unordered_map>
+#include <random>
+#include <netinet/in.h>
+#include "EventLoop.h"
+#include "ConnectionPool.h"
+#include "HttpParser.h"
+#include "DnsResolver.h"
+#include "Metrics.h"
+#include "AccessLog.h"
+#include "ResponseCache.h"
+#include "SingleFlight.h"
+#include "Router.h"
+#include "Handoff.h"
+#include "Tls.h"
+#include "Http2.h"
+#include "RateLimiter.h"
+#include "ConcurrencyLimiter.h"
 using namespace std;
 
 // Load balancing algorithms
 enum class LoadBalancingAlgorithm {
     ROUND_ROBIN,
     LEAST_CONNECTIONS,
-    IP_HASH
+    IP_HASH,
+    CONSISTENT_HASH,      // Maglev; only keys of a removed backend move
+    POWER_OF_TWO_CHOICES, // fewer active connections of two random backends
+    PEAK_EWMA,            // P2C on latency EWMA x outstanding requests
+    WEIGHTED_ROUND_ROBIN  // nginx smooth WRR with slow start
+};
+
+// Request attribute that CONSISTENT_HASH keys on
+enum class HashKeySource {
+    CLIENT_IP,
+    HEADER,
+    COOKIE
+};
+
+// Per-backend request outcomes for passive outlier detection. The window
+// counters cover one detection interval and are reset by each sweep.
+struct OutlierStats {
+    static const int latencyBucketCount = 13;
+    static const int latencyBucketMs[latencyBucketCount]; // upper bounds
+    
+    atomic<uint32_t> requests{0};
+    atomic<uint32_t> errors{0}; // 5xx and connect errors
+    atomic<uint32_t> latency[latencyBucketCount] = {};
+    atomic<int> consecutive5xx{0};
+    atomic<int> consecutiveConnectErrors{0};
+    
+    atomic<int64_t> ejectedUntil{0}; // steady_clock ticks
+    atomic<int> ejections{0};        // grows the next ejection, decays per clean interval
+    
+    void recordLatency(double ms);
+    // Upper bound of the bucket holding the given percentile (0 = no samples)
+    int latencyPercentileMs(double percentile) const;
+    void resetWindow();
 };
 
 // Backend server state
@@ -23,120 +73,726 @@ struct Backend {
     string name;
     string host;
     int port;
+    atomic<uint32_t> address; // IPv4 (network order) from DnsResolver; 0 = unresolved
+    atomic<bool> removed;     // no longer returned by DNS discovery
+    atomic<int64_t> removedAt; // steady_clock ticks it was last removed
+    atomic<bool> probeFailed; // active health check says DOWN (no recovery tries)
     atomic<int> activeConnections;
     atomic<bool> isHealthy;
     atomic<int> consecutiveFailures;
-    chrono::time_point<chrono::steady_clock> lastFailTime;
+    atomic<int64_t> lastFailTime; // steady_clock ticks
+    
+    // Peak-sensitive moving average of time to response head
+    atomic<double> latencyEwmaMs;
+    atomic<int64_t> latencyUpdatedAt; // steady_clock ticks
+    static constexpr double latencyDecaySeconds = 10.0;
     
     // Health check settings
     int maxFails;
     int failTimeout; // seconds
     
-    Backend(const string& n, const string& h, int p, int maxF = 3, int timeout = 30);
+    int weight;
+    atomic<int64_t> upSince; // steady_clock ticks of the last recovery (0 = never down)
+    
+    // Idle keep-alive connections to this backend
+    ConnectionPool pool;
+    
+    OutlierStats outlier;
+    atomic<int> pendingConnects;       // requests waiting on a new connection
+    atomic<uint64_t> circuitOverflows; // requests shed by the circuit breaker
+    
+    // Per-attempt responses, bytes and upstream timings for /metrics
+    TrafficMetrics traffic;
+    
+    Backend(const string& n, const string& h, int p, int maxF = 3, int timeout = 30, int w = 1);
     
-    bool checkHealth();
-    void recordFailure();
-    void recordSuccess();
-    bool shouldRetry();
+    // Cached address only; never does a DNS lookup
+    bool resolveAddress(struct sockaddr_in& addr) const;
+    // Return true when the backend (may have) changed selectability
+    bool recordFailure();
+    bool recordSuccess();
+    // Verdicts of the active health checker once rise/fall is reached
+    bool markProbeDown();
+    bool markProbeUp();
+    // Healthy, or down for at least failTimeout (eligible for a recovery try),
+    // not ejected as an outlier, and still a member
+    bool isSelectable(chrono::steady_clock::time_point now) const;
+    
+    void recordLatency(double ms);
+    // EWMA decayed for the time since the last sample, so a backend that
+    // was slow once is not shunned forever
+    double latencyEstimateMs(int64_t nowTicks) const;
+    
+    // Weight in hundredths, ramped up linearly during slow start
+    int scaledWeight(int64_t nowTicks, int slowStartSeconds) const;
+};
+
+// Active health check of one service's backends
+struct HealthCheckSettings {
+    int intervalSeconds = 30;
+    double jitter = 0.1;     // +/- fraction of the interval, so probes don't align
+    int timeoutMs = 2000;    // connect + response
+    string httpPath;         // empty: TCP connect only
+    int expectedStatus = 200;
+    int rise = 2;            // consecutive passes to mark UP
+    int fall = 3;            // consecutive failures to mark DOWN
+};
+
+// Passive outlier detection, fed by every proxied response
+struct OutlierDetectionSettings {
+    int consecutive5xx = 5;            // eject at once after this many in a row
+    int consecutiveConnectErrors = 3;
+    int intervalSeconds = 10;          // rate/latency evaluation window
+    int minRequests = 20;              // in a window before rates are judged
+    double max5xxRate = 0.5;           // 5xx + connect errors / requests
+    int maxP99LatencyMs = 0;           // 0 = no latency ejection
+    int baseEjectionSeconds = 30;      // doubles with every repeat ejection
+    int maxEjectionSeconds = 300;
+    int maxEjectionPercent = 50;       // never eject more of the service than this
+};
+
+// Per-backend load limits; requests over them fail fast with 503
+struct CircuitBreakerSettings {
+    int maxRequests = 1024;        // concurrent requests per backend
+    int maxPendingConnects = 128;  // requests waiting for a new connection
+};
+
+// Per-attempt and overall limits on waiting for a backend
+struct UpstreamTimeoutSettings {
+    int connectTimeoutMs = 60000;
+    int readTimeoutMs = 60000;  // longest silence from the backend within an attempt
+    int totalTimeoutMs = 0;     // all attempts and pauses up to the response head, then 504 (0 = none)
+};
+
+// How a failed or slow attempt is followed up. Only requests that are safe
+// to repeat are retried after the backend may have seen them; a retry goes
+// to another backend when there is one.
+struct RetryPolicySettings {
+    int backoffBaseMs = 25;  // retry n waits a random 0..base * 2^(n-1) ms
+    int backoffMaxMs = 250;
+    // GET/HEAD: a second attempt on another backend once the first has had
+    // no answer for this percentile of its backend's recent latencies; the
+    // first backend to answer serves the request
+    bool hedge = false;
+    double hedgePercentile = 0.95;
+    int hedgeMinDelayMs = 5;
+};
+
+// Immutable set of selectable backends. Workers read the current one through
+// an atomic pointer; writers publish a new copy (RCU-style) only when health
+// or membership changes, so selection never allocates or touches refcounts.
+struct BackendSnapshot {
+    vector<Backend*> backends;
+    vector<uint32_t> maglevTable; // CONSISTENT_HASH: slot -> index in backends
+    vector<int> weights;          // WEIGHTED_ROUND_ROBIN: scaled weight per backend
+    vector<uint32_t> schedule;    // ... and one smooth WRR cycle of backend indices
+    chrono::steady_clock::time_point retiredAt;
 };
 
 // Service configuration for path-based routing
 struct ServiceConfig {
     string path;
     LoadBalancingAlgorithm algorithm;
-    vector<shared_ptr<Backend>> backends;
+    vector<shared_ptr<Backend>> backends; // members live as long as the service
+    vector<shared_ptr<Backend>> droppedBackends; // ... or, once dropped, until unused
     atomic<size_t> roundRobinIndex;
     
+    // CONSISTENT_HASH key; requests without the header/cookie use the client IP
+    HashKeySource hashKeySource;
+    string hashKeyName;
+    // Prime, and much larger than the backend count for an even spread
+    static const size_t maglevTableSize = 65537;
+    
+    HealthCheckSettings healthCheck;
+    OutlierDetectionSettings outlierDetection;
+    CircuitBreakerSettings circuitBreaker;
+    UpstreamTimeoutSettings timeouts;
+    RetryPolicySettings retryPolicy;
+    atomic<int64_t> lastOutlierSweep; // steady_clock ticks
+    
+    // Final status sent to clients, and retries, for /metrics
+    TrafficMetrics traffic;
+    ShardedCounter hedges;           // second attempts started
+    ShardedCounter hedgesWon;        // ... that answered first
+    ShardedCounter deadlineExceeded; // requests answered with 504
+    
+    unique_ptr<ResponseCache> cache; // null unless caching is enabled
+    unique_ptr<SingleFlight> singleFlight; // null unless coalescing is enabled
+    unique_ptr<RateLimiter> rateLimit;     // null unless rate limiting is enabled
+    unique_ptr<ConcurrencyLimiter> concurrencyLimit; // null unless adaptive concurrency is enabled
+    unique_ptr<RetryBudget> retryBudget;   // null: retries are only capped by maxRetries
+    
+    // WEIGHTED_ROUND_ROBIN: seconds over which a recovered backend's weight
+    // ramps up to its configured value (0 = off)
+    int slowStartSeconds;
+    static const size_t maxScheduleLength = 4096;
+    
+    // Canonical config file definition (empty when built through the API),
+    // and the DNS watches feeding the backends, dropped when it is retired
+    string fingerprint;
+    vector<DnsResolver::WatchId> dnsWatches;
+    
+    // Retired snapshots are freed once no selection can still be reading them
+    static const int snapshotGracePeriodSeconds = 10;
+    // A backend DNS stopped returning stays a (non-selectable) member this
+    // long, so an address that flaps back keeps its pool and state
+    static const int removedBackendGraceSeconds = 60;
+    
+    atomic<const BackendSnapshot*> snapshot;
+    mutex snapshotMutex; // serializes writers
+    unique_ptr<BackendSnapshot> currentSnapshot;
+    vector<unique_ptr<BackendSnapshot>> retiredSnapshots;
+    
     ServiceConfig(const string& p, LoadBalancingAlgorithm algo);
     
-    shared_ptr<Backend> selectBackend(const string& clientIP);
-    shared_ptr<Backend> selectRoundRobin();
-    shared_ptr<Backend> selectLeastConnections();
-    shared_ptr<Backend> selectIPHash(const string& clientIP);
-};
-
-// HTTP Request parser
-struct HttpRequest {
-    string method;
-    string path;
-    string version;
-    map<string, string> headers;
-    string body;
+    void addBackend(shared_ptr<Backend> backend);
+    // Copy of the member list (it can grow at runtime through DNS discovery)
+    vector<shared_ptr<Backend>> members();
+    // Republishes the snapshot if any backend's selectability changed
+    void refreshSnapshot();
+    // Undoes a DNS removal; false if the backend was dropped already
+    bool restoreBackend(Backend* backend);
+    // Drops members removed for longer than the grace period, returning
+    // them, and frees dropped ones no request holds any more
+    vector<shared_ptr<Backend>> dropRemovedBackends();
     
-    static HttpRequest parse(const string& rawRequest);
-    string toString() const;
-};
-
-// HTTP Response parser
-struct HttpResponse {
-    int statusCode;
-    string statusMessage;
-    string version;
-    map<string, string> headers;
-    string body;
+    // Passive outlier detection inputs, and the periodic rate/latency sweep
+    void recordResponse(Backend* backend, int status, double latencyMs);
+    void recordConnectError(Backend* backend);
+    void evaluateOutliers();
     
-    static HttpResponse parse(const string& rawResponse);
-    string toString() const;
+    // The returned backend stays valid while the service does, or once
+    // dropped, while counted in its activeConnections/pendingConnects
+    Backend* selectBackend(const string& clientIP, const HttpHead& request);
+    // The usual choice unless it was tried already, then the next member
+    // after it that was not; null once every selectable backend was tried
+    Backend* selectUntried(const string& clientIP, const HttpHead& request, const vector<Backend*>& tried);
+    Backend* selectRoundRobin(const BackendSnapshot& set);
+    Backend* selectLeastConnections(const BackendSnapshot& set);
+    Backend* selectIPHash(const BackendSnapshot& set, const string& clientIP);
+    Backend* selectConsistentHash(const BackendSnapshot& set, string_view key);
+    Backend* selectPowerOfTwo(const BackendSnapshot& set);
+    Backend* selectPeakEwma(const BackendSnapshot& set);
+    Backend* selectWeightedRoundRobin(const BackendSnapshot& set);
+    
+private:
+    bool snapshotIsCurrent(chrono::steady_clock::time_point now) const;
+    bool eject(Backend* backend, const string& reason);
+    static vector<uint32_t> buildMaglevTable(const vector<Backend*>& members);
+    static vector<uint32_t> buildSmoothSchedule(vector<int> weights);
 };
 
-// Health checker (runs in background thread)
+// Health checker: probes every backend concurrently from one thread with
+// its own event loop (non-blocking connects, per-probe timeout timers)
 class HealthChecker {
 private:
-    vector<shared_ptr<Backend>> allBackends;
-    atomic<bool> running;
+    struct Target {
+        shared_ptr<Backend> backend;
+        shared_ptr<ServiceConfig> service;
+        int fd = -1;
+        bool connected = false;
+        string request;
+        size_t sent = 0;
+        string response;
+        EventLoop::TimerId timer = 0;
+        int passes = 0;
+        int failures = 0;
+    };
+    
+    EventLoop loop;
     thread healthCheckThread;
-    int checkIntervalSeconds;
+    vector<unique_ptr<Target>> targets; // loop thread only
+    minstd_rand random;
     
-    void healthCheckLoop();
+    void schedule(Target* target, bool first);
+    void startProbe(Target* target);
+    void onProbeEvent(Target* target, uint32_t events);
+    void finishProbe(Target* target, bool passed);
     
 public:
-    HealthChecker(int intervalSeconds = 10);
+    HealthChecker();
     ~HealthChecker();
     
-    void addBackend(shared_ptr<Backend> backend);
+    // Thread-safe; probing starts after a random fraction of the interval
+    void addBackend(shared_ptr<Backend> backend, shared_ptr<ServiceConfig> service);
+    // Thread-safe; stops probing the backend
+    void removeBackend(shared_ptr<Backend> backend);
+    // Thread-safe; stops probing the service's backends
+    void removeService(shared_ptr<ServiceConfig> service);
     void start();
     void stop();
 };
 
+// Proxy state of one accepted client connection
+enum class ConnectionState {
+    TLS_HANDSHAKE,
+    READING_REQUEST,
+    CONNECTING_BACKEND,
+    SENDING_REQUEST,
+    READING_RESPONSE,
+    RELAYING_RESPONSE,
+    WRITING_RESPONSE,
+    WAITING_FOR_CACHE,  // parked behind another request's fetch of the same key
+    WAITING_FOR_FLIGHT, // parked for a copy of an identical in-flight request's response
+    WAITING_FOR_PERMIT, // queued for a place under the service's concurrency limit
+    RETRY_BACKOFF,      // pausing before the next attempt
+    HTTP2               // multiplexed: the requests are its streams
+};
+
+struct Worker;
+struct LoadBalancerConfig;
+struct ServiceDefinition;
+
+// Hedge of a GET, racing the connection's own attempt on another backend.
+// It only gets as far as the first response byte: then it is adopted as
+// the connection's attempt, and the slower one is dropped.
+struct HedgedAttempt {
+    Backend* backend = nullptr;
+    int fd = -1;
+    bool reused = false;
+    bool connectPending = false; // counted in backend->pendingConnects
+    ConnectionState state = ConnectionState::CONNECTING_BACKEND;
+    size_t sent = 0;             // of the connection's upstreamRequest
+    chrono::steady_clock::time_point started;
+};
+
+struct ClientConnection {
+    int clientSocket;
+    uint64_t id; // tells reuses of the same fd apart in deferred callbacks
+    string clientIP;
+    Worker* worker;
+    ConnectionState state;
+    SSL* tls; // null on plain HTTP connections
+    
+    // Client limits: this connection's place among its IP's connections,
+    // or none left, in which case its requests are refused
+    RateLimiter::Slot connectionSlot;
+    bool overConnectionLimit;
+    
+    // HTTP/2: the session, and the streams running on it. Each stream is a
+    // connection of its own (socketless, under a negative clientSocket) that
+    // takes its one request through the HTTP/1.1 state machine.
+    unique_ptr<Http2Session> http2;
+    unordered_map<uint32_t, ClientConnection*> streams;
+    bool http2FlushPosted;
+    bool http2ReadPaused; // output full; resumed once it drains
+    ClientConnection* parent; // streams: the HTTP/2 connection they belong to
+    uint32_t streamId;
+    size_t http2BodyHeld;     // streams: request body taken from the session
+    
+    // Client side
+    string inBuffer;
+    string outBuffer;
+    size_t outOffset;
+    bool closeAfterWrite;
+    int requestsServed;
+    
+    // Current request; its head and body are views into the front of
+    // inBuffer (pipelined requests wait behind it)
+    HttpParser requestParser;
+    HttpHead request;
+    string_view requestBody;
+    const char* requestBase; // inBuffer data when the head was parsed
+    size_t requestLength;    // inBuffer bytes to drop once it is answered
+    bool requestHeadParsed;
+    bool requestComplete;
+    size_t requestBodyStart;
+    size_t requestScanned;
+    BodyFramer requestFramer;
+    bool clientKeepAlive;
+    shared_ptr<ServiceConfig> service;
+    int attempt;                      // upstream attempts so far, hedges included
+    vector<Backend*> triedBackends;   // retries and hedges go elsewhere if they can
+    chrono::steady_clock::time_point deadline; // totalTimeoutMs from the first attempt
+    RateLimiter::Slot requestSlot; // the service's rate limit, while maxConcurrent applies
+    bool holdsPermit;              // counted by the service's concurrency limiter
+    
+    // Response cache: key of a cacheable request, whether other misses of
+    // the key wait for this one, and the response being captured to fill it
+    string cacheKey;
+    bool cacheLeader;
+    shared_ptr<CachedResponse> cacheFill;
+    
+    // Single-flight: key of the request, whether it leads the key's fetch,
+    // and the response being captured for its followers
+    string flightKey;
+    bool flightLeader;
+    shared_ptr<CachedResponse> flightFill;
+    
+    // Backend side
+    Backend* backend; // owned by service
+    int backendSocket;
+    bool backendReused;
+    bool connectPending; // counted in backend->pendingConnects
+    string upstreamRequest;
+    size_t upstreamOffset;
+    string upstreamResponse;
+    chrono::steady_clock::time_point forwardStart; // latency sample origin
+    double upstreamLatencyMs; // of the current attempt; -1 until its head arrives
+    uint64_t upstreamBytes;   // response bytes read in the current attempt
+    unique_ptr<HedgedAttempt> hedge; // null unless a hedge is racing the attempt
+    EventLoop::TimerId hedgeTimer;
+    
+    // Response framing, so keep-alive upstream sockets can be reused
+    HttpParser responseParser;
+    HttpHead responseHead; // final (non-1xx) head, views into upstreamResponse
+    bool responseHeadParsed;
+    size_t responseScanned;
+    size_t responseHeadStart;
+    bool upstreamKeepAlive;
+    BodyFramer responseFramer;
+    
+    // Zero-copy relay pipe (borrowed from the worker while streaming)
+    int pipeRead;
+    int pipeWrite;
+    size_t pipeBytes;
+    bool useSplice;
+    
+    EventLoop::TimerId timer;
+    
+    ClientConnection(int sock, const string& ip, Worker* w);
+    
+    // Back to READING_REQUEST for the next request on a keep-alive connection
+    void resetRequest();
+    // Clears the upstream response state for an attempt started at started
+    void beginAttempt(chrono::steady_clock::time_point started);
+};
+
+// Background fetch that refreshes a stale cache entry while clients are
+// served the stale copy; runs on the worker that found the entry stale
+struct CacheRefresh {
+    shared_ptr<ServiceConfig> service;
+    Backend* backend = nullptr;
+    string key;
+    shared_ptr<const CachedResponse> stale;
+    string request;
+    size_t sent = 0;
+    int fd = -1;
+    bool connectPending = false;
+    string response;
+    HttpParser parser{false};
+    size_t headStart = 0;       // of the final (non-1xx) head
+    size_t scanned = 0;         // response bytes framed so far
+    bool headParsed = false;
+    BodyFramer framer;
+    chrono::steady_clock::time_point started;
+    EventLoop::TimerId timer = 0;
+};
+
+// One event loop thread with its own SO_REUSEPORT listening socket
+struct Worker {
+    int id;
+    EventLoop loop;
+    int listenSocket;
+    int tlsListenSocket; // -1 unless TLS is enabled
+    thread loopThread;
+    unordered_map<int, unique_ptr<ClientConnection>> connections;
+    vector<pair<int, int>> idlePipes; // empty splice pipes for reuse
+    uint64_t nextConnectionId;
+    int nextStreamKey; // connections key HTTP/2 streams from -1 down
+    unordered_map<int, unique_ptr<CacheRefresh>> cacheRefreshes; // by backend fd
+    minstd_rand random; // retry backoff jitter
+    
+    Worker(int workerId)
+        : id(workerId), listenSocket(-1), tlsListenSocket(-1), nextConnectionId(0), nextStreamKey(-1),
+          random(random_device()()) {}
+};
+
 // Main Load Balancer class
 class LoadBalancer {
 private:
     int listenPort;
     int statsPort;
+    int workerThreads;
+    // Reloadable; read by the workers on every request
+    atomic<int> keepAliveTimeoutMs;
+    atomic<int> maxKeepAliveRequests;
+    atomic<bool> zeroCopyRelay;
+    // Requests reach services through the route table; the map is for
+    // configuration, maintenance and stats, and is replaced on reload
     map<string, shared_ptr<ServiceConfig>> services;
+    mutex servicesMutex;
     atomic<bool> running;
+    
+    // Config file: path, reload serialization and the watcher of it and of
+    // the TLS certificate
+    static constexpr int configPollIntervalMs = 2000;
+    string configPath;
+    mutex configMutex;
+    unique_ptr<LoadBalancerConfig> startupConfig; // settings a reload cannot change
+    thread fileWatcher;
+    mutex watcherMutex;
+    condition_variable watcherWake;
+    
+    // Graceful drain: no new connections, requests in flight finish and
+    // keep-alive connections close once idle; start() returns when every
+    // worker is empty or the timeout has passed
+    atomic<bool> draining{false};
+    atomic<int> drainTimeoutSeconds{30};
+    atomic<int> drainDelaySeconds{5};
+    mutex drainMutex; // a drain waits for a handoff in progress
+    mutex stopMutex;
+    
+    // Listening sockets as passed to a successor process
+    static const int handoffPollIntervalMs = 500;
+    string handoffPath;
+    ListenerHandoff handoff;
+    ListenerHandoff::Listeners listeners; // set before the threads start
+    atomic<bool> handedOver{false};
+    thread handoffThread;
+    thread statsThread;
+    
+    // Compiled routes: explicit ones first, then a prefix route per service.
+    // Published RCU-style like backend snapshots; retired tables are freed
+    // once no request can still be matching against them.
+    static const int routeGracePeriodSeconds = 10;
+    atomic<const RouteTable*> routeTable{nullptr};
+    mutex routesMutex; // serializes writers
+    vector<Route> routes;
+    unique_ptr<RouteTable> currentRoutes;
+    vector<unique_ptr<RouteTable>> retiredRoutes;
     unique_ptr<HealthChecker> healthChecker;
+    unique_ptr<DnsResolver> resolver;
+    vector<unique_ptr<Worker>> workers;
+    PoolSettings poolSettings;
+    unique_ptr<TlsContext> tls; // null unless the HTTPS listener is enabled
+    Http2Settings http2Settings; // set before start()
+    unique_ptr<RateLimiter> clientLimits; // per client IP across all services; null unless set
+    
+    // Proxy settings
+    static const int maxRetries = 3;
+    static const size_t maxRequestHeaderBytes = 64 * 1024;
+    static const size_t maxResponseHeaderBytes = 64 * 1024;
+    static const size_t maxRequestBodyBytes = 16 * 1024 * 1024;
+    static const int maintenanceIntervalMs = 1000;
+    static const size_t relayChunkBytes = 64 * 1024;
+    static const size_t maxIdlePipes = 64;
+    static const int clientTimeoutMs = 60000;
+    static const int tlsHandshakeTimeoutMs = 10000;
     
     // Statistics
-    atomic<uint64_t> totalRequests;
-    atomic<uint64_t> failedRequests;
-    atomic<uint64_t> totalBytesReceived;
-    atomic<uint64_t> totalBytesSent;
+    ShardedCounter totalRequests;
+    ShardedCounter failedRequests;
+    ShardedCounter totalBytesReceived;
+    ShardedCounter totalBytesSent;
+    ShardedCounter http2Connections;
+    ShardedCounter http2Streams;
+    ShardedCounter http2StreamResets;
+    
+    unique_ptr<AccessLog> accessLog;
+    
+    // Event loop workers
+    int openListenSocket(int port);
+    void runWorker(Worker* worker);
+    void scheduleMaintenance(Worker* worker);
+    void runMaintenance();
+    void acceptConnections(Worker* worker, bool secure);
+    
+    // Drain and handoff
+    void stopAccepting(Worker* worker);
+    void checkDrained(Worker* worker);
+    void serveHandoff();
+    int openStatsSocket();
+    void serveStats(int statsSocket);
+    
+    // Client connection state machine
+    void onClientEvent(ClientConnection* conn, uint32_t events);
+    void continueHandshake(ClientConnection* conn);
+    // recv()/send() on the client socket, through TLS if the connection has
+    // it; a TLS record that needs the other direction reports EAGAIN
+    ssize_t clientRecv(ClientConnection* conn, char* buffer, size_t length);
+    ssize_t clientSend(ClientConnection* conn, const char* data, size_t length);
     
-    mutex logMutex;
+    // HTTP/2 front end; streams feed and drain the session through
+    // clientRecv()/clientSend() like any other connection
+    void startHttp2(ClientConnection* conn);
+    bool upgradeToHttp2(ClientConnection* conn);
+    void readHttp2(ClientConnection* conn);
+    void runHttp2Events(ClientConnection* conn);
+    void openStream(ClientConnection* conn, uint32_t streamId, string& request);
+    void flushHttp2(ClientConnection* conn);
+    void scheduleHttp2Flush(ClientConnection* conn);
+    void readRequest(ClientConnection* conn);
+    int parseRequest(ClientConnection* conn);
+    void handleClient(ClientConnection* conn);
+    // extraHeaders: header lines, each CRLF-terminated
+    void sendSimpleResponse(ClientConnection* conn, int statusCode, const string& reason,
+                            const string& body, const string& contentType = "text/plain",
+                            const string& extraHeaders = "");
+    // 429 with Retry-After; false (nothing sent) if the request is within limits
+    bool rejectOverLimit(ClientConnection* conn, const shared_ptr<ServiceConfig>& service);
+    void sendResponse(ClientConnection* conn, const string& response);
+    int flushClientBuffer(ClientConnection* conn);
+    void writeToClient(ClientConnection* conn);
+    void finishResponse(ClientConnection* conn);
+    void closeConnection(ClientConnection* conn);
+    void resetTimer(ClientConnection* conn, int timeoutMs);
+    void onTimeout(ClientConnection* conn);
+    
+    // Backend side of the state machine
+    void tryNextBackend(ClientConnection* conn);
+    int connectBackend(Backend* backend);
+    void onBackendEvent(ClientConnection* conn, uint32_t events);
+    void sendToBackend(ClientConnection* conn);
+    void readFromBackend(ClientConnection* conn);
+    void forwardRequest(ClientConnection* conn, bool reuseIdle);
+    bool frameResponse(ClientConnection* conn);
+    void onBackendClosed(ClientConnection* conn);
+    // timedOut: the attempt hit its connect or read timeout
+    void failForward(ClientConnection* conn, bool timedOut = false);
+    void closeBackendSocket(ClientConnection* conn, bool reusable);
+    void releaseBackend(ClientConnection* conn);
+    
+    // Retries, deadlines and hedged requests
+    void retryRequest(ClientConnection* conn, bool requestSent, bool timedOut);
+    // timeoutMs, or less if the request's deadline comes first
+    int attemptTimeoutMs(const ClientConnection* conn, int timeoutMs) const;
+    void sendGatewayTimeout(ClientConnection* conn);
+    void scheduleHedge(ClientConnection* conn);
+    void startHedge(ClientConnection* conn);
+    void onHedgeEvent(ClientConnection* conn, uint32_t events);
+    void adoptHedge(ClientConnection* conn, unique_ptr<HedgedAttempt> hedge);
+    void dropHedge(ClientConnection* conn, bool failed);
+    
+    // Streaming response relay (splice() when the body needs no parsing)
+    void startRelay(ClientConnection* conn);
+    void pumpRelay(ClientConnection* conn);
+    void finishRelay(ClientConnection* conn);
+    void abortRelay(ClientConnection* conn);
+    bool acquirePipe(ClientConnection* conn);
+    void releasePipe(ClientConnection* conn);
+    
+    // Response cache
+    bool serveFromCache(ClientConnection* conn, bool coalesce);
+    void resumeCacheWaiter(ClientConnection* conn);
+    void captureResponse(ClientConnection* conn, const char* data, size_t len);
+    void fillCache(ClientConnection* conn);
+    void releaseCacheFill(ClientConnection* conn);
+    void startCacheRefresh(ClientConnection* conn, shared_ptr<const CachedResponse> stale);
+    void armCacheRefreshTimer(Worker* worker, CacheRefresh* refresh);
+    void onCacheRefreshEvent(Worker* worker, CacheRefresh* refresh, uint32_t events);
+    void finishCacheRefresh(Worker* worker, CacheRefresh* refresh, bool succeeded);
+    
+    // Adaptive concurrency: a place for the request, and handing it on
+    bool acquirePermit(ClientConnection* conn);
+    void releasePermit(ClientConnection* conn);
+    void shedRequest(ClientConnection* conn);
+    
+    // Single-flight request coalescing
+    bool joinFlight(ClientConnection* conn);
+    void releaseFlight(ClientConnection* conn, bool completed);
+    void serveFlightResponse(ClientConnection* conn, shared_ptr<const CachedResponse> response);
     
-    void handleClient(int clientSocket, const string& clientIP);
     void handleStatsRequest(int clientSocket);
     string generateStatsHTML();
-    string generateHealthCheckResponse();
+    string generateMetrics();
     
-    shared_ptr<ServiceConfig> matchService(const string& path);
-    bool forwardRequest(int clientSocket, HttpRequest& request, 
-                       shared_ptr<Backend> backend,
-                       const string& clientIP);
+    // Builds and publishes the table for the given explicit routes
+    bool publishRoutes(const vector<Route>& explicitRoutes);
+    const CompiledRoute* matchRoute(const HttpHead& request, string_view path);
     
-    void logRequest(const string& clientIP, const string& method,
-                   const string& path, int statusCode,
-                   const string& backendName);
+    shared_ptr<ServiceConfig> findService(const string& path);
+    map<string, shared_ptr<ServiceConfig>> currentServices();
+    void addBackend(const shared_ptr<ServiceConfig>& service, const string& name,
+                    const string& host, int port, int maxFails, int failTimeout, int weight);
+    void watchDnsBackends(const shared_ptr<ServiceConfig>& service, const string& host, int port,
+                          int maxFails, int failTimeout, int weight);
+    
+    // Config file: a fully built service, and the file watcher thread
+    shared_ptr<ServiceConfig> buildService(const ServiceDefinition& definition);
+    void retireService(const shared_ptr<ServiceConfig>& service);
+    void watchFiles();
+    
+    // Queues an access log line for the connection's current request
+    void logRequest(const ClientConnection* conn, int statusCode,
+                    string_view backendName, string_view outcome = "");
     
 public:
     LoadBalancer(int port = 80, int stats = 8081);
     ~LoadBalancer();
     
+    // Number of event loop threads (0 = one per CPU core)
+    void setWorkerThreads(int count);
+    // Upstream keep-alive pool limits for backends added afterwards
+    void setUpstreamPoolSettings(const PoolSettings& settings);
+    // Client keep-alive idle timeout and request cap per connection
+    void setClientKeepAlive(int timeoutSeconds, int maxRequests);
+    // Relay fixed-length and close-delimited bodies with splice() (default on)
+    void setZeroCopyRelay(bool enabled);
+    
+    // Also routes requests under path to the service, with the prefix
+    // replaced by "/", unless an explicit route matches first
     void addService(const string& path, LoadBalancingAlgorithm algo);
+    // Explicit exact/prefix/regex route with host, method and header
+    // predicates; false if the service is unknown or the route malformed
+    bool addRoute(const Route& route);
+    // Replaces all explicit routes at once (in-flight requests are unaffected)
+    bool setRoutes(const vector<Route>& newRoutes);
+    // What a CONSISTENT_HASH service hashes on (default: client IP)
+    void setHashKey(const string& path, HashKeySource source, const string& name = "");
     void addBackendToService(const string& path, const string& name,
                             const string& host, int port,
-                            int maxFails = 3, int failTimeout = 30);
+                            int maxFails = 3, int failTimeout = 30, int weight = 1);
+    // One backend per A record of host (e.g. a headless Kubernetes service),
+    // kept in sync as DNS changes; new addresses get the service's slow start
+    void addBackendsFromDns(const string& path, const string& host, int port,
+                            int maxFails = 3, int failTimeout = 30, int weight = 1);
+    // Active health check settings of a service (default: TCP every 30s)
+    void setHealthCheck(const string& path, const HealthCheckSettings& settings);
+    void setOutlierDetection(const string& path, const OutlierDetectionSettings& settings);
+    void setCircuitBreaker(const string& path, const CircuitBreakerSettings& settings);
+    // Connect, read and overall timeouts of the service's upstream requests
+    void setUpstreamTimeouts(const string& path, const UpstreamTimeoutSettings& settings);
+    // Retry backoff and hedging of the service's requests
+    void setRetryPolicy(const string& path, const RetryPolicySettings& settings);
+    // Weight ramp-up for recovered backends of a WEIGHTED_ROUND_ROBIN service
+    void setSlowStart(const string& path, int seconds);
+    // Caches cacheable GET responses of the service in memory
+    void setCache(const string& path, const CacheSettings& settings);
+    // Identical concurrent GET/HEAD requests of the service share one upstream fetch
+    void setSingleFlight(const string& path, const SingleFlightSettings& settings);
+    // Requests per second and concurrent requests per client IP, route or
+    // header of the service; requests over them get 429 with Retry-After
+    void setRateLimit(const string& path, const RateLimitSettings& settings);
+    // Caps the service's outstanding upstream requests at a limit that
+    // follows its latency; requests over it queue briefly, then get 503
+    void setAdaptiveConcurrency(const string& path, const AdaptiveConcurrencySettings& settings);
+    // Retries of the service's requests at most settings.percent of them
+    void setRetryBudget(const string& path, const RetryBudgetSettings& settings);
+    // Requests per second and connections per client IP, whatever the
+    // service; the key source is ignored. Before start().
+    void setClientLimits(const RateLimitSettings& settings);
+    // Format, destination and sampling of the access log; before start()
+    bool setAccessLog(const AccessLogSettings& settings);
+    // HTTPS listener on settings.port besides the plain one; false if the
+    // certificate or key does not load. Before start().
+    bool setTls(const TlsSettings& settings);
+    // HTTP/2 on both listeners (default on); before start()
+    void setHttp2(const Http2Settings& settings);
+    
+    // Configures everything from a JSON file (see Config.h) before start();
+    // start() then watches the file and reloads it when it changes
+    bool loadConfigFile(const string& path);
+    // Re-reads the config file. Unchanged services keep running as they are;
+    // added, changed and removed ones are swapped in by publishing a new
+    // route table, and requests already in flight finish on the old ones.
+    // A file that does not parse or validate leaves everything as it was.
+    bool reloadConfig();
+    // Services, routes and the reloadable settings, all at once
+    bool applyConfig(const LoadBalancerConfig& config);
+    
+    // How long drain() lets requests in flight finish (default 30s)
+    void setDrainTimeout(int seconds);
+    // How long drain() keeps accepting, failing /health, before it closes
+    // the listeners (default 5s)
+    void setDrainDelay(int seconds);
+    // Unix socket through which a new process started with the same path
+    // takes over the listening sockets; before start()
+    void setHandoffSocket(const string& path);
+    // Thread-safe, returns at once: stops accepting, fails /health, closes
+    // connections as their requests finish; start() returns once all are
+    // closed, or after the drain timeout
+    void drain();
     
     void start();
     void stop();
@@ -0,0 +1,152 @@
+#include "Metrics.h"
+#include <cstdio>
+
+using namespace std;
+
+// ==================== Sharded Counter Implementation ====================
+
+int metricsShard() {
+    static atomic<int> nextShard(0);
+    thread_local int shard = nextShard.fetch_add(1, memory_order_relaxed) % metricsShardCount;
+    return shard;
+}
+
+uint64_t ShardedCounter::load() const {
+    uint64_t total = 0;
+    for (const auto& cell : cells) {
+        total += cell.value.load(memory_order_relaxed);
+    }
+    return total;
+}
+
+// ==================== Traffic Metrics Implementation ====================
+
+const double LatencyBuckets::upperBounds[LatencyBuckets::count - 1] = {
+    0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+    0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+int LatencyBuckets::index(double seconds) {
+    int i = 0;
+    while (i < count - 1 && seconds > upperBounds[i]) i++;
+    return i;
+}
+
+void TrafficMetrics::observe(atomic<uint64_t>* buckets, atomic<uint64_t>& sumMicros, double ms) {
+    if (ms < 0) ms = 0;
+    buckets[LatencyBuckets::index(ms / 1000)].fetch_add(1, memory_order_relaxed);
+    sumMicros.fetch_add((uint64_t)(ms * 1000), memory_order_relaxed);
+}
+
+void TrafficMetrics::recordStatus(int statusCode) {
+    int statusClass = statusCode / 100;
+    if (statusClass < 1 || statusClass > 5) return;
+    local().responses[statusClass - 1].fetch_add(1, memory_order_relaxed);
+}
+
+void TrafficMetrics::recordConnect(double ms) {
+    TrafficShard& shard = local();
+    observe(shard.connectBuckets, shard.connectSumMicros, ms);
+}
+
+void TrafficMetrics::recordResponse(double ms) {
+    TrafficShard& shard = local();
+    observe(shard.responseBuckets, shard.responseSumMicros, ms);
+}
+
+TrafficTotals TrafficMetrics::totals() const {
+    TrafficTotals t;
+    for (const auto& shard : shards) {
+        for (int i = 0; i < 5; i++) {
+            t.responses[i] += shard.responses[i].load(memory_order_relaxed);
+        }
+        t.bytesIn += shard.bytesIn.load(memory_order_relaxed);
+        t.bytesOut += shard.bytesOut.load(memory_order_relaxed);
+        t.retries += shard.retries.load(memory_order_relaxed);
+        t.failures += shard.failures.load(memory_order_relaxed);
+        for (int i = 0; i < LatencyBuckets::count; i++) {
+            t.connectBuckets[i] += shard.connectBuckets[i].load(memory_order_relaxed);
+            t.responseBuckets[i] += shard.responseBuckets[i].load(memory_order_relaxed);
+        }
+        t.connectSumMicros += shard.connectSumMicros.load(memory_order_relaxed);
+        t.responseSumMicros += shard.responseSumMicros.load(memory_order_relaxed);
+    }
+    return t;
+}
+
+// ==================== Prometheus Writer Implementation ====================
+
+void PrometheusWriter::family(const char* name, const char* type, const char* help) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+void PrometheusWriter::sample(const char* name, const string& labels, double value) {
+    char number[32];
+    snprintf(number, sizeof(number), "%.9g", value);
+    out += name;
+    if (!labels.empty()) {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+    out += ' ';
+    out += number;
+    out += '\n';
+}
+
+void PrometheusWriter::sample(const char* name, const string& labels, uint64_t value) {
+    out += name;
+    if (!labels.empty()) {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+    out += ' ';
+    out += to_string(value);
+    out += '\n';
+}
+
+void PrometheusWriter::histogram(const char* name, const string& labels,
+                                 const uint64_t* buckets, uint64_t sumMicros) {
+    string series = string(name) + "_bucket";
+    string prefix = labels.empty() ? "" : labels + ",";
+    uint64_t cumulative = 0;
+
+    for (int i = 0; i < LatencyBuckets::count; i++) {
+        cumulative += buckets[i];
+        char bound[32];
+        if (i < LatencyBuckets::count - 1) {
+            snprintf(bound, sizeof(bound), "%g", LatencyBuckets::upperBounds[i]);
+        } else {
+            snprintf(bound, sizeof(bound), "+Inf");
+        }
+        sample(series.c_str(), prefix + "le=\"" + bound + "\"", cumulative);
+    }
+    sample((string(name) + "_sum").c_str(), labels, sumMicros / 1e6);
+    sample((string(name) + "_count").c_str(), labels, cumulative);
+}
+
+string PrometheusWriter::label(const char* name, const string& value) {
+    string result = name;
+    result += "=\"";
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            result += '\\';
+            result += c;
+        } else if (c == '\n') {
+            result += "\\n";
+        } else {
+            result += c;
+        }
+    }
+    result += '"';
+    return result;
+}
@@ -0,0 +1,105 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <atomic>
+#include <cstdint>
+using namespace std;
+
+// Hot-path counters are split into per-thread shards, each on its own
+// cache line, so recording never bounces a line between cores. Readers
+// (the stats server) sum the shards; totals are eventually consistent.
+static const int metricsShardCount = 64;
+
+// Shard index of the calling thread, assigned round-robin on first use
+int metricsShard();
+
+// Monotonic counter sharded across threads
+class ShardedCounter {
+private:
+    struct alignas(64) Cell {
+        atomic<uint64_t> value{0};
+    };
+    Cell cells[metricsShardCount];
+
+public:
+    void add(uint64_t n) { cells[metricsShard()].value.fetch_add(n, memory_order_relaxed); }
+    void operator++(int) { add(1); }
+    void operator+=(uint64_t n) { add(n); }
+    uint64_t load() const;
+};
+
+// Fixed exponential latency buckets, in seconds (the last bucket is +Inf)
+struct LatencyBuckets {
+    static const int count = 15;
+    static const double upperBounds[count - 1];
+
+    static int index(double seconds);
+};
+
+// One thread's share of a service's or backend's traffic
+struct alignas(64) TrafficShard {
+    atomic<uint64_t> responses[5] = {};       // by status class, 1xx..5xx
+    atomic<uint64_t> bytesIn{0};              // from the backend
+    atomic<uint64_t> bytesOut{0};             // to the backend
+    atomic<uint64_t> retries{0};
+    atomic<uint64_t> failures{0};
+    atomic<uint64_t> connectBuckets[LatencyBuckets::count] = {};
+    atomic<uint64_t> connectSumMicros{0};
+    atomic<uint64_t> responseBuckets[LatencyBuckets::count] = {};
+    atomic<uint64_t> responseSumMicros{0};
+};
+
+// Sum of all shards at one point in time (non-cumulative buckets)
+struct TrafficTotals {
+    uint64_t responses[5] = {};
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    uint64_t retries = 0;
+    uint64_t failures = 0;
+    uint64_t connectBuckets[LatencyBuckets::count] = {};
+    uint64_t connectSumMicros = 0;
+    uint64_t responseBuckets[LatencyBuckets::count] = {};
+    uint64_t responseSumMicros = 0;
+};
+
+// Request counts, bytes and latency histograms for one service or backend
+class TrafficMetrics {
+private:
+    TrafficShard shards[metricsShardCount];
+
+    TrafficShard& local() { return shards[metricsShard()]; }
+    static void observe(atomic<uint64_t>* buckets, atomic<uint64_t>& sumMicros, double ms);
+
+public:
+    void recordStatus(int statusCode);
+    void recordConnect(double ms);
+    void recordResponse(double ms);
+    void addBytesIn(uint64_t n) { local().bytesIn.fetch_add(n, memory_order_relaxed); }
+    void addBytesOut(uint64_t n) { local().bytesOut.fetch_add(n, memory_order_relaxed); }
+    void addRetry() { local().retries.fetch_add(1, memory_order_relaxed); }
+    void addFailure() { local().failures.fetch_add(1, memory_order_relaxed); }
+
+    TrafficTotals totals() const;
+};
+
+// Builds a Prometheus text exposition (format 0.0.4)
+class PrometheusWriter {
+private:
+    string out;
+
+public:
+    // HELP/TYPE lines; call once per metric family before its samples
+    void family(const char* name, const char* type, const char* help);
+    // labels is a preformatted list such as service="/a/",backend="b1"
+    void sample(const char* name, const string& labels, double value);
+    void sample(const char* name, const string& labels, uint64_t value);
+    // _bucket/_sum/_count series from non-cumulative bucket counts
+    void histogram(const char* name, const string& labels,
+                   const uint64_t* buckets, uint64_t sumMicros);
+
+    static string label(const char* name, const string& value);
+    const string& text() const { return out; }
+};
+
+#endif // METRICS_H
@@ -0,0 +1,158 @@
+#include "RateLimiter.h"
+#include <chrono>
+#include <functional>
+#include <algorithm>
+
+using namespace std;
+
+// ==================== RateLimiter::Slot ====================
+
+RateLimiter::Slot& RateLimiter::Slot::operator=(Slot&& other) noexcept {
+    if (this != &other) {
+        reset();
+        bucket = move(other.bucket);
+    }
+    return *this;
+}
+
+void RateLimiter::Slot::reset() {
+    if (!bucket) return;
+    bucket->inFlight.fetch_sub(1, memory_order_relaxed);
+    bucket.reset();
+}
+
+// ==================== RateLimiter Implementation ====================
+
+RateLimiter::RateLimiter(const RateLimitSettings& limitSettings)
+    : config(limitSettings), interval(0), tolerance(0) {
+    if (config.requestsPerSecond > 0) {
+        interval = max<int64_t>(1, chrono::duration_cast<chrono::steady_clock::duration>(
+                                       chrono::duration<double>(1.0 / config.requestsPerSecond)).count());
+        // A burst of n lets n requests through at once: the last of them
+        // finds the bucket n - 1 intervals ahead of now
+        int burst = config.burst > 0 ? config.burst : max(1, (int)config.requestsPerSecond);
+        tolerance = interval * (burst - 1);
+    }
+    if (config.keySource == RateLimitKeySource::ROUTE) {
+        routeBucket = make_shared<Bucket>();
+    }
+}
+
+string RateLimiter::keyFor(const HttpHead& request, const string& clientIP) const {
+    switch (config.keySource) {
+        case RateLimitKeySource::ROUTE:
+            return "";
+        case RateLimitKeySource::HEADER: {
+            string_view value = request.header(config.headerName);
+            if (!value.empty()) return "h:" + string(value);
+            break;
+        }
+        case RateLimitKeySource::CLIENT_IP:
+            break;
+    }
+    return clientIP;
+}
+
+int RateLimiter::admit(const string& key, Slot& slot) {
+    if (interval == 0 && config.maxConcurrent <= 0) return 0;
+    shared_ptr<Bucket> bucket = bucketFor(key);
+    if (config.maxConcurrent > 0 && !tryEnter(bucket, slot)) {
+        concurrencyLimited++;
+        return 1;
+    }
+    int retryAfter = tryTake(*bucket);
+    if (retryAfter > 0) {
+        slot.reset();
+        rateLimited++;
+    }
+    return retryAfter;
+}
+
+int RateLimiter::takeToken(const string& key) {
+    if (interval == 0) return 0;
+    int retryAfter = tryTake(*bucketFor(key));
+    if (retryAfter > 0) rateLimited++;
+    return retryAfter;
+}
+
+bool RateLimiter::enter(const string& key, Slot& slot) {
+    if (config.maxConcurrent <= 0) return true;
+    if (tryEnter(bucketFor(key), slot)) return true;
+    concurrencyLimited++;
+    return false;
+}
+
+// GCRA: the bucket is a single "full again at" time. A request moves it one
+// interval further; it is refused if that would put it more than the burst
+// tolerance ahead of now.
+int RateLimiter::tryTake(Bucket& bucket) {
+    if (interval == 0) return 0;
+    int64_t now = chrono::steady_clock::now().time_since_epoch().count();
+    int64_t fullAt = bucket.fullAt.load(memory_order_relaxed);
+    while (true) {
+        int64_t from = max(fullAt, now);
+        if (from - now > tolerance) {
+            int64_t wait = from - now - tolerance;
+            int64_t second = chrono::duration_cast<chrono::steady_clock::duration>(chrono::seconds(1)).count();
+            return (int)max<int64_t>(1, (wait + second - 1) / second);
+        }
+        if (bucket.fullAt.compare_exchange_weak(fullAt, from + interval, memory_order_relaxed)) {
+            return 0;
+        }
+    }
+}
+
+bool RateLimiter::tryEnter(const shared_ptr<Bucket>& bucket, Slot& slot) {
+    if (bucket->inFlight.fetch_add(1, memory_order_relaxed) >= config.maxConcurrent) {
+        bucket->inFlight.fetch_sub(1, memory_order_relaxed);
+        return false;
+    }
+    slot = Slot();
+    slot.bucket = bucket;
+    return true;
+}
+
+shared_ptr<RateLimiter::Bucket> RateLimiter::bucketFor(const string& key) {
+    if (routeBucket) return routeBucket;
+
+    Shard& shard = shards[hash<string>()(key) % shardCount];
+    lock_guard<mutex> lock(shard.shardMutex);
+
+    auto found = shard.index.find(key);
+    if (found != shard.index.end()) {
+        shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+        return found->second->bucket;
+    }
+
+    // Forget the least recently seen key, preferring one with nothing in
+    // flight; a forgotten key starts over with a full bucket
+    size_t budget = max<size_t>(1, config.maxKeys / shardCount);
+    if (shard.index.size() >= budget) {
+        auto victim = prev(shard.lru.end());
+        auto candidate = victim;
+        for (int i = 0; i < evictionScan; i++) {
+            if (candidate->bucket->inFlight.load(memory_order_relaxed) == 0) {
+                victim = candidate;
+                break;
+            }
+            if (candidate == shard.lru.begin()) break;
+            --candidate;
+        }
+        shard.index.erase(victim->key);
+        shard.lru.erase(victim);
+    }
+
+    shard.lru.push_front(Node{key, make_shared<Bucket>()});
+    shard.index.emplace(key, shard.lru.begin());
+    return shard.lru.front().bucket;
+}
+
+size_t RateLimiter::keyCount() {
+    if (routeBucket) return 1;
+    size_t count = 0;
+    for (Shard& shard : shards) {
+        lock_guard<mutex> lock(shard.shardMutex);
+        count += shard.index.size();
+    }
+    return count;
+}
@@ -0,0 +1,105 @@
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <string>
+#include <string_view>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include "HttpParser.h"
+#include "Metrics.h"
+using namespace std;
+
+// What the requests sharing a bucket have in common
+enum class RateLimitKeySource {
+    CLIENT_IP,
+    HEADER, // requests without the header are keyed by client IP
+    ROUTE   // one bucket for all requests of the service
+};
+
+// Admission limits per key; requests over them get 429 without touching a backend
+struct RateLimitSettings {
+    RateLimitKeySource keySource = RateLimitKeySource::CLIENT_IP;
+    string headerName;
+    double requestsPerSecond = 0; // sustained rate (0 = no rate limit)
+    int burst = 0;                // requests a key may send at once (0 = one second's worth)
+    int maxConcurrent = 0;        // in flight per key (client limits: connections); 0 = no limit
+    size_t maxKeys = 65536;       // keys tracked; the least recently seen are forgotten
+};
+
+// Token buckets (GCRA: one atomic timestamp per key, updated by CAS) and
+// in-flight counts, kept in a sharded LRU so memory stays bounded however
+// many clients there are. The shard mutex only covers finding the key.
+class RateLimiter {
+public:
+    struct Bucket {
+        atomic<int64_t> fullAt{0}; // steady_clock ticks when the bucket is full again
+        atomic<int> inFlight{0};
+    };
+
+    // Holds one of a key's maxConcurrent places until reset or destroyed
+    class Slot {
+    public:
+        Slot() = default;
+        Slot(Slot&& other) noexcept : bucket(move(other.bucket)) {}
+        Slot& operator=(Slot&& other) noexcept;
+        ~Slot() { reset(); }
+
+        void reset();
+        explicit operator bool() const { return bucket != nullptr; }
+
+    private:
+        friend class RateLimiter;
+        shared_ptr<Bucket> bucket;
+    };
+
+    RateLimiter(const RateLimitSettings& limitSettings);
+
+    const RateLimitSettings& settings() const { return config; }
+
+    // Bucket key of a request (empty for ROUTE)
+    string keyFor(const HttpHead& request, const string& clientIP) const;
+
+    // Charges a request to key: 0 if it may go ahead, holding slot while
+    // maxConcurrent applies; otherwise the seconds for Retry-After
+    int admit(const string& key, Slot& slot);
+    // Only the rate part of admit() (client limits: connections are entered separately)
+    int takeToken(const string& key);
+    // Only the maxConcurrent part; false if the key has no place left
+    bool enter(const string& key, Slot& slot);
+
+    // Statistics
+    ShardedCounter rateLimited;
+    ShardedCounter concurrencyLimited;
+    size_t keyCount();
+
+private:
+    static const int shardCount = 64;
+    static const int evictionScan = 8; // busy keys skipped before evicting anyway
+
+    struct Node {
+        string key;
+        shared_ptr<Bucket> bucket;
+    };
+
+    struct Shard {
+        mutex shardMutex;
+        list<Node> lru; // front = most recently used
+        unordered_map<string, list<Node>::iterator> index;
+    };
+
+    RateLimitSettings config;
+    int64_t interval;  // ticks per token
+    int64_t tolerance; // ticks of burst on top of one interval
+    Shard shards[shardCount];
+    shared_ptr<Bucket> routeBucket; // ROUTE: the only key, outside the LRU
+
+    shared_ptr<Bucket> bucketFor(const string& key);
+    int tryTake(Bucket& bucket);
+    bool tryEnter(const shared_ptr<Bucket>& bucket, Slot& slot);
+};
+
+#endif // RATELIMITER_H
@@ -0,0 +1,340 @@
+#include "ResponseCache.h"
+#include <algorithm>
+#include <functional>
+#include <cstdlib>
+#include <ctime>
+#include <strings.h>
+
+using namespace std;
+
+namespace {
+
+string_view trimmed(string_view value) {
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) value.remove_suffix(1);
+    return value;
+}
+
+string lowercase(string_view value) {
+    string result(value);
+    transform(result.begin(), result.end(), result.begin(),
+              [](unsigned char c) { return (char)tolower(c); });
+    return result;
+}
+
+// Calls visit(name, argument) for each "name[=argument]" of a Cache-Control value
+template <typename Visit>
+void forEachDirective(string_view value, Visit visit) {
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        string_view item = trimmed(value.substr(0, comma));
+        size_t equals = item.find('=');
+        string_view name = trimmed(item.substr(0, equals));
+        string_view argument;
+        if (equals != string_view::npos) {
+            argument = trimmed(item.substr(equals + 1));
+            if (argument.size() >= 2 && argument.front() == '"' && argument.back() == '"') {
+                argument = argument.substr(1, argument.size() - 2);
+            }
+        }
+        if (!name.empty()) visit(name, argument);
+        if (comma == string_view::npos) break;
+        value.remove_prefix(comma + 1);
+    }
+}
+
+// Delta-seconds argument; -1 if missing or malformed
+int64_t seconds(string_view argument) {
+    if (argument.empty() || argument.size() > 12) return -1;
+    int64_t value = 0;
+    for (char c : argument) {
+        if (c < '0' || c > '9') return -1;
+        value = value * 10 + (c - '0');
+    }
+    return value;
+}
+
+// IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"); -1 if unparseable
+int64_t httpDate(string_view value) {
+    string text(trimmed(value));
+    struct tm parsed = {};
+    const char* end = strptime(text.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &parsed);
+    if (!end || *end != '\0') return -1;
+    return (int64_t)timegm(&parsed);
+}
+
+bool cacheableStatus(int status) {
+    switch (status) {
+        case 200: case 203: case 204: case 300: case 301: case 308: case 404: case 410:
+            return true;
+        default:
+            return false;
+    }
+}
+
+} // namespace
+
+// ==================== ResponseCache Implementation ====================
+
+ResponseCache::ResponseCache(const CacheSettings& cacheSettings)
+    : config(cacheSettings) {
+}
+
+bool ResponseCache::cacheableRequest(const HttpHead& request, bool& mayServe, bool& mayStore) {
+    bool get = request.method == "GET";
+    if (!get && request.method != "HEAD") return false;
+    // Responses to authenticated requests are private to the user
+    if (!request.header("Authorization").empty()) return false;
+
+    mayServe = true;
+    mayStore = get;
+    bool bypass = false;
+    forEachDirective(request.header("Cache-Control"), [&](string_view name, string_view argument) {
+        if (equalsIgnoreCase(name, "no-store")) {
+            bypass = true;
+        } else if (equalsIgnoreCase(name, "no-cache") ||
+                   (equalsIgnoreCase(name, "max-age") && seconds(argument) == 0)) {
+            mayServe = false;
+        }
+    });
+    if (hasToken(request.header("Pragma"), "no-cache")) {
+        mayServe = false;
+    }
+    return !bypass;
+}
+
+string ResponseCache::keyFor(const string& servicePath, const HttpHead& request) {
+    string key = servicePath;
+    key += '\n';
+    key.append(request.header("Host"));
+    key += '\n';
+    key.append(request.target);
+    return key;
+}
+
+ResponseCache::Shard& ResponseCache::shardFor(const string& key) {
+    return shards[hash<string>()(key) % shardCount];
+}
+
+vector<string> ResponseCache::varyValuesOf(const HttpHead& request, const vector<string>& names) {
+    vector<string> values;
+    values.reserve(names.size());
+    for (const string& name : names) {
+        values.emplace_back(request.header(name));
+    }
+    return values;
+}
+
+ResponseCache::Lookup ResponseCache::lookup(const string& key, const HttpHead& request, int64_t now,
+                                            bool coalesce, const CacheWaiter& waiter) {
+    Shard& shard = shardFor(key);
+    lock_guard<mutex> lock(shard.shardMutex);
+
+    auto found = shard.index.find(key);
+    if (found != shard.index.end()) {
+        Node& node = *found->second;
+        for (const auto& variant : node.variants) {
+            if (varyValuesOf(request, variant->varyNames) != variant->varyValues) continue;
+
+            if (now < variant->freshUntil) {
+                shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+                hits++;
+                return {Result::HIT, variant};
+            }
+            if (now < variant->staleUntil) {
+                shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+                staleHits++;
+                return {Result::STALE, variant};
+            }
+            break;
+        }
+    }
+
+    if (coalesce) {
+        auto inFlight = shard.pending.find(key);
+        if (inFlight != shard.pending.end()) {
+            inFlight->second.push_back(waiter);
+            coalesced++;
+            return {Result::WAIT, nullptr};
+        }
+        shard.pending[key];
+    }
+    misses++;
+    Lookup miss{Result::MISS, nullptr};
+    miss.leader = coalesce;
+    return miss;
+}
+
+vector<CacheWaiter> ResponseCache::finishFill(const string& key) {
+    Shard& shard = shardFor(key);
+    lock_guard<mutex> lock(shard.shardMutex);
+
+    vector<CacheWaiter> waiters;
+    auto inFlight = shard.pending.find(key);
+    if (inFlight != shard.pending.end()) {
+        waiters = move(inFlight->second);
+        shard.pending.erase(inFlight);
+    }
+    return waiters;
+}
+
+shared_ptr<CachedResponse> ResponseCache::prepare(const HttpHead& response, bool bodyFramed,
+                                                  int64_t now) const {
+    if (!bodyFramed || !cacheableStatus(response.statusCode)) return nullptr;
+    // Never share one user's cookie with everyone else
+    if (!response.header("Set-Cookie").empty()) return nullptr;
+
+    auto entry = make_shared<CachedResponse>();
+
+    string_view vary = response.header("Vary");
+    while (!vary.empty()) {
+        size_t comma = vary.find(',');
+        string_view name = trimmed(vary.substr(0, comma));
+        if (name == "*") return nullptr;
+        if (!name.empty()) entry->varyNames.push_back(lowercase(name));
+        if (comma == string_view::npos) break;
+        vary.remove_prefix(comma + 1);
+    }
+
+    bool storable = true;
+    int64_t maxAge = -1;
+    int64_t sharedMaxAge = -1;
+    int64_t staleWindow = config.staleWhileRevalidateSeconds;
+    forEachDirective(response.header("Cache-Control"), [&](string_view name, string_view argument) {
+        if (equalsIgnoreCase(name, "no-store") || equalsIgnoreCase(name, "private") ||
+            equalsIgnoreCase(name, "no-cache")) {
+            storable = false;
+        } else if (equalsIgnoreCase(name, "max-age")) {
+            maxAge = seconds(argument);
+        } else if (equalsIgnoreCase(name, "s-maxage")) {
+            sharedMaxAge = seconds(argument);
+        } else if (equalsIgnoreCase(name, "stale-while-revalidate")) {
+            int64_t window = seconds(argument);
+            if (window >= 0) staleWindow = window;
+        } else if (equalsIgnoreCase(name, "must-revalidate") ||
+                   equalsIgnoreCase(name, "proxy-revalidate")) {
+            staleWindow = 0;
+        }
+    });
+    if (!storable) return nullptr;
+
+    int64_t ttl = sharedMaxAge >= 0 ? sharedMaxAge : maxAge;
+    if (ttl < 0) {
+        string_view expires = response.header("Expires");
+        if (!expires.empty()) {
+            int64_t expiresAt = httpDate(expires);
+            int64_t date = httpDate(response.header("Date"));
+            ttl = max<int64_t>(0, expiresAt - (date >= 0 ? date : now)); // invalid Expires = expired
+        } else {
+            ttl = config.defaultTtlSeconds;
+        }
+    }
+    int64_t age = seconds(response.header("Age"));
+    if (age > 0) ttl -= age;
+    if (ttl <= 0) return nullptr;
+
+    entry->statusCode = response.statusCode;
+    entry->head.append(response.startLine).append("\r\n");
+    appendHeaders(response, {"Connection", "Keep-Alive", "Proxy-Connection", "Age"}, entry->head);
+    entry->storedAt = now;
+    entry->freshUntil = now + ttl;
+    entry->staleUntil = entry->freshUntil + staleWindow;
+    return entry;
+}
+
+void ResponseCache::store(const string& key, shared_ptr<CachedResponse> entry) {
+    if (entry->bytes() > config.maxObjectBytes) return;
+
+    Shard& shard = shardFor(key);
+    lock_guard<mutex> lock(shard.shardMutex);
+
+    auto found = shard.index.find(key);
+    if (found == shard.index.end()) {
+        shard.lru.push_front(Node{key, {}, 0});
+        found = shard.index.emplace(key, shard.lru.begin()).first;
+    } else {
+        shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+    }
+
+    // Replace the variant for the same request header values
+    Node& node = *found->second;
+    auto& variants = node.variants;
+    for (auto it = variants.begin(); it != variants.end(); ++it) {
+        if ((*it)->varyNames == entry->varyNames && (*it)->varyValues == entry->varyValues) {
+            node.bytes -= (*it)->bytes();
+            shard.bytes -= (*it)->bytes();
+            variants.erase(it);
+            break;
+        }
+    }
+    if (variants.size() >= maxVariants) {
+        node.bytes -= variants.back()->bytes();
+        shard.bytes -= variants.back()->bytes();
+        variants.pop_back();
+    }
+    node.bytes += entry->bytes();
+    shard.bytes += entry->bytes();
+    variants.insert(variants.begin(), move(entry));
+    stores++;
+
+    evict(shard);
+}
+
+void ResponseCache::evict(Shard& shard) {
+    size_t budget = config.maxBytes / shardCount;
+    while (shard.bytes > budget && !shard.lru.empty()) {
+        Node& victim = shard.lru.back();
+        shard.bytes -= victim.bytes;
+        shard.index.erase(victim.key);
+        shard.lru.pop_back();
+        evictions++;
+    }
+}
+
+void ResponseCache::erase(const string& key) {
+    Shard& shard = shardFor(key);
+    lock_guard<mutex> lock(shard.shardMutex);
+
+    auto found = shard.index.find(key);
+    if (found == shard.index.end()) return;
+    shard.bytes -= found->second->bytes;
+    shard.lru.erase(found->second);
+    shard.index.erase(found);
+}
+
+string ResponseCache::render(const CachedResponse& entry, int64_t now, const char* cacheStatus,
+                             const char* connection, bool headRequest) {
+    string out;
+    out.reserve(entry.head.size() + entry.body.size() + 96);
+    out.append(entry.head);
+    if (cacheStatus) {
+        out.append("Age: ").append(to_string(max<int64_t>(0, now - entry.storedAt))).append("\r\n");
+        out.append("X-Cache: ").append(cacheStatus).append("\r\n");
+    }
+    if (connection) {
+        out.append("Connection: ").append(connection).append("\r\n");
+    }
+    out.append("\r\n");
+    if (!headRequest) {
+        out.append(entry.body);
+    }
+    return out;
+}
+
+size_t ResponseCache::entryCount() {
+    size_t total = 0;
+    for (auto& shard : shards) {
+        lock_guard<mutex> lock(shard.shardMutex);
+        total += shard.index.size();
+    }
+    return total;
+}
+
+size_t ResponseCache::byteCount() {
+    size_t total = 0;
+    for (auto& shard : shards) {
+        lock_guard<mutex> lock(shard.shardMutex);
+        total += shard.bytes;
+    }
+    return total;
+}
@@ -0,0 +1,133 @@
+#ifndef RESPONSECACHE_H
+#define RESPONSECACHE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include "HttpParser.h"
+#include "Metrics.h"
+using namespace std;
+
+struct Worker;
+
+// Per-service proxy cache limits
+struct CacheSettings {
+    size_t maxBytes = 64 * 1024 * 1024;   // all entries of the service
+    size_t maxObjectBytes = 1024 * 1024;  // larger responses are relayed, not stored
+    int defaultTtlSeconds = 0;            // for responses without Cache-Control/Expires (0 = don't store)
+    int staleWhileRevalidateSeconds = 0;  // unless the response sets stale-while-revalidate
+    int coalesceWaitMs = 5000;            // how long a miss waits for another request's fetch
+};
+
+// A stored response: the upstream head minus hop-by-hop headers, and the
+// body exactly as framed by the backend (Content-Length or chunked)
+struct CachedResponse {
+    int statusCode = 0;
+    string head;                // status line and header lines, each CRLF-terminated
+    string body;
+    vector<string> varyNames;   // request headers named by Vary
+    vector<string> varyValues;  // ... and their values in the request that filled it
+    int64_t storedAt = 0;       // unix seconds
+    int64_t freshUntil = 0;
+    int64_t staleUntil = 0;     // may be served while a refresh runs
+    mutable atomic<bool> revalidating{false};
+
+    size_t bytes() const { return head.size() + body.size() + 128; }
+};
+
+// A client parked until another request for the same key has been fetched
+struct CacheWaiter {
+    Worker* worker;
+    int fd;
+    uint64_t connectionId;
+};
+
+// Sharded, memory-bounded LRU of cached responses for one service. Keys
+// are looked up under a per-shard mutex; the entries themselves are
+// immutable and shared, so hits are served outside the lock.
+class ResponseCache {
+public:
+    enum class Result {
+        HIT,    // fresh entry
+        STALE,  // expired but within stale-while-revalidate
+        MISS,   // caller fetches (and fills the entry if it registered as leader)
+        WAIT    // parked behind an in-flight fetch of the same key
+    };
+
+    struct Lookup {
+        Result result;
+        shared_ptr<const CachedResponse> entry;
+        bool leader = false; // MISS registered the caller as the key's fetcher
+    };
+
+    ResponseCache(const CacheSettings& cacheSettings);
+
+    const CacheSettings& settings() const { return config; }
+
+    // False if the request must bypass the cache. Otherwise mayServe says
+    // whether a stored response may answer it (not for no-cache), and
+    // mayStore whether its response may be stored (GET only; HEAD is served).
+    static bool cacheableRequest(const HttpHead& request, bool& mayServe, bool& mayStore);
+    static string keyFor(const string& servicePath, const HttpHead& request);
+
+    // With coalesce set, the first miss of a key becomes its leader and later
+    // misses wait for it; a leader must call finishFill() however it ends
+    Lookup lookup(const string& key, const HttpHead& request, int64_t now,
+                  bool coalesce, const CacheWaiter& waiter);
+    // Returns the clients waiting on the key
+    vector<CacheWaiter> finishFill(const string& key);
+
+    // Freshness and variant data of a response, or null if it may not be
+    // stored. The caller appends the body and calls store().
+    shared_ptr<CachedResponse> prepare(const HttpHead& response, bool bodyFramed, int64_t now) const;
+    static vector<string> varyValuesOf(const HttpHead& request, const vector<string>& names);
+    void store(const string& key, shared_ptr<CachedResponse> entry);
+    void erase(const string& key);
+
+    // Full response for a client: stored head, Age, Connection, body
+    // (no Age or X-Cache without a cacheStatus)
+    static string render(const CachedResponse& entry, int64_t now, const char* cacheStatus,
+                         const char* connection, bool headRequest);
+
+    // Statistics
+    ShardedCounter hits;
+    ShardedCounter staleHits;
+    ShardedCounter misses;
+    ShardedCounter coalesced;
+    ShardedCounter stores;
+    ShardedCounter evictions;
+    size_t entryCount();
+    size_t byteCount();
+
+private:
+    static const int shardCount = 16;
+    static const size_t maxVariants = 8;
+
+    struct Node {
+        string key;
+        vector<shared_ptr<const CachedResponse>> variants;
+        size_t bytes = 0;
+    };
+
+    struct Shard {
+        mutex shardMutex;
+        list<Node> lru; // front = most recently used
+        unordered_map<string, list<Node>::iterator> index;
+        unordered_map<string, vector<CacheWaiter>> pending; // keys being fetched
+        size_t bytes = 0;
+    };
+
+    CacheSettings config;
+    Shard shards[shardCount];
+
+    Shard& shardFor(const string& key);
+    void evict(Shard& shard);
+};
+
+#endif // RESPONSECACHE_H
@@ -0,0 +1,197 @@
+#include "Router.h"
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+string lowercase(string_view value) {
+    string result(value);
+    transform(result.begin(), result.end(), result.begin(),
+              [](unsigned char c) { return (char)tolower(c); });
+    return result;
+}
+
+// Host header without the port, lowercased
+string hostName(string_view host) {
+    if (!host.empty() && host.front() == '[') {
+        size_t end = host.find(']');
+        return lowercase(host.substr(0, end == string_view::npos ? host.size() : end + 1));
+    }
+    return lowercase(host.substr(0, host.find(':')));
+}
+
+} // namespace
+
+// ==================== CompiledRoute Implementation ====================
+
+bool CompiledRoute::matchesPredicates(const HttpHead& request) const {
+    if (!route.methods.empty() &&
+        find(route.methods.begin(), route.methods.end(), request.method) == route.methods.end()) {
+        return false;
+    }
+    for (const RouteHeaderMatch& header : route.headers) {
+        string_view value = request.header(header.name);
+        if (value.empty() || (!header.value.empty() && value != header.value)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+string CompiledRoute::upstreamTarget(string_view path, string_view query) const {
+    string target;
+    if (route.rewrite.empty()) {
+        target.append(path);
+    } else if (route.type == RouteMatchType::PREFIX) {
+        target.append(route.rewrite).append(path.substr(route.path.size()));
+    } else if (route.type == RouteMatchType::EXACT) {
+        target.append(route.rewrite);
+    } else {
+        target = regex_replace(string(path), pattern, route.rewrite, regex_constants::format_first_only);
+    }
+    target.append(query);
+    return target;
+}
+
+// ==================== RouteTable Implementation ====================
+
+bool RouteTable::add(const Route& route, shared_ptr<ServiceConfig> service, string& error) {
+    if (route.path.empty() || (route.type != RouteMatchType::REGEX && route.path.front() != '/')) {
+        error = "route path must start with '/': " + route.path;
+        return false;
+    }
+
+    auto compiled = make_unique<CompiledRoute>();
+    compiled->route = route;
+    compiled->service = move(service);
+    if (route.type == RouteMatchType::REGEX) {
+        try {
+            compiled->pattern = regex(route.path, regex::ECMAScript | regex::optimize);
+        } catch (const regex_error& e) {
+            error = "invalid route regex " + route.path + ": " + e.what();
+            return false;
+        }
+    }
+
+    VirtualHost* host = &anyHost;
+    if (route.host.size() > 1 && route.host.compare(0, 2, "*.") == 0) {
+        host = &wildcardHosts[lowercase(string_view(route.host).substr(1))];
+    } else if (!route.host.empty()) {
+        host = &hosts[hostName(route.host)];
+    }
+
+    const CompiledRoute* raw = compiled.get();
+    switch (route.type) {
+        case RouteMatchType::EXACT:
+            host->exact[route.path].push_back(raw);
+            break;
+        case RouteMatchType::PREFIX:
+            insertPrefix(host->prefixes, route.path, raw);
+            break;
+        case RouteMatchType::REGEX:
+            host->regexes.push_back(raw);
+            break;
+    }
+    routes.push_back(move(compiled));
+    return true;
+}
+
+void RouteTable::insertPrefix(RadixNode& root, string_view prefix, const CompiledRoute* route) {
+    RadixNode* node = &root;
+    while (!prefix.empty()) {
+        auto edge = find_if(node->children.begin(), node->children.end(),
+                            [&](const unique_ptr<RadixNode>& child) { return child->label[0] == prefix[0]; });
+        if (edge == node->children.end()) {
+            auto leaf = make_unique<RadixNode>();
+            leaf->label = string(prefix);
+            leaf->routes.push_back(route);
+            node->children.push_back(move(leaf));
+            return;
+        }
+
+        RadixNode* child = edge->get();
+        size_t common = 0;
+        while (common < child->label.size() && common < prefix.size() &&
+               child->label[common] == prefix[common]) {
+            common++;
+        }
+        if (common < child->label.size()) {
+            // Split the edge where the new prefix leaves it
+            auto middle = make_unique<RadixNode>();
+            middle->label = child->label.substr(0, common);
+            child->label.erase(0, common);
+            middle->children.push_back(move(*edge));
+            *edge = move(middle);
+            child = edge->get();
+        }
+        node = child;
+        prefix.remove_prefix(common);
+    }
+    node->routes.push_back(route);
+}
+
+// Descends as far as the path follows the tree, then tries the routes of
+// the deepest nodes first
+const CompiledRoute* RouteTable::longestPrefix(const RadixNode& node, string_view path,
+                                               const HttpHead& request) {
+    if (!path.empty()) {
+        for (const auto& child : node.children) {
+            if (child->label[0] != path[0]) continue;
+            if (path.compare(0, child->label.size(), child->label) == 0) {
+                const CompiledRoute* deeper = longestPrefix(*child, path.substr(child->label.size()), request);
+                if (deeper) return deeper;
+            }
+            break;
+        }
+    }
+    for (const CompiledRoute* route : node.routes) {
+        if (route->matchesPredicates(request)) return route;
+    }
+    return nullptr;
+}
+
+const CompiledRoute* RouteTable::matchHost(const VirtualHost& host, const HttpHead& request,
+                                           string_view path) {
+    auto exact = host.exact.find(string(path));
+    if (exact != host.exact.end()) {
+        for (const CompiledRoute* route : exact->second) {
+            if (route->matchesPredicates(request)) return route;
+        }
+    }
+
+    const CompiledRoute* prefix = longestPrefix(host.prefixes, path, request);
+    if (prefix) return prefix;
+
+    for (const CompiledRoute* route : host.regexes) {
+        if (route->matchesPredicates(request) &&
+            regex_match(path.begin(), path.end(), route->pattern)) {
+            return route;
+        }
+    }
+    return nullptr;
+}
+
+const RouteTable::VirtualHost* RouteTable::findHost(string_view host) const {
+    if (hosts.empty() && wildcardHosts.empty()) return &anyHost;
+
+    string name = hostName(host);
+    auto exact = hosts.find(name);
+    if (exact != hosts.end()) return &exact->second;
+
+    // "*.example.com" covers a.example.com and a.b.example.com; longest suffix wins
+    for (size_t dot = name.find('.'); dot != string::npos; dot = name.find('.', dot + 1)) {
+        auto wildcard = wildcardHosts.find(name.substr(dot));
+        if (wildcard != wildcardHosts.end()) return &wildcard->second;
+    }
+    return &anyHost;
+}
+
+const CompiledRoute* RouteTable::match(const HttpHead& request, string_view path) const {
+    const VirtualHost* host = findHost(request.header("Host"));
+    const CompiledRoute* route = matchHost(*host, request, path);
+    if (!route && host != &anyHost) {
+        route = matchHost(anyHost, request, path);
+    }
+    return route;
+}
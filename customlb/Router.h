@@ -0,0 +1,97 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <regex>
+#include <chrono>
+#include "HttpParser.h"
+using namespace std;
+
+struct ServiceConfig;
+
+// How a route's path is compared with the request path (query excluded)
+enum class RouteMatchType {
+    PREFIX, // longest matching prefix wins
+    EXACT,
+    REGEX   // ECMAScript, must match the whole path
+};
+
+// Header predicate; an empty value only requires the header to be present
+struct RouteHeaderMatch {
+    string name;
+    string value;
+};
+
+struct Route {
+    RouteMatchType type = RouteMatchType::PREFIX;
+    string path;
+    string host;                      // "", "shop.example.com" or "*.example.com"
+    vector<string> methods;           // empty: any method
+    vector<RouteHeaderMatch> headers; // all must match
+    string service;                   // path the service was added under
+    // Upstream path: replaces the matched prefix (PREFIX), the whole path
+    // (EXACT) or is a regex_replace format such as "/v2/$1" (REGEX).
+    // Empty keeps the request path. The query string is always kept.
+    string rewrite;
+};
+
+struct CompiledRoute {
+    Route route;
+    shared_ptr<ServiceConfig> service;
+    regex pattern; // REGEX only
+
+    bool matchesPredicates(const HttpHead& request) const;
+    // Request target to send upstream
+    string upstreamTarget(string_view path, string_view query) const;
+};
+
+// Immutable, compiled route table. Requests are matched against the
+// virtual host of their Host header (exact name, else the longest
+// "*.suffix"), then against the routes without a host. Within each, exact
+// paths win, then the longest prefix (radix tree), then regexes in the
+// order added.
+// Routes with the same path are tried in the order added until one's
+// method and header predicates match.
+class RouteTable {
+public:
+    // False with a message if the route is malformed
+    bool add(const Route& route, shared_ptr<ServiceConfig> service, string& error);
+
+    const CompiledRoute* match(const HttpHead& request, string_view path) const;
+
+    size_t size() const { return routes.size(); }
+
+    chrono::steady_clock::time_point retiredAt;
+
+private:
+    struct RadixNode {
+        string label; // edge from the parent
+        vector<unique_ptr<RadixNode>> children;
+        vector<const CompiledRoute*> routes;
+    };
+
+    struct VirtualHost {
+        unordered_map<string, vector<const CompiledRoute*>> exact;
+        RadixNode prefixes;
+        vector<const CompiledRoute*> regexes;
+    };
+
+    vector<unique_ptr<CompiledRoute>> routes;
+    unordered_map<string, VirtualHost> hosts;
+    unordered_map<string, VirtualHost> wildcardHosts; // by ".suffix"
+    VirtualHost anyHost;
+
+    static void insertPrefix(RadixNode& root, string_view prefix, const CompiledRoute* route);
+    static const CompiledRoute* longestPrefix(const RadixNode& node, string_view path,
+                                              const HttpHead& request);
+    static const CompiledRoute* matchHost(const VirtualHost& host, const HttpHead& request,
+                                          string_view path);
+    const VirtualHost* findHost(string_view host) const;
+};
+
+#endif // ROUTER_H
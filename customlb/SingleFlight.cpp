@@ -0,0 +1,85 @@
+#include "SingleFlight.h"
+#include <functional>
+
+using namespace std;
+
+// ==================== SingleFlight Implementation ====================
+
+SingleFlight::SingleFlight(const SingleFlightSettings& flightSettings)
+    : config(flightSettings) {
+}
+
+string SingleFlight::keyFor(const string& servicePath, const HttpHead& request, string_view body) const {
+    if (request.method != "GET" && request.method != "HEAD") return "";
+    if (!body.empty()) return "";
+
+    // Credentials make a response personal unless they are part of the key
+    bool keyedOnAuthorization = false;
+    bool keyedOnCookie = false;
+    for (const string& name : config.keyHeaders) {
+        keyedOnAuthorization |= equalsIgnoreCase(name, "Authorization");
+        keyedOnCookie |= equalsIgnoreCase(name, "Cookie");
+    }
+    if ((!keyedOnAuthorization && !request.header("Authorization").empty()) ||
+        (!keyedOnCookie && !request.header("Cookie").empty())) {
+        return "";
+    }
+
+    string key(request.method);
+    key += '\n';
+    key += servicePath;
+    key += '\n';
+    key.append(request.header("Host"));
+    key += '\n';
+    key.append(request.target);
+    for (const string& name : config.keyHeaders) {
+        key += '\n';
+        key.append(request.header(name));
+    }
+    return key;
+}
+
+SingleFlight::Shard& SingleFlight::shardFor(const string& key) {
+    return shards[hash<string>()(key) % shardCount];
+}
+
+bool SingleFlight::join(const string& key, const CacheWaiter& waiter) {
+    Shard& shard = shardFor(key);
+    lock_guard<mutex> lock(shard.shardMutex);
+
+    auto inFlight = shard.flights.find(key);
+    if (inFlight != shard.flights.end()) {
+        inFlight->second.push_back(waiter);
+        followers++;
+        return false;
+    }
+    shard.flights[key];
+    leaders++;
+    return true;
+}
+
+vector<CacheWaiter> SingleFlight::finish(const string& key) {
+    Shard& shard = shardFor(key);
+    lock_guard<mutex> lock(shard.shardMutex);
+
+    vector<CacheWaiter> waiters;
+    auto inFlight = shard.flights.find(key);
+    if (inFlight != shard.flights.end()) {
+        waiters = move(inFlight->second);
+        shard.flights.erase(inFlight);
+    }
+    return waiters;
+}
+
+shared_ptr<CachedResponse> SingleFlight::capture(const HttpHead& response, bool bodyFramed) {
+    // A close-delimited body has no end a copy could be framed by
+    if (!bodyFramed || response.statusCode == 101) return nullptr;
+    // Never hand one client's cookie to the others
+    if (!response.header("Set-Cookie").empty()) return nullptr;
+
+    auto entry = make_shared<CachedResponse>();
+    entry->statusCode = response.statusCode;
+    entry->head.append(response.startLine).append("\r\n");
+    appendHeaders(response, {"Connection", "Keep-Alive", "Proxy-Connection"}, entry->head);
+    return entry;
+}
@@ -0,0 +1,65 @@
+#ifndef SINGLEFLIGHT_H
+#define SINGLEFLIGHT_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include "HttpParser.h"
+#include "Metrics.h"
+#include "ResponseCache.h"
+using namespace std;
+
+// Per-service request coalescing limits
+struct SingleFlightSettings {
+    // Request headers that are part of the key besides method, Host and target.
+    // Requests with Authorization or Cookie only share a fetch if those are listed.
+    vector<string> keyHeaders = {"Accept", "Accept-Encoding"};
+    int maxWaitMs = 2000;                    // followers then fetch on their own
+    size_t maxResponseBytes = 1024 * 1024;   // larger responses are not fanned out
+};
+
+// Single-flight for identical in-flight GET/HEAD requests of one service:
+// the first request of a key (the leader) is forwarded, later ones (the
+// followers) are parked until its response can be copied to them. Nothing
+// outlives the fetch; see ResponseCache for storing responses.
+class SingleFlight {
+public:
+    SingleFlight(const SingleFlightSettings& flightSettings);
+
+    const SingleFlightSettings& settings() const { return config; }
+
+    // Key of a request that may share its upstream fetch, or empty if it must not
+    string keyFor(const string& servicePath, const HttpHead& request, string_view body) const;
+
+    // True if the caller became the key's leader; otherwise it was queued as
+    // a follower. A leader must call finish() however its request ends.
+    bool join(const string& key, const CacheWaiter& waiter);
+    vector<CacheWaiter> finish(const string& key);
+
+    // Copy of the response head for the followers (the leader captures the
+    // body), or null if this response may not be shared
+    static shared_ptr<CachedResponse> capture(const HttpHead& response, bool bodyFramed);
+
+    // Statistics
+    ShardedCounter leaders;
+    ShardedCounter followers;
+    ShardedCounter fallbacks; // followers that had to fetch on their own
+
+private:
+    static const int shardCount = 16;
+
+    struct Shard {
+        mutex shardMutex;
+        unordered_map<string, vector<CacheWaiter>> flights; // key -> followers
+    };
+
+    SingleFlightSettings config;
+    Shard shards[shardCount];
+
+    Shard& shardFor(const string& key);
+};
+
+#endif // SINGLEFLIGHT_H
@@ -0,0 +1,216 @@
+#include "Tls.h"
+#include <iostream>
+#include <fstream>
+#include <sys/stat.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+using namespace std;
+
+namespace {
+
+const size_t ticketKeyBytes = 80; // key name, HMAC secret and AES key
+
+string openSslError() {
+    unsigned long code = ERR_get_error();
+    ERR_clear_error();
+    if (code == 0) return "unknown error";
+    char text[256];
+    ERR_error_string_n(code, text, sizeof(text));
+    return text;
+}
+
+// Changes whenever a file is replaced or rewritten, including the symlink
+// swap of a Kubernetes secret update
+string fileVersion(const string& path) {
+    struct stat info;
+    if (path.empty() || stat(path.c_str(), &info) != 0) return "-";
+    return to_string(info.st_dev) + ":" + to_string(info.st_ino) + ":" + to_string(info.st_size) + ":" +
+           to_string(info.st_mtim.tv_sec) + "." + to_string(info.st_mtim.tv_nsec);
+}
+
+} // namespace
+
+// ==================== TlsContext Implementation ====================
+
+TlsContext::TlsContext(const TlsSettings& tlsSettings)
+    : config(tlsSettings), current(nullptr) {
+}
+
+TlsContext::~TlsContext() {
+    SSL_CTX_free(current);
+}
+
+string TlsContext::filesVersion() const {
+    return fileVersion(config.certificateFile) + " " + fileVersion(config.privateKeyFile) + " " +
+           fileVersion(config.ticketKeyFile);
+}
+
+bool TlsContext::load(string& error) {
+    string version = filesVersion();
+    SSL_CTX* context = build(error);
+    if (!context) return false;
+
+    lock_guard<mutex> lock(contextMutex);
+    SSL_CTX_free(current);
+    current = context;
+    loadedVersion = version;
+    return true;
+}
+
+void TlsContext::reloadIfChanged() {
+    string version = filesVersion();
+    if (version == loadedVersion) return;
+
+    string error;
+    SSL_CTX* context = build(error);
+    if (!context) {
+        // Retried on the next change; a certificate and key replaced one
+        // after the other do not match in between
+        cerr << "[TLS] Keeping the current certificate: " << error << endl;
+        loadedVersion = version;
+        return;
+    }
+
+    SSL_CTX* previous;
+    {
+        lock_guard<mutex> lock(contextMutex);
+        previous = current;
+        current = context;
+    }
+    SSL_CTX_free(previous); // freed for good once its last connection closes
+    loadedVersion = version;
+    reloads++;
+    cout << "[TLS] Reloaded " << config.certificateFile << endl;
+}
+
+SSL_CTX* TlsContext::build(string& error) {
+    SSL_CTX* context = SSL_CTX_new(TLS_server_method());
+    if (!context) {
+        error = openSslError();
+        return nullptr;
+    }
+
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    uint64_t options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    options |= SSL_OP_IGNORE_UNEXPECTED_EOF; // a client closing without close_notify is just EOF
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+    if (config.kernelOffload) options |= SSL_OP_ENABLE_KTLS;
+#endif
+    if (!config.sessionTickets) options |= SSL_OP_NO_TICKET;
+    SSL_CTX_set_options(context, options);
+
+    // Writes resume from wherever the output buffer is by then, and idle
+    // keep-alive connections give their record buffers back
+    SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                              SSL_MODE_RELEASE_BUFFERS);
+
+    static const unsigned char sessionContext[] = "customlb";
+    SSL_CTX_set_session_id_context(context, sessionContext, sizeof(sessionContext) - 1);
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(context, config.sessionCacheSize);
+    SSL_CTX_set_timeout(context, config.sessionTimeoutSeconds);
+    SSL_CTX_set_alpn_select_cb(context, selectAlpn, this);
+
+    if (SSL_CTX_use_certificate_chain_file(context, config.certificateFile.c_str()) != 1) {
+        error = config.certificateFile + ": " + openSslError();
+    } else if (SSL_CTX_use_PrivateKey_file(context, config.privateKeyFile.c_str(), SSL_FILETYPE_PEM) != 1) {
+        error = config.privateKeyFile + ": " + openSslError();
+    } else if (SSL_CTX_check_private_key(context) != 1) {
+        error = config.privateKeyFile + " does not match " + config.certificateFile;
+    } else if (config.sessionTickets) {
+        loadTicketKeys(context, error);
+    }
+    if (!error.empty()) {
+        SSL_CTX_free(context);
+        return nullptr;
+    }
+    return context;
+}
+
+// Tickets issued before a certificate reload must still resume after it
+bool TlsContext::loadTicketKeys(SSL_CTX* context, string& error) {
+    unsigned char keys[ticketKeyBytes];
+    if (!config.ticketKeyFile.empty()) {
+        ifstream file(config.ticketKeyFile, ios::binary);
+        if (!file.read(reinterpret_cast<char*>(keys), sizeof(keys))) {
+            error = config.ticketKeyFile + ": expected at least " + to_string(ticketKeyBytes) + " bytes";
+            return false;
+        }
+    } else {
+        lock_guard<mutex> lock(contextMutex);
+        if (!current || SSL_CTX_get_tlsext_ticket_keys(current, keys, sizeof(keys)) != 1) {
+            return true; // first load: keep the random keys OpenSSL made
+        }
+    }
+
+    if (SSL_CTX_set_tlsext_ticket_keys(context, keys, sizeof(keys)) != 1) {
+        error = "cannot set the session ticket keys: " + openSslError();
+        return false;
+    }
+    return true;
+}
+
+void TlsContext::setApplicationProtocols(const vector<string>& protocols) {
+    alpnProtocols.clear();
+    for (const string& protocol : protocols) {
+        alpnProtocols.push_back((char)protocol.size());
+        alpnProtocols.append(protocol);
+    }
+}
+
+// Our preference wins over the client's order
+int TlsContext::selectAlpn(SSL*, const unsigned char** out, unsigned char* outLength,
+                           const unsigned char* offered, unsigned int offeredLength, void* arg) {
+    const string& protocols = static_cast<TlsContext*>(arg)->alpnProtocols;
+    unsigned char* selected;
+    if (protocols.empty() ||
+        SSL_select_next_proto(&selected, outLength, reinterpret_cast<const unsigned char*>(protocols.data()),
+                              protocols.size(), offered, offeredLength) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+string_view TlsContext::selectedProtocol(SSL* ssl) {
+    const unsigned char* protocol;
+    unsigned int length;
+    SSL_get0_alpn_selected(ssl, &protocol, &length);
+    return string_view(reinterpret_cast<const char*>(protocol), protocol ? length : 0);
+}
+
+SSL* TlsContext::newConnection(int fd) {
+    SSL* ssl;
+    {
+        lock_guard<mutex> lock(contextMutex);
+        ssl = SSL_new(current);
+    }
+    if (!ssl) return nullptr;
+    if (SSL_set_fd(ssl, fd) != 1) {
+        SSL_free(ssl);
+        return nullptr;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+void TlsContext::recordHandshake(SSL* ssl) {
+    if (SSL_session_reused(ssl)) {
+        resumedHandshakes++;
+    } else {
+        fullHandshakes++;
+    }
+    if (kernelSend(ssl)) kernelSendConnections++;
+    if (kernelReceive(ssl)) kernelReceiveConnections++;
+}
+
+bool TlsContext::kernelSend(SSL* ssl) {
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+}
+
+bool TlsContext::kernelReceive(SSL* ssl) {
+    return BIO_get_ktls_recv(SSL_get_rbio(ssl));
+}
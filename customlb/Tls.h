@@ -0,0 +1,88 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <mutex>
+#include "Metrics.h"
+using namespace std;
+
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+
+// HTTPS listener settings
+struct TlsSettings {
+    int port = 443;
+    string certificateFile;   // PEM: the leaf certificate, then intermediates
+    string privateKeyFile;    // PEM
+    // Kernel TLS: after the handshake the kernel encrypts (and decrypts), so
+    // the response relay keeps using splice(). Falls back to user space
+    // encryption when the kernel or the negotiated cipher does not support it.
+    bool kernelOffload = true;
+    bool sessionTickets = true;
+    // 80 bytes shared by all replicas so a ticket issued by one resumes on
+    // any other (empty: random keys, kept across certificate reloads)
+    string ticketKeyFile;
+    int sessionCacheSize = 20480;   // TLS 1.2 session IDs held in memory
+    int sessionTimeoutSeconds = 3600;
+};
+
+// Server-side TLS state shared by every worker. The certificate and key are
+// re-read when their files change; connections already established keep the
+// context they started with.
+class TlsContext {
+public:
+    TlsContext(const TlsSettings& tlsSettings);
+    ~TlsContext();
+
+    TlsContext(const TlsContext&) = delete;
+    TlsContext& operator=(const TlsContext&) = delete;
+
+    const TlsSettings& settings() const { return config; }
+
+    // Builds the context from the files; false (and error set) if they don't load
+    bool load(string& error);
+    // Rebuilds the context if the certificate or key changed on disk. A pair
+    // that does not load (e.g. half written) keeps the current one.
+    void reloadIfChanged();
+
+    // ALPN protocols in order of preference (e.g. "h2", "http/1.1"); a
+    // client offering none of them gets no ALPN answer. Before start().
+    void setApplicationProtocols(const vector<string>& protocols);
+    // What ALPN settled on, empty without it
+    static string_view selectedProtocol(SSL* ssl);
+
+    // Server end of a freshly accepted socket, ready for SSL_do_handshake()
+    SSL* newConnection(int fd);
+    // Called once the handshake is done; counts how it went
+    void recordHandshake(SSL* ssl);
+
+    static bool kernelSend(SSL* ssl);
+    static bool kernelReceive(SSL* ssl);
+
+    // Handshakes and kernel offload, for /metrics
+    ShardedCounter fullHandshakes;
+    ShardedCounter resumedHandshakes;
+    ShardedCounter failedHandshakes;
+    ShardedCounter kernelSendConnections;
+    ShardedCounter kernelReceiveConnections;
+    atomic<uint64_t> reloads{0};
+
+private:
+    TlsSettings config;
+
+    mutex contextMutex; // guards current; SSL objects hold their own reference
+    SSL_CTX* current;
+    string loadedVersion; // of the files current was built from (watcher thread)
+    string alpnProtocols; // wire format: length-prefixed names
+
+    static int selectAlpn(SSL* ssl, const unsigned char** out, unsigned char* outLength,
+                          const unsigned char* offered, unsigned int offeredLength, void* arg);
+
+    string filesVersion() const;
+    SSL_CTX* build(string& error);
+    bool loadTicketKeys(SSL_CTX* context, string& error);
+};
+
+#endif // TLS_H
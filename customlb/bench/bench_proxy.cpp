@@ -0,0 +1,770 @@
+// End-to-end proxy benchmark. Starts stand-in backends and an in-process
+// LoadBalancer on loopback, then drives the proxy with a built-in load
+// generator and reports throughput and latency percentiles.
+//
+// Closed loop (default): every connection sends its next request as soon as
+// the previous response arrives. Open loop (--rate): requests are scheduled
+// at a fixed rate and their latency is measured from the scheduled time, so
+// queueing behind a slow response is counted (no coordinated omission).
+// Closed-loop results are also shown corrected for coordinated omission the
+// way HdrHistogram does it: a sample longer than the expected interval
+// implies the requests that should have been sent meanwhile.
+//
+// Usage: bench_proxy [options]
+//   --backends N         stand-in backends (4)
+//   --latency-ms N       backend think time per request (0)
+//   --size BYTES         response body size (1024)
+//   --error-rate F       fraction of backend responses that are 500s (0)
+//   --algorithm NAME     round-robin, least-conn, ip-hash, maglev, p2c,
+//                        peak-ewma or wrr (round-robin)
+//   --lb-threads N       proxy worker threads (2)
+//   --connections N      client connections (64)
+//   --threads N          load generator threads (2)
+//   --rate R             open loop at R requests/s in total (0 = closed loop)
+//   --duration S         measured seconds (5)
+//   --warmup S           seconds before measuring (1)
+//   --expected-us N      closed-loop correction interval (median latency)
+//   --port N             proxy port; stats and backends use the next ones (18480)
+//   --direct             bypass the proxy and load backend 0 directly
+//   --access-log         keep the access log on (written to /dev/null)
+//   --tls                load the proxy's HTTPS listener (port + 2) instead,
+//                        with a throwaway self-signed certificate
+//   --no-ktls            ... and with kernel TLS offload turned off, to
+//                        compare splice() through kTLS with SSL_write()
+
+#include "../LoadBalancer.h"
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <deque>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/pem.h>
+
+using namespace std;
+
+namespace {
+
+int64_t nowNanos() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int listenOn(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1024) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Blocking loopback connect, then switched to non-blocking
+int connectTo(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// Blocking GET of a short local page (the proxy's /metrics)
+string fetch(int port, const string& path) {
+    int fd = connectTo(port);
+    if (fd < 0) return "";
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    string request = "GET " + path + " HTTP/1.0\r\n\r\n";
+    string response;
+    if (::send(fd, request.data(), request.size(), MSG_NOSIGNAL) == (ssize_t)request.size()) {
+        char buffer[16384];
+        ssize_t n;
+        while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+            response.append(buffer, n);
+        }
+    }
+    close(fd);
+    return response;
+}
+
+// Value of one Prometheus sample, 0 if it is missing
+uint64_t metricValue(const string& text, const string& sample) {
+    size_t at = text.find("\n" + sample + " ");
+    return at == string::npos ? 0 : strtoull(text.c_str() + at + sample.size() + 2, nullptr, 10);
+}
+
+// Self-signed P-256 certificate and key for the proxy's HTTPS listener
+bool writeTestCertificate(const string& certificateFile, const string& keyFile) {
+    EVP_PKEY* key = EVP_EC_gen("P-256");
+    X509* certificate = X509_new();
+    bool written = false;
+    if (key && certificate) {
+        ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+        X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+        X509_gmtime_adj(X509_getm_notAfter(certificate), 24 * 3600);
+        X509_set_pubkey(certificate, key);
+        X509_NAME* name = X509_get_subject_name(certificate);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1, 0);
+        X509_set_issuer_name(certificate, name);
+
+        FILE* certificateOut = fopen(certificateFile.c_str(), "w");
+        FILE* keyOut = fopen(keyFile.c_str(), "w");
+        written = X509_sign(certificate, key, EVP_sha256()) > 0 && certificateOut && keyOut &&
+                  PEM_write_X509(certificateOut, certificate) == 1 &&
+                  PEM_write_PrivateKey(keyOut, key, nullptr, nullptr, 0, nullptr, nullptr) == 1;
+        if (certificateOut) fclose(certificateOut);
+        if (keyOut) fclose(keyOut);
+    }
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+    return written;
+}
+
+} // namespace
+
+// ==================== Stand-in Backend ====================
+
+struct StubOptions {
+    int latencyMs = 0;
+    size_t responseBytes = 1024;
+    double errorRate = 0;
+};
+
+// Keep-alive HTTP/1.1 server answering every request with a fixed body,
+// after an optional delay, on its own event loop thread
+class StubBackend {
+private:
+    struct Connection {
+        int fd;
+        string in;
+        string out;
+        size_t outOffset = 0;
+        HttpParser parser{true};
+        bool busy = false; // waiting out the think time
+        bool closed = false;
+    };
+
+    EventLoop loop;
+    thread loopThread;
+    int listenFd = -1;
+    StubOptions options;
+    string okResponse;
+    string errorResponse;
+    minstd_rand random;
+    unordered_map<int, shared_ptr<Connection>> connections;
+
+    void onAccept() {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            auto conn = make_shared<Connection>();
+            conn->fd = fd;
+            connections[fd] = conn;
+            loop.add(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                     [this, conn](uint32_t events) { onEvent(conn, events); });
+        }
+    }
+
+    void onEvent(const shared_ptr<Connection>& conn, uint32_t events) {
+        if (events & EPOLLOUT) {
+            flush(conn);
+        }
+        if (conn->closed || !(events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))) return;
+
+        char buffer[16384];
+        while (true) {
+            ssize_t n = recv(conn->fd, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                conn->in.append(buffer, n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            closeConnection(conn);
+            return;
+        }
+        serve(conn);
+    }
+
+    void serve(const shared_ptr<Connection>& conn) {
+        while (!conn->busy && !conn->closed) {
+            HttpHead head;
+            auto result = conn->parser.parse(conn->in.data(), conn->in.size(), head);
+            if (result == HttpParser::Result::INCOMPLETE) break;
+
+            BodyFramer framer;
+            if (result != HttpParser::Result::COMPLETE || !requestFraming(head, framer) ||
+                framer.mode == BodyFramer::Mode::CHUNKED) {
+                closeConnection(conn);
+                return;
+            }
+            size_t total = head.length + (framer.mode == BodyFramer::Mode::CONTENT_LENGTH ? framer.remaining : 0);
+            if (conn->in.size() < total) break;
+            conn->in.erase(0, total);
+            conn->parser.reset();
+
+            const string& response = uniform_real_distribution<double>(0, 1)(random) < options.errorRate
+                ? errorResponse : okResponse;
+            if (options.latencyMs <= 0) {
+                conn->out += response;
+                continue;
+            }
+            conn->busy = true;
+            loop.runAfter(options.latencyMs, [this, conn, &response]() {
+                if (conn->closed) return;
+                conn->busy = false;
+                conn->out += response;
+                flush(conn);
+                serve(conn);
+            });
+        }
+        flush(conn);
+    }
+
+    void flush(const shared_ptr<Connection>& conn) {
+        while (!conn->closed && conn->outOffset < conn->out.size()) {
+            ssize_t n = send(conn->fd, conn->out.data() + conn->outOffset,
+                             conn->out.size() - conn->outOffset, MSG_NOSIGNAL);
+            if (n > 0) {
+                conn->outOffset += n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            closeConnection(conn);
+            return;
+        }
+        conn->out.clear();
+        conn->outOffset = 0;
+    }
+
+    void closeConnection(const shared_ptr<Connection>& conn) {
+        if (conn->closed) return;
+        conn->closed = true;
+        loop.remove(conn->fd);
+        close(conn->fd);
+        connections.erase(conn->fd);
+    }
+
+public:
+    StubBackend(const StubOptions& opts, unsigned seed) : options(opts), random(seed) {
+        string body(options.responseBytes, 'x');
+        okResponse = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: " +
+                     to_string(body.size()) + "\r\n\r\n" + body;
+        errorResponse = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 5\r\n\r\nerror";
+    }
+
+    ~StubBackend() {
+        stop();
+        if (listenFd >= 0) close(listenFd);
+    }
+
+    bool start(int port) {
+        listenFd = listenOn(port);
+        if (listenFd < 0) return false;
+        loopThread = thread([this]() {
+            loop.add(listenFd, EPOLLIN | EPOLLET, [this](uint32_t) { onAccept(); });
+            loop.run();
+            for (auto& entry : connections) close(entry.first);
+        });
+        return true;
+    }
+
+    void stop() {
+        if (!loopThread.joinable()) return;
+        loop.stop();
+        loopThread.join();
+    }
+};
+
+// ==================== Load Generator ====================
+
+struct LoadOptions {
+    int port = 18480;
+    int connections = 64;
+    int threads = 2;
+    double rate = 0; // requests/s in total; 0 = closed loop
+    int64_t warmupEnd = 0;
+    int64_t measureEnd = 0;
+    string request;
+    SSL_CTX* tls = nullptr; // HTTPS when set
+};
+
+struct LoadResult {
+    vector<int64_t> latencies; // ns, requests scheduled inside the measured window
+    uint64_t completed = 0;    // responses that arrived inside the measured window
+    uint64_t serverErrors = 0;
+    uint64_t connectionErrors = 0;
+    uint64_t backlog = 0;      // open loop: scheduled but never sent
+};
+
+// One thread's share of the client connections, driven by its own epoll set
+class LoadGenerator {
+private:
+    struct Connection {
+        int fd = -1;
+        SSL* ssl = nullptr;
+        string in;
+        HttpParser parser{false};
+        bool headParsed = false;
+        int status = 0;
+        BodyFramer framer;
+        bool keepAlive = true;
+        int64_t start = 0; // intended send time; 0 = idle
+    };
+
+    const LoadOptions& options;
+    int connectionCount;
+    double rate;
+    int epollFd;
+    vector<Connection> connections;
+    deque<int64_t> scheduled;
+    LoadResult& result;
+
+    bool open(size_t index) {
+        Connection& conn = connections[index];
+        conn.fd = connectTo(options.port);
+        if (conn.fd < 0) return false;
+        if (options.tls && !handshake(conn)) {
+            close(conn.fd);
+            conn.fd = -1;
+            return false;
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.u64 = index;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, conn.fd, &event);
+        return true;
+    }
+
+    // Full handshake on the non-blocking socket before it joins the epoll set
+    bool handshake(Connection& conn) {
+        conn.ssl = SSL_new(options.tls);
+        SSL_set_fd(conn.ssl, conn.fd);
+        while (true) {
+            int result = SSL_connect(conn.ssl);
+            if (result == 1) return true;
+            int error = SSL_get_error(conn.ssl, result);
+            if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) break;
+            struct pollfd pfd = {conn.fd, (short)(error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT), 0};
+            if (poll(&pfd, 1, 1000) <= 0) break;
+        }
+        SSL_free(conn.ssl);
+        conn.ssl = nullptr;
+        return false;
+    }
+
+    ssize_t read(Connection& conn, char* buffer, size_t length) {
+        if (!conn.ssl) return recv(conn.fd, buffer, length, 0);
+        int n = SSL_read(conn.ssl, buffer, (int)length);
+        if (n <= 0 && SSL_get_error(conn.ssl, n) == SSL_ERROR_WANT_READ) {
+            errno = EAGAIN;
+            return -1;
+        }
+        return n > 0 ? n : 0;
+    }
+
+    void reconnect(size_t index) {
+        Connection& conn = connections[index];
+        SSL_free(conn.ssl);
+        conn.ssl = nullptr;
+        if (conn.fd >= 0) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, conn.fd, nullptr);
+            close(conn.fd);
+        }
+        conn.fd = -1;
+        conn.in.clear();
+        conn.parser.reset();
+        conn.headParsed = false;
+        conn.keepAlive = true;
+        conn.start = 0;
+        open(index);
+    }
+
+    void send(size_t index, int64_t start) {
+        Connection& conn = connections[index];
+        conn.start = start;
+        const string& request = options.request;
+        // Loopback requests fit in the socket buffer of an idle connection
+        bool sent = conn.fd >= 0 &&
+            (conn.ssl ? SSL_write(conn.ssl, request.data(), (int)request.size()) == (int)request.size()
+                      : ::send(conn.fd, request.data(), request.size(), MSG_NOSIGNAL) == (ssize_t)request.size());
+        if (!sent) {
+            result.connectionErrors++;
+            reconnect(index);
+        }
+    }
+
+    void complete(size_t index, int status) {
+        Connection& conn = connections[index];
+        int64_t now = nowNanos();
+        if (conn.start >= options.warmupEnd && conn.start < options.measureEnd) {
+            result.latencies.push_back(now - conn.start);
+        }
+        if (now >= options.warmupEnd && now < options.measureEnd) {
+            result.completed++;
+            if (status >= 500) result.serverErrors++;
+        }
+        conn.start = 0;
+        if (!conn.keepAlive) reconnect(index);
+    }
+
+    void onReadable(size_t index) {
+        Connection& conn = connections[index];
+        int fd = conn.fd;
+        bool closed = false;
+        char buffer[65536];
+        while (true) {
+            ssize_t n = read(conn, buffer, sizeof(buffer));
+            if (n > 0) {
+                conn.in.append(buffer, n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            closed = !(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+            break;
+        }
+
+        // A "Connection: close" response arrives together with the EOF
+        parseResponses(index);
+        if (closed && conn.fd == fd) {
+            if (conn.start) result.connectionErrors++;
+            reconnect(index);
+        }
+    }
+
+    void parseResponses(size_t index) {
+        Connection& conn = connections[index];
+        while (conn.start && !conn.in.empty()) {
+            if (!conn.headParsed) {
+                HttpHead head;
+                auto parsed = conn.parser.parse(conn.in.data(), conn.in.size(), head);
+                if (parsed == HttpParser::Result::INCOMPLETE) return;
+                if (parsed != HttpParser::Result::COMPLETE || !responseFraming(head, false, conn.framer)) {
+                    result.connectionErrors++;
+                    reconnect(index);
+                    return;
+                }
+                conn.headParsed = true;
+                conn.status = head.statusCode;
+                conn.keepAlive = head.keepAlive();
+                conn.in.erase(0, head.length);
+                conn.parser.reset();
+            }
+            size_t used = conn.framer.consume(conn.in.data(), conn.in.size());
+            conn.in.erase(0, used);
+            if (!conn.framer.complete) return;
+
+            conn.headParsed = false;
+            complete(index, conn.status);
+        }
+    }
+
+public:
+    LoadGenerator(const LoadOptions& opts, int count, double threadRate, LoadResult& out)
+        : options(opts), connectionCount(count), rate(threadRate),
+          epollFd(epoll_create1(EPOLL_CLOEXEC)), connections(count), result(out) {
+    }
+
+    ~LoadGenerator() {
+        for (auto& conn : connections) {
+            SSL_free(conn.ssl);
+            if (conn.fd >= 0) close(conn.fd);
+        }
+        close(epollFd);
+    }
+
+    void run() {
+        for (int i = 0; i < connectionCount; i++) {
+            if (!open(i)) result.connectionErrors++;
+        }
+
+        int64_t interval = rate > 0 ? (int64_t)(1e9 / rate) : 0;
+        int64_t nextSend = nowNanos();
+        struct epoll_event events[256];
+
+        while (true) {
+            int64_t now = nowNanos();
+            if (now >= options.measureEnd) break;
+
+            if (interval > 0) {
+                for (; nextSend <= now; nextSend += interval) {
+                    scheduled.push_back(nextSend);
+                }
+            }
+            for (int i = 0; i < connectionCount; i++) {
+                if (connections[i].start) continue;
+                if (interval == 0) {
+                    send(i, now);
+                } else if (!scheduled.empty()) {
+                    int64_t start = scheduled.front();
+                    scheduled.pop_front();
+                    send(i, start);
+                }
+            }
+
+            int timeoutMs = interval > 0 ? 1 : 100;
+            int ready = epoll_wait(epollFd, events, 256, timeoutMs);
+            for (int i = 0; i < ready; i++) {
+                onReadable(events[i].data.u64);
+            }
+        }
+
+        for (int64_t start : scheduled) {
+            if (start >= options.warmupEnd) result.backlog++;
+        }
+    }
+};
+
+// ==================== Report ====================
+
+// HdrHistogram-style correction: a sample longer than the expected interval
+// stands for the requests that would have been issued during it
+vector<int64_t> correctForOmission(const vector<int64_t>& samples, int64_t expected) {
+    vector<int64_t> corrected = samples;
+    if (expected <= 0) return corrected;
+    for (int64_t value : samples) {
+        for (int64_t missing = value - expected; missing >= expected; missing -= expected) {
+            corrected.push_back(missing);
+            if (corrected.size() > 100 * samples.size() + 1000000) return corrected;
+        }
+    }
+    return corrected;
+}
+
+void printPercentiles(const char* label, vector<int64_t> samples) {
+    cout << "  " << left << setw(12) << label;
+    if (samples.empty()) {
+        cout << "no samples" << endl;
+        return;
+    }
+    sort(samples.begin(), samples.end());
+    auto at = [&](double p) {
+        size_t index = min(samples.size() - 1, (size_t)(p * samples.size()));
+        return samples[index] / 1e6;
+    };
+    cout << fixed << setprecision(3)
+         << setw(12) << at(0.50) << setw(12) << at(0.99)
+         << setw(12) << at(0.999) << samples.back() / 1e6 << endl;
+}
+
+LoadBalancingAlgorithm parseAlgorithm(const string& name) {
+    if (name == "least-conn") return LoadBalancingAlgorithm::LEAST_CONNECTIONS;
+    if (name == "ip-hash") return LoadBalancingAlgorithm::IP_HASH;
+    if (name == "maglev") return LoadBalancingAlgorithm::CONSISTENT_HASH;
+    if (name == "p2c") return LoadBalancingAlgorithm::POWER_OF_TWO_CHOICES;
+    if (name == "peak-ewma") return LoadBalancingAlgorithm::PEAK_EWMA;
+    if (name == "wrr") return LoadBalancingAlgorithm::WEIGHTED_ROUND_ROBIN;
+    if (name != "round-robin") {
+        cerr << "Unknown algorithm " << name << ", using round-robin" << endl;
+    }
+    return LoadBalancingAlgorithm::ROUND_ROBIN;
+}
+
+int main(int argc, char* argv[]) {
+    StubOptions stub;
+    LoadOptions load;
+    int backendCount = 4;
+    int lbThreads = 2;
+    double durationSeconds = 5;
+    double warmupSeconds = 1;
+    int64_t expectedMicros = 0;
+    string algorithmName = "round-robin";
+    bool direct = false;
+    bool accessLogOn = false;
+    bool tlsOn = false;
+    bool kernelTls = true;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        auto value = [&]() { return i + 1 < argc ? argv[++i] : "0"; };
+        if (arg == "--backends") backendCount = max(1, atoi(value()));
+        else if (arg == "--latency-ms") stub.latencyMs = atoi(value());
+        else if (arg == "--size") stub.responseBytes = strtoul(value(), nullptr, 10);
+        else if (arg == "--error-rate") stub.errorRate = atof(value());
+        else if (arg == "--algorithm") algorithmName = value();
+        else if (arg == "--lb-threads") lbThreads = atoi(value());
+        else if (arg == "--connections") load.connections = max(1, atoi(value()));
+        else if (arg == "--threads") load.threads = max(1, atoi(value()));
+        else if (arg == "--rate") load.rate = atof(value());
+        else if (arg == "--duration") durationSeconds = atof(value());
+        else if (arg == "--warmup") warmupSeconds = atof(value());
+        else if (arg == "--expected-us") expectedMicros = atoll(value());
+        else if (arg == "--port") load.port = atoi(value());
+        else if (arg == "--direct") direct = true;
+        else if (arg == "--access-log") accessLogOn = true;
+        else if (arg == "--tls") tlsOn = true;
+        else if (arg == "--no-ktls") tlsOn = true, kernelTls = false;
+        else {
+            cerr << "Unknown option " << arg << " (see the header of bench/bench_proxy.cpp)" << endl;
+            return 1;
+        }
+    }
+    load.threads = min(load.threads, load.connections);
+
+    int proxyPort = load.port;
+    int statsPort = proxyPort + 1;
+    int tlsPort = proxyPort + 2;
+    tlsOn = tlsOn && !direct;
+    int firstBackendPort = proxyPort + 10;
+
+    vector<unique_ptr<StubBackend>> backends;
+    for (int i = 0; i < backendCount; i++) {
+        backends.push_back(make_unique<StubBackend>(stub, 1234 + i));
+        if (!backends.back()->start(firstBackendPort + i)) {
+            cerr << "Cannot listen on port " << firstBackendPort + i << endl;
+            return 1;
+        }
+    }
+
+    // The proxy runs in this process; its banner goes to stdout before the report
+    unique_ptr<LoadBalancer> lb;
+    thread lbThread;
+    string certificateFile = "/tmp/bench_proxy_" + to_string(getpid()) + ".crt";
+    string keyFile = "/tmp/bench_proxy_" + to_string(getpid()) + ".key";
+    if (!direct) {
+        lb = make_unique<LoadBalancer>(proxyPort, statsPort);
+        lb->setWorkerThreads(lbThreads);
+        AccessLogSettings log;
+        log.path = "/dev/null";
+        log.sampleRate = accessLogOn ? 1.0 : 0.0;
+        lb->setAccessLog(log);
+        if (tlsOn) {
+            TlsSettings tls;
+            tls.port = tlsPort;
+            tls.certificateFile = certificateFile;
+            tls.privateKeyFile = keyFile;
+            tls.kernelOffload = kernelTls;
+            bool loaded = writeTestCertificate(certificateFile, keyFile) && lb->setTls(tls);
+            unlink(certificateFile.c_str());
+            unlink(keyFile.c_str());
+            if (!loaded) {
+                cerr << "Cannot set up the HTTPS listener" << endl;
+                return 1;
+            }
+            load.port = tlsPort;
+            load.tls = SSL_CTX_new(TLS_client_method());
+        }
+        lb->addService("/bench/", parseAlgorithm(algorithmName));
+        for (int i = 0; i < backendCount; i++) {
+            lb->addBackendToService("/bench/", "stub-" + to_string(i), "127.0.0.1", firstBackendPort + i);
+        }
+        lbThread = thread([&]() { lb->start(); });
+
+        // Wait for the listeners
+        int probe = -1;
+        for (int tries = 0; tries < 100 && probe < 0; tries++) {
+            this_thread::sleep_for(chrono::milliseconds(20));
+            probe = connectTo(load.port);
+        }
+        if (probe < 0) {
+            cerr << "Load balancer did not start on port " << load.port << endl;
+            return 1;
+        }
+        close(probe);
+    } else {
+        load.port = firstBackendPort;
+    }
+
+    load.request = string("GET ") + (direct ? "/x" : "/bench/x") +
+                   " HTTP/1.1\r\nHost: localhost\r\nUser-Agent: bench_proxy\r\n\r\n";
+    int64_t start = nowNanos();
+    load.warmupEnd = start + (int64_t)(warmupSeconds * 1e9);
+    load.measureEnd = load.warmupEnd + (int64_t)(durationSeconds * 1e9);
+
+    vector<LoadResult> results(load.threads);
+    vector<thread> generators;
+    for (int t = 0; t < load.threads; t++) {
+        int count = load.connections / load.threads + (t < load.connections % load.threads ? 1 : 0);
+        generators.emplace_back([&, t, count]() {
+            LoadGenerator generator(load, count, load.rate / load.threads, results[t]);
+            generator.run();
+        });
+    }
+    for (auto& generator : generators) generator.join();
+
+    string metrics = tlsOn ? fetch(statsPort, "/metrics") : "";
+    if (lb) {
+        lb->stop();
+        lbThread.join();
+    }
+    for (auto& backend : backends) backend->stop();
+
+    LoadResult total;
+    for (auto& r : results) {
+        total.latencies.insert(total.latencies.end(), r.latencies.begin(), r.latencies.end());
+        total.completed += r.completed;
+        total.serverErrors += r.serverErrors;
+        total.connectionErrors += r.connectionErrors;
+        total.backlog += r.backlog;
+    }
+
+    cout << "\nProxy benchmark: " << backendCount << " backends (" << stub.latencyMs << " ms, "
+         << stub.responseBytes << " B, " << stub.errorRate * 100 << "% errors), "
+         << (direct ? "direct, no proxy" : algorithmName + ", " + to_string(lbThreads) + " proxy workers")
+         << (tlsOn ? (kernelTls ? ", TLS" : ", TLS without kTLS") : "") << endl;
+    cout << "Load: " << (load.rate > 0 ? "open loop at " + to_string((int)load.rate) + " req/s" : string("closed loop"))
+         << ", " << load.connections << " connections on " << load.threads << " threads, "
+         << durationSeconds << " s after " << warmupSeconds << " s warmup" << endl << endl;
+
+    cout << "  " << left << setw(12) << "requests" << total.completed << " ("
+         << fixed << setprecision(1) << total.completed / durationSeconds << " req/s)" << endl;
+    cout << "  " << left << setw(12) << "errors" << total.serverErrors << " 5xx, "
+         << total.connectionErrors << " connection" << endl;
+    if (load.rate > 0) {
+        cout << "  " << left << setw(12) << "backlog" << total.backlog << " scheduled but never sent" << endl;
+    }
+    if (tlsOn) {
+        // Offload needs the kernel's tls module and a cipher it implements
+        uint64_t handshakes = metricValue(metrics, "customlb_tls_handshakes_total{result=\"full\"}") +
+                              metricValue(metrics, "customlb_tls_handshakes_total{result=\"resumed\"}");
+        cout << "  " << left << setw(12) << "tls" << handshakes << " handshakes, kernel offload on "
+             << metricValue(metrics, "customlb_tls_kernel_offload_total{direction=\"send\"}") << endl;
+        SSL_CTX_free(load.tls);
+    }
+
+    cout << "\n  " << left << setw(12) << "latency ms" << setw(12) << "p50" << setw(12) << "p99"
+         << setw(12) << "p99.9" << "max" << endl;
+    if (load.rate > 0) {
+        printPercentiles("scheduled", total.latencies);
+    } else {
+        printPercentiles("measured", total.latencies);
+        int64_t expected = expectedMicros * 1000;
+        if (expected <= 0 && !total.latencies.empty()) {
+            vector<int64_t> sorted = total.latencies;
+            nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+            expected = sorted[sorted.size() / 2];
+        }
+        printPercentiles("corrected", correctForOmission(total.latencies, expected));
+    }
+    return 0;
+}
@@ -0,0 +1,162 @@
+// Backend selection microbenchmark: the snapshot-based ServiceConfig
+// selection against the previous per-request filtering implementation.
+//
+// Usage: bench_selection [backends] [milliseconds per run]
+
+#include "../LoadBalancer.h"
+#include <iostream>
+#include <iomanip>
+#include <climits>
+#include <cstdlib>
+
+using namespace std;
+
+// ==================== Previous Implementation ====================
+
+// Selection as it was before backend snapshots: every call filters the
+// backend list into a freshly allocated vector of shared_ptrs.
+struct LegacyService {
+    vector<shared_ptr<Backend>> backends;
+    atomic<size_t> roundRobinIndex{0};
+
+    bool selectable(const shared_ptr<Backend>& backend) {
+        return backend->isHealthy || backend->isSelectable(chrono::steady_clock::now());
+    }
+
+    shared_ptr<Backend> selectRoundRobin() {
+        vector<shared_ptr<Backend>> healthy;
+        for (auto& backend : backends) {
+            if (selectable(backend)) healthy.push_back(backend);
+        }
+        if (healthy.empty()) return nullptr;
+        return healthy[roundRobinIndex.fetch_add(1) % healthy.size()];
+    }
+
+    shared_ptr<Backend> selectLeastConnections() {
+        shared_ptr<Backend> selected = nullptr;
+        int minConnections = INT_MAX;
+        for (auto& backend : backends) {
+            if (selectable(backend)) {
+                int conns = backend->activeConnections.load();
+                if (conns < minConnections) {
+                    minConnections = conns;
+                    selected = backend;
+                }
+            }
+        }
+        return selected;
+    }
+
+    shared_ptr<Backend> selectIPHash(const string& clientIP) {
+        vector<shared_ptr<Backend>> healthy;
+        for (auto& backend : backends) {
+            if (selectable(backend)) healthy.push_back(backend);
+        }
+        if (healthy.empty()) return nullptr;
+        return healthy[hash<string>()(clientIP) % healthy.size()];
+    }
+};
+
+// ==================== Harness ====================
+
+// Runs select(threadIndex, iteration) on every thread for durationMs and
+// returns the aggregate selections per second.
+template <typename Select>
+double measure(int threads, int durationMs, Select select) {
+    atomic<bool> go(false);
+    atomic<bool> done(false);
+    vector<uint64_t> counts(threads * 8, 0); // padded against false sharing
+    vector<thread> pool;
+
+    for (int t = 0; t < threads; t++) {
+        pool.emplace_back([&, t]() {
+            while (!go) this_thread::yield();
+            uint64_t n = 0;
+            while (!done.load(memory_order_relaxed)) {
+                for (int i = 0; i < 256; i++) {
+                    if (!select(t, n + i)) abort();
+                }
+                n += 256;
+            }
+            counts[t * 8] = n;
+        });
+    }
+
+    auto start = chrono::steady_clock::now();
+    go = true;
+    this_thread::sleep_for(chrono::milliseconds(durationMs));
+    done = true;
+    for (auto& worker : pool) worker.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    uint64_t total = 0;
+    for (int t = 0; t < threads; t++) total += counts[t * 8];
+    return total / seconds;
+}
+
+int main(int argc, char* argv[]) {
+    int backendCount = argc > 1 ? atoi(argv[1]) : 8;
+    int durationMs = argc > 2 ? atoi(argv[2]) : 500;
+
+    vector<shared_ptr<Backend>> backends;
+    for (int i = 0; i < backendCount; i++) {
+        backends.push_back(make_shared<Backend>("backend-" + to_string(i), "127.0.0.1", 9000 + i));
+    }
+
+    LegacyService legacy;
+    legacy.backends = backends;
+
+    ServiceConfig roundRobin("/rr/", LoadBalancingAlgorithm::ROUND_ROBIN);
+    ServiceConfig leastConnections("/lc/", LoadBalancingAlgorithm::LEAST_CONNECTIONS);
+    ServiceConfig ipHash("/ip/", LoadBalancingAlgorithm::IP_HASH);
+    for (auto& backend : backends) {
+        roundRobin.addBackend(backend);
+        leastConnections.addBackend(backend);
+        ipHash.addBackend(backend);
+    }
+
+    HttpHead request;
+    vector<string> clientIPs;
+    for (int i = 0; i < 1024; i++) {
+        clientIPs.push_back("10.0." + to_string(i / 256) + "." + to_string(i % 256));
+    }
+
+    cout << "Backend selection, " << backendCount << " backends, "
+         << durationMs << " ms per run (million selections/s)" << endl;
+    cout << left << setw(20) << "algorithm" << setw(10) << "threads"
+         << setw(12) << "legacy" << setw(12) << "snapshot" << "speedup" << endl;
+
+    for (int threads : {1, 8, 64}) {
+        struct Case {
+            const char* name;
+            double legacy;
+            double snapshot;
+        };
+        vector<Case> cases;
+
+        cases.push_back({"round-robin",
+            measure(threads, durationMs, [&](int, uint64_t) { return legacy.selectRoundRobin() != nullptr; }),
+            measure(threads, durationMs, [&](int, uint64_t) { return roundRobin.selectBackend("", request) != nullptr; })});
+
+        cases.push_back({"least-connections",
+            measure(threads, durationMs, [&](int, uint64_t) { return legacy.selectLeastConnections() != nullptr; }),
+            measure(threads, durationMs, [&](int, uint64_t) { return leastConnections.selectBackend("", request) != nullptr; })});
+
+        cases.push_back({"ip-hash",
+            measure(threads, durationMs, [&](int t, uint64_t n) {
+                return legacy.selectIPHash(clientIPs[(t * 131 + n) & 1023]) != nullptr;
+            }),
+            measure(threads, durationMs, [&](int t, uint64_t n) {
+                return ipHash.selectBackend(clientIPs[(t * 131 + n) & 1023], request) != nullptr;
+            })});
+
+        for (const auto& c : cases) {
+            cout << left << setw(20) << c.name << setw(10) << threads
+                 << fixed << setprecision(2)
+                 << setw(12) << c.legacy / 1e6 << setw(12) << c.snapshot / 1e6
+                 << c.snapshot / c.legacy << "x" << endl;
+        }
+    }
+
+    return 0;
+}
@@ -2,21 +2,54 @@
 #include <iostream>
 #include <csignal>
 #include <memory>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
 
 std::unique_ptr<LoadBalancer> lb;
+std::atomic<bool> exiting(false);
 
-void signalHandler(int signum) {
-    std::cout << "\n\nInterrupt signal (" << signum << ") received. Shutting down...\n";
-    if (lb) {
-        lb->stop();
+// Signals are blocked in every thread and taken here with sigwait(), so
+// they can be acted on with ordinary (not async-signal-safe) code.
+// SIGTERM/SIGINT drain the load balancer, a second one stops it at once;
+// SIGHUP reloads the config file.
+void handleSignals(sigset_t signals) {
+    bool draining = false;
+    int signum;
+    while (sigwait(&signals, &signum) == 0) {
+        if (exiting) break;
+        if (signum == SIGHUP) {
+            std::cout << "[CONFIG] SIGHUP received, reloading" << std::endl;
+            lb->reloadConfig();
+        } else if (!draining) {
+            std::cout << "\n\nSignal (" << signum << ") received. Draining connections...\n";
+            draining = true;
+            lb->drain();
+        } else {
+            std::cout << "Signal (" << signum << ") received again. Shutting down...\n";
+            lb->stop();
+        }
     }
-    exit(signum);
 }
 
-int main() {
-    // Set up signal handler for graceful shutdown
-    signal(SIGINT, signalHandler);
-    signal(SIGTERM, signalHandler);
+// Runs the load balancer until it stops. The signal thread is woken and
+// joined before this returns, so it never uses lb while it is destroyed.
+void run(sigset_t signals) {
+    std::thread signalThread(handleSignals, signals);
+    lb->start();
+    exiting = true;
+    pthread_kill(signalThread.native_handle(), SIGTERM);
+    signalThread.join();
+}
+
+int main(int argc, char* argv[]) {
+    // Blocked here, and so in every thread started later
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
     
     std::cout << "==============================================\n";
     std::cout << "  Custom C++ Load Balancer for Microservices\n";
@@ -26,11 +59,30 @@ int main() {
     // Create load balancer (port 80 for main traffic, 8081 for stats)
     lb = std::make_unique<LoadBalancer>(80, 8081);
     
+    // A new binary started with the same socket takes over the listeners
+    // of the running one, which then drains and exits
+    const char* handoffPath = std::getenv("CUSTOMLB_HANDOFF_SOCKET");
+    if (handoffPath && *handoffPath) {
+        lb->setHandoffSocket(handoffPath);
+    }
+    
+    const char* configPath = argc > 1 ? argv[1] : std::getenv("CUSTOMLB_CONFIG");
+    if (configPath && *configPath) {
+        std::cout << "Loading configuration from " << configPath << "..." << std::endl;
+        if (!lb->loadConfigFile(configPath)) {
+            return 1;
+        }
+        
+        run(signals);
+        return 0;
+    }
+    
     // Configure services matching nginx.conf
     
-    // 1. Customer Service - IP Hash (Session Persistence)
-    std::cout << "Configuring Customer service (IP Hash)..." << std::endl;
-    lb->addService("/customer/", LoadBalancingAlgorithm::IP_HASH);
+    // 1. Customer Service - Consistent Hash on client IP (Session Persistence
+    //    that survives the deployment scaling up or down)
+    std::cout << "Configuring Customer service (Consistent Hash)..." << std::endl;
+    lb->addService("/customer/", LoadBalancingAlgorithm::CONSISTENT_HASH);
     lb->addBackendToService("/customer/", "customer-1", "customer", 8080, 3, 30);
     
     // 2. Catalog Service - Least Connections
@@ -38,15 +90,17 @@ int main() {
     lb->addService("/catalog/", LoadBalancingAlgorithm::LEAST_CONNECTIONS);
     lb->addBackendToService("/catalog/", "catalog-1", "catalog", 8080, 3, 30);
     
-    // 3. Order Service - Round Robin
-    std::cout << "Configuring Order service (Round Robin)..." << std::endl;
-    lb->addService("/order/", LoadBalancingAlgorithm::ROUND_ROBIN);
-    lb->addBackendToService("/order/", "order-1", "order", 8080, 3, 30);
+    // 3. Order Service - Weighted Round Robin (weight=1 as in nginx.conf),
+    //    recovered pods ramp up over 30s while the JVM warms up
+    std::cout << "Configuring Order service (Weighted Round Robin)..." << std::endl;
+    lb->addService("/order/", LoadBalancingAlgorithm::WEIGHTED_ROUND_ROBIN);
+    lb->addBackendToService("/order/", "order-1", "order", 8080, 3, 30, 1);
+    lb->setSlowStart("/order/", 30);
     
     std::cout << "\nConfiguration complete!\n" << std::endl;
     
     // Start the load balancer
-    lb->start();
+    run(signals);
     
     return 0;
 }